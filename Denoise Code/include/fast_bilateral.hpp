@@ -0,0 +1,225 @@
+// Fast approximation of cv::bilateralFilter for one 8-bit channel (a grey
+// image or a Y, U or V plane), taking the same diameter, sigma colour and
+// sigma space.
+//
+// The 2D kernel is split into a horizontal and then a vertical 1D bilateral
+// pass (Pham & van Vliet, separable bilateral filtering), so a pixel costs 2d
+// taps instead of the ~d^2 of the full kernel. Spatial and range weight of
+// every tap come from one lookup table per tap, indexed by the absolute
+// difference to the centre. Both passes run 8 pixels at a time, gathering the
+// weights with AVX2 on x86 when the CPU has it, or on NEON on ARM.
+//
+// The result is not bit-exact with OpenCV: the vertical pass sees edges the
+// horizontal one already softened. How close it comes is checked with
+// Other Tests/Enhancment test/Denoise_test/fast_bilateral_test.py.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAST_BILATERAL_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FAST_BILATERAL_NEON 1
+#endif
+
+namespace bilateral_detail {
+
+// One output row of a 1D pass over pixels [from, to). taps[k][x] is the k-th
+// neighbour of pixel x (taps[radius][x] the pixel itself) and weights holds
+// 256 entries per tap.
+inline void spanScalar(const uint8_t* const* taps, int tap_count, const float* weights, int from, int to,
+                       uint8_t* out) {
+    const uint8_t* centre = taps[tap_count / 2];
+    for (int x = from; x < to; x++) {
+        float sum = 0;
+        float total = 0;
+        for (int k = 0; k < tap_count; k++) {
+            int p = taps[k][x];
+            float w = weights[k * 256 + std::abs(p - centre[x])];
+            sum += w * p;
+            total += w;
+        }
+        out[x] = (uint8_t)(sum / total + 0.5f);
+    }
+}
+
+#if FAST_BILATERAL_X86
+__attribute__((target("avx2")))
+inline void spanAvx2(const uint8_t* const* taps, int tap_count, const float* weights, int width, uint8_t* out) {
+    const uint8_t* centre = taps[tap_count / 2];
+    const __m256 half = _mm256_set1_ps(0.5f);
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(centre + x)));
+        __m256 sum = _mm256_setzero_ps();
+        __m256 total = _mm256_setzero_ps();
+        for (int k = 0; k < tap_count; k++) {
+            __m256i p = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(taps[k] + x)));
+            __m256i d = _mm256_abs_epi32(_mm256_sub_epi32(p, c));
+            __m256 w = _mm256_i32gather_ps(weights + k * 256, d, 4);
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(w, _mm256_cvtepi32_ps(p)));
+            total = _mm256_add_ps(total, w);
+        }
+        __m256i v = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_div_ps(sum, total), half));
+        // A weighted mean of bytes is a byte, so packing cannot saturate
+        __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        _mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(packed, packed));
+    }
+    spanScalar(taps, tap_count, weights, x, width, out);
+}
+
+inline bool haveAvx2() {
+    static const bool available = __builtin_cpu_supports("avx2");
+    return available;
+}
+#endif
+
+#if FAST_BILATERAL_NEON
+// NEON has no gather, so the weights are looked up one lane at a time
+inline void spanNeon(const uint8_t* const* taps, int tap_count, const float* weights, int width, uint8_t* out) {
+    const uint8_t* centre = taps[tap_count / 2];
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint8x8_t c = vld1_u8(centre + x);
+        float32x4_t sum_low = vdupq_n_f32(0), sum_high = vdupq_n_f32(0);
+        float32x4_t total_low = vdupq_n_f32(0), total_high = vdupq_n_f32(0);
+        for (int k = 0; k < tap_count; k++) {
+            uint8x8_t p = vld1_u8(taps[k] + x);
+            uint8_t d[8];
+            vst1_u8(d, vabd_u8(p, c));
+            const float* table = weights + k * 256;
+            float w[8] = {table[d[0]], table[d[1]], table[d[2]], table[d[3]],
+                          table[d[4]], table[d[5]], table[d[6]], table[d[7]]};
+            float32x4_t w_low = vld1q_f32(w), w_high = vld1q_f32(w + 4);
+            uint16x8_t wide = vmovl_u8(p);
+            sum_low = vmlaq_f32(sum_low, w_low, vcvtq_f32_u32(vmovl_u16(vget_low_u16(wide))));
+            sum_high = vmlaq_f32(sum_high, w_high, vcvtq_f32_u32(vmovl_u16(vget_high_u16(wide))));
+            total_low = vaddq_f32(total_low, w_low);
+            total_high = vaddq_f32(total_high, w_high);
+        }
+        float sums[8], totals[8];
+        vst1q_f32(sums, sum_low);
+        vst1q_f32(sums + 4, sum_high);
+        vst1q_f32(totals, total_low);
+        vst1q_f32(totals + 4, total_high);
+        for (int i = 0; i < 8; i++) {
+            out[x + i] = (uint8_t)(sums[i] / totals[i] + 0.5f);
+        }
+    }
+    spanScalar(taps, tap_count, weights, x, width, out);
+}
+#endif
+
+inline void span(const uint8_t* const* taps, int tap_count, const float* weights, int width, uint8_t* out) {
+#if FAST_BILATERAL_X86
+    if (haveAvx2()) {
+        spanAvx2(taps, tap_count, weights, width, out);
+        return;
+    }
+#elif FAST_BILATERAL_NEON
+    spanNeon(taps, tap_count, weights, width, out);
+    return;
+#endif
+    spanScalar(taps, tap_count, weights, 0, width, out);
+}
+
+// Mirror an index into [0, size) the way BORDER_REFLECT_101 does
+inline int reflect(int i, int size) {
+    if (size == 1) {
+        return 0;
+    }
+    while (i < 0 || i >= size) {
+        i = i < 0 ? -i : 2 * size - 2 - i;
+    }
+    return i;
+}
+
+} // namespace bilateral_detail
+
+struct BilateralParams {
+    int diameter;       // Pixel neighbourhood, as in cv::bilateralFilter
+    double sigma_color; // Range sigma, in grey levels
+    double sigma_space; // Spatial sigma, in pixels
+};
+
+// Keeps the tables and the intermediate image between frames; one per thread
+class FastBilateral {
+public:
+    // Filter src into dst; both are width x height, and must not overlap
+    void filter(const BilateralParams& params, const uint8_t* src, size_t src_stride, uint8_t* dst,
+                size_t dst_stride, int width, int height) {
+        if (width < 1 || height < 1) {
+            return;
+        }
+        prepare(params);
+        const int r = radius_;
+        const int tap_count = 2 * r + 1;
+        padded_.resize(width + 2 * r);
+        between_.resize((size_t)width * height);
+        taps_.resize(tap_count);
+
+        // Horizontal, on a copy of each row with mirrored borders
+        for (int y = 0; y < height; y++) {
+            const uint8_t* row = src + y * src_stride;
+            for (int x = 0; x < r; x++) {
+                padded_[x] = row[bilateral_detail::reflect(x - r, width)];
+                padded_[width + r + x] = row[bilateral_detail::reflect(width + x, width)];
+            }
+            std::copy(row, row + width, padded_.begin() + r);
+            for (int k = 0; k < tap_count; k++) {
+                taps_[k] = padded_.data() + k;
+            }
+            bilateral_detail::span(taps_.data(), tap_count, weights_.data(), width,
+                                   between_.data() + (size_t)y * width);
+        }
+
+        // Vertical, on the horizontal result
+        for (int y = 0; y < height; y++) {
+            for (int k = 0; k < tap_count; k++) {
+                taps_[k] = between_.data() + (size_t)bilateral_detail::reflect(y + k - r, height) * width;
+            }
+            bilateral_detail::span(taps_.data(), tap_count, weights_.data(), width, dst + y * dst_stride);
+        }
+    }
+
+private:
+    // Rebuild the tables when the parameters change
+    void prepare(const BilateralParams& params) {
+        double sigma_color = params.sigma_color > 0 ? params.sigma_color : 1.0;
+        double sigma_space = params.sigma_space > 0 ? params.sigma_space : 1.0;
+        // Same radius rule as OpenCV: half the diameter, or 1.5 sigma without one
+        int radius = params.diameter > 0 ? params.diameter / 2 : (int)std::round(sigma_space * 1.5);
+        radius = std::max(radius, 1);
+        if (radius == radius_ && sigma_color == sigma_color_ && sigma_space == sigma_space_) {
+            return;
+        }
+        radius_ = radius;
+        sigma_color_ = sigma_color;
+        sigma_space_ = sigma_space;
+
+        // Spatial weight of the tap times range weight of the difference
+        weights_.resize((2 * radius + 1) * 256);
+        double color_coeff = -0.5 / (sigma_color * sigma_color);
+        double space_coeff = -0.5 / (sigma_space * sigma_space);
+        for (int k = -radius; k <= radius; k++) {
+            for (int d = 0; d < 256; d++) {
+                weights_[(k + radius) * 256 + d] = (float)std::exp(k * k * space_coeff + d * d * color_coeff);
+            }
+        }
+    }
+
+    int radius_ = 0;
+    double sigma_color_ = 0;
+    double sigma_space_ = 0;
+    std::vector<float> weights_;        // 256 per tap
+    std::vector<uint8_t> padded_;       // One source row with borders
+    std::vector<uint8_t> between_;      // Result of the horizontal pass
+    std::vector<const uint8_t*> taps_;  // Where each tap of the pass under way reads
+};
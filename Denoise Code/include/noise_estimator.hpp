@@ -0,0 +1,150 @@
+// Noise estimation shared by the camera stage, the relay servers and the
+// tests. Immerkaer's fast estimator: the absolute response to the Laplacian
+// difference kernel
+//
+//    1 -2  1
+//   -2  4 -2
+//    1 -2  1
+//
+// summed over the image and scaled, sigma = sqrt(pi / 2) / (6 (W - 2) (H - 2)) * sum.
+//
+// Convolution, absolute value and sum happen in one pass over the rows, in
+// 16-bit integer lanes (AVX2 on x86 when the CPU has it, NEON on ARM), with no
+// temporary images. Responses fit in 16 bits and are summed exactly, so the
+// result is bit-exact with summing the unsaturated filter2D response over the
+// interior pixels, unlike convertScaleAbs, which clips each response at 255.
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NOISE_ESTIMATOR_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define NOISE_ESTIMATOR_NEON 1
+#endif
+
+namespace noise_detail {
+
+// Kernel response at x, given the rows above, at and below
+inline int laplacian(const uint8_t* above, const uint8_t* row, const uint8_t* below, int x) {
+    int left = above[x - 1] - 2 * row[x - 1] + below[x - 1];
+    int centre = above[x] - 2 * row[x] + below[x];
+    int right = above[x + 1] - 2 * row[x + 1] + below[x + 1];
+    return left - 2 * centre + right;
+}
+
+inline uint64_t rowSumScalar(const uint8_t* above, const uint8_t* row, const uint8_t* below, int from, int to) {
+    uint64_t sum = 0;
+    for (int x = from; x < to; x++) {
+        int response = laplacian(above, row, below, x);
+        sum += response < 0 ? -response : response;
+    }
+    return sum;
+}
+
+#if NOISE_ESTIMATOR_X86
+// 16 pixels per step. The kernel is separable: a vertical [1 -2 1] on three
+// neighbouring columns, then a horizontal one on the results.
+__attribute__((target("avx2")))
+inline uint64_t rowSumAvx2(const uint8_t* above, const uint8_t* row, const uint8_t* below, int width) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i total = _mm256_setzero_si256();
+    int x = 1;
+    for (; x + 16 <= width - 1; x += 16) {
+        __m256i column[3];
+        for (int i = 0; i < 3; i++) {
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(above + x - 1 + i)));
+            __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + x - 1 + i)));
+            __m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(below + x - 1 + i)));
+            column[i] = _mm256_sub_epi16(_mm256_add_epi16(a, c), _mm256_slli_epi16(b, 1));
+        }
+        __m256i response = _mm256_sub_epi16(_mm256_add_epi16(column[0], column[2]), _mm256_slli_epi16(column[1], 1));
+        // |response| <= 2040, so pairs summed into 32 bits cannot overflow
+        // within a row of any realistic width
+        total = _mm256_add_epi32(total, _mm256_madd_epi16(_mm256_abs_epi16(response), ones));
+    }
+    alignas(32) uint32_t lanes[8];
+    _mm256_store_si256((__m256i*)lanes, total);
+    uint64_t sum = 0;
+    for (uint32_t lane : lanes) {
+        sum += lane;
+    }
+    return sum + rowSumScalar(above, row, below, x, width - 1);
+}
+
+inline bool haveAvx2() {
+    static const bool available = __builtin_cpu_supports("avx2");
+    return available;
+}
+#endif
+
+#if NOISE_ESTIMATOR_NEON
+// 8 pixels per step, same separable scheme as the AVX2 version
+inline uint64_t rowSumNeon(const uint8_t* above, const uint8_t* row, const uint8_t* below, int width) {
+    uint32x4_t total = vdupq_n_u32(0);
+    int x = 1;
+    for (; x + 8 <= width - 1; x += 8) {
+        int16x8_t column[3];
+        for (int i = 0; i < 3; i++) {
+            int16x8_t a = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(above + x - 1 + i)));
+            int16x8_t b = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(row + x - 1 + i)));
+            int16x8_t c = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(below + x - 1 + i)));
+            column[i] = vsubq_s16(vaddq_s16(a, c), vshlq_n_s16(b, 1));
+        }
+        int16x8_t response = vsubq_s16(vaddq_s16(column[0], column[2]), vshlq_n_s16(column[1], 1));
+        total = vpadalq_u16(total, vreinterpretq_u16_s16(vabsq_s16(response)));
+    }
+    uint64_t sum = vgetq_lane_u32(total, 0) + (uint64_t)vgetq_lane_u32(total, 1) +
+                   vgetq_lane_u32(total, 2) + (uint64_t)vgetq_lane_u32(total, 3);
+    return sum + rowSumScalar(above, row, below, x, width - 1);
+}
+#endif
+
+inline uint64_t rowSum(const uint8_t* above, const uint8_t* row, const uint8_t* below, int width) {
+#if NOISE_ESTIMATOR_X86
+    if (haveAvx2()) {
+        return rowSumAvx2(above, row, below, width);
+    }
+#elif NOISE_ESTIMATOR_NEON
+    return rowSumNeon(above, row, below, width);
+#endif
+    return rowSumScalar(above, row, below, 1, width - 1);
+}
+
+} // namespace noise_detail
+
+// Sum of absolute kernel responses over the interior of an 8-bit single
+// channel image (a grey image or a Y plane), taking every row_step-th row
+inline uint64_t laplacianAbsSum(const uint8_t* data, int width, int height, size_t stride, int row_step = 1) {
+    uint64_t sum = 0;
+    if (width < 3 || height < 3) {
+        return 0;
+    }
+    if (row_step < 1) {
+        row_step = 1;
+    }
+    for (int y = 1; y < height - 1; y += row_step) {
+        const uint8_t* row = data + y * stride;
+        sum += noise_detail::rowSum(row - stride, row, row + stride, width);
+    }
+    return sum;
+}
+
+// Noise standard deviation in grey levels. With row_step > 1 only every
+// row_step-th row is looked at, which for noise that does not vary by row
+// gives the same figure for a fraction of the work.
+inline double estimateNoise(const uint8_t* data, int width, int height, size_t stride, int row_step = 1) {
+    if (width < 3 || height < 3) {
+        return 0.0;
+    }
+    if (row_step < 1) {
+        row_step = 1;
+    }
+    int rows = (height - 2 + row_step - 1) / row_step;
+    uint64_t sum = laplacianAbsSum(data, width, height, stride, row_step);
+    return sum * std::sqrt(0.5 * M_PI) / (6.0 * (width - 2) * rows);
+}
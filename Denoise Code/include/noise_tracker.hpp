@@ -0,0 +1,91 @@
+// Running noise estimate of a video stream. The Laplacian sigma only needs a
+// meaningful sample, so instead of convolving every pixel of every frame the
+// tracker looks at every frame_step-th frame, and in it at every tile_step-th
+// tile (shifting by one tile each time, so all tiles take turns). Edges and
+// texture make the estimator overestimate, so only the smoothest
+// keep_fraction of the sampled tiles count (on plain noise that reads a few
+// percent low). The result is smoothed across frames with an EWMA and
+// published as one value any thread can read.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "noise_estimator.hpp"
+
+struct NoiseSampling {
+    int tile_size;        // Square tiles of this many pixels
+    int tile_step;        // Every tile_step-th tile is sampled
+    int frame_step;       // Every frame_step-th frame is sampled
+    double keep_fraction; // Share of the sampled tiles, smoothest first, that count
+    double smoothing;     // EWMA weight of a new sample (1 keeps no history)
+};
+
+class NoiseTracker {
+public:
+    explicit NoiseTracker(const NoiseSampling& sampling) : sampling_(sampling) {
+        sampling_.tile_size = std::max(sampling_.tile_size, 8);
+        sampling_.tile_step = std::max(sampling_.tile_step, 1);
+        sampling_.frame_step = std::max(sampling_.frame_step, 1);
+        sampling_.keep_fraction = std::min(std::max(sampling_.keep_fraction, 0.0), 1.0);
+    }
+
+    // Offer a frame (8-bit luma). Returns whether it was sampled. Call from
+    // one thread at a time; sigma() may be read from any.
+    bool update(const uint8_t* data, int width, int height, size_t stride) {
+        uint64_t frame = frames_++;
+        if (frame % sampling_.frame_step != 0 || width < 3 || height < 3) {
+            return false;
+        }
+
+        int size = sampling_.tile_size;
+        int columns = width / size;
+        int rows = height / size;
+        tiles_.clear();
+        if (columns == 0 || rows == 0) {
+            // Smaller than a tile, the whole frame is the sample
+            tiles_.push_back(estimateNoise(data, width, height, stride));
+        } else {
+            size_t phase = (frame / sampling_.frame_step) % sampling_.tile_step;
+            for (size_t tile = phase; tile < (size_t)(columns * rows); tile += sampling_.tile_step) {
+                const uint8_t* origin = data + (tile / columns) * size * stride + (tile % columns) * size;
+                tiles_.push_back(estimateNoise(origin, size, size, stride));
+            }
+        }
+
+        // Average over the smoothest tiles
+        size_t keep = std::max<size_t>(1, (size_t)(tiles_.size() * sampling_.keep_fraction + 0.5));
+        keep = std::min(keep, tiles_.size());
+        std::nth_element(tiles_.begin(), tiles_.begin() + (keep - 1), tiles_.end());
+        double sum = 0;
+        for (size_t i = 0; i < keep; i++) {
+            sum += tiles_[i];
+        }
+        double sample = sum / keep;
+
+        double previous = sigma_.load(std::memory_order_relaxed);
+        double smoothed = samples_++ == 0 ? sample : previous + sampling_.smoothing * (sample - previous);
+        sigma_.store(smoothed, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Start over, e.g. when a different camera takes the stream over
+    void reset() {
+        samples_ = 0;
+        frames_ = 0;
+        sigma_.store(0.0, std::memory_order_relaxed);
+    }
+
+    // Smoothed noise in grey levels, 0 before the first sample
+    double sigma() const { return sigma_.load(std::memory_order_relaxed); }
+
+private:
+    NoiseSampling sampling_;
+    uint64_t frames_ = 0;
+    uint64_t samples_ = 0;
+    std::vector<double> tiles_;
+    std::atomic<double> sigma_{0.0};
+};
@@ -0,0 +1,259 @@
+// Temporal denoising for a static camera: each plane (Y, U, V or a grey
+// image) is kept as a running average of the frames so far,
+//
+//   average += k * (frame - average)
+//
+// where the weight k of the new frame is small (strength) where the picture
+// holds still and grows to 1 where it moves, so moving objects do not leave
+// trails. Whether a pixel moves is judged by how far the frame is from the
+// average there, smoothed over the pixel and its horizontal neighbours
+// ([1 2 1] / 4): up to motion_low grey levels counts as noise, from
+// motion_high on as motion, with k rising linearly in between. Both limits are
+// best set from the measured noise: around 1.5 and 3 sigma, as higher limits
+// smear low contrast detail once the picture moves.
+//
+// With strength 1/4 the noise left in still areas is about 0.38 of the
+// input's, at the cost of a couple of integer operations per pixel. The
+// average is kept in 16 bits with 4 fractional bits, and the weight in Q15,
+// so 16 pixels go through per AVX2 step (8 on NEON, where the multiply is
+// vqrdmulh) with the same result as the scalar code.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEMPORAL_DENOISER_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define TEMPORAL_DENOISER_NEON 1
+#endif
+
+struct TemporalParams {
+    double strength;    // Weight of a new frame where nothing moves, 0..1
+    double motion_low;  // Difference (grey levels) still taken for noise
+    double motion_high; // Difference from which the new frame is taken as it is
+};
+
+namespace temporal_detail {
+
+const int FRACTION_BITS = 4;    // Of the running average
+const int ONE = 32767;          // Weight 1 in Q15
+
+// Weight curve in integers: k = min(floor + (m - low) * slope, ONE) for m
+// above low, where m is the smoothed difference in grey levels
+struct Curve {
+    int16_t floor;
+    int16_t low;
+    int16_t high;
+    int16_t slope;
+};
+
+// (a * b + 2^14) >> 15, as _mm256_mulhrs_epi16 and vqrdmulhq_s16 compute it
+inline int mulhrs(int a, int b) {
+    return (a * b + (1 << 14)) >> 15;
+}
+
+inline int weight(const Curve& curve, int motion) {
+    if (motion >= curve.high) {
+        return ONE;
+    }
+    int above = motion > curve.low ? motion - curve.low : 0;
+    return curve.floor + above * curve.slope;
+}
+
+// A row goes in two passes: first the distance of the new frame to the
+// average, |cur - state| in whole grey levels, then the blend, whose weight
+// needs the distances of the neighbours before their state moves on.
+inline void distancesScalar(const uint8_t* cur, const int16_t* state, uint8_t* distance, int from, int to) {
+    for (int x = from; x < to; x++) {
+        distance[x] = (uint8_t)(std::abs((cur[x] << FRACTION_BITS) - state[x]) >> FRACTION_BITS);
+    }
+}
+
+inline void blendScalar(const Curve& curve, const uint8_t* cur, const uint8_t* distance, int16_t* state,
+                        uint8_t* out, int width, int from, int to) {
+    for (int x = from; x < to; x++) {
+        int left = distance[std::max(x - 1, 0)];
+        int right = distance[std::min(x + 1, width - 1)];
+        int motion = (left + 2 * distance[x] + right) >> 2;
+        int diff = (cur[x] << FRACTION_BITS) - state[x];
+        state[x] = (int16_t)(state[x] + mulhrs(diff, weight(curve, motion)));
+        out[x] = (uint8_t)((state[x] + (1 << (FRACTION_BITS - 1))) >> FRACTION_BITS);
+    }
+}
+
+#if TEMPORAL_DENOISER_X86
+__attribute__((target("avx2")))
+inline __m256i loadWide(const uint8_t* p) {
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));
+}
+
+__attribute__((target("avx2")))
+inline __m128i packBytes(__m256i v) {
+    return _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2")))
+inline void rowAvx2(const Curve& curve, const uint8_t* cur, int16_t* state, uint8_t* distance, uint8_t* out,
+                    int width) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i diff = _mm256_sub_epi16(_mm256_slli_epi16(loadWide(cur + x), FRACTION_BITS),
+                                        _mm256_loadu_si256((const __m256i*)(state + x)));
+        __m256i d = _mm256_srli_epi16(_mm256_abs_epi16(diff), FRACTION_BITS);
+        _mm_storeu_si128((__m128i*)(distance + x), packBytes(d));
+    }
+    distancesScalar(cur, state, distance, x, width);
+
+    const __m256i floor = _mm256_set1_epi16(curve.floor);
+    const __m256i low = _mm256_set1_epi16(curve.low);
+    const __m256i below_high = _mm256_set1_epi16(curve.high - 1);
+    const __m256i slope = _mm256_set1_epi16(curve.slope);
+    const __m256i one = _mm256_set1_epi16(ONE);
+    const __m256i rounding = _mm256_set1_epi16(1 << (FRACTION_BITS - 1));
+    x = 1;
+    for (; x + 16 <= width - 1; x += 16) {
+        __m256i sides = _mm256_add_epi16(loadWide(distance + x - 1), loadWide(distance + x + 1));
+        __m256i motion = _mm256_srli_epi16(_mm256_add_epi16(sides, _mm256_slli_epi16(loadWide(distance + x), 1)), 2);
+
+        // k = floor + max(motion - low, 0) * slope, or ONE from high on
+        __m256i above = _mm256_subs_epu16(motion, low);
+        __m256i k = _mm256_add_epi16(floor, _mm256_mullo_epi16(above, slope));
+        k = _mm256_blendv_epi8(k, one, _mm256_cmpgt_epi16(motion, below_high));
+
+        __m256i s = _mm256_loadu_si256((const __m256i*)(state + x));
+        __m256i diff = _mm256_sub_epi16(_mm256_slli_epi16(loadWide(cur + x), FRACTION_BITS), s);
+        s = _mm256_add_epi16(s, _mm256_mulhrs_epi16(diff, k));
+        _mm256_storeu_si256((__m256i*)(state + x), s);
+        _mm_storeu_si128((__m128i*)(out + x), packBytes(_mm256_srai_epi16(_mm256_add_epi16(s, rounding), FRACTION_BITS)));
+    }
+    blendScalar(curve, cur, distance, state, out, width, 0, 1);
+    blendScalar(curve, cur, distance, state, out, width, x, width);
+}
+
+inline bool haveAvx2() {
+    static const bool available = __builtin_cpu_supports("avx2");
+    return available;
+}
+#endif
+
+#if TEMPORAL_DENOISER_NEON
+inline void rowNeon(const Curve& curve, const uint8_t* cur, int16_t* state, uint8_t* distance, uint8_t* out,
+                    int width) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        int16x8_t c = vreinterpretq_s16_u16(vshll_n_u8(vld1_u8(cur + x), FRACTION_BITS));
+        uint16x8_t d = vreinterpretq_u16_s16(vabdq_s16(c, vld1q_s16(state + x)));
+        vst1_u8(distance + x, vshrn_n_u16(d, FRACTION_BITS));
+    }
+    distancesScalar(cur, state, distance, x, width);
+
+    const uint16x8_t low = vdupq_n_u16(curve.low);
+    const uint16x8_t high = vdupq_n_u16(curve.high);
+    const int16x8_t floor = vdupq_n_s16(curve.floor);
+    const int16x8_t slope = vdupq_n_s16(curve.slope);
+    const int16x8_t one = vdupq_n_s16(ONE);
+    x = 1;
+    for (; x + 8 <= width - 1; x += 8) {
+        uint16x8_t sides = vaddl_u8(vld1_u8(distance + x - 1), vld1_u8(distance + x + 1));
+        uint16x8_t motion = vshrq_n_u16(vaddq_u16(sides, vshll_n_u8(vld1_u8(distance + x), 1)), 2);
+
+        int16x8_t above = vreinterpretq_s16_u16(vqsubq_u16(motion, low));
+        int16x8_t k = vmlaq_s16(floor, above, slope);
+        k = vbslq_s16(vcgeq_u16(motion, high), one, k);
+
+        int16x8_t s = vld1q_s16(state + x);
+        int16x8_t diff = vsubq_s16(vreinterpretq_s16_u16(vshll_n_u8(vld1_u8(cur + x), FRACTION_BITS)), s);
+        s = vaddq_s16(s, vqrdmulhq_s16(diff, k));
+        vst1q_s16(state + x, s);
+        vst1_u8(out + x, vqrshrun_n_s16(s, FRACTION_BITS));
+    }
+    blendScalar(curve, cur, distance, state, out, width, 0, 1);
+    blendScalar(curve, cur, distance, state, out, width, x, width);
+}
+#endif
+
+// distance is scratch of width bytes
+inline void row(const Curve& curve, const uint8_t* cur, int16_t* state, uint8_t* distance, uint8_t* out,
+                int width) {
+#if TEMPORAL_DENOISER_X86
+    if (haveAvx2()) {
+        rowAvx2(curve, cur, state, distance, out, width);
+        return;
+    }
+#elif TEMPORAL_DENOISER_NEON
+    rowNeon(curve, cur, state, distance, out, width);
+    return;
+#endif
+    distancesScalar(cur, state, distance, 0, width);
+    blendScalar(curve, cur, distance, state, out, width, 0, width);
+}
+
+} // namespace temporal_detail
+
+// Running average of one plane; keep one per plane of a stream
+class TemporalDenoiser {
+public:
+    // Average src into the running state and write the result to dst, which
+    // may be src itself. The first frame, or one of another size, starts the
+    // average over.
+    void filter(const TemporalParams& params, const uint8_t* src, size_t src_stride, uint8_t* dst,
+                size_t dst_stride, int width, int height) {
+        if (width < 1 || height < 1) {
+            return;
+        }
+        if (width != width_ || height != height_) {
+            width_ = width;
+            height_ = height;
+            state_.resize((size_t)width * height);
+            row_.resize(width);
+            distance_.resize(width);
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    state_[(size_t)y * width + x] = (int16_t)(src[y * src_stride + x] << temporal_detail::FRACTION_BITS);
+                }
+            }
+        }
+
+        temporal_detail::Curve curve = curveFor(params);
+        for (int y = 0; y < height; y++) {
+            // A copy of the row, so dst may overwrite src
+            memcpy(row_.data(), src + y * src_stride, width);
+            temporal_detail::row(curve, row_.data(), state_.data() + (size_t)y * width, distance_.data(),
+                                 dst + y * dst_stride, width);
+        }
+    }
+
+    // Forget the average, e.g. when the camera or the scene changes
+    void reset() {
+        width_ = 0;
+        height_ = 0;
+    }
+
+private:
+    static temporal_detail::Curve curveFor(const TemporalParams& params) {
+        using temporal_detail::ONE;
+        temporal_detail::Curve curve;
+        double strength = std::min(std::max(params.strength, 0.0), 1.0);
+        int low = std::min(std::max((int)(params.motion_low + 0.5), 0), 254);
+        int high = std::min(std::max((int)(params.motion_high + 0.5), low + 1), 255);
+        curve.floor = (int16_t)(strength * ONE);
+        curve.low = (int16_t)low;
+        curve.high = (int16_t)high;
+        // Rounded down, so floor + (high - 1 - low) * slope stays below ONE
+        curve.slope = (int16_t)((ONE - curve.floor) / (high - low));
+        return curve;
+    }
+
+    int width_ = 0;
+    int height_ = 0;
+    std::vector<int16_t> state_;  // The average, 4 fractional bits
+    std::vector<uint8_t> row_;    // The row being filtered
+    std::vector<uint8_t> distance_;
+};
@@ -0,0 +1,388 @@
+// Tile-parallel filtering. A frame (or plane) is cut into horizontal bands
+// sized to stay in cache, each band is filtered together with halo rows of
+// its neighbours, so the result is the same as filtering the whole frame, and
+// the bands are shared out over a pool of threads pinned to chosen cores
+// (on Linux; elsewhere the cores are left to the scheduler).
+//
+// Every worker starts on its own run of neighbouring bands and, once that is
+// done, steals from the far end of another worker's run, so a slow core or a
+// band full of detail does not hold the frame up. Each band's time is
+// recorded for the caller to report.
+//
+// Filters plug in as TileKernels; the common OpenCV ones and the separable
+// bilateral filter are below. OpenCV's own threading should be turned off
+// (cv::setNumThreads(1)) while a pool runs, or both fight over the cores.
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "fast_bilateral.hpp"
+
+// A filter the pool can run band by band
+class TileKernel {
+public:
+    virtual ~TileKernel() {}
+
+    // Rows above and below a band the filter reads
+    virtual int halo() const = 0;
+
+    // Called once per job, before any band, with the pool's worker count
+    virtual void prepare(int workers) { (void)workers; }
+
+    // Filter src into dst (same size, not overlapping). worker tells which
+    // thread calls, for kernels that keep scratch per thread.
+    virtual void apply(const cv::Mat& src, cv::Mat& dst, int worker) = 0;
+};
+
+// One band of the last job
+struct TileTiming {
+    int first_row;
+    int rows;
+    int worker;
+    bool stolen;        // Taken from another worker's run
+    uint64_t micros;
+};
+
+// Totals since the last takeStats()
+struct TileStats {
+    uint64_t jobs;
+    uint64_t tiles;
+    uint64_t stolen;
+    uint64_t total_us;  // Summed over tiles
+    uint64_t max_us;    // Slowest tile
+};
+
+class TilePool {
+public:
+    // One worker per entry of cores, pinned to that core (-1 leaves it
+    // unpinned). Bands aim at tile_bytes of input including the halo.
+    TilePool(const std::vector<int>& cores, size_t tile_bytes) : tile_bytes_(tile_bytes), worker_count_((int)cores.size()) {
+        for (size_t i = 0; i < cores.size(); i++) {
+            queues_.emplace_back(new WorkQueue());
+        }
+        scratch_.resize(cores.size());
+        for (size_t i = 0; i < cores.size(); i++) {
+            threads_.emplace_back(&TilePool::workerLoop, this, (int)i, cores[i]);
+        }
+    }
+
+    ~TilePool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    TilePool(const TilePool&) = delete;
+    TilePool& operator=(const TilePool&) = delete;
+
+    int workers() const { return worker_count_; }
+
+    // Filter src into dst band by band and wait for it. One job runs at a
+    // time; concurrent callers queue up.
+    void run(TileKernel& kernel, const cv::Mat& src, cv::Mat& dst) {
+        dst.create(src.size(), src.type());
+        if (threads_.empty() || src.rows == 0) {
+            kernel.prepare(1);
+            kernel.apply(src, dst, 0);
+            return;
+        }
+
+        std::lock_guard<std::mutex> job_lock(job_mutex_);
+        kernel.prepare(workers());
+
+        // Band height: tile_bytes_ of input with the halo, but at least two
+        // bands per worker so there is something to steal
+        int halo = std::max(kernel.halo(), 0);
+        size_t row_bytes = std::max<size_t>(src.cols * src.elemSize(), 1);
+        int rows = (int)(tile_bytes_ / row_bytes) - 2 * halo;
+        int per_worker = (src.rows + 2 * workers() - 1) / (2 * workers());
+        rows = std::max(1, std::min(rows, per_worker));
+        int bands = (src.rows + rows - 1) / rows;
+
+        timings_.assign(bands, TileTiming());
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            kernel_ = &kernel;
+            src_ = src;
+            dst_ = dst;
+            halo_ = halo;
+            band_rows_ = rows;
+            remaining_ = bands;
+            // Neighbouring bands go to the same worker
+            for (int w = 0; w < workers(); w++) {
+                std::lock_guard<std::mutex> queue_lock(queues_[w]->mutex);
+                for (int band = bands * w / workers(); band < bands * (w + 1) / workers(); band++) {
+                    queues_[w]->bands.push_back(band);
+                }
+            }
+            generation_++;
+        }
+        wake_.notify_all();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (remaining_ > 0) {
+            done_.wait(lock);
+        }
+        kernel_ = nullptr;
+        src_.release();
+        dst_.release();
+
+        stats_.jobs++;
+        for (const TileTiming& timing : timings_) {
+            stats_.tiles++;
+            stats_.stolen += timing.stolen ? 1 : 0;
+            stats_.total_us += timing.micros;
+            stats_.max_us = std::max(stats_.max_us, timing.micros);
+        }
+    }
+
+    // Bands of the last job; read between jobs
+    const std::vector<TileTiming>& lastTimings() const { return timings_; }
+
+    TileStats takeStats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        TileStats stats = stats_;
+        stats_ = TileStats();
+        return stats;
+    }
+
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<int> bands;
+    };
+
+    static void pin(int core) {
+        if (core < 0) {
+            return;
+        }
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (result != 0) {
+            std::cerr << "Tile worker could not be pinned to core " << core << ": " << strerror(result) << std::endl;
+        }
+#else
+        // No affinity call outside Linux (macOS only takes hints); say so once
+        static std::atomic<bool> warned(false);
+        if (!warned.exchange(true)) {
+            std::cerr << "Tile workers are not pinned to cores on this platform" << std::endl;
+        }
+#endif
+    }
+
+    // Own bands from the front, others' from the back
+    bool nextBand(int worker, int& band, bool& stolen) {
+        {
+            WorkQueue& own = *queues_[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.bands.empty()) {
+                band = own.bands.front();
+                own.bands.pop_front();
+                stolen = false;
+                return true;
+            }
+        }
+        for (int i = 1; i < workers(); i++) {
+            WorkQueue& victim = *queues_[(worker + i) % workers()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.bands.empty()) {
+                band = victim.bands.back();
+                victim.bands.pop_back();
+                stolen = true;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void filterBand(int worker, int band, bool stolen) {
+        auto start = std::chrono::steady_clock::now();
+        int first = band * band_rows_;
+        int last = std::min(first + band_rows_, src_.rows);
+        int top = std::max(first - halo_, 0);
+        int bottom = std::min(last + halo_, src_.rows);
+
+        // The kernel sees the band with its halo and writes into scratch;
+        // only the band's own rows are kept
+        cv::Mat& scratch = scratch_[worker];
+        kernel_->apply(src_.rowRange(top, bottom), scratch, worker);
+        cv::Mat band_dst = dst_.rowRange(first, last);
+        scratch.rowRange(first - top, last - top).copyTo(band_dst);
+
+        TileTiming& timing = timings_[band];
+        timing.first_row = first;
+        timing.rows = last - first;
+        timing.worker = worker;
+        timing.stolen = stolen;
+        timing.micros = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    void workerLoop(int worker, int core) {
+        pin(core);
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                while (!stopping_ && generation_ == seen) {
+                    wake_.wait(lock);
+                }
+                if (stopping_) {
+                    return;
+                }
+                seen = generation_;
+            }
+
+            int band;
+            bool stolen;
+            int finished = 0;
+            while (nextBand(worker, band, stolen)) {
+                filterBand(worker, band, stolen);
+                finished++;
+            }
+            if (finished > 0) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                remaining_ -= finished;
+                if (remaining_ == 0) {
+                    done_.notify_all();
+                }
+            }
+        }
+    }
+
+    size_t tile_bytes_;
+    int worker_count_;
+    std::vector<std::unique_ptr<WorkQueue>> queues_;
+    std::vector<std::thread> threads_;
+    std::vector<cv::Mat> scratch_;      // Per worker, the kernel's output for a band
+
+    std::mutex job_mutex_;              // One job at a time
+    std::mutex mutex_;                  // Job hand-over, completion and stats
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    bool stopping_ = false;
+    uint64_t generation_ = 0;
+    int remaining_ = 0;
+
+    // The job under way
+    TileKernel* kernel_ = nullptr;
+    cv::Mat src_;
+    cv::Mat dst_;
+    int halo_ = 0;
+    int band_rows_ = 0;
+    std::vector<TileTiming> timings_;
+    TileStats stats_ = TileStats();
+};
+
+// Cores first, first + 1, ... for count workers, wrapping around the
+// machine's cores
+inline std::vector<int> coreRange(int first, int count) {
+    int available = std::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<int> cores;
+    for (int i = 0; i < count; i++) {
+        cores.push_back((first + i) % available);
+    }
+    return cores;
+}
+
+class GaussianKernel : public TileKernel {
+public:
+    GaussianKernel(int ksize, double sigma) : ksize_(ksize), sigma_(sigma) {}
+    void set(int ksize, double sigma) {
+        ksize_ = ksize;
+        sigma_ = sigma;
+    }
+    int halo() const override { return ksize_ / 2; }
+    void apply(const cv::Mat& src, cv::Mat& dst, int) override {
+        cv::GaussianBlur(src, dst, cv::Size(ksize_, ksize_), sigma_);
+    }
+
+private:
+    int ksize_;
+    double sigma_;
+};
+
+class MedianKernel : public TileKernel {
+public:
+    explicit MedianKernel(int ksize) : ksize_(ksize) {}
+    int halo() const override { return ksize_ / 2; }
+    void apply(const cv::Mat& src, cv::Mat& dst, int) override { cv::medianBlur(src, dst, ksize_); }
+
+private:
+    int ksize_;
+};
+
+// OpenCV's bilateral filter, or for one channel images the separable one
+// (fast_bilateral.hpp) with a table set per worker
+class BilateralKernel : public TileKernel {
+public:
+    BilateralKernel(const BilateralParams& params, bool fast) : params_(params), fast_(fast) {}
+    void set(const BilateralParams& params) { params_ = params; }
+    int halo() const override { return params_.diameter > 0 ? params_.diameter / 2 : (int)(params_.sigma_space * 1.5 + 0.5); }
+    void prepare(int workers) override {
+        if ((int)engines_.size() < workers) {
+            engines_.resize(workers);
+        }
+    }
+    void apply(const cv::Mat& src, cv::Mat& dst, int worker) override {
+        if (fast_ && src.channels() == 1) {
+            dst.create(src.size(), src.type());
+            engines_[worker].filter(params_, src.data, src.step, dst.data, dst.step, src.cols, src.rows);
+        } else {
+            cv::bilateralFilter(src, dst, params_.diameter, params_.sigma_color, params_.sigma_space);
+        }
+    }
+
+private:
+    BilateralParams params_;
+    bool fast_;
+    std::vector<FastBilateral> engines_;
+};
+
+class NlmKernel : public TileKernel {
+public:
+    NlmKernel(float h, int template_size, int search_size)
+        : h_(h), template_size_(template_size), search_size_(search_size) {}
+    void set(float h, int template_size, int search_size) {
+        h_ = h;
+        template_size_ = template_size;
+        search_size_ = search_size;
+    }
+    // A patch of the search window reaches this far
+    int halo() const override { return template_size_ / 2 + search_size_ / 2; }
+    void apply(const cv::Mat& src, cv::Mat& dst, int) override {
+        if (src.channels() == 3) {
+            cv::fastNlMeansDenoisingColored(src, dst, h_, h_, template_size_, search_size_);
+        } else {
+            cv::fastNlMeansDenoising(src, dst, h_, template_size_, search_size_);
+        }
+    }
+
+private:
+    float h_;
+    int template_size_;
+    int search_size_;
+};
@@ -8,14 +8,20 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <vector>
+#include <string>
 #include <queue>
 #include <map>
 #include <opencv2/opencv.hpp>
-#include <fstream>
 #include <fcntl.h>  // Add this at the top
 #include <iomanip>   // For std::setprecision
 #include <deque>     // For std::deque
 
+#include "async_log.hpp"
+#include "frame_timing.hpp"
+#include "rate_control.hpp"
+#include "reactor.hpp"
+#include "stream_protocol.hpp"
+
 // FFmpeg includes
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -29,6 +35,27 @@ extern "C" {
 #define CLIENT_PORT 9998
 #define MAXLINE 65507 // Max UDP packet size
 #define MAX_BUFFER_SIZE 1000000 // 1MB max buffer size
+#define CAMERA_STREAM 0 // Which of the server's cameras to watch, in the order they connected
+
+// Retransmission: missing fragments are asked for again every NACK_INTERVAL_US,
+// and a frame is given up once it has waited NACK_DEADLINE_US and a newer one
+// is complete
+const uint64_t NACK_INTERVAL_US = 30000;
+const uint64_t NACK_DEADLINE_US = 130000; // Two frame intervals at 15 fps
+
+// Keyframe requests (PLI) after a lost frame or a decoder error, repeated
+// every PLI_INTERVAL_US until a keyframe arrives
+const uint64_t PLI_INTERVAL_US = 300000;
+
+// How the stream arrives is reported back every REPORT_INTERVAL_US, so the
+// server can adapt its bitrate; the reports also keep us registered
+const uint64_t REPORT_INTERVAL_US = 1000000;
+
+// The reactor sleeps until datagrams arrive, but wakes up in time for the next
+// NACK round. Each wakeup drains the socket RECEIVE_BATCH datagrams at a time.
+const int POLL_TIMEOUT_MS = NACK_INTERVAL_US / 2000;
+const size_t RECEIVE_BATCH = 32;
+const int MAX_RECEIVE_BATCHES = 8; // Then the completed frames get decoded first
 
 struct FFmpegContext {
     const AVCodec* codec;
@@ -40,14 +67,6 @@ struct FFmpegContext {
     int bgr_buffer_size;
 };
 
-// Structure to hold frame reconstruction data
-struct FrameData {
-    std::vector<uint8_t> data;
-    size_t expected_size;
-    uint32_t timestamp;
-    bool complete;
-};
-
 // Add FPS tracking variables
 double fps = 0.0;
 int64_t prev_frame_time = 0;
@@ -106,6 +125,10 @@ int main() {
         perror("setsockopt(SO_RCVBUF) failed");
     }
 
+    // Let the kernel stamp each datagram, so frame timings start on the wire
+    // rather than whenever we got round to reading it
+    DatagramBatch::enableTimestamps(sockfd);
+
     // Bind socket
     memset(&server_address, 0, sizeof(server_address));
     server_address.sin_family = AF_INET;
@@ -118,14 +141,14 @@ int main() {
     }
 
     // Register with the server
-    const char* registration = "Client registration";
+    std::string registration = "Client registration camera=" + std::to_string(CAMERA_STREAM);
     struct sockaddr_in server_dest_addr;
     memset(&server_dest_addr, 0, sizeof(server_dest_addr));
     server_dest_addr.sin_family = AF_INET;
     server_dest_addr.sin_port = htons(CLIENT_PORT);
     server_dest_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
 
-    sendto(sockfd, registration, strlen(registration), 0,
+    sendto(sockfd, registration.c_str(), registration.size(), 0,
            (const struct sockaddr*)&server_dest_addr, sizeof(server_dest_addr));
     std::cout << "Client registration message sent." << std::endl;
 
@@ -159,37 +182,59 @@ int main() {
 
     std::cout << "Client: Waiting for video..." << std::endl;
 
-    // Frame reconstruction map - keeps track of partial frames by timestamp
-    std::map<uint32_t, FrameData> frame_map;
-    uint32_t current_timestamp = 0;
-    std::queue<std::vector<uint8_t>> complete_frames;
+    // Frames are rebuilt in place from fragments, in any arrival order
+    FrameReassembler reassembler(NACK_DEADLINE_US);
+    ReassembledFrame reassembled;
+    reassembler.setNackInterval(NACK_INTERVAL_US);
+    bool need_keyframe = false;
+    uint64_t last_pli_us = 0;
+    unsigned long long frames_lost = 0;
+    unsigned long long resyncs = 0;
+    ReceiverStats receiver_stats;
+    uint64_t last_report_us = steadyMicros();
+    LatencyStats latency; // Per hop, from the relay's timing SEI
+
+    Reactor reactor;
+    reactor.add(sockfd);
+    DatagramBatch batch(RECEIVE_BATCH, MAX_DATAGRAM_SIZE);
     static int frame_counter = 0;
 
     while (true) {
         // Process frames that are already complete first
-        while (!complete_frames.empty()) {
-            std::vector<uint8_t>& h264_buffer = complete_frames.front();
+        while (reassembler.nextFrame(reassembled, steadyMicros())) {
+            if (reassembled.keyframe) {
+                need_keyframe = false;
+            }
+            receiver_stats.onFrame(reassembled);
             
             // Create packet for decoding
             AVPacket* packet = av_packet_alloc();
             if (!packet) {
                 std::cerr << "Failed to allocate packet" << std::endl;
-                complete_frames.pop();
                 continue;
             }
             
-            packet->data = h264_buffer.data();
-            packet->size = h264_buffer.size();
+            packet->data = (uint8_t*)reassembled.data;
+            packet->size = reassembled.size;
 
+            // When the frame went through each hop before us; the decoder
+            // skips the SEI itself
+            FrameTiming relay_timing = {};
+            findTimingSei(reassembled.data, reassembled.size, relay_timing);
+            uint64_t received_us = steadyToWallMicros(reassembled.complete_us);
+
+            // Without frame threads the picture is decoded right here
+            uint64_t decode_start_us = steadyMicros();
             int send_result = avcodec_send_packet(m_ffmpeg.context, packet);
+            receiver_stats.onDecode(steadyMicros() - decode_start_us);
             if (send_result < 0) {
                 std::cerr << "Error sending packet: " << send_result << std::endl;
                 // Try to recover from errors
                 if (send_result == AVERROR_INVALIDDATA) {
                     avcodec_flush_buffers(m_ffmpeg.context);
+                    need_keyframe = true;
                 }
                 av_packet_free(&packet);
-                complete_frames.pop();
                 continue;
             }
 
@@ -251,16 +296,15 @@ int main() {
                 char time_str[50];
                 std::strftime(time_str, sizeof(time_str), "%H:%M:%S", tm_ptr);
 
-                std::string log_path =  "client_log.txt";
-
-                std::ofstream pi_log(log_path, std::ios::app);
-                if (pi_log.is_open()) {
-                    // Log format: label time_string ts_ms sigma_before sigma_after
-                    pi_log << time_str << " " << ts_ms << "\n";
-                    pi_log.close();
-                } else {
-                    std::cerr << "Unable to open log.txt for writing at path: " << log_path << "\n";
-                }
+                // Log format: capture, relay received, decoded, filtered,
+                // encoded, sent, received here and shown, all in wall clock
+                // microseconds (0 where unknown). Queued here, written by the log thread.
+                uint64_t shown_us = wallClockMicros();
+                static const int log_file = AsyncLog::get().open("client_log.txt", "iiiiiiii", LogFormat::Text);
+                AsyncLog::get().write(log_file, relay_timing.capture_us, relay_timing.received_us,
+                                      relay_timing.decoded_us, relay_timing.filtered_us, relay_timing.encoded_us,
+                                      reassembled.send_time_us, received_us, shown_us);
+                latency.add(relay_timing, reassembled.send_time_us, received_us, shown_us);
 
                 // Calculate FPS
                 auto current_time = std::chrono::high_resolution_clock::now();
@@ -322,121 +366,71 @@ int main() {
             }
             
             av_packet_free(&packet);
-            complete_frames.pop();
         }
         
-        // Using select to efficiently wait for data
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(sockfd, &readfds);
-        
-        // Set a short timeout for select
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 1000; // 1ms timeout - more aggressive polling
+        // Ask the server for whatever is still missing
+        uint8_t nack[MAX_NACK_SIZE];
+        size_t nack_size = reassembler.collectNacks(steadyMicros(), nack, CAMERA_STREAM);
+        if (nack_size > 0) {
+            sendto(sockfd, nack, nack_size, 0,
+                   (const struct sockaddr*)&server_dest_addr, sizeof(server_dest_addr));
+        }
 
-        int activity = select(sockfd + 1, &readfds, NULL, NULL, &tv);
-        
-        if (activity < 0) {
-            if (errno != EINTR) { // Ignore if interrupted by signal
-                perror("select failed");
-                break;
-            }
-            continue;
+        // Without the lost frame the picture stays broken until the next
+        // keyframe, so ask for one now instead of waiting for the GOP. The
+        // same goes for a stream that started over (relay restart).
+        if (reassembler.framesLost() != frames_lost || reassembler.resyncs() != resyncs) {
+            frames_lost = reassembler.framesLost();
+            resyncs = reassembler.resyncs();
+            need_keyframe = true;
         }
-        
-        // No data available yet, continue processing or rendering
-        if (activity == 0) {
-            // Could add frame interpolation or other processing here
-            continue;
+        uint64_t now_us = steadyMicros();
+        if (need_keyframe && now_us - last_pli_us >= PLI_INTERVAL_US) {
+            uint8_t pli[CONTROL_HEADER_SIZE];
+            sendto(sockfd, pli, writePictureLoss(pli, CAMERA_STREAM), 0,
+                   (const struct sockaddr*)&server_dest_addr, sizeof(server_dest_addr));
+            last_pli_us = now_us;
         }
-        
-        // Data is available to read
-        if (FD_ISSET(sockfd, &readfds)) {
-            auto now = std::chrono::system_clock::now();
-            uint64_t ts_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                                now.time_since_epoch()).count();
-            std::time_t time_tt = std::chrono::system_clock::to_time_t(now);
-            std::tm *tm_ptr = std::localtime(&time_tt);
-            char time_str[50];
-            std::strftime(time_str, sizeof(time_str), "%H:%M:%S", tm_ptr);
-            
-            // Batch receive - try to get multiple packets at once
-            int consecutive_packets = 0;
-            const int MAX_CONSECUTIVE_PACKETS = 10; // Limit to prevent starvation
 
-            while (consecutive_packets < MAX_CONSECUTIVE_PACKETS) {
-                data = recvfrom(sockfd, buffer, MAXLINE, 0, (struct sockaddr*)&from_addr, &from_len);
-                
-                if (data < 0) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        // No more data available right now
-                        break;
-                    } else {
-                        perror("recvfrom failed");
-                        break;
-                    }
-                }
-                
-                // Check if this is a header packet (8 bytes with frame info)
-                if (data == 8) {
-                    uint32_t total_size = 
-                        ((uint8_t)buffer[0] << 24) | 
-                        ((uint8_t)buffer[1] << 16) | 
-                        ((uint8_t)buffer[2] << 8) | 
-                        (uint8_t)buffer[3];
-                        
-                    uint32_t timestamp = 
-                        ((uint8_t)buffer[4] << 24) | 
-                        ((uint8_t)buffer[5] << 16) | 
-                        ((uint8_t)buffer[6] << 8) | 
-                        (uint8_t)buffer[7];
-                    
-                    // Initialize a new frame entry
-                    frame_map[timestamp] = {
-                        .data = std::vector<uint8_t>(),
-                        .expected_size = total_size,
-                        .timestamp = timestamp,
-                        .complete = false
-                    };
-                    
-                    frame_map[timestamp].data.reserve(total_size);
-                    current_timestamp = timestamp;
-                    
-                    // Start frame reconstruction
-                    continue;
-                }
-                
-                // If we have a current timestamp, add data to that frame
-                if (current_timestamp > 0 && frame_map.find(current_timestamp) != frame_map.end()) {
-                    auto& frame = frame_map[current_timestamp];
-                    
-                    // Add received data to the frame buffer
-                    frame.data.insert(frame.data.end(), buffer, buffer + data);
-                    
-                    // Check if frame is complete
-                    if (frame.data.size() >= frame.expected_size) {
-                        frame.complete = true;
-                        
-                        // Move to complete frames queue
-                        complete_frames.push(frame.data);
-                        
-                        // Remove from map to free memory
-                        frame_map.erase(current_timestamp);
-                        current_timestamp = 0;
-                    }
-                }
+        // Tell the server how the stream is doing (and that we are still watching)
+        if (now_us - last_report_us >= REPORT_INTERVAL_US) {
+            uint8_t report[REPORT_SIZE];
+            sendto(sockfd, report, receiver_stats.writeReport(report, reassembler, CAMERA_STREAM), 0,
+                   (const struct sockaddr*)&server_dest_addr, sizeof(server_dest_addr));
+            last_report_us = now_us;
+        }
 
-                consecutive_packets++;
-            }
+        // Report how the transport is doing every few seconds
+        static time_t last_stats = time(nullptr);
+        time_t now_s = time(nullptr);
+        if (now_s - last_stats >= 5) {
+            std::cout << "Client: " << reassembler.framesCompleted() << " frames, "
+                      << reassembler.framesRecovered() << " repaired by FEC, "
+                      << reassembler.nacksSent() << " NACKs, "
+                      << reassembler.framesLost() << " unrecoverable, jitter "
+                      << receiver_stats.last().jitter_us << " us, decode "
+                      << receiver_stats.last().decode_us << " us" << std::endl;
+            std::cout << "Client: Latency ";
+            latency.print(std::cout);
+            std::cout << std::endl;
+            last_stats = now_s;
         }
-        
-        // Clean up old incomplete frames (after 5 seconds)
-        for (auto it = frame_map.begin(); it != frame_map.end();) {
-            if (current_timestamp - it->first > 150) { // Assuming ~30fps, 5 seconds = 150 frames
-                it = frame_map.erase(it);
-            } else {
-                ++it;
+
+        // Sleep until datagrams arrive, but not past the next NACK round
+        if (reactor.wait(POLL_TIMEOUT_MS) < 0) {
+            break;
+        }
+
+        // Drain the socket a batch at a time; the frames this completes are
+        // decoded at the top of the loop
+        for (int round = 0; round < MAX_RECEIVE_BATCHES; round++) {
+            int received = batch.receive(sockfd);
+            for (int i = 0; i < received; i++) {
+                // Place the fragment in its frame; finished frames come out of nextFrame()
+                reassembler.push(batch.data(i), batch.size(i), batch.arrivalMicros(i));
+            }
+            if (received < (int)batch.count()) {
+                break;
             }
         }
     }
@@ -12,10 +12,28 @@
 #include <sys/select.h>
 #include <algorithm>
 #include <ctime>
+#include <deque>
 #include <vector>
 #include <queue>
 #include <fstream>
+#include <atomic>
+#include <csignal>
+#include <memory>
+#include <thread>
 
+#include "client_registry.hpp"
+#include "denoise_controller.hpp"
+#include "frame_timing.hpp"
+#include "metrics.hpp"
+#include "noise_tracker.hpp"
+#include "nal_splitter.hpp"
+#include "paced_sender.hpp"
+#include "rate_control.hpp"
+#include "reactor.hpp"
+#include "send_history.hpp"
+#include "spsc_queue.hpp"
+#include "stream_protocol.hpp"
+#include "temporal_denoiser.hpp"
 
 // Include FFmpeg headers
 extern "C" {
@@ -24,6 +42,7 @@ extern "C" {
 #include <libavutil/avutil.h>
 #include <libswscale/swscale.h> // For sws_getContext and SWS_BILINEAR
 #include <libavutil/imgutils.h> // For av_image_get_buffer_size and av_image_fill_arrays
+#include <libavutil/pixdesc.h>
 }
 
 #define SERVER_IP "10.42.89.19"
@@ -32,180 +51,1449 @@ extern "C" {
 #define MAXLINE 1024
 #define MAX_UDP_SIZE 65507
 
-const size_t MAX_PACKET_SIZE = 1400; // Smaller than MAX_UDP_SIZE to avoid fragmentation
+// Pacing of the client stream. Up to one average frame leaves at wire rate;
+// anything beyond that (keyframes) is spread out at a multiple of the bitrate.
+const double PACING_RATE_FACTOR = 4.0;
+const bool USE_GSO = true; // Let the kernel split runs of chunks (UDP_SEGMENT) if supported
 
-// Extend FFmpegContext struct
+// Forward error correction on the client stream: parity fragments per group of
+// data fragments ({0, 0} turns it off). Keyframes get more, as losing one
+// costs a whole GOP.
+const FecParams FEC_DELTA = {8, 1};    // 12.5% overhead, repairs one loss per 8
+const FecParams FEC_KEYFRAME = {8, 2}; // 25% overhead, repairs bursts of two
+
+// Retransmission of fragments the client reports missing (NACK). Frames are
+// kept for a while after sending; past the deadline the client has moved on.
+const size_t HISTORY_FRAMES = 32;
+const uint64_t RETRANSMIT_DEADLINE_US = 150000; // About two frame intervals at 15 fps
+
+// Viewers: up to MAX_VIEWERS watch the same encode, each served from its own
+// position in the history. One that falls further behind than the history
+// skips to the newest frame and gets a keyframe.
+const size_t MAX_VIEWERS = 8;
+const uint64_t VIEWER_TIMEOUT_US = 5000000; // Dropped after this long without a heartbeat, NACK or PLI
+
+// Keyframes on request (PLI) from a client that lost the picture, or that just
+// registered. Rate limited, as every IDR costs several times a normal frame.
+const uint64_t MIN_KEYFRAME_INTERVAL_US = 500000;
+
+// Adaptive bitrate: every viewer's receiver reports drive its own rate
+// between MIN_BITRATE and MAX_BITRATE (AIMD, see rate_control.hpp), and the
+// encoder of a stream follows its slowest viewer. Fragments of a frame taking
+// longer than a frame interval to arrive means the link cannot keep up.
+const int64_t MAX_BITRATE = 4000000;
+const int64_t MIN_BITRATE = 300000;
+const int64_t BITRATE_STEP = 200000;          // Added per report while the viewer sees no loss
+const uint32_t JITTER_LIMIT_US = 30000;
+const uint32_t SPREAD_LIMIT_US = 66000;       // One frame interval at 15 fps
+const double VBV_SECONDS = 0.5;               // Encoder buffer, caps how far a frame may overshoot
+const double RATE_CHANGE_THRESHOLD = 0.05;    // Smaller changes are not worth an encoder reconfig
+
+// Cameras: each source address gets its own stream, with its own decoder,
+// encoder and viewers. A stream whose camera has been silent for
+// CAMERA_TIMEOUT_US goes to the next new camera (e.g. a Pi that rebooted and
+// now sends from another port).
+const size_t MAX_CAMERAS = 4;
+const uint64_t CAMERA_TIMEOUT_US = 10000000;
+
+// Pipeline sizing: receive -> decode -> filter workers -> encode -> send, per
+// camera stream; the filter workers are shared by all streams
+const int FILTER_WORKERS = 4;             // Frames are denoised in parallel, one per worker
+const int TILE_THREADS = 4;               // Each worker splits its frame into bands over this many threads (0: none)
+const size_t TILE_BYTES = 64 * 1024;      // Input a band aims at, halo included, to stay in L2
+const size_t DATAGRAM_QUEUE_SIZE = 128;   // Camera datagrams waiting for the decoder
+const size_t FRAME_QUEUE_SIZE = 2;        // Frames waiting in front of / behind each filter worker
+const size_t PACKET_QUEUE_SIZE = 32;      // Encoded packets waiting for the sender
+const size_t NACK_QUEUE_SIZE = 256;       // Retransmission requests waiting for the sender
+const size_t REPORT_QUEUE_SIZE = 32;      // Receiver reports waiting for the sender
+const size_t RECEIVE_BATCH = 16;          // Camera datagrams per recvmmsg call
+const int MAX_RECEIVE_BATCHES = 8;        // recvmmsg calls per wakeup before viewers get a turn
+const int MAX_CONTROL_MESSAGES = 64;      // Viewer messages handled per wakeup
+
+// Drop policies per stage. The receive stage never waits: a datagram that
+// does not fit in the decode queue is dropped. Decoded frames are dropped when
+// the filter workers are behind; once a frame has been denoised it is never
+// dropped, because losing encoded data corrupts the stream (a worker leaves a
+// frame in its input until the encode side has room for it).
+const DropPolicy DECODED_DROP_POLICY = DropPolicy::DropNewest;
+const DropPolicy ENCODED_DROP_POLICY = DropPolicy::Block;
+
+// Where the denoising happens
+enum class DenoiseMode {
+    Bgr,  // Convert to BGR24, filter all three colour channels, convert back
+    Yuv   // Filter the decoded YUV420P planes directly into the encoder frame
+};
+const DenoiseMode DENOISE_MODE = DenoiseMode::Yuv;
+const bool DENOISE_CHROMA = false; // Yuv mode: also filter U and V, otherwise luma only
+const bool FAST_BILATERAL = true;  // Yuv mode: separable bilateral filter, ~3x faster than OpenCV's at the same SSIM
+
+// How hard to denoise, from the noise measured in each frame (sigma in grey
+// levels): nothing below 1.5, Gaussian from 1.5, bilateral from 3, NLM from 6.
+// A weaker filter takes over only 0.3 below its threshold and after 15 frames.
+// A filter averaging over 40ms is not used: each worker has FILTER_WORKERS
+// frame intervals per frame, shared by every camera.
+const DenoiseLimits DENOISE_LIMITS = {1.5, 3.0, 6.0, 0.3, 15, 40000};
+
+// Noise is measured by the decode thread on every 2nd frame, in every 4th
+// 64x64 tile, averaging the smoothest 30% of those (about an eighth of the
+// work of measuring every frame in full) and smoothing with 0.1
+const NoiseSampling NOISE_SAMPLING = {64, 4, 2, 0.3, 0.1};
+
+// Temporal denoising on the decode thread, which sees the stream's frames in
+// order: each plane becomes a running average in which a new frame weighs
+// 0.25 where the picture holds still, up to all of it where it moves (a
+// difference of 1.5 to 3 sigma, but not below 3 grey levels, since compression
+// alone makes still areas flicker). That leaves still areas about 0.4 of the
+// noise for ~1ms per 720p frame; higher limits average more but smear low
+// contrast detail when the picture moves. The spatial filter is then chosen from the
+// noise left over, measured on the averaged frames.
+const bool TEMPORAL_DENOISE = true;
+const TemporalParams TEMPORAL_PARAMS = {0.25, 1.5, 3.0}; // Motion limits in sigma
+const double TEMPORAL_MIN_MOTION = 3.0;
+
+// Latency timestamps (frame_timing.hpp): the capture time the camera stamps
+// into the picture is read after decoding, and every encoded frame goes out
+// with an SEI message of when it was captured, received, decoded, filtered
+// and encoded, about 70 bytes per frame
+const bool TIMING_SEI = true;
+
+// Live metrics (metrics.hpp): a latency histogram per stage and the pipeline
+// counters, as Prometheus text on http://METRICS_ADDRESS:METRICS_PORT/metrics
+// (port 0 turns it off). The stats lines print the same per interval.
+const char* const METRICS_ADDRESS = "127.0.0.1"; // Local only; scrape through a tunnel or a local agent
+const int METRICS_PORT = 9102;
+
+// Decoder and encoder of one camera stream
 struct FFmpegContext {
     const AVCodec* codec;
     AVCodecContext* context;
     AVFrame* frame_yuv;
-    AVFrame* frame_bgr;
-    SwsContext* sws_ctx;
 
     // Encoding-specific fields
     const AVCodec* encoder_codec;
     AVCodecContext* encoder_context;
-    AVFrame* frame_encoder;
     AVPacket* packet_encoder;
 };
 
-FFmpegContext m_ffmpeg;
+// One camera datagram. The queue slots are a preallocated slab pool:
+// recvmmsg writes straight into them and the decoder reads them in place.
+struct Datagram {
+    size_t size;
+    uint64_t arrival_us; // When the kernel received it (steady clock)
+    bool restart;        // First datagram from a camera that took the stream over
+    uint8_t data[65536];
+};
 
-std::vector<uint8_t> h264_buffer; // Buffer to accumulate H.264 data
+// What a filter worker keeps for one camera stream: the queues to and from
+// that stream's decode and encode threads, and conversion state for its size
+struct FilterLane {
+    SpscQueue<AVFrame*> input{FRAME_QUEUE_SIZE};
+    SpscQueue<AVFrame*> output{FRAME_QUEUE_SIZE};
 
-bool isCompleteNalUnit(const std::vector<uint8_t>& buffer) {
-    // Check if the buffer has at least one NAL unit
-    // Look for start code pattern: 0x00 0x00 0x01 or 0x00 0x00 0x00 0x01
-    size_t i = 0;
-    int start_codes_found = 0;
+    // Conversion contexts are created on first use and reused via sws_getCachedContext
+    SwsContext* sws_ctx = nullptr;          // Decoded frame -> BGR24 (Bgr) or encoder layout (Yuv)
+    SwsContext* sws_ctx_encoder = nullptr;  // BGR24 -> encoder pixel format (Bgr)
+    AVFrame* frame_bgr = nullptr;
+    AVFrame* frame_scratch = nullptr;       // Yuv mode: decoded frame converted to the encoder layout
+    AVFrame* frame_encoder = nullptr;
+    FastBilateral bilateral;                // Yuv mode: tables and scratch of the separable bilateral filter
+    TilePool* tiles = nullptr;              // The worker's band threads, if it has them
+    DenoiseKernel kernel;                   // The filter as it runs on the bands
+    DenoiseController* denoise = nullptr;   // The stream's, shared by its lanes in every worker
+    const NoiseTracker* noise = nullptr;    // The stream's noise, measured by its decode thread
+};
 
-    while (i < buffer.size() - 3) {
-        if ((buffer[i] == 0 && buffer[i+1] == 0 && buffer[i+2] == 1) ||
-            (i < buffer.size() - 4 && buffer[i] == 0 && buffer[i+1] == 0 && 
-             buffer[i+2] == 0 && buffer[i+3] == 1)) {
-            
-            start_codes_found++;
-            if (start_codes_found >= 2) {
-                return true; // Found at least 2 start codes (one complete NAL unit)
-            }
-            
-            // Skip ahead to avoid finding the same start code
-            i += 3;
-        } else {
-            i++;
-        }
-    }
-    
-    return false; // Not enough start codes found
+// A denoising worker serves every camera stream, through one lane each
+struct FilterWorker {
+    FilterLane lanes[MAX_CAMERAS];
+    std::unique_ptr<TilePool> tiles;        // Pinned to cores of its own
+    std::thread thread;
+};
+
+// A retransmission request and the viewer slot it came from
+struct ViewerNack {
+    int viewer;
+    NackEntry entry;
+};
+
+// A receiver report and the viewer slot it came from
+struct ViewerReport {
+    int viewer;
+    ReceiverReport report;
+};
+
+// Everything that belongs to one camera: its codecs, the queues between its
+// stages and the threads that run them
+struct CameraStream {
+    int index = 0;
+    FFmpegContext ffmpeg;
+    SpscQueue<Datagram> datagrams{DATAGRAM_QUEUE_SIZE};
+    SpscQueue<AVPacket*> packets{PACKET_QUEUE_SIZE};
+    SpscQueue<ViewerNack> nacks{NACK_QUEUE_SIZE};
+    SpscQueue<ViewerReport> reports{REPORT_QUEUE_SIZE};
+    std::atomic<bool> keyframe_requested{false}; // Set by the receive thread, served by the encode thread
+    std::atomic<int64_t> target_bitrate{0};      // Set by the send thread, applied by the encode thread
+    DenoiseController denoise{DENOISE_LIMITS};   // Filter choice, shared by the filter workers
+    NoiseTracker noise{NOISE_SAMPLING};          // Updated by the decode thread, read by the filter workers
+    NoiseTracker residual{NOISE_SAMPLING};       // Same, after the temporal stage
+    TemporalDenoiser temporal[AV_NUM_DATA_POINTERS]; // Decode thread only, one per plane
+    AVBufferPool* temporal_pool = nullptr;           // Decode thread only, output pictures
+    int temporal_pool_size = 0;                      // Bytes per picture of temporal_pool
+    std::thread decode_thread;
+    std::thread encode_thread;
+    std::thread send_thread;
+
+    // Receive thread only
+    struct sockaddr_in source;        // Camera feeding the stream
+    uint64_t last_datagram_us = 0;
+    bool pending_restart = false;     // Tell the decoder before the next datagram
+};
+
+// Counters only go up; the stats lines print how much they grew
+struct PipelineStats {
+    std::atomic<unsigned long long> bytes_received{0};
+    std::atomic<unsigned long long> datagrams_dropped{0};
+    std::atomic<unsigned long long> frames_dropped{0};
+    std::atomic<unsigned long long> decoder_errors{0};
+    std::atomic<unsigned long long> buffer_trims{0};     // Oversized NAL units dropped by the splitter
+    std::atomic<unsigned long long> datagrams_retransmitted{0};
+    std::atomic<unsigned long long> keyframes_forced{0};
+    std::atomic<unsigned long long> denoised[DENOISE_LEVELS] = {}; // Frames per filter
+
+    // Time in each stage, per frame (per datagram for queue), every stream together
+    LatencyHistogram queue;     // Kernel arrival to the decoder splitting it into NAL units
+    LatencyHistogram decode;
+    LatencyHistogram temporal;
+    LatencyHistogram to_bgr;    // Bgr mode
+    LatencyHistogram denoise;
+    LatencyHistogram to_yuv;    // Bgr mode
+    LatencyHistogram encode;
+    LatencyHistogram send;      // Packetizing a frame, FEC included, into the send history
+    LatencyHistogram relay;     // Received to encoded, the whole relay
+    LatencyHistogram camera;    // Capture (stamped by the camera) to received
+};
+
+std::atomic<bool> running(true);
+std::atomic<size_t> stream_count(0); // Filter lanes [0, stream_count) are set up
+PipelineStats stats;
+
+// The stages as the metrics endpoint and the stats lines name them
+struct StageMetric {
+    const char* name;
+    const LatencyHistogram* histogram;
+};
+const StageMetric STAGE_METRICS[] = {
+    {"queue", &stats.queue}, {"decode", &stats.decode}, {"temporal", &stats.temporal},
+    {"to_bgr", &stats.to_bgr}, {"denoise", &stats.denoise}, {"to_yuv", &stats.to_yuv},
+    {"encode", &stats.encode}, {"send", &stats.send}, {"relay", &stats.relay}, {"camera", &stats.camera},
+};
+const int STAGE_COUNT = sizeof(STAGE_METRICS) / sizeof(STAGE_METRICS[0]);
+
+void handleSignal(int) {
+    running = false;
 }
 
-// Function to find start of NAL unit in buffer
-size_t findNalStartCode(const std::vector<uint8_t>& buffer, size_t start_pos = 0) {
-    for (size_t i = start_pos; i < buffer.size() - 3; i++) {
-        // Check for 3-byte start code: 0x00 0x00 0x01
-        if (buffer[i] == 0 && buffer[i+1] == 0 && buffer[i+2] == 1) {
-            return i;
-        }
-        // Check for 4-byte start code: 0x00 0x00 0x00 0x01
-        if (i < buffer.size() - 4 && buffer[i] == 0 && buffer[i+1] == 0 && 
-            buffer[i+2] == 0 && buffer[i+3] == 1) {
-            return i;
-        }
-    }
-    return buffer.size(); // Not found
+void registerMetrics(MetricsRegistry& registry);
+void attachTiming(AVFrame* frame, uint64_t received_us);
+bool denoiseTemporal(CameraStream& stream, const AVFrame* src, AVFrame* dst);
+void decodeLoop(CameraStream& stream, std::vector<std::unique_ptr<FilterWorker>>& workers);
+void encodeLoop(CameraStream& stream, std::vector<std::unique_ptr<FilterWorker>>& workers);
+void sendLoop(int client_sock, CameraStream& stream, ClientRegistry& registry);
+
+bool sameAddress(const struct sockaddr_in& a, const struct sockaddr_in& b) {
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
 }
 
-// Driver code 
-int main() { 
-    // Initialize libav used to decode H.264
-    avformat_network_init();
-    m_ffmpeg.codec = avcodec_find_decoder_by_name("h264_cuda"); // or other HW decoders
-    if (!m_ffmpeg.codec) {
+// Open a hardware decoder (software as a fallback) and the libx264 encoder
+void openCodecs(FFmpegContext& ffmpeg) {
+    ffmpeg.codec = avcodec_find_decoder_by_name("h264_cuda"); // or other HW decoders
+    if (!ffmpeg.codec) {
         // Fall back to software
-        m_ffmpeg.codec = avcodec_find_decoder_by_name("h264_cuvid");
+        ffmpeg.codec = avcodec_find_decoder_by_name("h264_cuvid");
     }
-    m_ffmpeg.context = avcodec_alloc_context3(m_ffmpeg.codec);
-    if (!m_ffmpeg.context)
+    ffmpeg.context = avcodec_alloc_context3(ffmpeg.codec);
+    if (!ffmpeg.context)
     {
         fprintf(stderr, "Could not allocate video codec context\n");
         exit(1);
     }
 
     // Add error resilience flags
-    m_ffmpeg.context->err_recognition = AV_EF_CAREFUL;
-    m_ffmpeg.context->flags |= AV_CODEC_FLAG_LOW_DELAY;
-    m_ffmpeg.context->flags2 |= AV_CODEC_FLAG2_CHUNKS;
-    //m_ffmpeg.context->thread_count = 16;
-    m_ffmpeg.context->thread_type = FF_THREAD_SLICE;
-    m_ffmpeg.context->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
-
-    if (avcodec_open2(m_ffmpeg.context, m_ffmpeg.codec, nullptr) < 0)
+    ffmpeg.context->err_recognition = AV_EF_CAREFUL;
+    ffmpeg.context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    ffmpeg.context->flags2 |= AV_CODEC_FLAG2_CHUNKS;
+    //ffmpeg.context->thread_count = 16;
+    ffmpeg.context->thread_type = FF_THREAD_SLICE;
+    ffmpeg.context->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+
+    if (avcodec_open2(ffmpeg.context, ffmpeg.codec, nullptr) < 0)
     {
         fprintf(stderr, "Could not open codec\n");
         exit(1);
     }
 
     // Allocate YUV frame
-    m_ffmpeg.frame_yuv = av_frame_alloc();
-    if (!m_ffmpeg.frame_yuv) 
+    ffmpeg.frame_yuv = av_frame_alloc();
+    if (!ffmpeg.frame_yuv) 
     {
         fprintf(stderr, "Could not allocate video frame\n");
         exit(1);
     }
 
-    // Allocate BGR frame
-    m_ffmpeg.frame_bgr = av_frame_alloc();
-    if (!m_ffmpeg.frame_bgr) {
-        fprintf(stderr, "Could not allocate BGR frame\n");
-        exit(1);
-    }
-
     // Initialize encoder
-     m_ffmpeg.encoder_codec = avcodec_find_encoder_by_name("libx264");
-    if (!m_ffmpeg.encoder_codec) {
+    ffmpeg.encoder_codec = avcodec_find_encoder_by_name("libx264");
+    if (!ffmpeg.encoder_codec) {
         std::cerr << "No suitable encoder found" << std::endl;
         exit(1);
     }
-    
 
-    m_ffmpeg.encoder_context = avcodec_alloc_context3(m_ffmpeg.encoder_codec);
-    if (!m_ffmpeg.encoder_context) {
+    ffmpeg.encoder_context = avcodec_alloc_context3(ffmpeg.encoder_codec);
+    if (!ffmpeg.encoder_context) {
         std::cerr << "Could not allocate encoder context" << std::endl;
         exit(1);
     }
 
     // Set encoder parameters
-    m_ffmpeg.encoder_codec = avcodec_find_encoder_by_name("libx264");
-    m_ffmpeg.encoder_context = avcodec_alloc_context3(m_ffmpeg.encoder_codec);
-    m_ffmpeg.encoder_context->bit_rate = 4000000; // Adjust bitrate as needed
-    m_ffmpeg.encoder_context->width = 1280;       // Set valid width
-    m_ffmpeg.encoder_context->height = 720;      // Set valid height
-    m_ffmpeg.encoder_context->time_base = {1, 15}; // 15 fps
-    m_ffmpeg.encoder_context->framerate = {15, 1};
-    m_ffmpeg.encoder_context->gop_size = 15;      // Group of pictures size
-    m_ffmpeg.encoder_context->max_b_frames = 0;   // Disable B-frames for low latency
-    m_ffmpeg.encoder_context->pix_fmt = AV_PIX_FMT_YUV420P; // Use YUV420P pixel format
-    m_ffmpeg.encoder_context->refs = 2;          // Fewer reference frames = faster
-    m_ffmpeg.encoder_context->thread_count = 16; // More reasonable value
-    m_ffmpeg.encoder_context->thread_type = FF_THREAD_FRAME; // Use frame-level threading
+    ffmpeg.encoder_context->bit_rate = MAX_BITRATE; // Lowered while viewers report congestion
+    ffmpeg.encoder_context->rc_max_rate = MAX_BITRATE; // VBV has to be on from the start to be changed later
+    ffmpeg.encoder_context->rc_buffer_size = (int)(MAX_BITRATE * VBV_SECONDS);
+    ffmpeg.encoder_context->width = 1280;       // Set valid width
+    ffmpeg.encoder_context->height = 720;      // Set valid height
+    ffmpeg.encoder_context->time_base = {1, 15}; // 15 fps
+    ffmpeg.encoder_context->framerate = {15, 1};
+    ffmpeg.encoder_context->gop_size = 150;     // Group of pictures size, clients ask for keyframes when they need one
+    ffmpeg.encoder_context->max_b_frames = 0;   // Disable B-frames for low latency
+    ffmpeg.encoder_context->pix_fmt = AV_PIX_FMT_YUV420P; // Use YUV420P pixel format
+    ffmpeg.encoder_context->refs = 2;          // Fewer reference frames = faster
+    ffmpeg.encoder_context->thread_count = 16 / MAX_CAMERAS; // Cores are shared between the streams
+    ffmpeg.encoder_context->thread_type = FF_THREAD_FRAME; // Use frame-level threading
 
 
     AVDictionary* opts = nullptr;
     av_dict_set(&opts, "preset", "ultrafast", 0); // Set encoding preset
     av_dict_set(&opts, "tune", "zerolatency", 0); // Set tuning option
+    av_dict_set(&opts, "forced-idr", "1", 0);     // A forced keyframe is an IDR, so decoding can restart there
 
-    if (avcodec_open2(m_ffmpeg.encoder_context, m_ffmpeg.encoder_codec, &opts) < 0) {
+    if (avcodec_open2(ffmpeg.encoder_context, ffmpeg.encoder_codec, &opts) < 0) {
         std::cerr << "Could not open encoder" << std::endl;
         exit(1);
     }
 
     av_dict_free(&opts); // Free the dictionary
    
-    std::cout << "Using encoder: " << m_ffmpeg.encoder_codec->name << std::endl;
+    std::cout << "Using encoder: " << ffmpeg.encoder_codec->name << std::endl;
 
-    // Allocate frame for encoding
-    m_ffmpeg.frame_encoder = av_frame_alloc();
-    if (!m_ffmpeg.frame_encoder) {
-        std::cerr << "Could not allocate encoder frame" << std::endl;
+    // Allocate packet for encoded data
+    ffmpeg.packet_encoder = av_packet_alloc();
+    if (!ffmpeg.packet_encoder) {
+        std::cerr << "Could not allocate encoder packet" << std::endl;
         exit(1);
     }
-    m_ffmpeg.frame_encoder->format = m_ffmpeg.encoder_context->pix_fmt;
-    m_ffmpeg.frame_encoder->width = m_ffmpeg.encoder_context->width;
-    m_ffmpeg.frame_encoder->height = m_ffmpeg.encoder_context->height;
+}
 
-    if (av_frame_get_buffer(m_ffmpeg.frame_encoder, 32) < 0) {
-        std::cerr << "Could not allocate frame buffer for encoder" << std::endl;
-        exit(1);
+// Set up a stream for a new camera: its codecs, a lane in every filter worker
+// with frames of the encoder's size, and its decode, encode and send threads.
+// Runs on the receive thread, which stalls for as long as the codecs take to open.
+std::unique_ptr<CameraStream> startStream(size_t index, const struct sockaddr_in& source, int client_sock,
+                                          std::vector<std::unique_ptr<FilterWorker>>& workers,
+                                          ClientRegistry& viewers) {
+    std::unique_ptr<CameraStream> stream(new CameraStream());
+    stream->index = (int)index;
+    stream->source = source;
+    openCodecs(stream->ffmpeg);
+
+    for (auto& worker : workers) {
+        FilterLane& lane = worker->lanes[index];
+        lane.denoise = &stream->denoise;
+        lane.tiles = worker->tiles.get();
+        lane.noise = TEMPORAL_DENOISE ? &stream->residual : &stream->noise;
+
+        lane.frame_bgr = av_frame_alloc();
+        if (!lane.frame_bgr) {
+            fprintf(stderr, "Could not allocate BGR frame\n");
+            exit(1);
+        }
+
+        lane.frame_scratch = av_frame_alloc();
+        if (!lane.frame_scratch) {
+            std::cerr << "Could not allocate scratch frame" << std::endl;
+            exit(1);
+        }
+
+        lane.frame_encoder = av_frame_alloc();
+        if (!lane.frame_encoder) {
+            std::cerr << "Could not allocate encoder frame" << std::endl;
+            exit(1);
+        }
+        lane.frame_encoder->format = stream->ffmpeg.encoder_context->pix_fmt;
+        lane.frame_encoder->width = stream->ffmpeg.encoder_context->width;
+        lane.frame_encoder->height = stream->ffmpeg.encoder_context->height;
+
+        if (av_frame_get_buffer(lane.frame_encoder, 32) < 0) {
+            std::cerr << "Could not allocate frame buffer for encoder" << std::endl;
+            exit(1);
+        }
     }
+    // The workers pick the new lanes up from here on
+    stream_count.store(index + 1, std::memory_order_release);
 
-    // Allocate packet for encoded data
-    m_ffmpeg.packet_encoder = av_packet_alloc();
-    if (!m_ffmpeg.packet_encoder) {
-        std::cerr << "Could not allocate encoder packet" << std::endl;
+    stream->send_thread = std::thread(sendLoop, client_sock, std::ref(*stream), std::ref(viewers));
+    stream->encode_thread = std::thread(encodeLoop, std::ref(*stream), std::ref(workers));
+    stream->decode_thread = std::thread(decodeLoop, std::ref(*stream), std::ref(workers));
+    return stream;
+}
+
+// Stream for a datagram from a camera: the one it already feeds, a new one
+// while there is room, or one whose camera has gone quiet. nullptr if every
+// stream is taken by a live camera.
+CameraStream* routeCamera(std::vector<std::unique_ptr<CameraStream>>& streams, const struct sockaddr_in& source,
+                          uint64_t now_us, int client_sock, std::vector<std::unique_ptr<FilterWorker>>& workers,
+                          ClientRegistry& viewers) {
+    CameraStream* quiet = nullptr;
+    for (auto& stream : streams) {
+        if (sameAddress(stream->source, source)) {
+            stream->last_datagram_us = now_us;
+            return stream.get();
+        }
+        if (!quiet && now_us - stream->last_datagram_us > CAMERA_TIMEOUT_US) {
+            quiet = stream.get();
+        }
+    }
+
+    CameraStream* stream = quiet;
+    if (streams.size() < MAX_CAMERAS) {
+        streams.push_back(startStream(streams.size(), source, client_sock, workers, viewers));
+        stream = streams.back().get();
+    } else if (quiet) {
+        // Same pipeline, new camera: the decoder has to start over
+        quiet->source = source;
+        quiet->pending_restart = true;
+    } else {
+        return nullptr;
+    }
+
+    std::cout << "Server: Camera " << inet_ntoa(source.sin_addr) << ":" << ntohs(source.sin_port)
+              << " is stream " << stream->index << std::endl;
+    stream->last_datagram_us = now_us;
+    return stream;
+}
+
+// A registration, heartbeat, PLI or NACK from a viewer
+void handleClientMessage(int client_sock, char* buffer, ssize_t n, const struct sockaddr_in& from_addr,
+                         socklen_t from_len, std::vector<std::unique_ptr<CameraStream>>& streams,
+                         ClientRegistry& viewers) {
+    if (isControlMessage((uint8_t*)buffer, n)) {
+        // Any control message keeps its viewer alive, and brings back
+        // one we had forgotten about (e.g. after a restart) on the camera
+        // the message names
+        int camera = std::min(readControlCamera((uint8_t*)buffer), (int)MAX_CAMERAS - 1);
+        bool joined = false;
+        int viewer = viewers.touch(from_addr, from_len, steadyMicros(), &joined, camera);
+        int watched = viewer != ClientRegistry::NONE ? viewers.streamOf(viewer) : -1;
+        CameraStream* stream = watched >= 0 && watched < (int)streams.size() ? streams[watched].get() : nullptr;
+        if (stream && (joined || buffer[1] == CONTROL_PLI)) {
+            stream->keyframe_requested = true; // A viewer can only start decoding at an IDR
+        }
+        if (stream && buffer[1] == CONTROL_NACK) {
+            // Retransmission requests go to the stream's send thread, which has the history
+            NackEntry entries[MAX_NACK_ENTRIES];
+            size_t count = readNack((uint8_t*)buffer, n, entries, MAX_NACK_ENTRIES);
+            for (size_t i = 0; i < count; i++) {
+                stream->nacks.tryPush(ViewerNack{viewer, entries[i]});
+            }
+        }
+        ReceiverReport report;
+        if (stream && readReport((uint8_t*)buffer, n, report)) {
+            stream->reports.tryPush(ViewerReport{viewer, report}); // The send thread knows what was sent
+        }
+        return;
+    }
+
+    buffer[n] = '\0'; // Null-terminate if you expect string data
+    std::cout << "Server: Received client message from "
+              << inet_ntoa(from_addr.sin_addr) << ":" << ntohs(from_addr.sin_port)
+              << " : " << buffer << std::endl;
+
+    // A registration may name the camera to watch ("camera=1"),
+    // otherwise it is the first one
+    int camera = 0;
+    const char* camera_arg = strstr(buffer, "camera=");
+    if (camera_arg) {
+        camera = std::min(std::max(atoi(camera_arg + 7), 0), (int)MAX_CAMERAS - 1);
+    }
+
+    // Add the client to the viewers the video is forwarded to
+    int viewer = viewers.touch(from_addr, from_len, steadyMicros(), nullptr, camera);
+    if (viewer == ClientRegistry::NONE) {
+        std::cerr << "Server: Already serving " << viewers.capacity()
+                  << " viewers, registration refused" << std::endl;
+        const char* refusal = "Registration refused: server full";
+        sendto(client_sock, refusal, strlen(refusal), 0, (struct sockaddr *)&from_addr, from_len);
+        return;
+    }
+    viewers.watch(viewer, camera);
+    if (camera < (int)streams.size()) {
+        streams[camera]->keyframe_requested = true; // A new viewer can only start decoding at an IDR
+    }
+
+    // After printing the client message
+    const char* confirmation = "Registration successful";
+    sendto(client_sock, confirmation, strlen(confirmation), 0, (struct sockaddr *)&from_addr, from_len);
+}
+
+// Receive thread: sleeps in the reactor until a socket has data, then drains
+// it. Camera datagrams go straight into the decode queue of their stream, in
+// recvmmsg batches; viewer messages are handled as they come. Never does any
+// decoding work itself.
+void receiveLoop(int client_sock, int camera_sock, std::vector<std::unique_ptr<CameraStream>>& streams,
+                 std::vector<std::unique_ptr<FilterWorker>>& workers, ClientRegistry& viewers) {
+    static time_t last_stats = time(nullptr);
+    uint64_t last_expiry_us = steadyMicros();
+    size_t expected = 0;
+
+    // Counter values and stage histograms as of the last stats lines
+    unsigned long long last_bytes = 0;
+    unsigned long long last_denoised[DENOISE_LEVELS] = {};
+    HistogramWindow stage_windows[STAGE_COUNT]; // Stream of the last camera datagram; cameras send in bursts
+
+    Reactor reactor;
+    reactor.add(client_sock);
+    reactor.add(camera_sock);
+
+    // Each batch entry receives into a queue slot of the expected stream, or
+    // into scratch space when there is none (datagrams to drop or to move)
+    DatagramBatch batch(RECEIVE_BATCH, 0);
+    std::vector<Datagram> scratch(batch.count());
+    Datagram* targets[DatagramBatch::MAX_BATCH];
+
+    // How many viewers each stream has; cameras nobody watches are not decoded
+    std::vector<Viewer> viewer_table;
+    uint64_t viewer_version = 0;
+    size_t watchers[MAX_CAMERAS] = {0};
+
+    while (running) {
+        if (viewers.snapshot(viewer_table, viewer_version)) {
+            std::fill(watchers, watchers + MAX_CAMERAS, 0);
+            for (const Viewer& viewer : viewer_table) {
+                if (viewer.active) {
+                    watchers[viewer.stream]++;
+                }
+            }
+        }
+
+        // Wake up regularly so a shutdown request is noticed
+        reactor.wait(100);
+
+        if (reactor.ready(client_sock)) {
+            // Handle client_sock activity, everything that is waiting
+            for (int message = 0; message < MAX_CONTROL_MESSAGES; message++) {
+                char buffer[MAX_NACK_SIZE + 1];
+                struct sockaddr_in from_addr;
+                socklen_t from_len = sizeof(from_addr);
+
+                ssize_t n = recvfrom(client_sock, buffer, sizeof(buffer) - 1, MSG_DONTWAIT,
+                                     (struct sockaddr *)&from_addr, &from_len);
+                if (n < 0) {
+                    break;
+                }
+                if (n > 0) {
+                    handleClientMessage(client_sock, buffer, n, from_addr, from_len, streams, viewers);
+                }
+            }
+        }
+
+        // A few batches per wakeup; the level triggered reactor brings us
+        // straight back for the rest after the viewers had their turn
+        for (int round = 0; reactor.ready(camera_sock) && round < MAX_RECEIVE_BATCHES; round++) {
+            CameraStream* guess = expected < streams.size() ? streams[expected].get() : nullptr;
+            for (size_t i = 0; i < batch.count(); i++) {
+                Datagram* slot = guess ? guess->datagrams.beginPush(i) : nullptr;
+                targets[i] = slot ? slot : &scratch[i];
+                batch.set(i, targets[i]->data, sizeof(targets[i]->data));
+            }
+
+            int received = batch.receive(camera_sock);
+            size_t kept = 0; // Datagrams that stay in the expected stream's queue, in order
+            for (int i = 0; i < received; i++) {
+                size_t data = batch.size(i);
+                stats.bytes_received += data;
+
+                CameraStream* stream = routeCamera(streams, batch.source(i), steadyMicros(), client_sock, workers, viewers);
+                if (!stream) {
+                    stats.datagrams_dropped++; // Every stream is busy with another camera
+                    continue;
+                }
+                if (watchers[stream->index] == 0) {
+                    continue;
+                }
+                expected = stream->index;
+
+                // Usually already in place, unless another camera's datagram
+                // left a gap before it
+                Datagram* target = nullptr;
+                if (stream == guess) {
+                    target = guess->datagrams.beginPush(kept);
+                    kept += target ? 1 : 0;
+                } else {
+                    target = stream->datagrams.beginPush();
+                }
+                if (!target) {
+                    stats.datagrams_dropped++; // The stream's decoder is behind
+                    continue;
+                }
+                if (target != targets[i]) {
+                    memcpy(target->data, targets[i]->data, data);
+                }
+                target->size = data;
+                target->arrival_us = batch.arrivalMicros(i);
+                target->restart = stream->pending_restart;
+                stream->pending_restart = false;
+                if (stream != guess) {
+                    stream->datagrams.endPush();
+                }
+            }
+            if (kept > 0) {
+                guess->datagrams.endPush(kept);
+            }
+            if (received < (int)batch.count()) {
+                break; // Drained
+            }
+        }
+
+        // Forget viewers that went quiet
+        uint64_t now_us = steadyMicros();
+        if (now_us - last_expiry_us >= 1000000) {
+            size_t expired = viewers.expire(now_us);
+            if (expired > 0) {
+                std::cout << "Server: " << expired << " viewer(s) timed out, "
+                          << viewers.active() << " left" << std::endl;
+            }
+            last_expiry_us = now_us;
+        }
+
+        time_t now = time(nullptr);
+        if (now - last_stats >= 5) {
+            unsigned long long bytes = stats.bytes_received.load();
+            std::cout << "Server: " << streams.size() << " cameras, " << viewers.active() << " viewers, "
+                      << (bytes - last_bytes) / 1024 / (now - last_stats)
+                      << " KB/s from cameras, dropped " << stats.datagrams_dropped.load()
+                      << " datagrams and " << stats.frames_dropped.load() << " frames, retransmitted "
+                      << stats.datagrams_retransmitted.load() << " datagrams, forced "
+                      << stats.keyframes_forced.load() << " keyframes, " << stats.decoder_errors.load()
+                      << " decoder errors, " << stats.buffer_trims.load() << " buffer trims" << std::endl;
+            last_bytes = bytes;
+
+            unsigned long long denoised[DENOISE_LEVELS];
+            for (int level = 0; level < DENOISE_LEVELS; level++) {
+                denoised[level] = stats.denoised[level].load() - last_denoised[level];
+                last_denoised[level] += denoised[level];
+            }
+            std::cout << "Server: Denoised " << denoised[(int)DenoiseLevel::Skip] << " skipped, "
+                      << denoised[(int)DenoiseLevel::Gaussian] << " Gaussian, "
+                      << denoised[(int)DenoiseLevel::Bilateral] << " bilateral, "
+                      << denoised[(int)DenoiseLevel::Nlm] << " NLM" << std::endl;
+
+            // p50/p99/max of every stage that saw frames since the last time
+            std::cout << "Server: Stages p50/p99/max us:";
+            for (int i = 0; i < STAGE_COUNT; i++) {
+                WindowSummary window = stage_windows[i].take(*STAGE_METRICS[i].histogram);
+                if (window.count > 0) {
+                    std::cout << " " << STAGE_METRICS[i].name << " " << window.p50_us << "/" << window.p99_us
+                              << "/" << window.max_us;
+                }
+            }
+            std::cout << std::endl;
+
+            // Band timing over every worker's tile threads
+            TileStats tiles = TileStats();
+            for (auto& worker : workers) {
+                if (worker->tiles) {
+                    TileStats worker_tiles = worker->tiles->takeStats();
+                    tiles.jobs += worker_tiles.jobs;
+                    tiles.tiles += worker_tiles.tiles;
+                    tiles.stolen += worker_tiles.stolen;
+                    tiles.total_us += worker_tiles.total_us;
+                    tiles.max_us = std::max(tiles.max_us, worker_tiles.max_us);
+                }
+            }
+            if (tiles.tiles > 0) {
+                std::cout << "Server: " << tiles.tiles << " bands in " << tiles.jobs << " planes, "
+                          << tiles.total_us / tiles.tiles << " us average, " << tiles.max_us << " us slowest, "
+                          << tiles.stolen << " stolen" << std::endl;
+            }
+            last_stats = now;
+        }
+    }
+}
+
+// Everything the metrics endpoint shows
+void registerMetrics(MetricsRegistry& registry) {
+    registry.addCounter("received_bytes", "Bytes received from the cameras", &stats.bytes_received);
+    registry.addCounter("dropped_datagrams", "Camera datagrams dropped because a decoder was behind",
+                        &stats.datagrams_dropped);
+    registry.addCounter("dropped_frames", "Decoded frames dropped because the filters were behind",
+                        &stats.frames_dropped);
+    registry.addCounter("decoder_errors", "Packets the decoder rejected", &stats.decoder_errors);
+    registry.addCounter("buffer_trims", "Oversized NAL units dropped by the splitter", &stats.buffer_trims);
+    registry.addCounter("retransmitted_datagrams", "Datagrams sent again for viewer NACKs",
+                        &stats.datagrams_retransmitted);
+    registry.addCounter("forced_keyframes", "Keyframes forced for viewers", &stats.keyframes_forced);
+
+    const char* const level_labels[DENOISE_LEVELS] = {
+        "level=\"skip\"", "level=\"gaussian\"", "level=\"bilateral\"", "level=\"nlm\"",
+    };
+    for (int level = 0; level < DENOISE_LEVELS; level++) {
+        registry.addCounter("denoised_frames", "Frames per denoise filter", &stats.denoised[level],
+                            level_labels[level]);
+    }
+
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        registry.addStage(STAGE_METRICS[i].name, STAGE_METRICS[i].histogram);
+    }
+}
+
+// Note when a decoded frame arrived and left the decoder, and the capture time
+// the camera stamped into it, in a FrameTiming that travels with the frame
+// (as its opaque_ref) through the filter workers to the encode thread
+void attachTiming(AVFrame* frame, uint64_t received_us) {
+    AVBufferRef* ref = av_buffer_allocz(sizeof(FrameTiming));
+    if (!ref) {
+        return;
+    }
+    FrameTiming* timing = (FrameTiming*)ref->data;
+    timing->received_us = received_us;
+    timing->decoded_us = wallClockMicros();
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (desc && !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+        timing->capture_us = readCaptureTime(frame->data[0], frame->linesize[0], frame->width, frame->height,
+                                             timing->decoded_us);
+    }
+    av_buffer_unref(&frame->opaque_ref);
+    frame->opaque_ref = ref;
+}
+
+// Picture buffer for a temporal output frame of src's size and format, from
+// the stream's pool. The buffer goes back to the pool once the encoder and
+// the filter workers have released the frame. Returns false if there is none.
+bool getTemporalBuffer(CameraStream& stream, const AVFrame* src, AVFrame* dst) {
+    AVPixelFormat format = (AVPixelFormat)src->format;
+    int size = av_image_get_buffer_size(format, src->width, src->height, 32);
+    if (size <= 0) {
+        return false;
+    }
+    // Pictures handed out before a size change return to the old pool,
+    // which lives until the last of them is released
+    if (size != stream.temporal_pool_size) {
+        av_buffer_pool_uninit(&stream.temporal_pool);
+        stream.temporal_pool = av_buffer_pool_init(size, nullptr);
+        stream.temporal_pool_size = stream.temporal_pool ? size : 0;
+    }
+    AVBufferRef* buffer = stream.temporal_pool ? av_buffer_pool_get(stream.temporal_pool) : nullptr;
+    if (!buffer) {
+        return false;
+    }
+
+    dst->buf[0] = buffer;
+    if (av_image_fill_arrays(dst->data, dst->linesize, buffer->data, format, src->width, src->height, 32) < 0) {
+        av_frame_unref(dst);
+        return false;
+    }
+    dst->format = src->format;
+    dst->width = src->width;
+    dst->height = src->height;
+    return true;
+}
+
+// Average a decoded frame into the stream's running averages, one per plane,
+// writing the result to a new frame (the decoder still references the
+// decoded one). Returns false, leaving dst alone, for formats other than
+// 8-bit planar YUV and when there is no buffer for the result.
+bool denoiseTemporal(CameraStream& stream, const AVFrame* src, AVFrame* dst) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)src->format);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_RGB)) || desc->comp[0].depth != 8) {
+        return false;
+    }
+
+    if (!getTemporalBuffer(stream, src, dst)) {
+        std::cerr << "Could not allocate temporal frame buffers, frame passed through" << std::endl;
+        return false;
+    }
+    av_frame_copy_props(dst, src);
+
+    uint64_t start_us = steadyMicros();
+
+    // Motion limits follow the noise measured on the decoded frames
+    double sigma = stream.noise.sigma();
+    TemporalParams params = TEMPORAL_PARAMS;
+    params.motion_low = std::max(TEMPORAL_PARAMS.motion_low * sigma, TEMPORAL_MIN_MOTION);
+    params.motion_high = std::max(TEMPORAL_PARAMS.motion_high * sigma, 2 * TEMPORAL_MIN_MOTION);
+
+    // Planes 1 and 2 are chroma (U and V, or NV12's interleaved UV)
+    int planes = av_pix_fmt_count_planes((AVPixelFormat)src->format);
+    for (int plane = 0; plane < planes; plane++) {
+        int width = av_image_get_linesize((AVPixelFormat)src->format, src->width, plane);
+        int height = plane == 1 || plane == 2 ? AV_CEIL_RSHIFT(src->height, desc->log2_chroma_h) : src->height;
+        stream.temporal[plane].filter(params, src->data[plane], src->linesize[plane], dst->data[plane],
+                                      dst->linesize[plane], width, height);
+    }
+
+    stats.temporal.record(steadyMicros() - start_us);
+
+    stream.residual.update(dst->data[0], dst->width, dst->height, dst->linesize[0]);
+    return true;
+}
+
+// Decode thread of a stream: splits the byte stream into NAL units, decodes
+// them and deals the decoded frames out to the stream's lane of the filter
+// workers in strict rotation.
+void decodeLoop(CameraStream& stream, std::vector<std::unique_ptr<FilterWorker>>& workers) {
+    FFmpegContext& ffmpeg = stream.ffmpeg;
+    NalSplitter nal_splitter; // Splits the camera byte stream into NAL units
+    size_t next_worker = 0;
+    uint64_t received_us = 0; // Wall clock arrival of the newest datagram
+    Backoff backoff;
+
+    AVPacket *packet = av_packet_alloc();
+    if (!packet) {
+        std::cerr << "Failed to allocate packet" << std::endl;
         exit(1);
     }
 
-    char buffer[MAXLINE]; 
+    while (running) {
+        Datagram* datagram = stream.datagrams.front();
+        if (!datagram) {
+            backoff.wait();
+            continue;
+        }
+        backoff.reset();
+        uint64_t now_us = steadyMicros();
+        stats.queue.record(now_us > datagram->arrival_us ? now_us - datagram->arrival_us : 0);
+        received_us = steadyToWallMicros(datagram->arrival_us);
+
+        // A different camera took the stream over: nothing buffered or
+        // referenced so far belongs to its byte stream
+        if (datagram->restart) {
+            nal_splitter.reset();
+            avcodec_flush_buffers(ffmpeg.context);
+            stream.noise.reset();
+            stream.residual.reset();
+            for (TemporalDenoiser& temporal : stream.temporal) {
+                temporal.reset();
+            }
+        }
+
+        // Extend our H.264 buffer with new data. A NAL unit that grows past
+        // the splitter's 1MB block is dropped and the stream resynchronised.
+        if (!nal_splitter.append(datagram->data, datagram->size)) {
+            std::cout << "Buffer trimmed, dropped an oversized NAL unit" << std::endl;
+            stats.buffer_trims++;
+        }
+        stream.datagrams.pop();
+
+        // Each complete NAL unit arrives as a refcounted slice of the
+        // splitter's buffer, so the decoder takes it without a copy
+        while (nal_splitter.next(packet)) {
+            packet->pts = AV_NOPTS_VALUE;
+            packet->dts = AV_NOPTS_VALUE;
+
+            // Send the packet to the decoder
+            uint64_t decode_start_us = steadyMicros();
+            int send_result = avcodec_send_packet(ffmpeg.context, packet);
+            if (send_result == 0) {
+                // Try to receive decoded frame
+                int receive_result = avcodec_receive_frame(ffmpeg.context, ffmpeg.frame_yuv);
+
+                if (receive_result == 0) {
+                    stats.decode.record(steadyMicros() - decode_start_us);
+                    // Sample the noise on the decoded luma (Y of YUV420P and
+                    // NV12 alike), dropped frames included
+                    stream.noise.update(ffmpeg.frame_yuv->data[0], ffmpeg.frame_yuv->width,
+                                        ffmpeg.frame_yuv->height, ffmpeg.frame_yuv->linesize[0]);
+                    if (TIMING_SEI) {
+                        attachTiming(ffmpeg.frame_yuv, received_us);
+                    }
+
+                    // Hand the frame over to the next worker. Frames are dealt out in
+                    // strict rotation (a dropped frame does not advance it), so the
+                    // encode thread can collect them in order the same way.
+                    AVFrame* decoded = av_frame_alloc();
+                    if (!decoded) {
+                        std::cerr << "Could not allocate frame, decoded frame dropped" << std::endl;
+                        stats.frames_dropped++;
+                    } else {
+                        if (!TEMPORAL_DENOISE || !denoiseTemporal(stream, ffmpeg.frame_yuv, decoded)) {
+                            // The lanes read their noise from residual: without the
+                            // temporal stage that is the decoded frame's own
+                            if (TEMPORAL_DENOISE) {
+                                stream.residual.update(ffmpeg.frame_yuv->data[0], ffmpeg.frame_yuv->width,
+                                                       ffmpeg.frame_yuv->height, ffmpeg.frame_yuv->linesize[0]);
+                            }
+                            av_frame_move_ref(decoded, ffmpeg.frame_yuv);
+                        }
+                        if (pushWithPolicy(workers[next_worker]->lanes[stream.index].input, decoded,
+                                           DECODED_DROP_POLICY, running)) {
+                            next_worker = (next_worker + 1) % workers.size();
+                        } else {
+                            av_frame_free(&decoded);
+                            stats.frames_dropped++;
+                        }
+                    }
+                }
+                else {
+                    char err_buf[AV_ERROR_MAX_STRING_SIZE];
+                    std::cerr << "Error decoding frame: "
+                              << av_make_error_string(err_buf, AV_ERROR_MAX_STRING_SIZE, receive_result)
+                              << std::endl;
+                    if (receive_result == AVERROR(EAGAIN)) {
+                        std::cout << "Decoder needs more data" << std::endl;
+                    } else if (receive_result == AVERROR_EOF) {
+                        std::cout << "End of stream reached" << std::endl;
+                    } else {
+                        // Reset the decoder after serious errors
+                        stats.decoder_errors++;
+                        avcodec_flush_buffers(ffmpeg.context);
+                    }
+                }
+
+                // Unref the frame to prepare for next decode
+                av_frame_unref(ffmpeg.frame_yuv);
+            } else {
+                stats.decoder_errors++;
+            }
+            // Release our reference to the slice
+            av_packet_unref(packet);
+        }
+    }
+
+    av_packet_free(&packet);
+    av_buffer_pool_uninit(&stream.temporal_pool);
+}
+
+// Filter an image or plane, in bands on the worker's tile threads if it has them
+void runDenoise(FilterLane& lane, const DenoiseSettings& settings, const cv::Mat& src, cv::Mat& dst, bool subsampled) {
+    if (lane.tiles && settings.level != DenoiseLevel::Skip) {
+        lane.kernel.set(settings, subsampled, FAST_BILATERAL);
+        lane.tiles->run(lane.kernel, src, dst);
+    } else {
+        applyDenoise(settings, src, dst, subsampled, FAST_BILATERAL ? &lane.bilateral : nullptr);
+    }
+}
+
+// Bgr mode: YUV -> BGR, denoise, BGR -> YUV into the encoder frame. Returns
+// false, with the encoder frame unfinished, if a conversion could not be set up.
+bool denoiseBgr(FilterLane& lane, const AVFrame* decoded, const DenoiseSettings& settings) {
+    // Successfully decoded a frame
+    lane.sws_ctx = sws_getCachedContext(
+        lane.sws_ctx,
+        decoded->width, decoded->height, (AVPixelFormat)decoded->format,
+        decoded->width, decoded->height, AV_PIX_FMT_BGR24,
+        SWS_BILINEAR, nullptr, nullptr, nullptr);
+    if (!lane.sws_ctx) {
+        std::cerr << "Could not initialize sws context for BGR" << std::endl;
+        return false;
+    }
+
+    // Properly initialize frame_bgr if not already done; a failed attempt is
+    // tried again with the next frame
+    if (!lane.frame_bgr->data[0]) {
+        lane.frame_bgr->format = AV_PIX_FMT_BGR24;
+        lane.frame_bgr->width = decoded->width;
+        lane.frame_bgr->height = decoded->height;
+
+        // Allocate proper buffers for the frame
+        if (av_frame_get_buffer(lane.frame_bgr, 32) < 0) {
+            std::cerr << "Could not allocate BGR frame buffers" << std::endl;
+            av_frame_unref(lane.frame_bgr);
+            return false;
+        }
+    }
+
+    // Now do the conversion
+    StageTimer to_bgr_timer(stats.to_bgr);
+    sws_scale(
+        lane.sws_ctx,
+        decoded->data, decoded->linesize,
+        0, decoded->height,
+        lane.frame_bgr->data, lane.frame_bgr->linesize
+    );
+    to_bgr_timer.stop();
+
+    // Create OpenCV Mat that references the FFmpeg frame data
+    cv::Mat frame(lane.frame_bgr->height,
+                  lane.frame_bgr->width,
+                  CV_8UC3,
+                  lane.frame_bgr->data[0],
+                  lane.frame_bgr->linesize[0]);
+
+    // Create destination Mat for filtered result
+    cv::Mat dst;
+    // Apply the filter the noise calls for
+    StageTimer denoise_timer(stats.denoise);
+    runDenoise(lane, settings, frame, dst, false);
+    denoise_timer.stop();
+
+
+    // Convert the frame to a GpuMat
+    //cv::cuda::GpuMat gpu_frame, gpu_dst;
+    //gpu_frame.upload(frame);
+
+    // Apply CUDA-based denoising
+    //cv::cuda::fastNlMeansDenoisingColored(gpu_frame, gpu_dst, 2, 3, 7, 3);
+
+    // Download the result back to a standard Mat
+    //gpu_dst.download(dst);
+
+    // BGR to YUV context, built once per lane
+    lane.sws_ctx_encoder = sws_getCachedContext(
+        lane.sws_ctx_encoder,
+        dst.cols, dst.rows, AV_PIX_FMT_BGR24,
+        lane.frame_encoder->width, lane.frame_encoder->height, (AVPixelFormat)lane.frame_encoder->format,
+        SWS_BILINEAR, nullptr, nullptr, nullptr
+    );
+
+    if (!lane.sws_ctx_encoder) {
+        std::cerr << "Could not initialize sws context for encoder" << std::endl;
+        return false;
+    }
+
+    // Convert the filtered image straight from the Mat to YUV for encoding
+    const uint8_t* const dst_data[1] = { dst.data };
+    const int dst_linesize[1] = { (int)dst.step };
+    StageTimer to_yuv_timer(stats.to_yuv);
+    sws_scale(
+        lane.sws_ctx_encoder,
+        dst_data, dst_linesize,
+        0, dst.rows,
+        lane.frame_encoder->data, lane.frame_encoder->linesize
+    );
+    return true;
+}
+
+// Yuv mode: filter the YUV420P planes, written straight into the encoder
+// frame. Saves both colour conversions, and luma-only saves the filter two
+// thirds of the samples it would see in BGR. Returns false like denoiseBgr.
+bool denoiseYuv(FilterLane& lane, const AVFrame* decoded, const DenoiseSettings& settings) {
+    AVFrame* out = lane.frame_encoder;
+    const AVFrame* src = decoded;
+
+    // The decoded planes are used as they are when the decoder already
+    // produces the encoder's layout, which is the normal case
+    if (decoded->format != out->format || decoded->width != out->width || decoded->height != out->height) {
+        lane.sws_ctx = sws_getCachedContext(
+            lane.sws_ctx,
+            decoded->width, decoded->height, (AVPixelFormat)decoded->format,
+            out->width, out->height, (AVPixelFormat)out->format,
+            SWS_BILINEAR, nullptr, nullptr, nullptr);
+        if (!lane.sws_ctx) {
+            std::cerr << "Could not initialize sws context for the encoder layout" << std::endl;
+            return false;
+        }
+
+        if (!lane.frame_scratch->data[0]) {
+            lane.frame_scratch->format = out->format;
+            lane.frame_scratch->width = out->width;
+            lane.frame_scratch->height = out->height;
+            if (av_frame_get_buffer(lane.frame_scratch, 32) < 0) {
+                std::cerr << "Could not allocate scratch frame buffers" << std::endl;
+                av_frame_unref(lane.frame_scratch);
+                return false;
+            }
+        }
+
+        sws_scale(
+            lane.sws_ctx,
+            decoded->data, decoded->linesize,
+            0, decoded->height,
+            lane.frame_scratch->data, lane.frame_scratch->linesize
+        );
+        src = lane.frame_scratch;
+    }
+
+    // The decoder keeps its frames as references, so never filter in place:
+    // read from the decoded planes and write into the encoder's
+    StageTimer denoise_timer(stats.denoise);
+    for (int plane = 0; plane < 3; plane++) {
+        int width = plane == 0 ? out->width : (out->width + 1) / 2;
+        int height = plane == 0 ? out->height : (out->height + 1) / 2;
+        cv::Mat src_plane(height, width, CV_8UC1, src->data[plane], src->linesize[plane]);
+        cv::Mat dst_plane(height, width, CV_8UC1, out->data[plane], out->linesize[plane]);
+
+        if (plane == 0) {
+            runDenoise(lane, settings, src_plane, dst_plane, false);
+        } else if (DENOISE_CHROMA) {
+            // Chroma is subsampled 2x, so the neighbourhood is halved as well
+            runDenoise(lane, settings, src_plane, dst_plane, true);
+        } else {
+            src_plane.copyTo(dst_plane);
+        }
+    }
+    return true;
+}
+
+// Denoise one frame of a lane into a fresh encoder frame and pass it on. A
+// frame that fails is passed on as nullptr: the encode thread collects the
+// lanes in strict rotation, so every frame dealt out must come back.
+// The caller made sure there is room in the output queue.
+void filterFrame(FilterLane& lane, AVFrame* decoded) {
+    AVFrame* filtered = nullptr;
+
+    // Make encoder frame writable. If the encoder still holds the previous
+    // frame this allocates a fresh buffer instead of overwriting it.
+    if (av_frame_make_writable(lane.frame_encoder) < 0) {
+        std::cerr << "Could not make encoder frame writable" << std::endl;
+        av_frame_free(&decoded);
+        lane.output.tryPush(std::move(filtered));
+        return;
+    }
+
+    // Let the stream's controller pick the filter for its current noise
+    DenoiseSettings settings = lane.denoise->choose(lane.noise->sigma());
+
+    uint64_t start_us = steadyMicros();
+    bool done = DENOISE_MODE == DenoiseMode::Yuv ? denoiseYuv(lane, decoded, settings)
+                                                 : denoiseBgr(lane, decoded, settings);
+    if (!done) {
+        av_frame_free(&decoded);
+        lane.output.tryPush(std::move(filtered));
+        return;
+    }
+    lane.denoise->recordTime(settings.level, steadyMicros() - start_us);
+    stats.denoised[(int)settings.level]++;
+
+    // The frame's timing goes along with the filtered picture
+    av_buffer_unref(&lane.frame_encoder->opaque_ref);
+    lane.frame_encoder->opaque_ref = decoded->opaque_ref;
+    decoded->opaque_ref = nullptr;
+    if (lane.frame_encoder->opaque_ref) {
+        ((FrameTiming*)lane.frame_encoder->opaque_ref->data)->filtered_us = wallClockMicros();
+    }
+    av_frame_free(&decoded);
+
+    // Pass a new reference on to the encode thread
+    filtered = av_frame_clone(lane.frame_encoder);
+    if (!filtered) {
+        std::cerr << "Could not reference the filtered frame" << std::endl;
+    }
+    lane.output.tryPush(std::move(filtered));
+}
+
+// Filter worker: takes one frame from each stream's lane in turn. A lane
+// whose encode thread has not collected the last results is skipped, so a
+// stalled stream never holds up the others.
+void filterLoop(FilterWorker& worker) {
+    AVFrame* decoded = nullptr;
+    Backoff backoff;
+
+    while (running) {
+        bool busy = false;
+        size_t lanes = stream_count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < lanes; i++) {
+            FilterLane& lane = worker.lanes[i];
+            if (lane.output.size() < lane.output.capacity() && lane.input.tryPop(decoded)) {
+                filterFrame(lane, decoded);
+                busy = true;
+            }
+        }
+
+        if (busy) {
+            backoff.reset();
+        } else {
+            backoff.wait();
+        }
+    }
+}
+
+// Encode thread of a stream: collects filtered frames from the workers in the
+// order they were dealt out and encodes them
+void encodeLoop(CameraStream& stream, std::vector<std::unique_ptr<FilterWorker>>& workers) {
+    FFmpegContext& ffmpeg = stream.ffmpeg;
+    int64_t frame_count = 0;
+    size_t next_worker = 0;
+    AVFrame* filtered = nullptr;
+    uint64_t last_forced_keyframe_us = 0;
+
+    // Timing of the frames inside the encoder, by pts. There are no B-frames,
+    // so packets come out in the order the frames went in.
+    std::deque<std::pair<int64_t, FrameTiming>> timings;
+    uint8_t sei[TIMING_SEI_MAX_SIZE];
+
+    while (popBlocking(workers[next_worker]->lanes[stream.index].output, filtered, running)) {
+        next_worker = (next_worker + 1) % workers.size();
+        if (!filtered) {
+            stats.frames_dropped++; // Failed in the filter worker, only its turn came back
+            continue;
+        }
+
+        // Set frame PTS (presentation timestamp)
+        filtered->pts = frame_count++;
+
+        // Follow the rate of the slowest viewer. libx264 picks new rate
+        // control settings up with the next frame, without a reopen.
+        int64_t target = stream.target_bitrate.load();
+        int64_t current = ffmpeg.encoder_context->bit_rate;
+        if (target > 0 && std::abs(target - current) > current * RATE_CHANGE_THRESHOLD) {
+            ffmpeg.encoder_context->bit_rate = target;
+            ffmpeg.encoder_context->rc_max_rate = target;
+            ffmpeg.encoder_context->rc_buffer_size = (int)(target * VBV_SECONDS);
+            std::cout << "Server: Stream " << stream.index << " now encodes at "
+                      << target / 1000 << " kbps" << std::endl;
+        }
+
+        // Serve a keyframe request, unless the last forced one was too recent;
+        // the request then stays pending until it is allowed
+        uint64_t now_us = steadyMicros();
+        if (stream.keyframe_requested && now_us - last_forced_keyframe_us >= MIN_KEYFRAME_INTERVAL_US) {
+            stream.keyframe_requested = false;
+            last_forced_keyframe_us = now_us;
+            filtered->pict_type = AV_PICTURE_TYPE_I;
+            stats.keyframes_forced++;
+        }
+
+        if (TIMING_SEI) {
+            FrameTiming timing = {};
+            if (filtered->opaque_ref) {
+                timing = *(const FrameTiming*)filtered->opaque_ref->data;
+            }
+            timings.emplace_back(filtered->pts, timing);
+        }
+
+        // Send the frame to the encoder. Its time counts together with the
+        // receive calls, not the handing over of the packets.
+        uint64_t encode_start_us = steadyMicros();
+        int ret = avcodec_send_frame(ffmpeg.encoder_context, filtered);
+        uint64_t encode_us = steadyMicros() - encode_start_us;
+        av_frame_free(&filtered);
+        if (ret < 0) {
+            std::cerr << "Error sending frame for encoding" << std::endl;
+            continue;
+        }
+
+        // Get the encoded packets
+        while (ret >= 0) {
+            uint64_t receive_start_us = steadyMicros();
+            ret = avcodec_receive_packet(ffmpeg.encoder_context, ffmpeg.packet_encoder);
+            encode_us += steadyMicros() - receive_start_us;
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                // Need more input or end of stream
+                break;
+            } else if (ret < 0) {
+                std::cerr << "Error during encoding" << std::endl;
+                break;
+            }
+
+            // Move the packet into a new one owned by the send thread, with
+            // the timing SEI in front of the picture
+            AVPacket* encoded = av_packet_alloc();
+            if (!encoded) {
+                // Later frames refer to this one, so the viewers need a fresh start
+                std::cerr << "Could not allocate packet, encoded frame dropped" << std::endl;
+                av_packet_unref(ffmpeg.packet_encoder);
+                stats.frames_dropped++;
+                stream.keyframe_requested = true;
+                continue;
+            }
+            if (TIMING_SEI) {
+                FrameTiming timing = {};
+                while (!timings.empty() && timings.front().first <= ffmpeg.packet_encoder->pts) {
+                    if (timings.front().first == ffmpeg.packet_encoder->pts) {
+                        timing = timings.front().second;
+                    }
+                    timings.pop_front();
+                }
+                timing.encoded_us = wallClockMicros();
+                if (timing.received_us && timing.encoded_us >= timing.received_us) {
+                    stats.relay.record(timing.encoded_us - timing.received_us);
+                }
+                // Only when the clocks agree on the order, skew would wrap around
+                if (timing.capture_us && timing.received_us >= timing.capture_us) {
+                    stats.camera.record(timing.received_us - timing.capture_us);
+                }
+
+                size_t sei_size = writeTimingSei(timing, sei);
+                if (av_new_packet(encoded, (int)(sei_size + ffmpeg.packet_encoder->size)) < 0) {
+                    std::cerr << "Could not allocate packet" << std::endl;
+                    exit(1);
+                }
+                memcpy(encoded->data, sei, sei_size);
+                memcpy(encoded->data + sei_size, ffmpeg.packet_encoder->data, ffmpeg.packet_encoder->size);
+                av_packet_copy_props(encoded, ffmpeg.packet_encoder);
+                av_packet_unref(ffmpeg.packet_encoder);
+            } else {
+                av_packet_move_ref(encoded, ffmpeg.packet_encoder);
+            }
+            if (!pushWithPolicy(stream.packets, encoded, ENCODED_DROP_POLICY, running)) {
+                av_packet_free(&encoded);
+            }
+        }
+        stats.encode.record(encode_us);
+    }
+}
+
+// Send thread of a stream: splits every encoded packet into datagrams once,
+// keeps them in the history and serves every viewer of the stream from there
+// at its own position
+void sendLoop(int client_sock, CameraStream& stream, ClientRegistry& registry) {
+    int64_t bit_rate = MAX_BITRATE;
+    AVRational framerate = stream.ffmpeg.encoder_context->framerate;
+    size_t average_frame_bytes = bit_rate / 8 * framerate.den / std::max(framerate.num, 1);
+
+    PacedSender sender(client_sock, (int64_t)(bit_rate * PACING_RATE_FACTOR), average_frame_bytes);
+    sender.enableGso(USE_GSO);
+
+    FramePacketizer packetizer;
+    SendHistory history(HISTORY_FRAMES, registry.capacity());
+    std::vector<struct iovec> outgoing;
+    uint32_t frame_id = 0; // Next frame to go into the history
+    AVPacket* encoded = nullptr;
+    ViewerNack nack;
+    ViewerReport report;
+    Backoff backoff;
+
+    // Per viewer slot: the next frame it gets, which viewer that was for, how
+    // many datagrams it was sent and the rate its reports allow
+    std::vector<Viewer> viewers;
+    std::vector<uint32_t> cursors(registry.capacity(), 0);
+    std::vector<uint32_t> sessions(registry.capacity(), 0);
+    std::vector<uint32_t> sent(registry.capacity(), 0);
+    std::vector<RateController> rates(registry.capacity(), RateController(MIN_BITRATE, MAX_BITRATE, BITRATE_STEP,
+                                                                           JITTER_LIMIT_US, SPREAD_LIMIT_US));
+    uint64_t viewers_version = 0;
+    size_t active = 0;
+
+    while (running) {
+        bool busy = false;
+        bool rates_changed = false;
+
+        // Pick up viewers that joined, left or switched cameras; a new one
+        // starts at the next frame. Only the stream's own viewers stay active.
+        if (registry.snapshot(viewers, viewers_version)) {
+            active = 0;
+            for (size_t i = 0; i < viewers.size(); i++) {
+                viewers[i].active = viewers[i].active && viewers[i].stream == stream.index;
+                if (!viewers[i].active) {
+                    sessions[i] = 0;
+                } else if (sessions[i] != viewers[i].session) {
+                    sessions[i] = viewers[i].session;
+                    cursors[i] = frame_id;
+                    rates[i].reset();
+                }
+                active += viewers[i].active ? 1 : 0;
+            }
+            rates_changed = true;
+        }
+
+        // Receiver reports move their viewer's rate
+        while (stream.reports.tryPop(report)) {
+            if (viewers[report.viewer].active && rates[report.viewer].onReport(report.report, sent[report.viewer])) {
+                const RateController& rate = rates[report.viewer];
+                std::cout << "Server: Viewer " << report.viewer << " of stream " << stream.index << " lost "
+                          << (int)(rate.loss() * 100) << "%, jitter " << rate.lastReport().jitter_us / 1000
+                          << " ms, decode " << rate.lastReport().decode_us / 1000 << " ms: "
+                          << rate.rate() / 1000 << " kbps" << std::endl;
+                rates_changed = true;
+            }
+        }
+
+        // The encoder serves the slowest viewer, and every frame goes out
+        // once per viewer
+        if (rates_changed) {
+            bit_rate = MAX_BITRATE;
+            for (size_t i = 0; i < viewers.size(); i++) {
+                if (viewers[i].active) {
+                    bit_rate = std::min(bit_rate, rates[i].rate());
+                }
+            }
+            stream.target_bitrate = bit_rate;
+            average_frame_bytes = bit_rate / 8 * framerate.den / std::max(framerate.num, 1);
+            size_t scale = std::max<size_t>(active, 1);
+            sender.setRate((int64_t)(bit_rate * PACING_RATE_FACTOR * scale), average_frame_bytes * scale);
+        }
+
+        // Repairs go first, they are late already
+        uint64_t now_us = steadyMicros();
+        while (stream.nacks.tryPop(nack)) {
+            const Viewer& viewer = viewers[nack.viewer];
+            outgoing.clear();
+            if (viewer.active &&
+                history.lookup(nack.entry, nack.viewer, now_us, RETRANSMIT_DEADLINE_US, outgoing) > 0) {
+                sent[nack.viewer] += sender.send((struct sockaddr *)&viewer.addr, viewer.len, outgoing.data(),
+                                                 outgoing.size());
+                stats.datagrams_retransmitted += outgoing.size();
+                busy = true;
+            }
+        }
+
+        if (stream.packets.tryPop(encoded)) {
+            // Every datagram carries its own header, so the client can place
+            // fragments in any order and notice a lost one straight away
+            bool keyframe = (encoded->flags & AV_PKT_FLAG_KEY) != 0;
+            StageTimer send_timer(stats.send);
+            const std::vector<struct iovec>& datagrams =
+                packetizer.packetize(encoded->data, encoded->size, frame_id, keyframe, wallClockMicros(),
+                                     keyframe ? FEC_KEYFRAME : FEC_DELTA);
+            if (datagrams.empty()) {
+                std::cerr << "Encoded frame of " << encoded->size << " bytes is too large to send" << std::endl;
+            }
+            history.store(frame_id++, datagrams);
+            send_timer.stop();
+            av_packet_free(&encoded);
+            busy = true;
+        }
+
+        // One frame per viewer per round, so a viewer that is catching up
+        // does not hold up the others. Batched and paced, instead of one
+        // sendto and a 1ms sleep per chunk.
+        for (size_t i = 0; i < viewers.size(); i++) {
+            if (!viewers[i].active || cursors[i] == frame_id) {
+                continue;
+            }
+            if (frame_id - cursors[i] > history.capacity()) {
+                // What it is missing is gone, start over at a keyframe
+                cursors[i] = frame_id - 1;
+                stream.keyframe_requested = true;
+            }
+            outgoing.clear();
+            uint32_t id = cursors[i]++;
+            if (history.frame(id, outgoing) > 0) {
+                sent[i] += sender.send((struct sockaddr *)&viewers[i].addr, viewers[i].len, outgoing.data(),
+                                       outgoing.size());
+                // Pacing may have held the frame back, its repair deadline starts now
+                history.markSent(id, i, steadyMicros());
+            }
+            busy = true;
+        }
+
+        if (busy) {
+            backoff.reset();
+        } else {
+            backoff.wait();
+        }
+    }
+}
+
+// Driver code. An address given on the command line replaces SERVER_IP,
+// e.g. 127.0.0.1 to take a replayed stream (Cloud/Test/Replay test).
+int main(int argc, char** argv) { 
+    const char* server_ip = argc > 1 ? argv[1] : SERVER_IP;
+
+    // Initialize libav used to decode H.264
+    avformat_network_init();
+
+    // The filter workers are shared by every camera stream; their lanes are
+    // set up as the cameras appear
+    std::vector<std::unique_ptr<FilterWorker>> workers;
+    for (int i = 0; i < FILTER_WORKERS; i++) {
+        workers.push_back(std::unique_ptr<FilterWorker>(new FilterWorker()));
+        if (TILE_THREADS > 0) {
+            // Every worker's band threads get cores of their own, so workers
+            // do not compete for a core while the machine has enough
+            workers.back()->tiles.reset(new TilePool(coreRange(i * TILE_THREADS, TILE_THREADS), TILE_BYTES));
+        }
+    }
+    if (TILE_THREADS > 0) {
+        cv::setNumThreads(1); // The bands are the parallelism; OpenCV's own pool would fight them for cores
+    }
+
 
     //Creating client socket
     //###################################################################################
@@ -223,9 +1511,15 @@ int main() {
     
     // Filling server information for client
     client_bind_addr.sin_family = AF_INET; // IPv4 
-    client_bind_addr.sin_addr.s_addr =  inet_addr(SERVER_IP); 
+    client_bind_addr.sin_addr.s_addr =  inet_addr(server_ip); 
     client_bind_addr.sin_port = htons(CLIENT_PORT); 
     
+    // Room for a whole keyframe burst, the pacer takes care of the rest
+    int sndbuf = 4 * 1024 * 1024; // 4MB send buffer
+    if (setsockopt(client_sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0) {
+        perror("setsockopt(SO_SNDBUF) failed");
+    }
+
     // Bind the socket with the server address 
     if ( bind(client_sock, (const struct sockaddr *)&client_bind_addr, 
             sizeof(client_bind_addr)) < 0 ) 
@@ -252,7 +1546,7 @@ int main() {
     
     // Filling server information for client
     camera_addr.sin_family = AF_INET; // IPv4 
-    camera_addr.sin_addr.s_addr =  inet_addr(SERVER_IP); 
+    camera_addr.sin_addr.s_addr =  inet_addr(server_ip); 
     camera_addr.sin_port = htons(CAMERA_PORT); 
 
     // After creating camera_sock, add:
@@ -262,10 +1556,13 @@ int main() {
     }
 
     // Set receive buffer size to be large enough for video frames
-    int rcvbuf = 1024 * 1024; // 1MB buffer
+    int rcvbuf = 1024 * 1024 * MAX_CAMERAS; // 1MB per camera
     if (setsockopt(camera_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
         perror("setsockopt(SO_RCVBUF) failed");
     }
+
+    // Stamp camera datagrams on arrival, so queueing delay can be measured
+    DatagramBatch::enableTimestamps(camera_sock);
     
     // Bind the socket with the server address 
     if ( bind(camera_sock, (const struct sockaddr *)&camera_addr, 
@@ -275,326 +1572,90 @@ int main() {
         exit(EXIT_FAILURE); 
     } 
     //##################################################################################
-    std::cout<<"Server: Listening for client registration on "<< SERVER_IP << ":" << CLIENT_PORT << " & " << CAMERA_PORT <<std::endl; 
+    std::cout<<"Server: Listening for client registration on "<< server_ip << ":" << CLIENT_PORT << " & " << CAMERA_PORT <<std::endl; 
     
-    // Add this above your main loop:
-    struct sockaddr_in registered_client_addr;
-    socklen_t registered_client_len = 0;
-    bool client_registered = false;
+    ClientRegistry viewers(MAX_VIEWERS, VIEWER_TIMEOUT_US);
+    std::vector<std::unique_ptr<CameraStream>> streams; // Grows as cameras appear, receive thread only
 
-    while (true) {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(client_sock, &readfds);
-        FD_SET(camera_sock, &readfds);
+    // Stop all stages cleanly on Ctrl+C
+    signal(SIGINT, handleSignal);
+    signal(SIGTERM, handleSignal);
 
-        int maxfd = std::max(client_sock, camera_sock);
+    // Start the filter workers; each camera stream starts its own decode,
+    // encode and send threads when its first datagram arrives
+    for (auto& worker : workers) {
+        worker->thread = std::thread(filterLoop, std::ref(*worker));
+    }
 
-        int activity = select(maxfd + 1, &readfds, NULL, NULL, NULL); // Block forever
+    // Stage histograms and counters for Prometheus, next to the stats lines
+    MetricsRegistry registry("relay");
+    registerMetrics(registry);
+    std::unique_ptr<MetricsServer> metrics;
+    if (METRICS_PORT > 0) {
+        metrics.reset(new MetricsServer(registry, METRICS_ADDRESS, METRICS_PORT));
+    }
 
-        if (activity > 0) {
-            if (FD_ISSET(client_sock, &readfds)) {
-                // Handle client_sock activity
-                char buffer[1024];
-                struct sockaddr_in from_addr;
-                socklen_t from_len = sizeof(from_addr);
+    // The receive stage runs on the main thread until shutdown
+    receiveLoop(client_sock, camera_sock, streams, workers, viewers);
 
-                ssize_t n = recvfrom(client_sock, buffer, sizeof(buffer), 0,
-                                     (struct sockaddr *)&from_addr, &from_len);
+    for (auto& stream : streams) {
+        stream->decode_thread.join();
+    }
+    for (auto& worker : workers) {
+        worker->thread.join();
+    }
+    for (auto& stream : streams) {
+        stream->encode_thread.join();
+        stream->send_thread.join();
+    }
 
-                if (n > 0) {
-                    buffer[n] = '\0'; // Null-terminate if you expect string data
-                    std::cout << "Server: Received client message from "
-                              << inet_ntoa(from_addr.sin_addr) << ":" << ntohs(from_addr.sin_port)
-                              << " : " << buffer << std::endl;
-
-                     // Store the client address for forwarding video
-                    registered_client_addr = from_addr;
-                    registered_client_len = from_len;
-                    client_registered = true;
-
-                    // After printing the client message
-                    const char* confirmation = "Registration successful";
-                    sendto(client_sock, confirmation, strlen(confirmation), 0, (struct sockaddr *)&from_addr, from_len);
-                }
-                
-            }
-            if (FD_ISSET(camera_sock, &readfds)) {
-                static unsigned long long total_bytes = 0;
-                static int packets = 0;
-                static time_t last_stats = time(nullptr);
-                
-                char buffer[65536];
-                struct sockaddr_in from_addr; 
-                socklen_t from_len = sizeof(from_addr);
-                
-                int data = recvfrom(camera_sock, buffer, sizeof(buffer), 0, 
-                                    (struct sockaddr *)&from_addr, &from_len);
-                                    
-                if (data > 0 && client_registered) {
-                    std::cout << "Server: Received " << data << " bytes from camera" << std::endl;
-                    // Extend our H.264 buffer with new data
-                    h264_buffer.insert(h264_buffer.end(), buffer, buffer + data);
-
-
-                    while (isCompleteNalUnit(h264_buffer)) {
-                        size_t nal_start = findNalStartCode(h264_buffer);
-                        size_t next_nal_start = findNalStartCode(h264_buffer, nal_start + 3);
-                        
-                        if (next_nal_start > nal_start && next_nal_start < h264_buffer.size()) {
-                            // Extract complete NAL unit
-                            std::vector<uint8_t> nal_unit(h264_buffer.begin() + nal_start, h264_buffer.begin() + next_nal_start);
-                            
-                            // Create packet properly
-                            AVPacket *packet = av_packet_alloc();
-                            if (!packet) {
-                                std::cerr << "Failed to allocate packet" << std::endl;
-                                continue;
-                            }
-                            
-                            // Allocate and copy data properly
-                            uint8_t* packet_data = (uint8_t*)av_malloc(nal_unit.size());
-                            if (!packet_data) {
-                                std::cerr << "Failed to allocate packet data buffer" << std::endl;
-                                av_packet_free(&packet);
-                                continue;
-                            }
-                            
-                            // Copy NAL unit to packet data buffer
-                            memcpy(packet_data, nal_unit.data(), nal_unit.size());
-                            
-                            // Set up packet with proper buffer management
-                            av_packet_from_data(packet, packet_data, nal_unit.size());
-                            packet->pts = AV_NOPTS_VALUE;
-                            packet->dts = AV_NOPTS_VALUE;
-
-                            // Send the packet to the decoder
-                            int send_result = avcodec_send_packet(m_ffmpeg.context, packet);
-                            //char time_str3[50];
-                            if (send_result == 0) {
-                                // Try to receive decoded frame
-                                int receive_result = avcodec_receive_frame(m_ffmpeg.context, m_ffmpeg.frame_yuv);
-                                
-                                if (receive_result == 0) {
-                                    
-									// Successfully decoded a frame
-                                    if (!m_ffmpeg.sws_ctx) {
-                                        m_ffmpeg.sws_ctx = sws_getContext(
-                                            m_ffmpeg.context->width, m_ffmpeg.context->height, m_ffmpeg.context->pix_fmt,
-                                            m_ffmpeg.context->width, m_ffmpeg.context->height, AV_PIX_FMT_BGR24,
-                                            SWS_BILINEAR, nullptr, nullptr, nullptr);
-                                    }
-
-                                    // Properly initialize frame_bgr if not already done
-                                    if (!m_ffmpeg.frame_bgr->width || !m_ffmpeg.frame_bgr->height) {
-                                        m_ffmpeg.frame_bgr->format = AV_PIX_FMT_BGR24;
-                                        m_ffmpeg.frame_bgr->width = m_ffmpeg.context->width;
-                                        m_ffmpeg.frame_bgr->height = m_ffmpeg.context->height;
-                                        
-                                        // Allocate proper buffers for the frame
-                                        if (av_frame_get_buffer(m_ffmpeg.frame_bgr, 32) < 0) {
-                                            std::cerr << "Could not allocate BGR frame buffers" << std::endl;
-                                            // Handle error
-                                        }
-                                    }
-
-                                    // Make frame data writable
-                                    if (av_frame_make_writable(m_ffmpeg.frame_bgr) < 0) {
-                                        std::cerr << "Could not make BGR frame writable" << std::endl;
-                                        // Handle error
-                                    }
-
-                                    // Now do the conversion
-                                    sws_scale(
-                                        m_ffmpeg.sws_ctx,
-                                        m_ffmpeg.frame_yuv->data, m_ffmpeg.frame_yuv->linesize,
-                                        0, m_ffmpeg.context->height,
-                                        m_ffmpeg.frame_bgr->data, m_ffmpeg.frame_bgr->linesize
-                                    );
-
-                                    // Create OpenCV Mat that references the FFmpeg frame data
-                                    cv::Mat frame(m_ffmpeg.context->height, 
-                                                 m_ffmpeg.context->width, 
-                                                 CV_8UC3, 
-                                                 m_ffmpeg.frame_bgr->data[0], 
-                                                 m_ffmpeg.frame_bgr->linesize[0]);
-
-                                    // Create destination Mat for filtered result
-                                    cv::Mat dst;
-                                    // Apply OpenCV denoisiing 
-                                    cv::bilateralFilter(frame, dst, 8, 10, 2);
-
-
-                                    // Convert the frame to a GpuMat
-                                    //cv::cuda::GpuMat gpu_frame, gpu_dst;
-                                    //gpu_frame.upload(frame);
-
-                                    // Apply CUDA-based denoising
-                                    //cv::cuda::fastNlMeansDenoisingColored(gpu_frame, gpu_dst, 2, 3, 7, 3);
-
-                                    // Download the result back to a standard Mat
-                                    //gpu_dst.download(dst); 
-
-                                    // Copy the filtered data back to the FFmpeg frame
-                                    memcpy(m_ffmpeg.frame_bgr->data[0], dst.data, dst.step * dst.rows);
-
-                                    // Create a separate sws context for BGR to YUV conversion
-                                    SwsContext* sws_ctx_encoder = sws_getContext(
-                                        m_ffmpeg.encoder_context->width, m_ffmpeg.encoder_context->height, AV_PIX_FMT_BGR24,
-                                        m_ffmpeg.encoder_context->width, m_ffmpeg.encoder_context->height, m_ffmpeg.encoder_context->pix_fmt,
-                                        SWS_BILINEAR, nullptr, nullptr, nullptr
-                                    );
-
-                                    if (!sws_ctx_encoder) {
-                                        std::cerr << "Could not initialize sws context for encoder" << std::endl;
-                                        exit(1);
-                                    }
-
-                                    // Make encoder frame writable
-                                    if (av_frame_make_writable(m_ffmpeg.frame_encoder) < 0) {
-                                        std::cerr << "Could not make encoder frame writable" << std::endl;
-                                        // Handle error
-                                    }
-
-                                    // Convert BGR to YUV for encoding
-                                    sws_scale(
-                                        sws_ctx_encoder,
-                                        m_ffmpeg.frame_bgr->data, m_ffmpeg.frame_bgr->linesize,
-                                        0, m_ffmpeg.encoder_context->height,
-                                        m_ffmpeg.frame_encoder->data, m_ffmpeg.frame_encoder->linesize
-                                    );
-
-                                    // Free the temporary sws context
-                                    sws_freeContext(sws_ctx_encoder);
-
-                                    // Set frame PTS (presentation timestamp)
-                                    m_ffmpeg.frame_encoder->pts = av_rescale_q(packets, m_ffmpeg.encoder_context->time_base, m_ffmpeg.encoder_context->time_base);
-                                    packets++;
-
-                                    // Send the frame to the encoder
-                                    int ret = avcodec_send_frame(m_ffmpeg.encoder_context, m_ffmpeg.frame_encoder);
-                                    if (ret < 0) {
-                                        std::cerr << "Error sending frame for encoding" << std::endl;
-                                    } else {
-                                        // Get the encoded packets
-                                        while (ret >= 0) {
-                                            ret = avcodec_receive_packet(m_ffmpeg.encoder_context, m_ffmpeg.packet_encoder);
-                                            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                                                // Need more input or end of stream
-                                                break;
-                                            } else if (ret < 0) {
-                                                std::cerr << "Error during encoding" << std::endl;
-                                                break;
-                                            }
-
-                                            // Successfully got an encoded packet, send it to the client
-                                            if (client_registered) {
-                                                // Send the encoded packet to the registered client
-                                                size_t packet_size = m_ffmpeg.packet_encoder->size;
-                                                
-                                                // Split into smaller packets if needed (to avoid UDP fragmentation)
-                                                
-                                                // Send header with information about the packet
-                                                uint8_t header[8];
-                                                // First 4 bytes: total size of encoded frame
-                                                header[0] = (packet_size >> 24) & 0xFF;
-                                                header[1] = (packet_size >> 16) & 0xFF;
-                                                header[2] = (packet_size >> 8) & 0xFF;
-                                                header[3] = packet_size & 0xFF;
-                                                // Next 4 bytes: packet timestamp
-                                                uint32_t timestamp = packets; // Use packet counter as timestamp
-                                                header[4] = (timestamp >> 24) & 0xFF;
-                                                header[5] = (timestamp >> 16) & 0xFF;
-                                                header[6] = (timestamp >> 8) & 0xFF;
-                                                header[7] = timestamp & 0xFF;
-                                                
-                                                // Send header
-                                                sendto(client_sock, header, sizeof(header), 0, 
-                                                       (struct sockaddr *)&registered_client_addr, registered_client_len);
-                                                
-                                                // Send data in chunks
-                                                for (size_t offset = 0; offset < packet_size; offset += MAX_PACKET_SIZE) {
-                                                    size_t chunk_size = std::min(MAX_PACKET_SIZE, packet_size - offset);
-                                                    sendto(client_sock, m_ffmpeg.packet_encoder->data + offset, chunk_size, 0, 
-                                                           (struct sockaddr *)&registered_client_addr, registered_client_len);
-                                                    
-                                                    // Small delay to prevent overwhelming the network or receiver
-                                                    usleep(1000); // 1000us delay between chunks
-                                                }
-                                            }
-                                            
-                                            // Unref the packet for reuse
-                                            av_packet_unref(m_ffmpeg.packet_encoder);
-                                        }
-                                    }
-                                } 
-                                else {
-                                    char err_buf[AV_ERROR_MAX_STRING_SIZE];
-                                    std::cerr << "Error decoding frame: " 
-                                              << av_make_error_string(err_buf, AV_ERROR_MAX_STRING_SIZE, receive_result) 
-                                              << std::endl;
-                                    if (receive_result == AVERROR(EAGAIN)) {
-                                        std::cout << "Decoder needs more data" << std::endl;
-                                    } else if (receive_result == AVERROR_EOF) {
-                                        std::cout << "End of stream reached" << std::endl;
-                                    } else {
-                                        // Reset the decoder after serious errors
-                                        avcodec_flush_buffers(m_ffmpeg.context);
-                                    }
-                                }
-                                
-                                // Unref the frame to prepare for next decode
-                                av_frame_unref(m_ffmpeg.frame_yuv);
-                            }
-                            // Free the packet
-                            av_packet_free(&packet);
-                            
-                            // Remove processed NAL unit from buffer
-                            h264_buffer.erase(h264_buffer.begin(), h264_buffer.begin() + next_nal_start);
-                        } else {
-                            // Not enough data for a complete NAL unit
-                            break;
-                        }
-                    }
-       
-                    // If buffer gets too large, trim it
-                    if (h264_buffer.size() > 1000000) { // 1MB threshold
-                        size_t nal_start = findNalStartCode(h264_buffer);
-                        if (nal_start < h264_buffer.size()) {
-                            h264_buffer.erase(h264_buffer.begin(), h264_buffer.begin() + nal_start);
-                        } else {
-                            h264_buffer.erase(h264_buffer.begin(), h264_buffer.begin() + h264_buffer.size() / 2);
-                        }
-                        std::cout << "Buffer trimmed to " << h264_buffer.size() << " bytes" << std::endl;
-                    }
-                }
+    // Release whatever was still in flight between the stages
+    AVFrame* pending_frame = nullptr;
+    AVPacket* pending_packet = nullptr;
+    for (auto& worker : workers) {
+        for (size_t i = 0; i < streams.size(); i++) {
+            FilterLane& lane = worker->lanes[i];
+            while (lane.input.tryPop(pending_frame)) {
+                av_frame_free(&pending_frame);
+            }
+            while (lane.output.tryPop(pending_frame)) {
+                av_frame_free(&pending_frame);
+            }
+            if (lane.sws_ctx) {
+                sws_freeContext(lane.sws_ctx);
             }
+            if (lane.sws_ctx_encoder) {
+                sws_freeContext(lane.sws_ctx_encoder);
+            }
+            av_frame_free(&lane.frame_bgr);
+            av_frame_free(&lane.frame_scratch);
+            av_frame_free(&lane.frame_encoder);
         }
     }
+    for (auto& stream : streams) {
+        while (stream->packets.tryPop(pending_packet)) {
+            av_packet_free(&pending_packet);
+        }
 
-    // Free FFmpeg resources
-    if (m_ffmpeg.frame_yuv) {
-        av_frame_free(&m_ffmpeg.frame_yuv);
-    }
-    if (m_ffmpeg.frame_bgr) {
-        av_frame_free(&m_ffmpeg.frame_bgr);
-    }
-    if (m_ffmpeg.context) {
-        avcodec_free_context(&m_ffmpeg.context);
-    }
-    if (m_ffmpeg.frame_encoder) {
-        av_frame_free(&m_ffmpeg.frame_encoder);
-    }
-    if (m_ffmpeg.packet_encoder) {
-        av_packet_free(&m_ffmpeg.packet_encoder);
-    }
-    if (m_ffmpeg.encoder_context) {
-        avcodec_free_context(&m_ffmpeg.encoder_context);
+        // Free FFmpeg resources
+        FFmpegContext& ffmpeg = stream->ffmpeg;
+        if (ffmpeg.frame_yuv) {
+            av_frame_free(&ffmpeg.frame_yuv);
+        }
+        if (ffmpeg.context) {
+            avcodec_free_context(&ffmpeg.context);
+        }
+        if (ffmpeg.packet_encoder) {
+            av_packet_free(&ffmpeg.packet_encoder);
+        }
+        if (ffmpeg.encoder_context) {
+            avcodec_free_context(&ffmpeg.encoder_context);
+        }
     }
 
     // Close sockets
     close(client_sock);
     close(camera_sock);
 
-    return 0; 
+    return 0;
 }
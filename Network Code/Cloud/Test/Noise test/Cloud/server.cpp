@@ -14,8 +14,10 @@
 #include <ctime>
 #include <vector>
 #include <queue>
-#include <fstream>
 
+#include "async_log.hpp"
+#include "noise_estimator.hpp"
+#include "stream_protocol.hpp"
 
 // Include FFmpeg headers
 extern "C" {
@@ -32,8 +34,6 @@ extern "C" {
 #define MAXLINE 1024
 #define MAX_UDP_SIZE 65507
 
-const size_t MAX_PACKET_SIZE = 1400; // Smaller than MAX_UDP_SIZE to avoid fragmentation
-
 // Extend FFmpegContext struct
 struct FFmpegContext {
     const AVCodec* codec;
@@ -301,6 +301,10 @@ int main() {
     socklen_t registered_client_len = 0;
     bool client_registered = false;
 
+    // Frames sent to the client and the buffer their datagrams are built in
+    FramePacketizer packetizer;
+    uint32_t frame_id = 0;
+
 
     while (true) {
         fd_set readfds;
@@ -322,7 +326,9 @@ int main() {
                 ssize_t n = recvfrom(client_sock, buffer, sizeof(buffer), 0,
                                      (struct sockaddr *)&from_addr, &from_len);
 
-                if (n > 0) {
+                if (n > 0 && isControlMessage((uint8_t*)buffer, n)) {
+                    // Heartbeats and repair requests; this test server serves one client as is
+                } else if (n > 0) {
                     buffer[n] = '\0'; // Null-terminate if you expect string data
                     std::cout << "Server: Received client message from "
                               << inet_ntoa(from_addr.sin_addr) << ":" << ntohs(from_addr.sin_port)
@@ -441,29 +447,9 @@ int main() {
                                     // Convert to grayscale for noise estimation
                                     cv::Mat gray;
                                     cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
-                                    // Define a high-pass filter kernel
-                                    cv::Mat kernel = (cv::Mat_<float>(3, 3) <<
-                                                    1, -2,  1,
-                                                    -2,  4, -2,
-                                                    1, -2,  1);
-
-                                    // Apply the filter using filter2D – storing the result in a 32F matrix to capture negative values
-                                    cv::Mat convResult;
-                                    cv::filter2D(gray, convResult, CV_32F, kernel);
-
-                                    // Convert to absolute values
-                                    cv::Mat absConvResult;
-                                    cv::convertScaleAbs(convResult, absConvResult);
-
-                                    // Sum the absolute responses to obtain a noise energy measure
-                                    double sigma_before = cv::sum(absConvResult)[0];
-
-                                    // Normalize the noise value based on image dimensions.
-                                    // Here the chosen normalization factors (sqrt(0.5*pi) and division by 6*(width-2)*(height-2)) 
-                                    // are based on your provided formula. Adjust them if needed based on experimental calibration.
-                                    int width = gray.cols;
-                                    int height = gray.rows;
-                                    sigma_before = sigma_before * std::sqrt(0.5 * M_PI) / (6.0 * (width - 2) * (height - 2));
+
+                                    // Laplacian estimator in one pass, without saturating the responses
+                                    double sigma_before = estimateNoise(gray.data, gray.cols, gray.rows, gray.step);
                                     // ===== Noise Estimation End =====
 
                                     
@@ -495,35 +481,16 @@ int main() {
                                     // Convert the filtered image to grayscale
                                     cv::Mat gray_filtered;
                                     cv::cvtColor(dst, gray_filtered, cv::COLOR_BGR2GRAY);
-
-                                    // Apply the filter using filter2D – storing the result in a 32F matrix to capture negative values
-                                    cv::Mat convResult_filtered;
-                                    cv::filter2D(gray_filtered, convResult_filtered, CV_32F, kernel);
-
-                                    // Convert to absolute values
-                                    cv::Mat absConvResult_filtered;
-                                    cv::convertScaleAbs(convResult_filtered, absConvResult_filtered);
-
-                                    // Sum the absolute responses to obtain a noise energy measure
-                                    double sigma_filtered = cv::sum(absConvResult_filtered)[0];
-
-                                    // Normalize the noise value based on image dimensions
-                                    width = gray_filtered.cols;
-                                    height = gray_filtered.rows;
-                                    sigma_filtered = sigma_filtered * std::sqrt(0.5 * M_PI) / (6.0 * (width - 2) * (height - 2));
+                                    double sigma_filtered = estimateNoise(gray_filtered.data, gray_filtered.cols, gray_filtered.rows,
+                                                                          gray_filtered.step);
                                     // ===== Noise Estimation End =====
 
                                     // Log noise
                                     //std::string log_path =  "b_server_noise_log_tv_" + std::to_string(sigma_colour) + "_.txt";
-                                    std::string log_path =  "f_server_noise_log_tv_" + std::to_string(sigma_colour) + ".txt";
-                                    std::ofstream pi_log(log_path, std::ios::app);
-                                    if (pi_log.is_open()) {
-                                        // Log format: label time_string ts_ms sigma_before sigma_after
-                                        pi_log << sigma_before << " " << sigma_filtered << "\n";
-                                        pi_log.close();
-                                    } else {
-                                        std::cerr << "Unable to open log.txt for writing at path: " << log_path << "\n";
-                                    }
+                                    // Log format: sigma_before sigma_after. Queued here, written by the log thread
+                                    static const int log_file = AsyncLog::get().open(
+                                        "f_server_noise_log_tv_" + std::to_string(sigma_colour) + ".txt", "ff", LogFormat::Text);
+                                    AsyncLog::get().write(log_file, sigma_before, sigma_filtered);
 
 
                                     // Copy the filtered data back to the FFmpeg frame
@@ -575,33 +542,14 @@ int main() {
 
                                             // Successfully got an encoded packet, send it to the client
                                             if (client_registered) {
-                                                // Send the encoded packet to the registered client
-                                                size_t packet_size = m_ffmpeg.packet_encoder->size;
-                                                
-                                                // Split into smaller packets if needed (to avoid UDP fragmentation)
-                                                
-                                                // Send header with information about the packet
-                                                uint8_t header[8];
-                                                // First 4 bytes: total size of encoded frame
-                                                header[0] = (packet_size >> 24) & 0xFF;
-                                                header[1] = (packet_size >> 16) & 0xFF;
-                                                header[2] = (packet_size >> 8) & 0xFF;
-                                                header[3] = packet_size & 0xFF;
-                                                // Next 4 bytes: packet timestamp
-                                                uint32_t timestamp = packets; // Use packet counter as timestamp
-                                                header[4] = (timestamp >> 24) & 0xFF;
-                                                header[5] = (timestamp >> 16) & 0xFF;
-                                                header[6] = (timestamp >> 8) & 0xFF;
-                                                header[7] = timestamp & 0xFF;
-                                                
-                                                // Send header
-                                                sendto(client_sock, header, sizeof(header), 0, 
-                                                       (struct sockaddr *)&registered_client_addr, registered_client_len);
-                                                
-                                                // Send data in chunks
-                                                for (size_t offset = 0; offset < packet_size; offset += MAX_PACKET_SIZE) {
-                                                    size_t chunk_size = std::min(MAX_PACKET_SIZE, packet_size - offset);
-                                                    sendto(client_sock, m_ffmpeg.packet_encoder->data + offset, chunk_size, 0, 
+                                                // Split into datagrams that each carry their own header
+                                                bool keyframe = (m_ffmpeg.packet_encoder->flags & AV_PKT_FLAG_KEY) != 0;
+                                                const std::vector<struct iovec>& datagrams = packetizer.packetize(
+                                                    m_ffmpeg.packet_encoder->data, m_ffmpeg.packet_encoder->size,
+                                                    frame_id++, keyframe, wallClockMicros());
+
+                                                for (const struct iovec& datagram : datagrams) {
+                                                    sendto(client_sock, datagram.iov_base, datagram.iov_len, 0, 
                                                            (struct sockaddr *)&registered_client_addr, registered_client_len);
                                                     
                                                     // Small delay to prevent overwhelming the network or receiver
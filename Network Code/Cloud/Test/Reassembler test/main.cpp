@@ -0,0 +1,91 @@
+// Checks how FrameReassembler follows the sender's frame ids: a relay that
+// restarts from 0, a bogus id far ahead, and a short run of lost frames.
+// Prints every failed check and exits with 1 if there was one.
+#include <iostream>
+#include <vector>
+
+#include "stream_protocol.hpp"
+
+const size_t FRAME_SIZE = 3000; // A few fragments per frame
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+// Push every datagram of one frame
+static void pushFrame(FrameReassembler& reassembler, FramePacketizer& packetizer,
+                      uint32_t frame_id, uint64_t now_us) {
+    std::vector<uint8_t> frame(FRAME_SIZE, (uint8_t)frame_id);
+    const std::vector<struct iovec>& datagrams =
+        packetizer.packetize(frame.data(), frame.size(), frame_id, frame_id == 0, now_us);
+    for (const struct iovec& datagram : datagrams) {
+        reassembler.push((const uint8_t*)datagram.iov_base, datagram.iov_len, now_us);
+    }
+}
+
+// Push frames first .. first + count - 1 and return how many came out in order
+static int pushRun(FrameReassembler& reassembler, FramePacketizer& packetizer,
+                   uint32_t first, uint32_t count, uint64_t& now_us) {
+    int delivered = 0;
+    ReassembledFrame frame;
+    for (uint32_t id = first; id != first + count; id++) {
+        pushFrame(reassembler, packetizer, id, now_us);
+        while (reassembler.nextFrame(frame, now_us)) {
+            delivered += frame.frame_id == id && frame.size == FRAME_SIZE && frame.data[0] == (uint8_t)id;
+        }
+        now_us += 33000;
+    }
+    return delivered;
+}
+
+static void relayRestart() {
+    FrameReassembler reassembler;
+    FramePacketizer packetizer;
+    uint64_t now_us = 1;
+
+    check(pushRun(reassembler, packetizer, 1000, 20, now_us) == 20, "restart: frames before the restart");
+    check(pushRun(reassembler, packetizer, 0, 20, now_us) == 20, "restart: frames after the restart");
+    check(reassembler.resyncs() == 1, "restart: one resync");
+    check(reassembler.framesLost() == 0, "restart: nothing counted as lost");
+}
+
+static void bogusJump() {
+    FrameReassembler reassembler;
+    FramePacketizer packetizer;
+    uint64_t now_us = 1;
+
+    check(pushRun(reassembler, packetizer, 10, 5, now_us) == 5, "jump: frames before the jump");
+    // Would take 2^31 steps if every skipped frame were given up one by one
+    check(pushRun(reassembler, packetizer, 0x80000000u + 15, 5, now_us) == 5, "jump: frames after the jump");
+    check(reassembler.resyncs() == 1, "jump: one resync");
+}
+
+static void shortGap() {
+    FrameReassembler reassembler;
+    FramePacketizer packetizer;
+    uint64_t now_us = 1;
+
+    check(pushRun(reassembler, packetizer, 50, 5, now_us) == 5, "gap: frames before the gap");
+    // 20 frames missing: too many for the slots, too few to be a restart
+    check(pushRun(reassembler, packetizer, 75, 5, now_us) == 5, "gap: frames after the gap");
+    check(reassembler.resyncs() == 0, "gap: no resync");
+    check(reassembler.framesLost() == 20, "gap: missing frames counted as lost");
+}
+
+int main() {
+    relayRestart();
+    bogusJump();
+    shortGap();
+
+    if (failures > 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
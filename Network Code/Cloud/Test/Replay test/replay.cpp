@@ -0,0 +1,392 @@
+// Replays a recorded camera stream into a relay in place of the Raspberry Pi,
+// so the server pipeline can be benchmarked on any Linux box:
+//
+//   ./bin/replay capture.h264 [--server=127.0.0.1] [--port=9999] [--fps=30] [--speed=1] [--loop=1]
+//   ./bin/replay capture.pcap [--capture-port=9999] [--server=...] [--speed=...] [--loop=...]
+//
+// An Annex-B file (rpicam-vid --inline -o capture.h264) is cut into access
+// units, one sent per frame interval in datagrams of up to MAX_CHUNK bytes,
+// the way rpicam-vid's UDP output sends them. A pcap of the camera's stream
+// (tcpdump -w capture.pcap udp port 9999; the classic format, not pcapng) is
+// sent datagram by datagram with the gaps it was recorded with. --speed
+// scales the pace: 1 is real time, 4 four times as fast, 0 as fast as the
+// socket takes it.
+//
+// Start the server on 127.0.0.1 and the sink first: the relays only decode
+// with a viewer, and a viewer can only start at a keyframe.
+#include <iostream>
+#include <cstdlib>
+#include <unistd.h>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "stream_protocol.hpp"
+
+#define SERVER_IP "127.0.0.1"
+#define CAMERA_PORT 9999
+
+const size_t MAX_CHUNK = 65507;             // Largest UDP payload, as rpicam-vid sends
+const double DEFAULT_FPS = 30.0;            // Annex-B files carry no timing
+const uint64_t PROGRESS_INTERVAL_US = 5000000;
+
+// One datagram to send and when, relative to the start of the recording
+struct Datagram {
+    uint64_t time_us;
+    size_t offset;      // Into the payload buffer
+    size_t size;
+};
+
+struct Recording {
+    std::vector<uint8_t> payload;
+    std::vector<Datagram> datagrams;
+    uint64_t duration_us = 0;   // One pass, including the last frame interval
+    size_t frames = 0;
+};
+
+bool sentEarlier(const Datagram& a, const Datagram& b) {
+    return a.time_us < b.time_us;
+}
+
+bool readFile(const std::string& path, std::vector<uint8_t>& data) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// Position of the next 00 00 01 from pos on (data.size() if none)
+size_t findStartCode(const std::vector<uint8_t>& data, size_t pos) {
+    for (size_t i = pos; i + 2 < data.size(); i++) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            return i;
+        }
+    }
+    return data.size();
+}
+
+// Cut an Annex-B stream into access units, one per frame. A frame starts with
+// the first AUD, SEI, SPS or PPS after a picture, or with a slice whose
+// first_mb_in_slice is 0 (its first header bit is set).
+void loadAnnexB(std::vector<uint8_t>& data, double fps, Recording& recording) {
+    std::vector<size_t> units; // Where each access unit starts
+    bool have_picture = false;
+    size_t pos = findStartCode(data, 0);
+    while (pos < data.size()) {
+        size_t header = pos + 3;
+        // A 4 byte start code belongs with its NAL unit
+        size_t nal_start = pos > 0 && data[pos - 1] == 0 ? pos - 1 : pos;
+        if (header < data.size()) {
+            int type = data[header] & 0x1F;
+            bool picture = type == 1 || type == 5;
+            bool first_slice = picture && header + 1 < data.size() && (data[header + 1] & 0x80);
+            bool before_picture = type == 6 || type == 7 || type == 8 || type == 9;
+            if (units.empty() || (have_picture && (first_slice || before_picture))) {
+                units.push_back(units.empty() ? 0 : nal_start);
+                have_picture = false;
+            }
+            have_picture = have_picture || picture;
+        }
+        pos = findStartCode(data, header);
+    }
+
+    uint64_t interval_us = (uint64_t)(1000000 / fps);
+    recording.payload.swap(data);
+    for (size_t i = 0; i < units.size(); i++) {
+        size_t end = i + 1 < units.size() ? units[i + 1] : recording.payload.size();
+        for (size_t offset = units[i]; offset < end; offset += MAX_CHUNK) {
+            recording.datagrams.push_back({i * interval_us, offset, std::min(MAX_CHUNK, end - offset)});
+        }
+    }
+    recording.frames = units.size();
+    recording.duration_us = units.size() * interval_us;
+}
+
+// Classic pcap: a 24 byte file header, then a 16 byte header per packet
+uint32_t pcapWord(const uint8_t* p, bool swapped) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return swapped ? __builtin_bswap32(value) : value;
+}
+
+uint16_t bigEndian16(const uint8_t* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+// An IP datagram the camera's large UDP datagrams were fragmented into
+struct IpFragments {
+    std::vector<uint8_t> data;
+    size_t received = 0;
+    size_t total = 0;       // Known once the last fragment is in
+    uint64_t time_us = 0;   // Of the first fragment
+};
+
+// Offset of the IPv4 header in a captured frame of this link type, or -1
+int ipOffset(uint32_t link_type, const uint8_t* frame, size_t size) {
+    switch (link_type) {
+    case 0:     // BSD loopback (lo on some systems)
+        return size >= 4 ? 4 : -1;
+    case 1: {   // Ethernet, possibly VLAN tagged
+        if (size < 14) {
+            return -1;
+        }
+        int offset = 12;
+        while (bigEndian16(frame + offset) == 0x8100 && (size_t)offset + 6 <= size) {
+            offset += 4;
+        }
+        return bigEndian16(frame + offset) == 0x0800 ? offset + 2 : -1;
+    }
+    case 101:   // Raw IP
+    case 228:   // Raw IPv4
+        return 0;
+    case 113:   // Linux cooked capture (tcpdump -i any)
+        return size >= 16 && bigEndian16(frame + 14) == 0x0800 ? 16 : -1;
+    case 276:   // Linux cooked capture v2
+        return size >= 20 && bigEndian16(frame) == 0x0800 ? 20 : -1;
+    default:
+        return -1;
+    }
+}
+
+// The UDP payloads to port (any port for 0) in a pcap, fragmented ones put
+// back together
+bool loadPcap(const std::vector<uint8_t>& data, int port, Recording& recording) {
+    if (data.size() < 24) {
+        return false;
+    }
+    uint32_t magic;
+    memcpy(&magic, data.data(), 4);
+    bool swapped = magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1;
+    bool nanoseconds = magic == 0xA1B23C4D || magic == 0x4D3CB2A1;
+    if (!swapped && !nanoseconds && magic != 0xA1B2C3D4) {
+        std::cerr << "Not a pcap file (pcapng is not supported, convert with editcap -F pcap)" << std::endl;
+        return false;
+    }
+    uint32_t link_type = pcapWord(data.data() + 20, swapped) & 0xFFFF;
+
+    std::map<uint64_t, IpFragments> pending; // By source address and IP id
+    size_t pos = 24;
+    while (pos + 16 <= data.size()) {
+        uint64_t seconds = pcapWord(data.data() + pos, swapped);
+        uint64_t fraction = pcapWord(data.data() + pos + 4, swapped);
+        size_t captured = pcapWord(data.data() + pos + 8, swapped);
+        pos += 16;
+        if (pos + captured > data.size()) {
+            break;
+        }
+        const uint8_t* frame = data.data() + pos;
+        pos += captured;
+
+        uint64_t time_us = seconds * 1000000 + (nanoseconds ? fraction / 1000 : fraction);
+
+        int ip = ipOffset(link_type, frame, captured);
+        if (ip < 0 || (size_t)ip + 20 > captured || (frame[ip] >> 4) != 4 || frame[ip + 9] != 17) {
+            continue;
+        }
+        size_t header_size = (frame[ip] & 0x0F) * 4;
+        size_t ip_size = std::min<size_t>(bigEndian16(frame + ip + 2), captured - ip);
+        if (header_size < 20 || ip_size < header_size) {
+            continue;
+        }
+        uint16_t flags = bigEndian16(frame + ip + 6);
+        bool more_fragments = (flags & 0x2000) != 0;
+        size_t fragment_offset = (size_t)(flags & 0x1FFF) * 8;
+        const uint8_t* body = frame + ip + header_size;
+        size_t body_size = ip_size - header_size;
+
+        // Put fragmented datagrams back together; most of the camera's are
+        std::vector<uint8_t> whole;
+        uint64_t datagram_us = time_us;
+        if (more_fragments || fragment_offset > 0) {
+            uint64_t key = ((uint64_t)pcapWord(frame + ip + 12, false) << 16) | bigEndian16(frame + ip + 4);
+            IpFragments& fragments = pending[key];
+            if (fragments.received == 0) {
+                fragments.time_us = time_us;
+            }
+            if (fragment_offset + body_size > fragments.data.size()) {
+                fragments.data.resize(fragment_offset + body_size);
+            }
+            memcpy(fragments.data.data() + fragment_offset, body, body_size);
+            fragments.received += body_size;
+            if (!more_fragments) {
+                fragments.total = fragment_offset + body_size;
+            }
+            if (fragments.total == 0 || fragments.received < fragments.total) {
+                continue;
+            }
+            whole.swap(fragments.data);
+            datagram_us = fragments.time_us;
+            pending.erase(key);
+            body = whole.data();
+            body_size = whole.size();
+        }
+
+        if (body_size < 8 || (port != 0 && bigEndian16(body + 2) != port)) {
+            continue;
+        }
+        // The UDP length counts its own 8 byte header; anything less is corrupt
+        size_t udp_length = bigEndian16(body + 4);
+        if (udp_length < 8) {
+            continue;
+        }
+        size_t payload_size = std::min<size_t>(udp_length, body_size) - 8;
+        recording.datagrams.push_back({datagram_us, recording.payload.size(), payload_size});
+        recording.payload.insert(recording.payload.end(), body + 8, body + 8 + payload_size);
+    }
+
+    // Reassembled datagrams are stamped with their first fragment; times
+    // from the first datagram on
+    std::stable_sort(recording.datagrams.begin(), recording.datagrams.end(), sentEarlier);
+    if (!recording.datagrams.empty()) {
+        uint64_t first_us = recording.datagrams.front().time_us;
+        for (Datagram& datagram : recording.datagrams) {
+            datagram.time_us -= first_us;
+        }
+        // Round off the pass with the average gap, so loops keep the pace
+        uint64_t span_us = recording.datagrams.back().time_us;
+        recording.duration_us = span_us + span_us / std::max<size_t>(recording.datagrams.size() - 1, 1);
+    }
+    return true;
+}
+
+bool endsWith(const std::string& text, const std::string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int main(int argc, char** argv) {
+    std::string path;
+    std::string server_ip = SERVER_IP;
+    int port = CAMERA_PORT;
+    int capture_port = CAMERA_PORT;
+    double fps = DEFAULT_FPS;
+    double speed = 1.0;
+    int loops = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--server=", 0) == 0) {
+            server_ip = arg.substr(9);
+        } else if (arg.rfind("--port=", 0) == 0) {
+            port = atoi(arg.substr(7).c_str());
+        } else if (arg.rfind("--capture-port=", 0) == 0) {
+            capture_port = atoi(arg.substr(15).c_str());
+        } else if (arg.rfind("--fps=", 0) == 0) {
+            fps = atof(arg.substr(6).c_str());
+        } else if (arg.rfind("--speed=", 0) == 0) {
+            speed = atof(arg.substr(8).c_str());
+        } else if (arg.rfind("--loop=", 0) == 0) {
+            loops = atoi(arg.substr(7).c_str());
+        } else if (arg[0] != '-' && path.empty()) {
+            path = arg;
+        } else {
+            path.clear();
+            break;
+        }
+    }
+    if (path.empty() || fps <= 0 || speed < 0 || loops < 1) {
+        std::cerr << "Usage: " << argv[0] << " capture.h264|capture.pcap [--server=ip] [--port=n] [--capture-port=n]"
+                  << " [--fps=n] [--speed=x, 0 for maximum] [--loop=n]" << std::endl;
+        return 1;
+    }
+
+    std::vector<uint8_t> data;
+    if (!readFile(path, data)) {
+        std::cerr << "Could not read " << path << std::endl;
+        return 1;
+    }
+    Recording recording;
+    if (endsWith(path, ".pcap") || endsWith(path, ".cap")) {
+        if (!loadPcap(data, capture_port, recording)) {
+            return 1;
+        }
+        std::cout << "Replay: " << recording.datagrams.size() << " datagrams to port " << capture_port << " over "
+                  << recording.duration_us / 1000 << " ms" << std::endl;
+    } else {
+        loadAnnexB(data, fps, recording);
+        std::cout << "Replay: " << recording.frames << " frames in " << recording.datagrams.size()
+                  << " datagrams at " << fps << " fps" << std::endl;
+    }
+    if (recording.datagrams.empty()) {
+        std::cerr << "Nothing to replay in " << path << std::endl;
+        return 1;
+    }
+
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    int sndbuf = 4 * 1024 * 1024; // Room for a keyframe at maximum speed
+    if (setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0) {
+        perror("setsockopt(SO_SNDBUF) failed");
+    }
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = inet_addr(server_ip.c_str());
+
+    std::cout << "Replay: Sending to " << server_ip << ":" << port << " at ";
+    if (speed > 0) {
+        std::cout << speed << "x speed" << std::endl;
+    } else {
+        std::cout << "maximum speed" << std::endl;
+    }
+
+    // Every datagram goes at its recorded time, scaled, from the start;
+    // late ones go straight away, so a slow moment does not shift the rest
+    uint64_t start_us = steadyMicros();
+    uint64_t last_progress_us = start_us;
+    unsigned long long sent = 0;
+    unsigned long long bytes = 0;
+    unsigned long long failed = 0;
+    for (int loop = 0; loop < loops; loop++) {
+        for (const Datagram& datagram : recording.datagrams) {
+            if (speed > 0) {
+                uint64_t due_us = start_us + (uint64_t)((loop * recording.duration_us + datagram.time_us) / speed);
+                std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::microseconds(due_us)));
+            }
+            if (sendto(sockfd, recording.payload.data() + datagram.offset, datagram.size, 0,
+                       (const struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+                failed++;
+                continue;
+            }
+            sent++;
+            bytes += datagram.size;
+
+            if (steadyMicros() - last_progress_us >= PROGRESS_INTERVAL_US) {
+                last_progress_us = steadyMicros();
+                std::cout << "Replay: " << sent << " datagrams, " << bytes / 1024 << " KB sent" << std::endl;
+            }
+        }
+    }
+
+    // The last frame lasts its interval as well
+    if (speed > 0) {
+        uint64_t end_us = start_us + (uint64_t)(loops * recording.duration_us / speed);
+        std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::microseconds(end_us)));
+    }
+    double seconds = std::max(steadyMicros() - start_us, (uint64_t)1) / 1e6;
+    std::cout << "Replay: Sent " << sent << " datagrams (" << failed << " failed), " << bytes / 1024 << " KB";
+    if (recording.frames > 0) {
+        std::cout << ", " << recording.frames * loops << " frames";
+    }
+    std::cout << " in " << seconds << " s: " << bytes * 8 / seconds / 1e6 << " Mbit/s";
+    if (recording.frames > 0) {
+        std::cout << ", " << recording.frames * loops / seconds << " fps";
+    }
+    std::cout << std::endl;
+
+    close(sockfd);
+    return 0;
+}
@@ -0,0 +1,324 @@
+// Headless viewer for replay benchmarks: registers with the relay like the
+// client does, rebuilds and decodes every frame, and records per frame how
+// long each hop took from the relay's timing SEI (frame_timing.hpp):
+//
+//   ./bin/sink [--server=127.0.0.1] [--frames=0] [--idle=3] [--out=sink.json] [--log=sink_log.txt]
+//
+// The run ends after --frames frames (0: no limit), once no frame came for
+// --idle seconds, or on Ctrl+C. Every LATENCY_INTERVAL_US it prints fps and
+// p50/p99/max per hop over the interval; at the end it writes the totals as
+// JSON, to compare between builds. The per-frame log has the latency test
+// client's layout, so "frame latency extract.py" reads it too.
+//
+// Everything runs on one box, so all hops share a clock. The camera hop is
+// left out: a recording still carries the capture times it was made with.
+#include <iostream>
+#include <cstdlib>
+#include <unistd.h>
+#include <cstring>
+#include <csignal>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "async_log.hpp"
+#include "frame_timing.hpp"
+#include "metrics.hpp"
+#include "stream_protocol.hpp"
+
+// FFmpeg includes
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#define SERVER_IP "127.0.0.1"
+#define CLIENT_PORT 9998
+#define MAXLINE 65507 // Max UDP packet size
+
+// The server drops viewers it has not heard from in a while
+const uint64_t HEARTBEAT_INTERVAL_US = 1000000;
+
+// Keyframe requests (PLI) after a lost frame or a decoder error, repeated
+// every PLI_INTERVAL_US until a keyframe arrives. The relay's GOP is long,
+// waiting for it would skew the measurements with broken pictures.
+const uint64_t PLI_INTERVAL_US = 300000;
+
+// Fps and per-hop latency are printed this often
+const uint64_t LATENCY_INTERVAL_US = 5000000;
+
+const char* const HOP_NAMES[LATENCY_HOPS] = {"camera", "decode", "filter", "encode",
+                                             "send", "network", "viewer", "total"};
+
+std::atomic<bool> running(true);
+
+void handleSignal(int) {
+    running = false;
+}
+
+void recordHop(LatencyHistogram* hops, LatencyHop hop, uint64_t from_us, uint64_t to_us) {
+    if (from_us != 0 && to_us >= from_us) {
+        hops[(int)hop].record(to_us - from_us);
+    }
+}
+
+bool writeSummary(const std::string& path, const LatencyHistogram* hops, unsigned long long frames,
+                  unsigned long long lost, unsigned long long decode_errors, unsigned long long bytes,
+                  double seconds, double fps) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    out << "{\n  \"frames\": " << frames << ",\n  \"frames_lost\": " << lost << ",\n  \"decode_errors\": "
+        << decode_errors << ",\n  \"bytes\": " << bytes << ",\n  \"seconds\": " << seconds
+        << ",\n  \"fps\": " << fps << ",\n  \"hops\": {";
+    bool first = true;
+    std::vector<uint64_t> counts(HISTOGRAM_BUCKETS);
+    for (int hop = 0; hop < LATENCY_HOPS; hop++) {
+        uint64_t count = hops[hop].counts(counts.data());
+        if (count == 0) {
+            continue;
+        }
+        uint64_t max_us = hops[hop].max();
+        out << (first ? "" : ",") << "\n    \"" << HOP_NAMES[hop] << "\": {\"count\": " << count
+            << ", \"mean_us\": " << hops[hop].sum() / count
+            << ", \"p50_us\": " << metrics_detail::percentile(counts.data(), count, 0.50, max_us)
+            << ", \"p99_us\": " << metrics_detail::percentile(counts.data(), count, 0.99, max_us)
+            << ", \"max_us\": " << max_us << "}";
+        first = false;
+    }
+    out << "\n  }\n}\n";
+    return (bool)out;
+}
+
+int main(int argc, char** argv) {
+    std::string server_ip = SERVER_IP;
+    unsigned long long frame_limit = 0;
+    double idle_seconds = 3.0;
+    std::string out_path = "sink.json";
+    std::string log_path = "sink_log.txt";
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--server=", 0) == 0) {
+            server_ip = arg.substr(9);
+        } else if (arg.rfind("--frames=", 0) == 0) {
+            frame_limit = strtoull(arg.substr(9).c_str(), nullptr, 10);
+        } else if (arg.rfind("--idle=", 0) == 0) {
+            idle_seconds = atof(arg.substr(7).c_str());
+        } else if (arg.rfind("--out=", 0) == 0) {
+            out_path = arg.substr(6);
+        } else if (arg.rfind("--log=", 0) == 0) {
+            log_path = arg.substr(6);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--server=ip] [--frames=n] [--idle=seconds] [--out=path]"
+                      << " [--log=path]" << std::endl;
+            return 1;
+        }
+    }
+
+    // Software decoder, as the client uses
+    const AVCodec* codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    if (!codec) {
+        fprintf(stderr, "Codec not found\n");
+        exit(1);
+    }
+    AVCodecContext* context = avcodec_alloc_context3(codec);
+    if (!context) {
+        fprintf(stderr, "Could not allocate video codec context\n");
+        exit(1);
+    }
+    context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    context->flags2 |= AV_CODEC_FLAG2_CHUNKS;
+    if (avcodec_open2(context, codec, nullptr) < 0) {
+        fprintf(stderr, "Could not open codec\n");
+        exit(1);
+    }
+    AVFrame* frame = av_frame_alloc();
+    AVPacket* packet = av_packet_alloc();
+    if (!frame || !packet) {
+        fprintf(stderr, "Could not allocate video frames\n");
+        exit(1);
+    }
+
+    // Any local port; the server sends to where the registration came from
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    int rcvbuf = 8 * 1024 * 1024; // 8MB receive buffer
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
+        perror("setsockopt(SO_RCVBUF) failed");
+    }
+    // Short timeout, so heartbeats, the idle limit and Ctrl+C are served
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 200000;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        perror("setsockopt(SO_RCVTIMEO) failed");
+    }
+
+    struct sockaddr_in server_addr, from_addr;
+    socklen_t from_len = sizeof(from_addr);
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(CLIENT_PORT);
+    server_addr.sin_addr.s_addr = inet_addr(server_ip.c_str());
+
+    signal(SIGINT, handleSignal);
+    signal(SIGTERM, handleSignal);
+
+    // Register, and again every heartbeat until the server confirms
+    const char* registration = "Client registration";
+    static char buffer[MAXLINE + 1];
+    bool registered = false;
+    uint64_t last_heartbeat_us = 0;
+    while (running && !registered) {
+        if (steadyMicros() - last_heartbeat_us >= HEARTBEAT_INTERVAL_US) {
+            sendto(sockfd, registration, strlen(registration), 0, (const struct sockaddr*)&server_addr,
+                   sizeof(server_addr));
+            last_heartbeat_us = steadyMicros();
+        }
+        int data = recvfrom(sockfd, buffer, MAXLINE, 0, (struct sockaddr*)&from_addr, &from_len);
+        // Video for other viewers may come before the answer
+        if (data > 0 && strncmp(buffer, "Registration", 12) == 0) {
+            buffer[data] = '\0';
+            std::cout << "Sink: " << buffer << std::endl;
+            registered = strstr(buffer, "successful") != nullptr;
+            if (!registered) {
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    std::cout << "Sink: Waiting for video..." << std::endl;
+
+    FrameReassembler reassembler;
+    ReassembledFrame reassembled;
+    LatencyHistogram hops[LATENCY_HOPS];
+    HistogramWindow windows[LATENCY_HOPS];
+    const int log_file = AsyncLog::get().open(log_path, "iiiiiiii", LogFormat::Text);
+
+    unsigned long long frames = 0;
+    unsigned long long decode_errors = 0;
+    unsigned long long bytes = 0;
+    unsigned long long last_frames = 0;
+    uint64_t first_frame_us = 0;
+    uint64_t last_frame_us = 0;
+    uint64_t last_print_us = steadyMicros();
+    bool need_keyframe = false;
+    uint64_t last_pli_us = 0;
+    unsigned long long frames_lost = 0;
+    unsigned long long resyncs = 0;
+
+    while (running && (frame_limit == 0 || frames < frame_limit)) {
+        uint64_t now_us = steadyMicros();
+        if (now_us - last_heartbeat_us >= HEARTBEAT_INTERVAL_US) {
+            uint8_t heartbeat[CONTROL_HEADER_SIZE];
+            sendto(sockfd, heartbeat, writeHeartbeat(heartbeat), 0, (const struct sockaddr*)&server_addr,
+                   sizeof(server_addr));
+            last_heartbeat_us = now_us;
+        }
+
+        // Ask for a keyframe after a loss, a decoder error or a stream that
+        // started over, as the viewer client does
+        if (reassembler.framesLost() != frames_lost || reassembler.resyncs() != resyncs) {
+            frames_lost = reassembler.framesLost();
+            resyncs = reassembler.resyncs();
+            need_keyframe = true;
+        }
+        if (need_keyframe && steadyMicros() - last_pli_us >= PLI_INTERVAL_US) {
+            uint8_t pli[CONTROL_HEADER_SIZE];
+            sendto(sockfd, pli, writePictureLoss(pli), 0,
+                   (const struct sockaddr*)&server_addr, sizeof(server_addr));
+            last_pli_us = steadyMicros();
+        }
+        if (first_frame_us != 0 && now_us - last_frame_us >= (uint64_t)(idle_seconds * 1e6)) {
+            std::cout << "Sink: No frames for " << idle_seconds << " s, done" << std::endl;
+            break;
+        }
+
+        // Fps and the hops over the last interval
+        if (now_us - last_print_us >= LATENCY_INTERVAL_US && frames > last_frames) {
+            std::cout << "Sink: " << (frames - last_frames) * 1e6 / (now_us - last_print_us) << " fps, "
+                      << reassembler.framesLost() << " lost, p50/p99/max us:";
+            for (int hop = 0; hop < LATENCY_HOPS; hop++) {
+                WindowSummary window = windows[hop].take(hops[hop]);
+                if (window.count > 0) {
+                    std::cout << " " << HOP_NAMES[hop] << " " << window.p50_us << "/" << window.p99_us << "/"
+                              << window.max_us;
+                }
+            }
+            std::cout << std::endl;
+            last_frames = frames;
+            last_print_us = now_us;
+        }
+
+        int data = recvfrom(sockfd, buffer, MAXLINE, 0, (struct sockaddr*)&from_addr, &from_len);
+        if (data <= 0) {
+            continue;
+        }
+        bytes += data;
+        reassembler.push((const uint8_t*)buffer, data, steadyMicros());
+
+        while (reassembler.nextFrame(reassembled, steadyMicros())) {
+            if (reassembled.keyframe) {
+                need_keyframe = false;
+            }
+            FrameTiming relay_timing = {};
+            findTimingSei(reassembled.data, reassembled.size, relay_timing);
+            uint64_t received_us = steadyToWallMicros(reassembled.complete_us);
+
+            packet->data = (uint8_t*)reassembled.data;
+            packet->size = (int)reassembled.size;
+            if (avcodec_send_packet(context, packet) < 0) {
+                decode_errors++;
+                avcodec_flush_buffers(context);
+                need_keyframe = true;
+                continue;
+            }
+            while (avcodec_receive_frame(context, frame) == 0) {
+                uint64_t decoded_us = wallClockMicros();
+                recordHop(hops, LatencyHop::RelayDecode, relay_timing.received_us, relay_timing.decoded_us);
+                recordHop(hops, LatencyHop::RelayFilter, relay_timing.decoded_us, relay_timing.filtered_us);
+                recordHop(hops, LatencyHop::RelayEncode, relay_timing.filtered_us, relay_timing.encoded_us);
+                recordHop(hops, LatencyHop::RelaySend, relay_timing.encoded_us, reassembled.send_time_us);
+                recordHop(hops, LatencyHop::Network, reassembled.send_time_us, received_us);
+                recordHop(hops, LatencyHop::Viewer, received_us, decoded_us);
+                recordHop(hops, LatencyHop::Total, relay_timing.received_us, decoded_us);
+
+                // Same layout as the latency test client, without the capture time
+                AsyncLog::get().write(log_file, (uint64_t)0, relay_timing.received_us, relay_timing.decoded_us,
+                                      relay_timing.filtered_us, relay_timing.encoded_us, reassembled.send_time_us,
+                                      received_us, decoded_us);
+
+                frames++;
+                last_frame_us = steadyMicros();
+                if (first_frame_us == 0) {
+                    first_frame_us = last_frame_us;
+                }
+                av_frame_unref(frame);
+            }
+        }
+    }
+
+    // Frame intervals over the time between the first frame and the last
+    double seconds = frames > 1 ? (last_frame_us - first_frame_us) / 1e6 : 0.0;
+    double fps = seconds > 0 ? (frames - 1) / seconds : 0.0;
+    std::cout << "Sink: " << frames << " frames in " << seconds << " s (" << fps << " fps), "
+              << reassembler.framesLost() << " lost, " << decode_errors << " decode errors" << std::endl;
+    if (!writeSummary(out_path, hops, frames, reassembler.framesLost(), decode_errors, bytes, seconds, fps)) {
+        std::cerr << "Could not write " << out_path << std::endl;
+    } else {
+        std::cout << "Sink: Summary written to " << out_path << std::endl;
+    }
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&context);
+    close(sockfd);
+    return 0;
+}
@@ -12,10 +12,20 @@
 #include <sys/select.h>
 #include <algorithm>
 #include <ctime>
+#include <deque>
+#include <memory>
 #include <vector>
 #include <queue>
 #include <fstream>
 
+#include "client_registry.hpp"
+#include "fast_bilateral.hpp"
+#include "frame_timing.hpp"
+#include "metrics.hpp"
+#include "rate_control.hpp"
+#include "reactor.hpp"
+#include "send_history.hpp"
+#include "stream_protocol.hpp"
 
 // Include FFmpeg headers
 extern "C" {
@@ -24,6 +34,7 @@ extern "C" {
 #include <libavutil/avutil.h>
 #include <libswscale/swscale.h> // For sws_getContext and SWS_BILINEAR
 #include <libavutil/imgutils.h> // For av_image_get_buffer_size and av_image_fill_arrays
+#include <libavutil/pixdesc.h>
 }
 
 #define SERVER_IP "192.168.0.112"
@@ -31,7 +42,99 @@ extern "C" {
 #define CAMERA_PORT 9999
 #define MAXLINE 1024
 
-const size_t MAX_PACKET_SIZE = 1400; // Smaller than MAX_UDP_SIZE to avoid fragmentation
+// Forward error correction on the client stream: parity fragments per group of
+// data fragments ({0, 0} turns it off). Keyframes get more, as losing one
+// costs a whole GOP.
+const FecParams FEC_DELTA = {8, 1};
+const FecParams FEC_KEYFRAME = {8, 2};
+
+// Retransmission of fragments the client reports missing (NACK). On the LAN a
+// repair arrives well within a frame interval; past the deadline the client
+// has moved on.
+const size_t HISTORY_FRAMES = 32;
+const uint64_t RETRANSMIT_DEADLINE_US = 50000;
+
+// Camera datagrams are taken RECEIVE_BATCH at a time (recvmmsg on Linux, a
+// recvmsg loop on macOS, where this relay runs for VideoToolbox)
+const size_t RECEIVE_BATCH = 16;
+
+// Viewers: up to MAX_VIEWERS watch the same encode; every frame is sent to each
+const size_t MAX_VIEWERS = 8;
+const uint64_t VIEWER_TIMEOUT_US = 5000000; // Dropped after this long without a heartbeat, NACK or PLI
+
+// Keyframes on request (PLI) from a client that lost the picture, or that just
+// registered. Rate limited, as every IDR costs several times a normal frame.
+const uint64_t MIN_KEYFRAME_INTERVAL_US = 250000;
+
+// Adaptive bitrate: every viewer's receiver reports drive its own rate
+// between MIN_BITRATE and MAX_BITRATE (AIMD, see rate_control.hpp), and the
+// encoder follows the slowest viewer
+const int64_t MAX_BITRATE = 1000000;
+const int64_t MIN_BITRATE = 150000;
+const int64_t BITRATE_STEP = 50000;           // Added per report while the viewer sees no loss
+const uint32_t JITTER_LIMIT_US = 10000;
+const uint32_t SPREAD_LIMIT_US = 16000;       // One frame interval at 60 fps
+const double VBV_SECONDS = 0.5;               // Encoder buffer, caps how far a frame may overshoot
+const double RATE_CHANGE_THRESHOLD = 0.05;    // Smaller changes are not worth an encoder reconfig
+
+// Where the denoising happens
+enum class DenoiseMode {
+    Bgr,  // Convert to BGR24, filter all three colour channels, convert back
+    Yuv   // Filter the decoded YUV420P planes directly into the encoder frame
+};
+const DenoiseMode DENOISE_MODE = DenoiseMode::Yuv;
+const bool DENOISE_CHROMA = false; // Yuv mode: also filter U and V (lightly), otherwise luma only
+const bool FAST_BILATERAL = true;  // Yuv mode: separable bilateral filter, ~3x faster than OpenCV's at the same SSIM
+const BilateralParams LUMA_BILATERAL = {8, 10, 2};   // What Bgr mode applies to all three channels
+const BilateralParams CHROMA_BILATERAL = {4, 10, 1}; // Half the neighbourhood on the subsampled planes
+
+// Latency timestamps (frame_timing.hpp): the capture time the camera stamps
+// into the picture is read after decoding, and every encoded frame goes out
+// with an SEI message of when it was captured, received, decoded, filtered
+// and encoded, about 70 bytes per frame
+const bool TIMING_SEI = true;
+
+// Live metrics (metrics.hpp): a latency histogram per stage and the pipeline
+// counters, as Prometheus text on http://METRICS_ADDRESS:METRICS_PORT/metrics
+// (port 0 turns it off). The stats line prints the same every STATS_INTERVAL.
+const char* const METRICS_ADDRESS = "127.0.0.1";
+const int METRICS_PORT = 9102;
+const int STATS_INTERVAL = 5; // Seconds
+
+// Counters only go up; the stats line prints how much they grew. Atomic, as
+// the metrics thread reads them.
+struct PipelineStats {
+    std::atomic<unsigned long long> bytes_received{0};
+    std::atomic<unsigned long long> decoder_errors{0};
+    std::atomic<unsigned long long> buffer_trims{0};     // Times the H.264 buffer outgrew 1MB
+    std::atomic<unsigned long long> datagrams_retransmitted{0};
+    std::atomic<unsigned long long> keyframes_forced{0};
+
+    // Time in each stage, per frame (per datagram for queue)
+    LatencyHistogram queue;     // Kernel arrival to the datagram joining the H.264 buffer
+    LatencyHistogram decode;
+    LatencyHistogram to_bgr;    // Bgr mode
+    LatencyHistogram denoise;
+    LatencyHistogram to_yuv;    // Bgr mode
+    LatencyHistogram encode;
+    LatencyHistogram send;      // Packetizing a frame and sending it to every viewer
+    LatencyHistogram relay;     // Received to encoded, the whole relay
+    LatencyHistogram camera;    // Capture (stamped by the camera) to received
+};
+
+PipelineStats stats;
+
+// The stages as the metrics endpoint and the stats line name them
+struct StageMetric {
+    const char* name;
+    const LatencyHistogram* histogram;
+};
+const StageMetric STAGE_METRICS[] = {
+    {"queue", &stats.queue}, {"decode", &stats.decode}, {"to_bgr", &stats.to_bgr},
+    {"denoise", &stats.denoise}, {"to_yuv", &stats.to_yuv}, {"encode", &stats.encode},
+    {"send", &stats.send}, {"relay", &stats.relay}, {"camera", &stats.camera},
+};
+const int STAGE_COUNT = sizeof(STAGE_METRICS) / sizeof(STAGE_METRICS[0]);
 
 // Extend FFmpegContext struct
 struct FFmpegContext {
@@ -39,7 +142,9 @@ struct FFmpegContext {
     AVCodecContext* context;
     AVFrame* frame_yuv;
     AVFrame* frame_bgr;
-    SwsContext* sws_ctx;
+    AVFrame* frame_scratch;   // Yuv mode: decoded frame converted to the encoder layout
+    SwsContext* sws_ctx;      // Decoded frame -> BGR24 (Bgr) or encoder layout (Yuv)
+    FastBilateral bilateral;  // Yuv mode: tables and scratch of the separable bilateral filter
 
     // Encoding-specific fields
     const AVCodec* encoder_codec;
@@ -52,6 +157,15 @@ FFmpegContext m_ffmpeg;
 
 std::vector<uint8_t> h264_buffer; // Buffer to accumulate H.264 data
 
+// The capture time the camera stamped into a decoded frame (0 without one)
+uint64_t capturedAt(const AVFrame* frame) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+        return 0;
+    }
+    return readCaptureTime(frame->data[0], frame->linesize[0], frame->width, frame->height, wallClockMicros());
+}
+
 bool isCompleteNalUnit(const std::vector<uint8_t>& buffer) {
     // Check if the buffer has at least one NAL unit
     // Look for start code pattern: 0x00 0x00 0x01 or 0x00 0x00 0x00 0x01
@@ -94,8 +208,183 @@ size_t findNalStartCode(const std::vector<uint8_t>& buffer, size_t start_pos = 0
     return buffer.size(); // Not found
 }
 
-// Driver code 
-int main() { 
+// Bilateral filter of one plane, with the separable engine or OpenCV's
+void filterPlane(FFmpegContext& ffmpeg, const BilateralParams& params, const cv::Mat& src, cv::Mat& dst) {
+    if (FAST_BILATERAL) {
+        ffmpeg.bilateral.filter(params, src.data, src.step, dst.data, dst.step, src.cols, src.rows);
+    } else {
+        cv::bilateralFilter(src, dst, params.diameter, params.sigma_color, params.sigma_space);
+    }
+}
+
+// Bgr mode: YUV -> BGR, denoise, BGR -> YUV into the encoder frame
+void denoiseBgr(FFmpegContext& ffmpeg) {
+    // Successfully decoded a frame
+    if (!ffmpeg.sws_ctx) {
+        ffmpeg.sws_ctx = sws_getContext(
+            ffmpeg.context->width, ffmpeg.context->height, ffmpeg.context->pix_fmt,
+            ffmpeg.context->width, ffmpeg.context->height, AV_PIX_FMT_BGR24,
+            SWS_BILINEAR, nullptr, nullptr, nullptr);
+    }
+
+    // Properly initialize frame_bgr if not already done
+    if (!ffmpeg.frame_bgr->width || !ffmpeg.frame_bgr->height) {
+        ffmpeg.frame_bgr->format = AV_PIX_FMT_BGR24;
+        ffmpeg.frame_bgr->width = ffmpeg.context->width;
+        ffmpeg.frame_bgr->height = ffmpeg.context->height;
+
+        // Allocate proper buffers for the frame
+        if (av_frame_get_buffer(ffmpeg.frame_bgr, 32) < 0) {
+            std::cerr << "Could not allocate BGR frame buffers" << std::endl;
+            // Handle error
+        }
+    }
+
+    // Make frame data writable
+    if (av_frame_make_writable(ffmpeg.frame_bgr) < 0) {
+        std::cerr << "Could not make BGR frame writable" << std::endl;
+        // Handle error
+    }
+
+    // Now do the conversion
+    StageTimer to_bgr_timer(stats.to_bgr);
+    sws_scale(
+        ffmpeg.sws_ctx,
+        ffmpeg.frame_yuv->data, ffmpeg.frame_yuv->linesize,
+        0, ffmpeg.context->height,
+        ffmpeg.frame_bgr->data, ffmpeg.frame_bgr->linesize
+    );
+    to_bgr_timer.stop();
+
+    // Create OpenCV Mat that references the FFmpeg frame data
+    cv::Mat frame(ffmpeg.context->height, 
+                 ffmpeg.context->width, 
+                 CV_8UC3, 
+                 ffmpeg.frame_bgr->data[0], 
+                 ffmpeg.frame_bgr->linesize[0]);
+
+    // Create destination Mat for filtered result
+    cv::Mat dst;
+    // Apply OpenCV denoisiing 
+    StageTimer denoise_timer(stats.denoise);
+    cv::bilateralFilter(frame, dst, 8, 10, 2);
+    denoise_timer.stop();
+
+
+    // Convert the frame to a GpuMat
+    //cv::cuda::GpuMat gpu_frame, gpu_dst;
+    //gpu_frame.upload(frame);
+
+    // Apply CUDA-based denoising
+    //cv::cuda::fastNlMeansDenoisingColored(gpu_frame, gpu_dst, 2, 3, 7, 3);
+
+    // Download the result back to a standard Mat
+    //gpu_dst.download(dst); 
+
+    // Copy the filtered data back to the FFmpeg frame
+    memcpy(ffmpeg.frame_bgr->data[0], dst.data, dst.step * dst.rows);
+
+    // Create a separate sws context for BGR to YUV conversion
+    SwsContext* sws_ctx_encoder = sws_getContext(
+        ffmpeg.encoder_context->width, ffmpeg.encoder_context->height, AV_PIX_FMT_BGR24,
+        ffmpeg.encoder_context->width, ffmpeg.encoder_context->height, ffmpeg.encoder_context->pix_fmt,
+        SWS_BILINEAR, nullptr, nullptr, nullptr
+    );
+
+    if (!sws_ctx_encoder) {
+        std::cerr << "Could not initialize sws context for encoder" << std::endl;
+        exit(1);
+    }
+
+    // Convert BGR to YUV for encoding
+    StageTimer to_yuv_timer(stats.to_yuv);
+    sws_scale(
+        sws_ctx_encoder,
+        ffmpeg.frame_bgr->data, ffmpeg.frame_bgr->linesize,
+        0, ffmpeg.encoder_context->height,
+        ffmpeg.frame_encoder->data, ffmpeg.frame_encoder->linesize
+    );
+    to_yuv_timer.stop();
+
+    // Free the temporary sws context
+    sws_freeContext(sws_ctx_encoder);
+}
+
+// Yuv mode: filter the decoded YUV420P planes straight into the encoder
+// frame, the way the camera stage filters its Y plane. Saves both colour
+// conversions, and luma-only saves the filter two thirds of the samples it
+// would see in BGR.
+void denoiseYuv(FFmpegContext& ffmpeg) {
+    AVFrame* out = ffmpeg.frame_encoder;
+    const AVFrame* src = ffmpeg.frame_yuv;
+
+    // The decoded planes are used as they are when the decoder already
+    // produces the encoder's layout, which is the normal case
+    if (src->format != out->format || src->width != out->width || src->height != out->height) {
+        ffmpeg.sws_ctx = sws_getCachedContext(
+            ffmpeg.sws_ctx,
+            src->width, src->height, (AVPixelFormat)src->format,
+            out->width, out->height, (AVPixelFormat)out->format,
+            SWS_BILINEAR, nullptr, nullptr, nullptr);
+
+        if (!ffmpeg.frame_scratch->width || !ffmpeg.frame_scratch->height) {
+            ffmpeg.frame_scratch->format = out->format;
+            ffmpeg.frame_scratch->width = out->width;
+            ffmpeg.frame_scratch->height = out->height;
+            if (av_frame_get_buffer(ffmpeg.frame_scratch, 32) < 0) {
+                std::cerr << "Could not allocate scratch frame buffers" << std::endl;
+                exit(1);
+            }
+        }
+
+        sws_scale(
+            ffmpeg.sws_ctx,
+            src->data, src->linesize,
+            0, src->height,
+            ffmpeg.frame_scratch->data, ffmpeg.frame_scratch->linesize
+        );
+        src = ffmpeg.frame_scratch;
+    }
+
+    // The decoder keeps its frames as references, so never filter in place:
+    // read from the decoded planes and write into the encoder's
+    StageTimer denoise_timer(stats.denoise);
+    for (int plane = 0; plane < 3; plane++) {
+        int width = plane == 0 ? out->width : (out->width + 1) / 2;
+        int height = plane == 0 ? out->height : (out->height + 1) / 2;
+        cv::Mat src_plane(height, width, CV_8UC1, src->data[plane], src->linesize[plane]);
+        cv::Mat dst_plane(height, width, CV_8UC1, out->data[plane], out->linesize[plane]);
+
+        if (plane == 0) {
+            filterPlane(ffmpeg, LUMA_BILATERAL, src_plane, dst_plane);
+        } else if (DENOISE_CHROMA) {
+            // Chroma is subsampled 2x, so the neighbourhood is halved as well
+            filterPlane(ffmpeg, CHROMA_BILATERAL, src_plane, dst_plane);
+        } else {
+            src_plane.copyTo(dst_plane);
+        }
+    }
+}
+
+// Everything the metrics endpoint shows
+void registerMetrics(MetricsRegistry& registry) {
+    registry.addCounter("received_bytes", "Bytes received from the camera", &stats.bytes_received);
+    registry.addCounter("decoder_errors", "Packets the decoder rejected", &stats.decoder_errors);
+    registry.addCounter("buffer_trims", "Times the H.264 buffer was trimmed", &stats.buffer_trims);
+    registry.addCounter("retransmitted_datagrams", "Datagrams sent again for viewer NACKs",
+                        &stats.datagrams_retransmitted);
+    registry.addCounter("forced_keyframes", "Keyframes forced for viewers", &stats.keyframes_forced);
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        registry.addStage(STAGE_METRICS[i].name, STAGE_METRICS[i].histogram);
+    }
+}
+
+// Driver code. An address given on the command line replaces SERVER_IP,
+// e.g. 127.0.0.1 to take a stream replayed on this same Mac (the replay
+// tool in Cloud/Test/Replay test only needs POSIX sockets).
+int main(int argc, char** argv) { 
+    const char* server_ip = argc > 1 ? argv[1] : SERVER_IP;
+
     // Initialize libav used to decode H.264
     avformat_network_init();
     m_ffmpeg.codec = avcodec_find_decoder_by_name("h264_cuvid"); // or other HW decoders
@@ -142,6 +431,12 @@ int main() {
         exit(1);
     }
 
+    m_ffmpeg.frame_scratch = av_frame_alloc();
+    if (!m_ffmpeg.frame_scratch) {
+        fprintf(stderr, "Could not allocate scratch frame\n");
+        exit(1);
+    }
+
     // Initialize encoder
     m_ffmpeg.encoder_codec = avcodec_find_encoder_by_name("h264_videotoolbox");
     if (!m_ffmpeg.encoder_codec) {
@@ -158,12 +453,14 @@ int main() {
 
 
     // Set encoder parameters
-    m_ffmpeg.encoder_context->bit_rate = 1000000; // Adjust bitrate as needed
+    m_ffmpeg.encoder_context->bit_rate = MAX_BITRATE; // Lowered while viewers report congestion
+    m_ffmpeg.encoder_context->rc_max_rate = MAX_BITRATE;
+    m_ffmpeg.encoder_context->rc_buffer_size = (int)(MAX_BITRATE * VBV_SECONDS);
     m_ffmpeg.encoder_context->width = 1280;       // Set valid width
     m_ffmpeg.encoder_context->height = 720;      // Set valid height
     m_ffmpeg.encoder_context->time_base = {1, 60}; // 60 fps
     m_ffmpeg.encoder_context->framerate = {60, 1};
-    m_ffmpeg.encoder_context->gop_size = 60;      // Group of pictures size
+    m_ffmpeg.encoder_context->gop_size = 600;     // Group of pictures size, clients ask for keyframes when they need one
     m_ffmpeg.encoder_context->max_b_frames = 0;   // Disable B-frames for low latency
     m_ffmpeg.encoder_context->pix_fmt = AV_PIX_FMT_YUV420P; // Use YUV420P pixel format
     m_ffmpeg.encoder_context->refs = 2;          // Fewer reference frames = faster
@@ -224,7 +521,7 @@ int main() {
     
     // Filling server information for client
     client_bind_addr.sin_family = AF_INET; // IPv4 
-    client_bind_addr.sin_addr.s_addr =  inet_addr(SERVER_IP); 
+    client_bind_addr.sin_addr.s_addr =  inet_addr(server_ip); 
     client_bind_addr.sin_port = htons(CLIENT_PORT); 
     
     // Bind the socket with the server address 
@@ -253,7 +550,7 @@ int main() {
     
     // Filling server information for client
     camera_addr.sin_family = AF_INET; // IPv4 
-    camera_addr.sin_addr.s_addr =  inet_addr(SERVER_IP); 
+    camera_addr.sin_addr.s_addr =  inet_addr(server_ip); 
     camera_addr.sin_port = htons(CAMERA_PORT); 
 
     // After creating camera_sock, add:
@@ -275,6 +572,9 @@ int main() {
         perror("setsockopt(SO_SNDBUF) failed");
     }
 
+    // Stamp camera datagrams on arrival, so queueing delay can be measured
+    DatagramBatch::enableTimestamps(camera_sock);
+
     // Bind the socket with the server address
     if (bind(camera_sock, (const struct sockaddr *)&camera_addr,
             sizeof(camera_addr)) < 0)
@@ -283,66 +583,199 @@ int main() {
         exit(EXIT_FAILURE);
     }
     //##################################################################################
-    std::cout<<"Server: Listening for client registration on "<< SERVER_IP << ":" << CLIENT_PORT << " & " << CAMERA_PORT <<std::endl; 
+    std::cout<<"Server: Listening for client registration on "<< server_ip << ":" << CLIENT_PORT << " & " << CAMERA_PORT <<std::endl; 
     
-    // Add this above your main loop:
-    struct sockaddr_in registered_client_addr;
-    socklen_t registered_client_len = 0;
-    bool client_registered = false;
+    // Everyone watching, and a copy of the table for sending
+    ClientRegistry registry(MAX_VIEWERS, VIEWER_TIMEOUT_US);
+    std::vector<Viewer> viewers;
+    uint64_t viewers_version = 0;
+    uint64_t last_expiry_us = steadyMicros();
+
+    // Per viewer slot: which viewer it was, datagrams sent to it and the rate
+    // its reports allow
+    std::vector<uint32_t> sessions(MAX_VIEWERS, 0);
+    std::vector<uint32_t> sent(MAX_VIEWERS, 0);
+    std::vector<RateController> rates(MAX_VIEWERS, RateController(MIN_BITRATE, MAX_BITRATE, BITRATE_STEP,
+                                                                   JITTER_LIMIT_US, SPREAD_LIMIT_US));
+
+    // Frames sent to the viewers and the buffer their datagrams are built in
+    FramePacketizer packetizer;
+    SendHistory history(HISTORY_FRAMES, MAX_VIEWERS);
+    std::vector<struct iovec> resend;
+    uint32_t frame_id = 0;
+    bool keyframe_requested = false;
+
+    // Timing of the frames inside the encoder, by pts, and the encoded frame
+    // with the timing SEI in front
+    std::deque<std::pair<int64_t, FrameTiming>> timings;
+    std::vector<uint8_t> timed_frame;
+    uint64_t last_forced_keyframe_us = 0;
+
+    // One wait for both sockets, and the buffers camera datagrams land in
+    Reactor reactor;
+    reactor.add(client_sock);
+    reactor.add(camera_sock);
+    DatagramBatch camera_batch(RECEIVE_BATCH, 65536);
+
+    // Stage histograms and counters for Prometheus, next to the stats line
+    MetricsRegistry metrics_registry("relay");
+    registerMetrics(metrics_registry);
+    std::unique_ptr<MetricsServer> metrics;
+    if (METRICS_PORT > 0) {
+        metrics.reset(new MetricsServer(metrics_registry, METRICS_ADDRESS, METRICS_PORT));
+    }
+    time_t last_stats = time(nullptr);
+    unsigned long long last_bytes = 0;
+    HistogramWindow stage_windows[STAGE_COUNT];
 
     while (true) {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(client_sock, &readfds);
-        FD_SET(camera_sock, &readfds);
+        // Forget viewers that went quiet
+        if (steadyMicros() - last_expiry_us >= 1000000) {
+            last_expiry_us = steadyMicros();
+            size_t expired = registry.expire(last_expiry_us);
+            if (expired > 0) {
+                std::cout << "Server: " << expired << " viewer(s) timed out, "
+                          << registry.active() << " left" << std::endl;
+            }
+        }
 
-        int maxfd = std::max(client_sock, camera_sock);
+        // The counters and the stages over the last interval
+        time_t now = time(nullptr);
+        if (now - last_stats >= STATS_INTERVAL) {
+            unsigned long long bytes = stats.bytes_received.load();
+            std::cout << "Server: " << registry.active() << " viewers, "
+                      << (bytes - last_bytes) / 1024 / (now - last_stats) << " KB/s from camera, retransmitted "
+                      << stats.datagrams_retransmitted.load() << " datagrams, forced "
+                      << stats.keyframes_forced.load() << " keyframes, " << stats.decoder_errors.load()
+                      << " decoder errors, " << stats.buffer_trims.load() << " buffer trims" << std::endl;
+            last_bytes = bytes;
+
+            // p50/p99/max of every stage that saw frames since the last time
+            std::cout << "Server: Stages p50/p99/max us:";
+            for (int i = 0; i < STAGE_COUNT; i++) {
+                WindowSummary window = stage_windows[i].take(*STAGE_METRICS[i].histogram);
+                if (window.count > 0) {
+                    std::cout << " " << STAGE_METRICS[i].name << " " << window.p50_us << "/" << window.p99_us
+                              << "/" << window.max_us;
+                }
+            }
+            std::cout << std::endl;
+            last_stats = now;
+        }
 
-        int activity = select(maxfd + 1, &readfds, NULL, NULL, NULL); // Block forever
+        // Wake up at least once a second, so quiet viewers still expire
+        int activity = reactor.wait(1000);
 
         if (activity > 0) {
-            if (FD_ISSET(client_sock, &readfds)) {
+            if (reactor.ready(client_sock)) {
                 // Handle client_sock activity
-                char buffer[1024];
+                char buffer[MAX_NACK_SIZE + 1];
                 struct sockaddr_in from_addr;
                 socklen_t from_len = sizeof(from_addr);
 
-                ssize_t n = recvfrom(client_sock, buffer, sizeof(buffer), 0,
+                ssize_t n = recvfrom(client_sock, buffer, sizeof(buffer) - 1, 0,
                                      (struct sockaddr *)&from_addr, &from_len);
 
-                if (n > 0) {
+                if (n > 0 && isControlMessage((uint8_t*)buffer, n)) {
+                    // Any control message keeps its viewer alive, and brings back
+                    // one we had forgotten about (e.g. after a restart)
+                    bool joined = false;
+                    int viewer = registry.touch(from_addr, from_len, steadyMicros(), &joined);
+                    if (viewer != ClientRegistry::NONE && (joined || buffer[1] == CONTROL_PLI)) {
+                        keyframe_requested = true; // A viewer can only start decoding at an IDR
+                    }
+                    if (viewer != ClientRegistry::NONE && buffer[1] == CONTROL_NACK) {
+                        // Send the fragments the viewer is missing again, straight from the history
+                        NackEntry entries[MAX_NACK_ENTRIES];
+                        size_t count = readNack((uint8_t*)buffer, n, entries, MAX_NACK_ENTRIES);
+                        resend.clear();
+                        for (size_t i = 0; i < count; i++) {
+                            history.lookup(entries[i], viewer, steadyMicros(), RETRANSMIT_DEADLINE_US, resend);
+                        }
+                        for (const struct iovec& datagram : resend) {
+                            if (sendto(client_sock, datagram.iov_base, datagram.iov_len, 0,
+                                       (struct sockaddr *)&from_addr, from_len) >= 0) {
+                                sent[viewer]++;
+                                stats.datagrams_retransmitted++;
+                            }
+                        }
+                    }
+                    ReceiverReport report;
+                    if (viewer != ClientRegistry::NONE && readReport((uint8_t*)buffer, n, report)) {
+                        // A different viewer in the slot starts from the top
+                        registry.snapshot(viewers, viewers_version);
+                        if (sessions[viewer] != viewers[viewer].session) {
+                            sessions[viewer] = viewers[viewer].session;
+                            rates[viewer].reset();
+                        }
+                        if (rates[viewer].onReport(report, sent[viewer])) {
+                            std::cout << "Server: Viewer " << viewer << " lost " << (int)(rates[viewer].loss() * 100)
+                                      << "%, jitter " << report.jitter_us / 1000 << " ms, decode "
+                                      << report.decode_us / 1000 << " ms: " << rates[viewer].rate() / 1000
+                                      << " kbps" << std::endl;
+                        }
+
+                        // The encoder serves the slowest viewer. Encoders that can
+                        // change rate mid-stream (libx264 can) pick it up with the
+                        // next frame; others stay at the rate they were opened with.
+                        int64_t target = MAX_BITRATE;
+                        for (size_t i = 0; i < viewers.size(); i++) {
+                            if (viewers[i].active) {
+                                target = std::min(target, rates[i].rate());
+                            }
+                        }
+                        int64_t current = m_ffmpeg.encoder_context->bit_rate;
+                        if (std::abs(target - current) > current * RATE_CHANGE_THRESHOLD) {
+                            m_ffmpeg.encoder_context->bit_rate = target;
+                            m_ffmpeg.encoder_context->rc_max_rate = target;
+                            m_ffmpeg.encoder_context->rc_buffer_size = (int)(target * VBV_SECONDS);
+                            std::cout << "Server: Now encoding at " << target / 1000 << " kbps" << std::endl;
+                        }
+                    }
+                } else if (n > 0) {
                     buffer[n] = '\0'; // Null-terminate if you expect string data
                     std::cout << "Server: Received client message from "
                               << inet_ntoa(from_addr.sin_addr) << ":" << ntohs(from_addr.sin_port)
                               << " : " << buffer << std::endl;
 
-                     // Store the client address for forwarding video
-                    registered_client_addr = from_addr;
-                    registered_client_len = from_len;
-                    client_registered = true;
-
-                    // After printing the client message
-                    const char* confirmation = "Registration successful";
-                    sendto(client_sock, confirmation, strlen(confirmation), 0, (struct sockaddr *)&from_addr, from_len);
+                    // Add the client to the viewers the video is forwarded to
+                    if (registry.touch(from_addr, from_len, steadyMicros()) == ClientRegistry::NONE) {
+                        std::cerr << "Server: Already serving " << registry.capacity()
+                                  << " viewers, registration refused" << std::endl;
+                        const char* refusal = "Registration refused: server full";
+                        sendto(client_sock, refusal, strlen(refusal), 0, (struct sockaddr *)&from_addr, from_len);
+                    } else {
+                        keyframe_requested = true; // A new viewer can only start decoding at an IDR
+
+                        // After printing the client message
+                        const char* confirmation = "Registration successful";
+                        sendto(client_sock, confirmation, strlen(confirmation), 0, (struct sockaddr *)&from_addr, from_len);
+                    }
                 }
                 
             }
-            if (FD_ISSET(camera_sock, &readfds)) {
-                static unsigned long long total_bytes = 0;
+            if (reactor.ready(camera_sock)) {
                 static int packets = 0;
-                static time_t last_stats = time(nullptr);
                 
-                char buffer[65536];
-                struct sockaddr_in from_addr; 
-                socklen_t from_len = sizeof(from_addr);
-                
-                int data = recvfrom(camera_sock, buffer, sizeof(buffer), 0, 
-                                    (struct sockaddr *)&from_addr, &from_len);
+                // Everything that is waiting, up to a batch
+                int received = camera_batch.receive(camera_sock);
+                uint64_t received_us = received > 0 ? steadyToWallMicros(camera_batch.arrivalMicros(received - 1)) : 0;
+                int data = 0;
+                for (int i = 0; i < received; i++) {
+                    data += camera_batch.size(i);
+                }
+                stats.bytes_received += data;
                                     
-                if (data > 0 && client_registered) {
+                if (data > 0 && registry.active() > 0) {
                     //std::cout << "Server: Received " << data << " bytes from camera" << std::endl;
                     // Extend our H.264 buffer with new data
-                    h264_buffer.insert(h264_buffer.end(), buffer, buffer + data);
+                    uint64_t now_us = steadyMicros();
+                    for (int i = 0; i < received; i++) {
+                        uint64_t arrival_us = camera_batch.arrivalMicros(i);
+                        stats.queue.record(now_us > arrival_us ? now_us - arrival_us : 0);
+                        h264_buffer.insert(h264_buffer.end(), camera_batch.data(i),
+                                           camera_batch.data(i) + camera_batch.size(i));
+                    }
 
 
                     while (isCompleteNalUnit(h264_buffer)) {
@@ -377,6 +810,7 @@ int main() {
                             packet->dts = AV_NOPTS_VALUE;
 
                             // Send the packet to the decoder
+                            uint64_t decode_start_us = steadyMicros();
                             int send_result = avcodec_send_packet(m_ffmpeg.context, packet);
                             //char time_str3[50];
                             if (send_result == 0) {
@@ -384,109 +818,59 @@ int main() {
                                 int receive_result = avcodec_receive_frame(m_ffmpeg.context, m_ffmpeg.frame_yuv);
                                 
                                 if (receive_result == 0) {
-                                    
-									// Successfully decoded a frame
-                                    if (!m_ffmpeg.sws_ctx) {
-                                        m_ffmpeg.sws_ctx = sws_getContext(
-                                            m_ffmpeg.context->width, m_ffmpeg.context->height, m_ffmpeg.context->pix_fmt,
-                                            m_ffmpeg.context->width, m_ffmpeg.context->height, AV_PIX_FMT_BGR24,
-                                            SWS_BILINEAR, nullptr, nullptr, nullptr);
+                                    stats.decode.record(steadyMicros() - decode_start_us);
+                                    FrameTiming timing = {};
+                                    if (TIMING_SEI) {
+                                        timing.capture_us = capturedAt(m_ffmpeg.frame_yuv);
+                                        timing.received_us = received_us;
+                                        timing.decoded_us = wallClockMicros();
                                     }
-
-                                    // Properly initialize frame_bgr if not already done
-                                    if (!m_ffmpeg.frame_bgr->width || !m_ffmpeg.frame_bgr->height) {
-                                        m_ffmpeg.frame_bgr->format = AV_PIX_FMT_BGR24;
-                                        m_ffmpeg.frame_bgr->width = m_ffmpeg.context->width;
-                                        m_ffmpeg.frame_bgr->height = m_ffmpeg.context->height;
-                                        
-                                        // Allocate proper buffers for the frame
-                                        if (av_frame_get_buffer(m_ffmpeg.frame_bgr, 32) < 0) {
-                                            std::cerr << "Could not allocate BGR frame buffers" << std::endl;
-                                            // Handle error
-                                        }
-                                    }
-
-                                    // Make frame data writable
-                                    if (av_frame_make_writable(m_ffmpeg.frame_bgr) < 0) {
-                                        std::cerr << "Could not make BGR frame writable" << std::endl;
-                                        // Handle error
-                                    }
-
-                                    // Now do the conversion
-                                    sws_scale(
-                                        m_ffmpeg.sws_ctx,
-                                        m_ffmpeg.frame_yuv->data, m_ffmpeg.frame_yuv->linesize,
-                                        0, m_ffmpeg.context->height,
-                                        m_ffmpeg.frame_bgr->data, m_ffmpeg.frame_bgr->linesize
-                                    );
-
-                                    // Create OpenCV Mat that references the FFmpeg frame data
-                                    cv::Mat frame(m_ffmpeg.context->height, 
-                                                 m_ffmpeg.context->width, 
-                                                 CV_8UC3, 
-                                                 m_ffmpeg.frame_bgr->data[0], 
-                                                 m_ffmpeg.frame_bgr->linesize[0]);
-
-                                    // Create destination Mat for filtered result
-                                    cv::Mat dst;
-                                    // Apply OpenCV denoisiing 
-                                    cv::bilateralFilter(frame, dst, 8, 10, 2);
-
-
-                                    // Convert the frame to a GpuMat
-                                    //cv::cuda::GpuMat gpu_frame, gpu_dst;
-                                    //gpu_frame.upload(frame);
-
-                                    // Apply CUDA-based denoising
-                                    //cv::cuda::fastNlMeansDenoisingColored(gpu_frame, gpu_dst, 2, 3, 7, 3);
-
-                                    // Download the result back to a standard Mat
-                                    //gpu_dst.download(dst); 
-
-                                    // Copy the filtered data back to the FFmpeg frame
-                                    memcpy(m_ffmpeg.frame_bgr->data[0], dst.data, dst.step * dst.rows);
-
-                                    // Create a separate sws context for BGR to YUV conversion
-                                    SwsContext* sws_ctx_encoder = sws_getContext(
-                                        m_ffmpeg.encoder_context->width, m_ffmpeg.encoder_context->height, AV_PIX_FMT_BGR24,
-                                        m_ffmpeg.encoder_context->width, m_ffmpeg.encoder_context->height, m_ffmpeg.encoder_context->pix_fmt,
-                                        SWS_BILINEAR, nullptr, nullptr, nullptr
-                                    );
-
-                                    if (!sws_ctx_encoder) {
-                                        std::cerr << "Could not initialize sws context for encoder" << std::endl;
-                                        exit(1);
-                                    }
-
+                                    
                                     // Make encoder frame writable
                                     if (av_frame_make_writable(m_ffmpeg.frame_encoder) < 0) {
                                         std::cerr << "Could not make encoder frame writable" << std::endl;
                                         // Handle error
                                     }
 
-                                    // Convert BGR to YUV for encoding
-                                    sws_scale(
-                                        sws_ctx_encoder,
-                                        m_ffmpeg.frame_bgr->data, m_ffmpeg.frame_bgr->linesize,
-                                        0, m_ffmpeg.encoder_context->height,
-                                        m_ffmpeg.frame_encoder->data, m_ffmpeg.frame_encoder->linesize
-                                    );
-
-                                    // Free the temporary sws context
-                                    sws_freeContext(sws_ctx_encoder);
+                                    // Denoise into the encoder frame
+                                    if (DENOISE_MODE == DenoiseMode::Yuv) {
+                                        denoiseYuv(m_ffmpeg);
+                                    } else {
+                                        denoiseBgr(m_ffmpeg);
+                                    }
 
                                     // Set frame PTS (presentation timestamp)
                                     m_ffmpeg.frame_encoder->pts = av_rescale_q(packets, m_ffmpeg.encoder_context->time_base, m_ffmpeg.encoder_context->time_base);
                                     packets++;
+                                    if (TIMING_SEI) {
+                                        timing.filtered_us = wallClockMicros();
+                                        timings.emplace_back(m_ffmpeg.frame_encoder->pts, timing);
+                                    }
 
-                                    // Send the frame to the encoder
+                                    // Serve a keyframe request, unless the last forced one was too recent;
+                                    // the request then stays pending until it is allowed
+                                    uint64_t now_us = steadyMicros();
+                                    if (keyframe_requested && now_us - last_forced_keyframe_us >= MIN_KEYFRAME_INTERVAL_US) {
+                                        keyframe_requested = false;
+                                        last_forced_keyframe_us = now_us;
+                                        m_ffmpeg.frame_encoder->pict_type = AV_PICTURE_TYPE_I;
+                                        stats.keyframes_forced++;
+                                    }
+
+                                    // Send the frame to the encoder. Its time counts together with
+                                    // the receive calls, not the sending of the packets.
+                                    uint64_t encode_start_us = steadyMicros();
                                     int ret = avcodec_send_frame(m_ffmpeg.encoder_context, m_ffmpeg.frame_encoder);
+                                    uint64_t encode_us = steadyMicros() - encode_start_us;
+                                    m_ffmpeg.frame_encoder->pict_type = AV_PICTURE_TYPE_NONE; // The frame is reused
                                     if (ret < 0) {
                                         std::cerr << "Error sending frame for encoding" << std::endl;
                                     } else {
                                         // Get the encoded packets
                                         while (ret >= 0) {
+                                            uint64_t receive_start_us = steadyMicros();
                                             ret = avcodec_receive_packet(m_ffmpeg.encoder_context, m_ffmpeg.packet_encoder);
+                                            encode_us += steadyMicros() - receive_start_us;
                                             if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
                                                 // Need more input or end of stream
                                                 break;
@@ -495,45 +879,74 @@ int main() {
                                                 break;
                                             }
 
-                                            // Successfully got an encoded packet, send it to the client
-                                            if (client_registered) {
-                                                // Send the encoded packet to the registered client
-                                                size_t packet_size = m_ffmpeg.packet_encoder->size;
-                                                
-                                                // Split into smaller packets if needed (to avoid UDP fragmentation)
-                                                
-                                                // Send header with information about the packet
-                                                uint8_t header[8];
-                                                // First 4 bytes: total size of encoded frame
-                                                header[0] = (packet_size >> 24) & 0xFF;
-                                                header[1] = (packet_size >> 16) & 0xFF;
-                                                header[2] = (packet_size >> 8) & 0xFF;
-                                                header[3] = packet_size & 0xFF;
-                                                // Next 4 bytes: packet timestamp
-                                                uint32_t timestamp = packets; // Use packet counter as timestamp
-                                                header[4] = (timestamp >> 24) & 0xFF;
-                                                header[5] = (timestamp >> 16) & 0xFF;
-                                                header[6] = (timestamp >> 8) & 0xFF;
-                                                header[7] = timestamp & 0xFF;
-                                                
-                                                // Send header
-                                                sendto(client_sock, header, sizeof(header), 0, 
-                                                       (struct sockaddr *)&registered_client_addr, registered_client_len);
-                                                
-                                                // Send data in chunks
-                                                for (size_t offset = 0; offset < packet_size; offset += MAX_PACKET_SIZE) {
-                                                    size_t chunk_size = std::min(MAX_PACKET_SIZE, packet_size - offset);
-                                                    sendto(client_sock, m_ffmpeg.packet_encoder->data + offset, chunk_size, 0, 
-                                                           (struct sockaddr *)&registered_client_addr, registered_client_len);
-                                                    
-                                                    // Small delay to prevent overwhelming the network or receiver
-                                                    //usleep(1000); // 1000us delay between chunks
+                                            // The frame's timing goes in front of the picture
+                                            const uint8_t* frame_data = m_ffmpeg.packet_encoder->data;
+                                            size_t frame_size = m_ffmpeg.packet_encoder->size;
+                                            if (TIMING_SEI) {
+                                                FrameTiming packet_timing = {};
+                                                while (!timings.empty() && timings.front().first <= m_ffmpeg.packet_encoder->pts) {
+                                                    if (timings.front().first == m_ffmpeg.packet_encoder->pts) {
+                                                        packet_timing = timings.front().second;
+                                                    }
+                                                    timings.pop_front();
+                                                }
+                                                packet_timing.encoded_us = wallClockMicros();
+                                                if (packet_timing.received_us && packet_timing.encoded_us >= packet_timing.received_us) {
+                                                    stats.relay.record(packet_timing.encoded_us - packet_timing.received_us);
+                                                }
+                                                // Only when the clocks agree on the order, skew would wrap around
+                                                if (packet_timing.capture_us && packet_timing.received_us >= packet_timing.capture_us) {
+                                                    stats.camera.record(packet_timing.received_us - packet_timing.capture_us);
+                                                }
+                                                timed_frame.resize(TIMING_SEI_MAX_SIZE + frame_size);
+                                                size_t sei_size = writeTimingSei(packet_timing, timed_frame.data());
+                                                memcpy(timed_frame.data() + sei_size, frame_data, frame_size);
+                                                frame_data = timed_frame.data();
+                                                frame_size += sei_size;
+                                            }
+
+                                            // Successfully got an encoded packet, send it to every viewer
+                                            registry.snapshot(viewers, viewers_version);
+                                            if (registry.active() > 0) {
+                                                // Split into datagrams that each carry their own header, once for everyone
+                                                bool keyframe = (m_ffmpeg.packet_encoder->flags & AV_PKT_FLAG_KEY) != 0;
+                                                StageTimer send_timer(stats.send);
+                                                const std::vector<struct iovec>& datagrams = packetizer.packetize(
+                                                    frame_data, frame_size,
+                                                    frame_id, keyframe, wallClockMicros(),
+                                                    keyframe ? FEC_KEYFRAME : FEC_DELTA);
+
+                                                for (size_t v = 0; v < viewers.size(); v++) {
+                                                    const Viewer& viewer = viewers[v];
+                                                    if (!viewer.active) {
+                                                        continue;
+                                                    }
+                                                    for (const struct iovec& datagram : datagrams) {
+                                                        if (sendto(client_sock, datagram.iov_base, datagram.iov_len, 0,
+                                                                   (struct sockaddr *)&viewer.addr, viewer.len) >= 0) {
+                                                            sent[v]++;
+                                                        }
+                                                        
+                                                        // Small delay to prevent overwhelming the network or receiver
+                                                        //usleep(1000); // 1000us delay between chunks
+                                                    }
+                                                }
+                                                // Every viewer has it now, the repair deadlines start
+                                                history.store(frame_id, datagrams);
+                                                uint64_t sent_us = steadyMicros();
+                                                for (size_t v = 0; v < viewers.size(); v++) {
+                                                    if (viewers[v].active) {
+                                                        history.markSent(frame_id, v, sent_us);
+                                                    }
                                                 }
+                                                frame_id++;
+                                                send_timer.stop();
                                             }
                                             
                                             // Unref the packet for reuse
                                             av_packet_unref(m_ffmpeg.packet_encoder);
                                         }
+                                        stats.encode.record(encode_us);
                                     }
                                 } 
                                 else {
@@ -547,12 +960,15 @@ int main() {
                                         std::cout << "End of stream reached" << std::endl;
                                     } else {
                                         // Reset the decoder after serious errors
+                                        stats.decoder_errors++;
                                         avcodec_flush_buffers(m_ffmpeg.context);
                                     }
                                 }
                                 
                                 // Unref the frame to prepare for next decode
                                 av_frame_unref(m_ffmpeg.frame_yuv);
+                            } else {
+                                stats.decoder_errors++;
                             }
                             // Free the packet
                             av_packet_free(&packet);
@@ -574,6 +990,7 @@ int main() {
                             h264_buffer.erase(h264_buffer.begin(), h264_buffer.begin() + h264_buffer.size() / 2);
                         }
                         std::cout << "Buffer trimmed to " << h264_buffer.size() << " bytes" << std::endl;
+                        stats.buffer_trims++;
                     }
                 }
             }
@@ -12,10 +12,13 @@
 #include <map>
 #include <opencv2/opencv.hpp>
 #include <fstream>
-#include <sstream>
 #include <filesystem>
 #include <chrono>
 
+#include "async_log.hpp"
+#include "frame_timing.hpp"
+#include "stream_protocol.hpp"
+
 // FFmpeg includes
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -30,7 +33,17 @@ extern "C" {
 #define MAXLINE 65507 // Max UDP packet size
 #define MAX_BUFFER_SIZE 1000000 // 1MB max buffer size
 
-int frameCount = 0;
+// The server drops viewers it has not heard from in a while
+const uint64_t HEARTBEAT_INTERVAL_US = 1000000;
+
+// Keyframe requests (PLI) after a lost frame or a decoder error, repeated
+// every PLI_INTERVAL_US until a keyframe arrives. The relay's GOP is long,
+// waiting for it would skew the measurements with broken pictures.
+const uint64_t PLI_INTERVAL_US = 300000;
+
+// Per-hop latency is printed this often
+const uint64_t LATENCY_INTERVAL_US = 5000000;
+
 struct FFmpegContext {
     const AVCodec* codec;
     AVCodecContext* context;
@@ -40,14 +53,6 @@ struct FFmpegContext {
     uint8_t* bgr_buffer;  // Persistent buffer for BGR conversion
     int bgr_buffer_size;
 };
-static int frame_counter = 0;
-// Structure to hold frame reconstruction data
-struct FrameData {
-    std::vector<uint8_t> data;
-    size_t expected_size;
-    uint32_t timestamp;
-    bool complete;
-};
 
 int main() {
     // Initialize FFmpeg
@@ -178,90 +183,75 @@ int main() {
 
     std::cout << "Client: Waiting for video..." << std::endl;
 
-    // Frame reconstruction map - keeps track of partial frames by timestamp
-    std::map<uint32_t, FrameData> frame_map;
-    uint32_t current_timestamp = 0;
-    std::queue<std::vector<uint8_t>> complete_frames;
+    // Frames are rebuilt in place from fragments, in any arrival order
+    FrameReassembler reassembler;
+    ReassembledFrame reassembled;
+    uint64_t last_heartbeat_us = steadyMicros();
+    bool need_keyframe = false;
+    uint64_t last_pli_us = 0;
+    unsigned long long frames_lost = 0;
+    unsigned long long resyncs = 0;
+    LatencyStats latency; // Per hop, from the relay's timing SEI
+    uint64_t last_latency_us = steadyMicros();
 
     while (true) {
+        // Tell the server we are still watching
+        if (steadyMicros() - last_heartbeat_us >= HEARTBEAT_INTERVAL_US) {
+            uint8_t heartbeat[CONTROL_HEADER_SIZE];
+            sendto(sockfd, heartbeat, writeHeartbeat(heartbeat), 0,
+                   (const struct sockaddr*)&server_dest_addr, sizeof(server_dest_addr));
+            last_heartbeat_us = steadyMicros();
+        }
+
+        // Ask for a keyframe after a loss, a decoder error or a stream that
+        // started over, as the viewer client does
+        if (reassembler.framesLost() != frames_lost || reassembler.resyncs() != resyncs) {
+            frames_lost = reassembler.framesLost();
+            resyncs = reassembler.resyncs();
+            need_keyframe = true;
+        }
+        if (need_keyframe && steadyMicros() - last_pli_us >= PLI_INTERVAL_US) {
+            uint8_t pli[CONTROL_HEADER_SIZE];
+            sendto(sockfd, pli, writePictureLoss(pli), 0,
+                   (const struct sockaddr*)&server_dest_addr, sizeof(server_dest_addr));
+            last_pli_us = steadyMicros();
+        }
+
         // Receive video data
         data = recvfrom(sockfd, buffer, MAXLINE, 0, (struct sockaddr*)&from_addr, &from_len);
         if (data < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 std::cout << "Receive timeout - no data available" << std::endl;
-                // Process any complete frames we may have
-                if (!complete_frames.empty()) {
-                    continue;
-                }
             } else {
                 perror("recvfrom failed");
             }
             continue;
         }
 
-        // Check if this is a header packet (8 bytes with frame info)
-        if (data == 8) {
-            uint32_t total_size = 
-                ((uint8_t)buffer[0] << 24) | 
-                ((uint8_t)buffer[1] << 16) | 
-                ((uint8_t)buffer[2] << 8) | 
-                (uint8_t)buffer[3];
-                
-            uint32_t timestamp = 
-                ((uint8_t)buffer[4] << 24) | 
-                ((uint8_t)buffer[5] << 16) | 
-                ((uint8_t)buffer[6] << 8) | 
-                (uint8_t)buffer[7];
-            
-            // Initialize a new frame entry
-            frame_map[timestamp] = {
-                .data = std::vector<uint8_t>(),
-                .expected_size = total_size,
-                .timestamp = timestamp,
-                .complete = false
-            };
-            
-            frame_map[timestamp].data.reserve(total_size);
-            current_timestamp = timestamp;
-            
-            // Start frame reconstruction
-            continue;
-        }
-        
-        // If we have a current timestamp, add data to that frame
-        if (current_timestamp > 0 && frame_map.find(current_timestamp) != frame_map.end()) {
-            auto& frame = frame_map[current_timestamp];
-            
-            // Add received data to the frame buffer
-            frame.data.insert(frame.data.end(), buffer, buffer + data);
-            
-            // Check if frame is complete
-            if (frame.data.size() >= frame.expected_size) {
-                frame.complete = true;
-                
-                // Move to complete frames queue
-                complete_frames.push(frame.data);
-                
-                // Remove from map to free memory
-                frame_map.erase(current_timestamp);
-                current_timestamp = 0;
-            }
-        }
+        // Place the fragment in its frame; finished frames come out of nextFrame()
+        reassembler.push((const uint8_t*)buffer, data, steadyMicros());
         
         // Process complete frames
-        while (!complete_frames.empty()) {
-            std::vector<uint8_t>& h264_buffer = complete_frames.front();
+        while (reassembler.nextFrame(reassembled, steadyMicros())) {
+            if (reassembled.keyframe) {
+                need_keyframe = false;
+            }
 
             // Create packet for decoding
             AVPacket* packet = av_packet_alloc();
             if (!packet) {
                 std::cerr << "Failed to allocate packet" << std::endl;
-                complete_frames.pop();
                 continue;
             }
             
-            packet->data = h264_buffer.data();
-            packet->size = h264_buffer.size();
+            packet->data = (uint8_t*)reassembled.data;
+            packet->size = reassembled.size;
+
+            // When the frame went through each hop before us; the decoder
+            // skips the SEI itself
+            FrameTiming relay_timing = {};
+            findTimingSei(reassembled.data, reassembled.size, relay_timing);
+            uint64_t received_us = steadyToWallMicros(reassembled.complete_us);
 
             int send_result = avcodec_send_packet(m_ffmpeg.context, packet);
             if (send_result < 0) {
@@ -269,9 +259,9 @@ int main() {
                 // Try to recover from errors
                 if (send_result == AVERROR_INVALIDDATA) {
                     avcodec_flush_buffers(m_ffmpeg.context);
+                    need_keyframe = true;
                 }
                 av_packet_free(&packet);
-                complete_frames.pop();
                 continue;
             }
 
@@ -322,46 +312,22 @@ int main() {
                     m_ffmpeg.frame_bgr->linesize[0]
                 );
 
-                // Register Timestamp
-                int label = frame_counter++;
-                auto now = std::chrono::system_clock::now();
-                uint64_t ts_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                                    now.time_since_epoch()).count();
-                std::time_t time_tt = std::chrono::system_clock::to_time_t(now);
-                std::tm *tm_ptr = std::localtime(&time_tt);
-                char time_str[50];
-                std::strftime(time_str, sizeof(time_str), "%H:%M:%S", tm_ptr);
-
-                // Log label and timestamp
-                std::string log_path =  "log.txt";
-                std::ofstream pi_log(log_path, std::ios::app);
-                if (pi_log.is_open()) {
-                    // Log format: label time_string ts_ms sigma_before sigma_after
-                    pi_log << label << " " << ts_ms << "\n";
-                    pi_log.close();
-                } else {
-                    std::cerr << "Unable to open log.txt for writing at path: " << log_path << "\n";
+                // Log format: capture, relay received, decoded, filtered,
+                // encoded, sent, received here and shown, all in wall clock
+                // microseconds (0 where unknown). Queued here, written by the
+                // log thread; "frame latency extract.py" sums it up per hop.
+                uint64_t shown_us = wallClockMicros();
+                static const int log_file = AsyncLog::get().open("log.txt", "iiiiiiii", LogFormat::Text);
+                AsyncLog::get().write(log_file, relay_timing.capture_us, relay_timing.received_us,
+                                      relay_timing.decoded_us, relay_timing.filtered_us, relay_timing.encoded_us,
+                                      reassembled.send_time_us, received_us, shown_us);
+                latency.add(relay_timing, reassembled.send_time_us, received_us, shown_us);
+                if (steadyMicros() - last_latency_us >= LATENCY_INTERVAL_US) {
+                    std::cout << "Client: Latency ";
+                    latency.print(std::cout);
+                    std::cout << std::endl;
+                    last_latency_us = steadyMicros();
                 }
-                
-                // Overlay text
-                std::stringstream overlay_text;
-                overlay_text << "Frame " << label << " " << time_str << " " << ts_ms;
-                // Define the original position.
-                cv::putText(frame, overlay_text.str(), cv::Point(10, frame.rows - 70),
-                cv::FONT_HERSHEY_SIMPLEX, 0.8, cv::Scalar(255), 2);
-                
-            
-                std::ostringstream filename;
-                filename << "frames/frame_" << std::setfill('0') << std::setw(5) << frameCount << ".jpg";
-                // Save the frame using imwrite
-                if (!imwrite(filename.str(), frame)) {
-                    std::cerr << "Error: Could not write image to " << filename.str() << std::endl;
-                }
-
-                frameCount++;
-
-
-
 
                 // Display the frame
                 cv::imshow("Video", frame);
@@ -384,16 +350,6 @@ int main() {
             }
             
             av_packet_free(&packet);
-            complete_frames.pop();
-        }
-        
-        // Clean up old incomplete frames (after 5 seconds)
-        for (auto it = frame_map.begin(); it != frame_map.end();) {
-            if (current_timestamp - it->first > 150) { // Assuming ~30fps, 5 seconds = 150 frames
-                it = frame_map.erase(it);
-            } else {
-                ++it;
-            }
         }
     }
 
@@ -1,81 +1,61 @@
-import re
-from PIL import Image, ImageEnhance
-import pytesseract
-import glob
-import os
+import statistics
 
 # Configuration
-IMAGE_FOLDER = "."
+LOG_FILE = "log.txt"
 OUTPUT_FILE = "extracted_data.txt"
 
-def extract_data_from_image(image_path, frame_number):
+# The client logs one line per shown frame: capture, relay received, decoded,
+# filtered, encoded, sent, received at the client and shown, in wall clock
+# microseconds (0 where unknown). Each hop is the time between two of them.
+HOPS = ["camera", "decode", "filter", "encode", "send", "network", "viewer"]
+
+def read_log(log_path):
     """
-    Extracts the long number from the blue number region and the white number region.
+    Reads the timestamps of every frame in the client's log.
     """
-    try:
-        image = Image.open(image_path)
-
-        # Crop region for the blue number (top region)
-        blue_number_region = image.crop((0, 520, 640, 720))  # Adjust as needed
-        blue_number_text = pytesseract.image_to_string(blue_number_region)
-        print(f"OCR output (blue number) for {image_path}:\n{blue_number_text}")
-
-        # Regex to extract the long number (e.g., 1747820951048)
-        pattern = r"(\d{10,})"  # Matches any number with 10 or more digits
-        blue_number_matches = re.findall(pattern, blue_number_text)
-        print(f"Regex matches (blue number) for {image_path}: {blue_number_matches}")
-
-        # Get the first match for the blue number
-        blue_long_number = blue_number_matches[0] if blue_number_matches else None
-
-        # Crop region for the white number (bottom-left region)
-        white_number_region = image.crop((0, 680, 600, 720))  # Adjusted coordinates for bottom-left
-        white_number_text = pytesseract.image_to_string(white_number_region, config="--psm 7")
-        print(f"OCR output (white number) for {image_path}:\n{white_number_text}")
-
-        # Regex to extract the frame number and long number from the white number region
-        frame_pattern = r"Frame\s+(\d+)"  # Matches "Frame <number>"
-        white_number_matches = re.findall(pattern, white_number_text)
-        white_frame_matches = re.findall(frame_pattern, white_number_text)
-        print(f"Regex matches (white number) for {image_path}: {white_number_matches}")
-        print(f"Regex matches (white frame) for {image_path}: {white_frame_matches}")
-
-        # Get the first match for the white number and frame
-        white_long_number = white_number_matches[0] if white_number_matches else None
-        white_frame_number = white_frame_matches[0] if white_frame_matches else None
-
-        # Ensure both numbers are extracted
-        if blue_long_number and white_long_number and white_frame_number:
-            return frame_number, blue_long_number, int(white_frame_number), white_long_number
-        else:
-            print(f"Failed to extract data from {image_path}")
-            return None
-    except Exception as e:
-        print(f"Error processing {image_path}: {e}")
-        return None
-
-def process_images():
+    frames = []
+    with open(log_path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) == 8:
+                frames.append([int(field) for field in fields])
+    return frames
+
+def hop_latencies(timestamps):
+    """
+    Milliseconds per hop and in total (capture to shown), None where a timestamp is missing.
+    """
+    hops = []
+    for start, end in zip(timestamps[:-1], timestamps[1:]):
+        hops.append((end - start) / 1000 if start and end else None)
+    first = timestamps[0] if timestamps[0] else timestamps[1]
+    hops.append((timestamps[-1] - first) / 1000 if first else None)
+    return hops
+
+def process_log():
     """
-    Processes all images in the folder and extracts data.
+    Writes the latency of every hop per frame and prints the averages.
     """
-    image_paths = sorted(glob.glob(os.path.join(IMAGE_FOLDER, "frame_*.jpg")))
+    frames = read_log(LOG_FILE)
     results = []
-
-    frame_number = 0  # Start frame number from 0
-    for image_path in image_paths:
-        data = extract_data_from_image(image_path, frame_number)
-        if data:
-            frame_blue, blue_long_number, frame_white, white_long_number = data
-            results.append(f"{frame_blue}, {blue_long_number}, {frame_white}, {white_long_number}")
-            print(f"Extracted from {image_path}: {results[-1]}")
-        else:
-            print(f"Failed to extract data from {image_path}")
-        frame_number += 1  # Increment the frame number for each image
-
-    # Write results to the output file
+    per_hop = [[] for _ in range(len(HOPS) + 1)]
+    for frame_number, timestamps in enumerate(frames):
+        hops = hop_latencies(timestamps)
+        results.append(", ".join([str(frame_number), str(timestamps[0])] +
+                                 ["" if hop is None else f"{hop:.3f}" for hop in hops]))
+        for values, hop in zip(per_hop, hops):
+            if hop is not None:
+                values.append(hop)
+
+    # Write results to the output file: frame, capture time, then ms per hop and in total
     with open(OUTPUT_FILE, "w") as f:
         f.write("\n".join(results))
     print(f"Data written to {OUTPUT_FILE}")
 
+    for name, values in zip(HOPS + ["total"], per_hop):
+        if values:
+            print(f"{name}: mean {statistics.mean(values):.1f} ms, median {statistics.median(values):.1f} ms, "
+                  f"max {max(values):.1f} ms over {len(values)} frames")
+
 if __name__ == "__main__":
-    process_images()
\ No newline at end of file
+    process_log()
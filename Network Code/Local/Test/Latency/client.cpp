@@ -10,10 +10,12 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <opencv2/opencv.hpp>
-#include <fstream>
 #include <sstream>
 #include <filesystem>
 
+#include "async_log.hpp"
+#include "frame_timing.hpp"
+
 // FFmpeg includes
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -176,14 +178,31 @@ void flushFrameBuffer(std::vector<uint8_t>& frameBuffer, FFmpegContext &m_ffmpeg
         // ===== Noise Estimation End =====
 
         // Log label and timestamp
-        std::string log_path =  "log.txt";
-        std::ofstream pi_log(log_path, std::ios::app);
-        if (pi_log.is_open()) {
-            // Log format: label time_string ts_ms sigma_before sigma_after
-            pi_log << sigma_before << "\n";
-            pi_log.close();
-        } else {
-            std::cerr << "Unable to open log.txt for writing at path: " << log_path << "\n";
+        // Log format: sigma_before. Queued here, written by the log thread
+        static const int log_file = AsyncLog::get().open("log.txt", "f", LogFormat::Text);
+        AsyncLog::get().write(log_file, sigma_before);
+
+        // Capture to shown, from the time the camera stamped into the picture.
+        // Log format: capture_us shown_us, wall clock microseconds.
+        uint64_t shown_us = wallClockMicros();
+        uint64_t capture_us = readCaptureTime(m_ffmpeg.frame_yuv->data[0], m_ffmpeg.frame_yuv->linesize[0],
+                                              m_ffmpeg.frame_yuv->width, m_ffmpeg.frame_yuv->height, shown_us);
+        if (capture_us) {
+            static const int latency_file = AsyncLog::get().open("latency_log.txt", "ii", LogFormat::Text);
+            AsyncLog::get().write(latency_file, capture_us, shown_us);
+
+            static int64_t latency_sum_us = 0;
+            static int latency_frames = 0;
+            static uint64_t last_latency_us = steadyMicros();
+            latency_sum_us += (int64_t)(shown_us - capture_us);
+            latency_frames++;
+            if (steadyMicros() - last_latency_us >= 5000000) {
+                std::cout << "Client: Capture to shown " << latency_sum_us / latency_frames / 1000.0 << " ms over "
+                          << latency_frames << " frames" << std::endl;
+                latency_sum_us = 0;
+                latency_frames = 0;
+                last_latency_us = steadyMicros();
+            }
         }
         // Display the frame.
         cv::imshow("Video", frame);
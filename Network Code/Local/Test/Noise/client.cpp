@@ -10,10 +10,11 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <opencv2/opencv.hpp>
-#include <fstream>
 #include <sstream>
 #include <filesystem>
 
+#include "async_log.hpp"
+
 // FFmpeg includes
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -155,15 +156,9 @@ void flushFrameBuffer(std::vector<uint8_t>& frameBuffer, FFmpegContext &m_ffmpeg
         std::strftime(time_str, sizeof(time_str), "%H:%M:%S", tm_ptr);
 
         // Log label and timestamp
-        std::string log_path =  "log.txt";
-        std::ofstream pi_log(log_path, std::ios::app);
-        if (pi_log.is_open()) {
-            // Log format: label time_string ts_ms sigma_before sigma_after
-            pi_log << label << " " << ts_ms << "\n";
-            pi_log.close();
-        } else {
-            std::cerr << "Unable to open log.txt for writing at path: " << log_path << "\n";
-        }
+        // Log format: label ts_ms. Queued here, written by the log thread
+        static const int log_file = AsyncLog::get().open("log.txt", "ii", LogFormat::Text);
+        AsyncLog::get().write(log_file, label, ts_ms);
 
         // Overlay text
         std::stringstream overlay_text;
@@ -0,0 +1,433 @@
+// Per-frame logging off the hot path. A thread that logs gets a ring of its
+// own (an SpscQueue of fixed-size records, so writing a line is a couple of
+// stores and no system call); one background thread empties the rings,
+// formats the records into blocks per file and writes each file's blocks with
+// a single writev every FLUSH_INTERVAL, or as soon as BLOCK_SIZE is pending.
+// Files stay open for the life of the process.
+//
+// Each file has a layout, one letter per value of a line:
+//   t  milliseconds since the epoch, written as local time HH:MM:SS
+//   i  integer
+//   f  floating point, written as iostreams do by default
+// and is written either as text, space separated as the logs always were, or
+// as binary: a header with the layout, then 8 bytes per value of the layout
+// (a line with fewer values is padded with 0, one with more cut). Binary logs are
+// turned into the text layout by convertLog() (Other Tests/Log converter).
+//
+// A full ring drops the record rather than wait; drops are counted and
+// reported when the log shuts down.
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "spsc_queue.hpp"
+
+enum class LogFormat {
+    Text,
+    Binary
+};
+
+const int LOG_MAX_VALUES = 8;
+
+union LogValue {
+    int64_t i;
+    double f;
+};
+
+// One line, as it waits in a ring
+struct LogRecord {
+    uint32_t file;
+    uint32_t count;
+    LogValue values[LOG_MAX_VALUES];
+};
+
+// Binary logs start with this, then the layout's length (uint32) and letters
+const char LOG_MAGIC[4] = {'A', 'L', 'O', 'G'};
+
+namespace log_detail {
+
+inline void setValue(LogValue& value, double f) {
+    value.f = f;
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value>::type setValue(LogValue& value, T i) {
+    value.i = (int64_t)i;
+}
+
+inline void fill(LogRecord&, int) {}
+
+template <typename T, typename... Rest>
+inline void fill(LogRecord& record, int index, T first, Rest... rest) {
+    setValue(record.values[index], first);
+    fill(record, index + 1, rest...);
+}
+
+// One value as text; returns the characters written (at most 32)
+inline int formatValue(char kind, LogValue value, char* out) {
+    if (kind == 't') {
+        time_t seconds = (time_t)(value.i / 1000);
+        struct tm local;
+        localtime_r(&seconds, &local);
+        return (int)strftime(out, 32, "%H:%M:%S", &local);
+    }
+    if (kind == 'f') {
+        return snprintf(out, 32, "%g", value.f);
+    }
+    return snprintf(out, 32, "%lld", (long long)value.i);
+}
+
+// A line of text: values space separated, then a newline
+inline int formatLine(const std::string& layout, const LogValue* values, int count, char* out) {
+    int length = 0;
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            out[length++] = ' ';
+        }
+        length += formatValue(i < (int)layout.size() ? layout[i] : 'i', values[i], out + length);
+    }
+    out[length++] = '\n';
+    return length;
+}
+
+} // namespace log_detail
+
+class AsyncLog {
+public:
+    static constexpr size_t MAX_FILES = 16;
+    static constexpr size_t RING_SIZE = 4096;               // Records per thread
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;         // Bytes per write buffer
+    static constexpr int FLUSH_INTERVAL_MS = 100;
+
+    // The process' log, started on first use and flushed on exit
+    static AsyncLog& get() {
+        static AsyncLog log;
+        return log;
+    }
+
+    // Open (append to) a log file; returns the handle for write(), or -1
+    int open(const std::string& path, const std::string& layout, LogFormat format) {
+        if (layout.empty() || layout.size() > (size_t)LOG_MAX_VALUES) {
+            std::cerr << "Unable to log to " << path << ": a layout has 1 to " << LOG_MAX_VALUES << " values" << std::endl;
+            return -1;
+        }
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            std::cerr << "Unable to open " << path << " for writing: " << strerror(errno) << std::endl;
+            return -1;
+        }
+        std::unique_ptr<File> file(new File());
+        file->fd = fd;
+        file->path = path;
+        file->layout = layout;
+        file->format = format;
+
+        // A new binary log starts with its layout
+        struct stat status;
+        if (format == LogFormat::Binary && fstat(fd, &status) == 0 && status.st_size == 0) {
+            uint32_t length = (uint32_t)layout.size();
+            append(*file, LOG_MAGIC, sizeof(LOG_MAGIC));
+            append(*file, &length, sizeof(length));
+            append(*file, layout.data(), layout.size());
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t index = file_count_.load(std::memory_order_relaxed);
+        if (index == MAX_FILES) {
+            std::cerr << "Unable to log to " << path << ": more than " << MAX_FILES << " log files" << std::endl;
+            close(fd);
+            return -1;
+        }
+        files_[index] = std::move(file);
+        file_count_.store(index + 1, std::memory_order_release);
+        return (int)index;
+    }
+
+    // Queue a line for a file; the values go with the file's layout. Returns
+    // false if the line was dropped.
+    template <typename... Values>
+    bool write(int file, Values... values) {
+        static_assert(sizeof...(Values) <= LOG_MAX_VALUES, "Too many values for a log line");
+        if (file < 0) {
+            return false;
+        }
+        SpscQueue<LogRecord>& ring = threadRing();
+        LogRecord* record = ring.beginPush();
+        if (!record) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        record->file = (uint32_t)file;
+        record->count = sizeof...(Values);
+        log_detail::fill(*record, 0, values...);
+        ring.endPush();
+        return true;
+    }
+
+    // Wait until every line queued so far is written
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        uint64_t wanted = ++flush_requested_;
+        wake_.notify_all();
+        while (flushed_ < wanted && !stopping_) {
+            flushed_cv_.wait(lock);
+        }
+    }
+
+    ~AsyncLog() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        writer_.join();
+        for (size_t i = 0; i < file_count_.load(); i++) {
+            close(files_[i]->fd);
+        }
+        if (dropped_.load() > 0) {
+            std::cerr << "Log dropped " << dropped_.load() << " lines, the writer could not keep up" << std::endl;
+        }
+    }
+
+    AsyncLog(const AsyncLog&) = delete;
+    AsyncLog& operator=(const AsyncLog&) = delete;
+
+private:
+    struct Ring {
+        SpscQueue<LogRecord> records{RING_SIZE};
+        std::atomic<bool> owned{true};    // A live thread produces into it
+    };
+
+    struct File {
+        int fd;
+        std::string path;
+        std::string layout;
+        LogFormat format;
+        std::vector<std::unique_ptr<std::vector<char>>> blocks;   // Pending bytes, in order
+    };
+
+    // Hands the ring back when its thread ends, so the next thread reuses it
+    struct RingHandle {
+        Ring* ring = nullptr;
+        ~RingHandle() {
+            if (ring) {
+                ring->owned.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    AsyncLog() : writer_(&AsyncLog::writerLoop, this) {}
+
+    SpscQueue<LogRecord>& threadRing() {
+        thread_local RingHandle handle;
+        if (!handle.ring) {
+            handle.ring = claimRing();
+        }
+        return handle.ring->records;
+    }
+
+    Ring* claimRing() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& ring : rings_) {
+            bool owned = false;
+            if (ring->owned.compare_exchange_strong(owned, true)) {
+                return ring.get();
+            }
+        }
+        rings_.emplace_back(new Ring());
+        return rings_.back().get();
+    }
+
+    static void append(File& file, const void* data, size_t size) {
+        const char* bytes = (const char*)data;
+        while (size > 0) {
+            if (file.blocks.empty() || file.blocks.back()->size() == BLOCK_SIZE) {
+                file.blocks.emplace_back(new std::vector<char>());
+                file.blocks.back()->reserve(BLOCK_SIZE);
+            }
+            std::vector<char>& block = *file.blocks.back();
+            size_t part = std::min(size, BLOCK_SIZE - block.size());
+            block.insert(block.end(), bytes, bytes + part);
+            bytes += part;
+            size -= part;
+        }
+    }
+
+    // Move every queued record into its file's blocks; returns the number moved
+    size_t drain() {
+        std::vector<Ring*> rings;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto& ring : rings_) {
+                rings.push_back(ring.get());
+            }
+        }
+        size_t file_count = file_count_.load(std::memory_order_acquire);
+        size_t moved = 0;
+        char line[LOG_MAX_VALUES * 33 + 1];
+        for (Ring* ring : rings) {
+            LogRecord* record;
+            while ((record = ring->records.front()) != nullptr) {
+                if (record->file < file_count) {
+                    File& file = *files_[record->file];
+                    int count = std::min<int>(record->count, LOG_MAX_VALUES);
+                    if (file.format == LogFormat::Text) {
+                        append(file, line, log_detail::formatLine(file.layout, record->values, count, line));
+                    } else {
+                        // Always the layout's length, so the records stay aligned for
+                        // convertLog(): missing values are written as 0, extras dropped
+                        int length = (int)file.layout.size();
+                        for (int i = count; i < length; i++) {
+                            record->values[i].i = 0;
+                        }
+                        append(file, record->values, length * sizeof(LogValue));
+                    }
+                }
+                ring->records.pop();
+                moved++;
+            }
+        }
+        return moved;
+    }
+
+    // One writev per file for everything pending
+    void writeOut() {
+        size_t file_count = file_count_.load(std::memory_order_acquire);
+        std::vector<struct iovec> vectors;
+        for (size_t i = 0; i < file_count; i++) {
+            File& file = *files_[i];
+            if (file.blocks.empty()) {
+                continue;
+            }
+            vectors.clear();
+            for (auto& block : file.blocks) {
+                struct iovec vector;
+                vector.iov_base = block->data();
+                vector.iov_len = block->size();
+                vectors.push_back(vector);
+            }
+            size_t done = 0;
+            while (done < vectors.size()) {
+                int batch = (int)std::min<size_t>(vectors.size() - done, IOV_MAX);
+                ssize_t written = writev(file.fd, vectors.data() + done, batch);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    std::cerr << "Log write to " << file.path << " failed: " << strerror(errno) << std::endl;
+                    break;
+                }
+                // Skip what went out; a short write resumes mid-block
+                while (written > 0 && done < vectors.size()) {
+                    size_t part = std::min((size_t)written, vectors[done].iov_len);
+                    vectors[done].iov_base = (char*)vectors[done].iov_base + part;
+                    vectors[done].iov_len -= part;
+                    written -= part;
+                    if (vectors[done].iov_len == 0) {
+                        done++;
+                    }
+                }
+            }
+            file.blocks.clear();
+        }
+    }
+
+    size_t pendingBytes() const {
+        size_t bytes = 0;
+        size_t file_count = file_count_.load(std::memory_order_acquire);
+        for (size_t i = 0; i < file_count; i++) {
+            for (auto& block : files_[i]->blocks) {
+                bytes += block->size();
+            }
+        }
+        return bytes;
+    }
+
+    void writerLoop() {
+        auto last_write = std::chrono::steady_clock::now();
+        while (true) {
+            uint64_t flush_wanted;
+            bool stopping;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait_for(lock, std::chrono::milliseconds(FLUSH_INTERVAL_MS / 10));
+                flush_wanted = flush_requested_;
+                stopping = stopping_;
+            }
+
+            drain();
+            auto now = std::chrono::steady_clock::now();
+            if (stopping || flush_wanted > flushed_ || pendingBytes() >= BLOCK_SIZE ||
+                now - last_write >= std::chrono::milliseconds(FLUSH_INTERVAL_MS)) {
+                writeOut();
+                last_write = now;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (flush_wanted > flushed_) {
+                flushed_ = flush_wanted;
+                flushed_cv_.notify_all();
+            }
+            if (stopping) {
+                return;
+            }
+        }
+    }
+
+    // Files are only added, under mutex_; the writer reads the first
+    // file_count_ of them without it
+    std::unique_ptr<File> files_[MAX_FILES];
+    std::atomic<size_t> file_count_{0};
+    std::vector<std::unique_ptr<Ring>> rings_;
+    std::atomic<uint64_t> dropped_{0};
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable flushed_cv_;
+    bool stopping_ = false;
+    uint64_t flush_requested_ = 0;
+    uint64_t flushed_ = 0;
+    std::thread writer_;
+};
+
+// Turn a binary log into its text layout; false if it is not a binary log
+inline bool convertLog(FILE* binary, FILE* text) {
+    char magic[sizeof(LOG_MAGIC)];
+    uint32_t length;
+    if (fread(magic, 1, sizeof(magic), binary) != sizeof(magic) || memcmp(magic, LOG_MAGIC, sizeof(magic)) != 0 ||
+        fread(&length, sizeof(length), 1, binary) != 1 || length == 0 || length > LOG_MAX_VALUES) {
+        return false;
+    }
+    std::string layout(length, 'i');
+    if (fread(&layout[0], 1, length, binary) != length) {
+        return false;
+    }
+
+    LogValue values[LOG_MAX_VALUES];
+    char line[LOG_MAX_VALUES * 33 + 1];
+    while (fread(values, sizeof(LogValue), length, binary) == length) {
+        fwrite(line, 1, log_detail::formatLine(layout, values, (int)length, line), text);
+    }
+    return true;
+}
@@ -0,0 +1,140 @@
+// Viewers of the stream. A viewer joins by registering (or by any control
+// message from an address we do not know yet, e.g. after a server restart),
+// stays alive by sending heartbeats, NACKs or PLIs, and is dropped once it has
+// been silent for longer than the timeout.
+//
+// Viewers live in fixed slots, so other threads can refer to one by index.
+// A slot's session number changes whenever a different viewer takes it over,
+// which tells the sender to start that slot over instead of carrying on
+// where the previous viewer left off.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <netinet/in.h>
+
+struct Viewer {
+    struct sockaddr_in addr;
+    socklen_t len = 0;
+    uint64_t last_seen_us = 0;
+    uint32_t session = 0;
+    int stream = 0; // Which camera it watches
+    bool active = false;
+};
+
+class ClientRegistry {
+public:
+    static constexpr int NONE = -1;
+
+    ClientRegistry(size_t capacity, uint64_t timeout_us)
+        : viewers_(capacity), timeout_us_(timeout_us) {}
+
+    // A message arrived from addr: refresh the viewer, registering it if it is
+    // new, watching stream. Returns its slot, or NONE if every slot is taken.
+    // joined is set if the viewer was not known before.
+    int touch(const struct sockaddr_in& addr, socklen_t len, uint64_t now_us, bool* joined = nullptr,
+              int stream = 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (joined) {
+            *joined = false;
+        }
+
+        int slot = findLocked(addr);
+        if (slot == NONE) {
+            for (size_t i = 0; i < viewers_.size(); i++) {
+                if (!viewers_[i].active) {
+                    slot = (int)i;
+                    break;
+                }
+            }
+            if (slot == NONE) {
+                return NONE;
+            }
+            Viewer& viewer = viewers_[slot];
+            viewer.addr = addr;
+            viewer.len = len;
+            viewer.session = next_session_++;
+            viewer.stream = stream;
+            viewer.active = true;
+            active_++;
+            version_++;
+            if (joined) {
+                *joined = true;
+            }
+        }
+        viewers_[slot].last_seen_us = now_us;
+        return slot;
+    }
+
+    // Switch a viewer to another camera stream
+    void watch(int slot, int stream) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (viewers_[slot].stream != stream) {
+            viewers_[slot].stream = stream;
+            version_++;
+        }
+    }
+
+    int streamOf(int slot) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return viewers_[slot].stream;
+    }
+
+    // Slot of a known viewer, NONE if addr is not registered
+    int find(const struct sockaddr_in& addr) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return findLocked(addr);
+    }
+
+    // Drop viewers that have been silent for too long, returns how many
+    size_t expire(uint64_t now_us) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t expired = 0;
+        for (Viewer& viewer : viewers_) {
+            if (viewer.active && now_us - viewer.last_seen_us > timeout_us_) {
+                viewer.active = false;
+                active_--;
+                version_++;
+                expired++;
+            }
+        }
+        return expired;
+    }
+
+    // Copy the slots if anyone joined or left since version was taken; returns
+    // whether out was updated. Cheap to call on every iteration.
+    bool snapshot(std::vector<Viewer>& out, uint64_t& version) const {
+        if (version_.load(std::memory_order_acquire) == version) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        out = viewers_;
+        version = version_;
+        return true;
+    }
+
+    size_t active() const { return active_; }
+    size_t capacity() const { return viewers_.size(); }
+
+private:
+    int findLocked(const struct sockaddr_in& addr) const {
+        for (size_t i = 0; i < viewers_.size(); i++) {
+            const Viewer& viewer = viewers_[i];
+            if (viewer.active && viewer.addr.sin_addr.s_addr == addr.sin_addr.s_addr &&
+                viewer.addr.sin_port == addr.sin_port) {
+                return (int)i;
+            }
+        }
+        return NONE;
+    }
+
+    mutable std::mutex mutex_;
+    std::vector<Viewer> viewers_;
+    uint64_t timeout_us_;
+    uint32_t next_session_ = 1;
+    std::atomic<uint64_t> version_{1};
+    std::atomic<size_t> active_{0};
+};
@@ -0,0 +1,214 @@
+// Content-adaptive denoising. The noise of the stream is tracked with the
+// shared Laplacian estimator (noise_tracker.hpp), and the controller picks
+// the filter that noise calls for: nothing for clean daytime scenes, a cheap
+// Gaussian, the bilateral filter, or non-local means for noisy night scenes.
+//
+// A stronger filter is chosen as soon as the noise calls for it, a weaker one
+// only once the noise has stayed below the threshold (minus a margin) for
+// hold_frames frames, so the filter does not flicker around a threshold. Each
+// filter's running cost is tracked, and one that does not fit the per-frame
+// budget is replaced by the next cheaper one.
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "fast_bilateral.hpp"
+#include "noise_tracker.hpp"
+#include "tile_scheduler.hpp"
+
+enum class DenoiseLevel {
+    Skip,
+    Gaussian,
+    Bilateral,
+    Nlm
+};
+const int DENOISE_LEVELS = 4;
+
+// Noise (sigma, in grey levels) at which each filter takes over
+struct DenoiseLimits {
+    double gaussian_sigma;
+    double bilateral_sigma;
+    double nlm_sigma;
+    double hysteresis;   // A weaker filter only below its threshold minus this
+    int hold_frames;     // ... for this many frames in a row
+    uint64_t budget_us;  // Longest a filter may take on average per frame
+};
+
+// The filter picked for one frame and how strong it is
+struct DenoiseSettings {
+    DenoiseLevel level;
+    double sigma;      // Noise the filter was picked for
+    double strength;   // Gaussian sigma, bilateral sigma colour or NLM h
+};
+
+// Run the filter settings ask for from src into dst (1 or 3 channels, 8 bit).
+// subsampled halves the neighbourhood, for chroma planes. Given an engine,
+// single channel images get the separable bilateral filter instead of
+// OpenCV's (fast_bilateral.hpp).
+inline void applyDenoise(const DenoiseSettings& settings, const cv::Mat& src, cv::Mat& dst, bool subsampled = false,
+                         FastBilateral* bilateral = nullptr) {
+    switch (settings.level) {
+    case DenoiseLevel::Skip:
+        src.copyTo(dst);
+        break;
+    case DenoiseLevel::Gaussian:
+        cv::GaussianBlur(src, dst, cv::Size(subsampled ? 3 : 5, subsampled ? 3 : 5), settings.strength);
+        break;
+    case DenoiseLevel::Bilateral:
+        if (bilateral && src.channels() == 1) {
+            BilateralParams params = {subsampled ? 4 : 8, settings.strength, subsampled ? 1.0 : 2.0};
+            dst.create(src.size(), src.type());
+            bilateral->filter(params, src.data, src.step, dst.data, dst.step, src.cols, src.rows);
+        } else {
+            cv::bilateralFilter(src, dst, subsampled ? 4 : 8, settings.strength, subsampled ? 1 : 2);
+        }
+        break;
+    case DenoiseLevel::Nlm:
+        if (src.channels() == 3) {
+            cv::fastNlMeansDenoisingColored(src, dst, (float)settings.strength, (float)settings.strength,
+                                            subsampled ? 3 : 5, subsampled ? 11 : 15);
+        } else {
+            cv::fastNlMeansDenoising(src, dst, (float)settings.strength, subsampled ? 3 : 5, subsampled ? 11 : 15);
+        }
+        break;
+    }
+}
+
+// Rows around a pixel the filter applyDenoise runs reads, the halo a band
+// needs when the frame is filtered in bands
+inline int denoiseHalo(const DenoiseSettings& settings, bool subsampled = false) {
+    switch (settings.level) {
+    case DenoiseLevel::Gaussian:
+        return subsampled ? 1 : 2;
+    case DenoiseLevel::Bilateral:
+        return subsampled ? 2 : 4;
+    case DenoiseLevel::Nlm:
+        return subsampled ? 3 / 2 + 11 / 2 : 5 / 2 + 15 / 2; // Template plus search window
+    default:
+        return 0;
+    }
+}
+
+// applyDenoise as a kernel for a TilePool, with a bilateral engine per worker
+class DenoiseKernel : public TileKernel {
+public:
+    void set(const DenoiseSettings& settings, bool subsampled, bool fast_bilateral) {
+        settings_ = settings;
+        subsampled_ = subsampled;
+        fast_bilateral_ = fast_bilateral;
+    }
+    int halo() const override { return denoiseHalo(settings_, subsampled_); }
+    void prepare(int workers) override {
+        if ((int)engines_.size() < workers) {
+            engines_.resize(workers);
+        }
+    }
+    void apply(const cv::Mat& src, cv::Mat& dst, int worker) override {
+        applyDenoise(settings_, src, dst, subsampled_, fast_bilateral_ ? &engines_[worker] : nullptr);
+    }
+
+private:
+    DenoiseSettings settings_ = {DenoiseLevel::Skip, 0.0, 0.0};
+    bool subsampled_ = false;
+    bool fast_bilateral_ = false;
+    std::vector<FastBilateral> engines_;
+};
+
+// Shared by every thread that filters frames of one stream
+class DenoiseController {
+public:
+    static constexpr uint64_t PROBE_INTERVAL = 300; // Frames between fresh timings of the wanted filter
+
+    explicit DenoiseController(const DenoiseLimits& limits) : limits_(limits) {
+        for (auto& cost : cost_us_) {
+            cost = 0;
+        }
+    }
+
+    // Pick the filter for a frame with the given noise
+    DenoiseSettings choose(double sigma) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        frames_++;
+
+        // Stronger at once, weaker only after hold_frames clearly below
+        int wanted = levelFor(sigma, 0.0);
+        if (wanted > level_) {
+            level_ = wanted;
+            below_ = 0;
+        } else if (wanted < level_ && levelFor(sigma, limits_.hysteresis) < level_) {
+            if (++below_ >= limits_.hold_frames) {
+                level_--;
+                below_ = 0;
+            }
+        } else {
+            below_ = 0;
+        }
+
+        // Step down to a filter that fits the budget. Once in a while the
+        // wanted one is timed afresh, in case it was only slow under load.
+        if (frames_ % PROBE_INTERVAL == 0) {
+            cost_us_[level_].store(0, std::memory_order_relaxed);
+        }
+        int level = level_;
+        while (level > 0 && cost_us_[level].load(std::memory_order_relaxed) > limits_.budget_us) {
+            level--;
+        }
+
+        DenoiseSettings settings;
+        settings.level = (DenoiseLevel)level;
+        settings.sigma = sigma;
+        settings.strength = strengthFor(settings.level, sigma);
+        return settings;
+    }
+
+    // A filter took elapsed_us on a frame. Updates from several workers may
+    // race; losing one now and then does not matter to a running average.
+    void recordTime(DenoiseLevel level, uint64_t elapsed_us) {
+        std::atomic<uint64_t>& cost = cost_us_[(int)level];
+        uint64_t previous = cost.load(std::memory_order_relaxed);
+        cost.store(previous == 0 ? elapsed_us : (previous * 7 + elapsed_us) / 8, std::memory_order_relaxed);
+    }
+
+    uint64_t averageTime(DenoiseLevel level) const { return cost_us_[(int)level].load(std::memory_order_relaxed); }
+
+private:
+    // Strongest filter whose threshold (lowered by margin) sigma reaches
+    int levelFor(double sigma, double margin) const {
+        if (sigma >= limits_.nlm_sigma - margin) {
+            return (int)DenoiseLevel::Nlm;
+        }
+        if (sigma >= limits_.bilateral_sigma - margin) {
+            return (int)DenoiseLevel::Bilateral;
+        }
+        if (sigma >= limits_.gaussian_sigma - margin) {
+            return (int)DenoiseLevel::Gaussian;
+        }
+        return (int)DenoiseLevel::Skip;
+    }
+
+    static double strengthFor(DenoiseLevel level, double sigma) {
+        switch (level) {
+        case DenoiseLevel::Gaussian:
+            return std::min(std::max(sigma * 0.3, 0.5), 1.5);
+        case DenoiseLevel::Bilateral:
+            return std::min(std::max(sigma * 3.0, 10.0), 40.0); // 10 is what the server always used
+        case DenoiseLevel::Nlm:
+            return std::min(std::max(sigma, 3.0), 15.0);
+        default:
+            return 0.0;
+        }
+    }
+
+    DenoiseLimits limits_;
+    std::mutex mutex_;
+    int level_ = 0;
+    int below_ = 0;
+    uint64_t frames_ = 0;
+    std::atomic<uint64_t> cost_us_[DENOISE_LEVELS];
+};
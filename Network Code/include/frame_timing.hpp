@@ -0,0 +1,340 @@
+// Latency of each hop from camera to viewer, carried with the frames
+// themselves instead of burnt-in text read back by OCR.
+//
+// Camera -> relay: the rpicam stage runs before rpicam-vid's encoder and has
+// no way into its bitstream, so the capture time goes into the picture: a row
+// of black and white cells along the bottom left of the luma plane (sync
+// byte, 56 bits of capture time in microseconds, CRC-8). The cells are 8x16
+// pixels on the 8x8 transform grid, which H.264 keeps intact at any usable
+// bitrate, and the relay reads them back right after decoding.
+//
+// Relay -> client: the relay notes when each frame got through decode, filter
+// and encode, and puts those times together with the capture time in an SEI
+// user data (unregistered) message in front of the encoded picture. Decoders
+// skip SEI they do not know, so the client reads it from the packet before
+// decoding; the send time is in every fragment header already.
+//
+// All times are wall clock microseconds (0 where unknown). Hops between two
+// machines are only as good as their NTP sync.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+
+#include "stream_protocol.hpp"
+
+struct FrameTiming {
+    uint64_t capture_us;    // Camera, read from the picture
+    uint64_t received_us;   // Relay: last datagram of the frame arrived
+    uint64_t decoded_us;    // Relay: out of the decoder
+    uint64_t filtered_us;   // Relay: out of the filter workers
+    uint64_t encoded_us;    // Relay: out of the encoder
+};
+
+// The stamped cells
+const int CAPTURE_CODE_CELL_WIDTH = 8;
+const int CAPTURE_CODE_CELL_HEIGHT = 16;
+const int CAPTURE_CODE_BYTES = 9;   // Sync, 7 bytes of time, CRC
+const int CAPTURE_CODE_WIDTH = CAPTURE_CODE_BYTES * 8 * CAPTURE_CODE_CELL_WIDTH;
+const uint8_t CAPTURE_CODE_SYNC = 0xB2;
+const uint8_t CAPTURE_CODE_BLACK = 16;  // Video range, so no encoder clips them
+const uint8_t CAPTURE_CODE_WHITE = 235;
+// A read time further than this from the reader's clock is taken for picture
+// content that happened to pass the sync byte and CRC, not for a stamp
+const uint64_t CAPTURE_CODE_MAX_SKEW_US = 5000000;
+
+// Our SEI message: user_data_unregistered (payload type 5) with this UUID
+const uint8_t TIMING_SEI_UUID[16] = {0x6c, 0x61, 0x74, 0x65, 0x6e, 0x63, 0x79, 0x2d,
+                                     0x73, 0x74, 0x61, 0x6d, 0x70, 0x73, 0x00, 0x01};
+const int TIMING_SEI_PAYLOAD_SIZE = 16 + 5 * 8;
+const size_t TIMING_SEI_MAX_SIZE = 128; // Start code and NAL included, with room for escapes
+
+namespace timing_detail {
+
+inline uint8_t crc8(const uint8_t* data, int size) {
+    uint8_t crc = 0;
+    for (int i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+// First row of the cells, on the 8x8 grid
+inline int codeTop(int height) {
+    return (height - CAPTURE_CODE_CELL_HEIGHT) & ~7;
+}
+
+// Append RBSP bytes to a NAL unit, escaping 0x000000..0x000003 as H.264 asks
+inline size_t putEscaped(uint8_t* out, size_t length, int& zeros, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (zeros >= 2 && data[i] <= 3) {
+            out[length++] = 0x03;
+            zeros = 0;
+        }
+        out[length++] = data[i];
+        zeros = data[i] == 0 ? zeros + 1 : 0;
+    }
+    return length;
+}
+
+// One SEI NAL unit (after its header byte), unescaped; the payload of our
+// message if it is in there
+inline bool parseSei(const uint8_t* nal, size_t size, FrameTiming& timing) {
+    uint8_t rbsp[TIMING_SEI_MAX_SIZE * 4];
+    size_t length = 0;
+    int zeros = 0;
+    for (size_t i = 0; i < size && length < sizeof(rbsp); i++) {
+        if (zeros >= 2 && nal[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        rbsp[length++] = nal[i];
+        zeros = nal[i] == 0 ? zeros + 1 : 0;
+    }
+
+    // sei_message()s until the trailing bits
+    size_t pos = 0;
+    while (pos < length && rbsp[pos] != 0x80) {
+        int type = 0;
+        while (pos < length && rbsp[pos] == 0xFF) {
+            type += 255;
+            pos++;
+        }
+        if (pos >= length) {
+            return false;
+        }
+        type += rbsp[pos++];
+        size_t payload_size = 0;
+        while (pos < length && rbsp[pos] == 0xFF) {
+            payload_size += 255;
+            pos++;
+        }
+        if (pos >= length) {
+            return false;
+        }
+        payload_size += rbsp[pos++];
+        if (pos + payload_size > length) {
+            return false;
+        }
+
+        const uint8_t* payload = rbsp + pos;
+        if (type == 5 && payload_size >= (size_t)TIMING_SEI_PAYLOAD_SIZE &&
+            memcmp(payload, TIMING_SEI_UUID, sizeof(TIMING_SEI_UUID)) == 0) {
+            const uint8_t* fields = payload + sizeof(TIMING_SEI_UUID);
+            timing.capture_us = getBigEndian(fields, 8);
+            timing.received_us = getBigEndian(fields + 8, 8);
+            timing.decoded_us = getBigEndian(fields + 16, 8);
+            timing.filtered_us = getBigEndian(fields + 24, 8);
+            timing.encoded_us = getBigEndian(fields + 32, 8);
+            return true;
+        }
+        pos += payload_size;
+    }
+    return false;
+}
+
+} // namespace timing_detail
+
+// Write the capture time into the bottom left of a luma plane; false if the
+// plane is too small to hold the cells
+inline bool stampCaptureTime(uint8_t* luma, size_t stride, int width, int height, uint64_t capture_us) {
+    if (width < CAPTURE_CODE_WIDTH || height < CAPTURE_CODE_CELL_HEIGHT) {
+        return false;
+    }
+    uint8_t code[CAPTURE_CODE_BYTES];
+    code[0] = CAPTURE_CODE_SYNC;
+    putBigEndian(code + 1, capture_us, 7);
+    code[CAPTURE_CODE_BYTES - 1] = timing_detail::crc8(code, CAPTURE_CODE_BYTES - 1);
+
+    int top = timing_detail::codeTop(height);
+    for (int y = top; y < top + CAPTURE_CODE_CELL_HEIGHT; y++) {
+        uint8_t* row = luma + y * stride;
+        for (int bit = 0; bit < CAPTURE_CODE_BYTES * 8; bit++) {
+            bool set = (code[bit / 8] >> (7 - bit % 8)) & 1;
+            memset(row + bit * CAPTURE_CODE_CELL_WIDTH, set ? CAPTURE_CODE_WHITE : CAPTURE_CODE_BLACK,
+                   CAPTURE_CODE_CELL_WIDTH);
+        }
+    }
+    return true;
+}
+
+// Read the capture time back from a decoded luma plane; 0 if there is no
+// (intact) code or it is not within CAPTURE_CODE_MAX_SKEW_US of now_us. Each
+// cell is judged by the middle of its pixels, away from the ringing at its
+// edges.
+inline uint64_t readCaptureTime(const uint8_t* luma, size_t stride, int width, int height, uint64_t now_us) {
+    if (width < CAPTURE_CODE_WIDTH || height < CAPTURE_CODE_CELL_HEIGHT) {
+        return 0;
+    }
+    const int threshold = (CAPTURE_CODE_BLACK + CAPTURE_CODE_WHITE) / 2;
+    uint8_t code[CAPTURE_CODE_BYTES] = {};
+    int top = timing_detail::codeTop(height);
+    for (int bit = 0; bit < CAPTURE_CODE_BYTES * 8; bit++) {
+        int sum = 0;
+        int count = 0;
+        for (int y = top + CAPTURE_CODE_CELL_HEIGHT / 4; y < top + CAPTURE_CODE_CELL_HEIGHT * 3 / 4; y++) {
+            const uint8_t* cell = luma + y * stride + bit * CAPTURE_CODE_CELL_WIDTH;
+            for (int x = CAPTURE_CODE_CELL_WIDTH / 4; x < CAPTURE_CODE_CELL_WIDTH * 3 / 4; x++) {
+                sum += cell[x];
+                count++;
+            }
+        }
+        if (sum > threshold * count) {
+            code[bit / 8] |= (uint8_t)(0x80 >> (bit % 8));
+        }
+    }
+    if (code[0] != CAPTURE_CODE_SYNC ||
+        code[CAPTURE_CODE_BYTES - 1] != timing_detail::crc8(code, CAPTURE_CODE_BYTES - 1)) {
+        return 0;
+    }
+    uint64_t capture_us = getBigEndian(code + 1, 7);
+    uint64_t skew_us = capture_us > now_us ? capture_us - now_us : now_us - capture_us;
+    return skew_us <= CAPTURE_CODE_MAX_SKEW_US ? capture_us : 0;
+}
+
+// The SEI NAL unit (Annex B, start code included) carrying the times; out
+// needs TIMING_SEI_MAX_SIZE bytes. Returns its size.
+inline size_t writeTimingSei(const FrameTiming& timing, uint8_t* out) {
+    uint8_t payload[2 + TIMING_SEI_PAYLOAD_SIZE];
+    payload[0] = 5; // user_data_unregistered
+    payload[1] = TIMING_SEI_PAYLOAD_SIZE;
+    memcpy(payload + 2, TIMING_SEI_UUID, sizeof(TIMING_SEI_UUID));
+    uint8_t* fields = payload + 2 + sizeof(TIMING_SEI_UUID);
+    putBigEndian(fields, timing.capture_us, 8);
+    putBigEndian(fields + 8, timing.received_us, 8);
+    putBigEndian(fields + 16, timing.decoded_us, 8);
+    putBigEndian(fields + 24, timing.filtered_us, 8);
+    putBigEndian(fields + 32, timing.encoded_us, 8);
+
+    size_t length = 0;
+    out[length++] = 0;
+    out[length++] = 0;
+    out[length++] = 0;
+    out[length++] = 1;
+    out[length++] = 0x06; // nal_ref_idc 0, SEI
+    int zeros = 0;
+    length = timing_detail::putEscaped(out, length, zeros, payload, sizeof(payload));
+    const uint8_t trailing = 0x80;
+    return timing_detail::putEscaped(out, length, zeros, &trailing, 1);
+}
+
+// Look for our SEI among the NAL units of an Annex B access unit. Stops at
+// the first slice, as SEI always comes before it.
+inline bool findTimingSei(const uint8_t* data, size_t size, FrameTiming& timing) {
+    size_t pos = 0;
+    while (pos + 3 < size) {
+        if (data[pos] != 0 || data[pos + 1] != 0 || data[pos + 2] != 1) {
+            pos++;
+            continue;
+        }
+        size_t start = pos + 3;
+        int type = data[start] & 0x1F;
+        if (type >= 1 && type <= 5) {
+            return false;
+        }
+
+        size_t end = start + 1;
+        while (end + 2 < size && !(data[end] == 0 && data[end + 1] == 0 && data[end + 2] <= 1)) {
+            end++;
+        }
+        if (end + 2 >= size) {
+            end = size;
+        }
+        if (type == 6 && timing_detail::parseSei(data + start + 1, end - start - 1, timing)) {
+            return true;
+        }
+        pos = end;
+    }
+    return false;
+}
+
+// A local steady clock reading (e.g. a datagram's arrival) on the wall clock
+inline uint64_t steadyToWallMicros(uint64_t steady_us) {
+    uint64_t now_steady = steadyMicros();
+    uint64_t now_wall = wallClockMicros();
+    return now_steady > steady_us ? now_wall - (now_steady - steady_us) : now_wall;
+}
+
+// Hops of the path, as the viewer reports them
+enum class LatencyHop {
+    Camera,      // Capture -> relay received (camera encode and the uplink)
+    RelayDecode,
+    RelayFilter, // Including the wait for a filter worker
+    RelayEncode,
+    RelaySend,   // Encoded -> sent, the wait for the pacer
+    Network,     // Sent -> the last fragment at the viewer
+    Viewer,      // Viewer decode and conversion, until shown
+    Total,       // Capture (or relay received, without a capture time) -> shown
+    Count
+};
+
+const int LATENCY_HOPS = (int)LatencyHop::Count;
+
+// Per-hop averages over a reporting period, at the viewer
+class LatencyStats {
+public:
+    void add(const FrameTiming& relay, uint64_t sent_us, uint64_t received_us, uint64_t shown_us) {
+        addHop(LatencyHop::Camera, relay.capture_us, relay.received_us);
+        addHop(LatencyHop::RelayDecode, relay.received_us, relay.decoded_us);
+        addHop(LatencyHop::RelayFilter, relay.decoded_us, relay.filtered_us);
+        addHop(LatencyHop::RelayEncode, relay.filtered_us, relay.encoded_us);
+        addHop(LatencyHop::RelaySend, relay.encoded_us, sent_us);
+        addHop(LatencyHop::Network, sent_us, received_us);
+        addHop(LatencyHop::Viewer, received_us, shown_us);
+        addHop(LatencyHop::Total, relay.capture_us ? relay.capture_us : relay.received_us, shown_us);
+    }
+
+    // "camera 41.2 decode 2.3 ... total 88.0 (max 102.5) ms over 75 frames",
+    // hops without samples left out; then starts a new period
+    void print(std::ostream& out) {
+        static const char* const names[LATENCY_HOPS] = {"camera", "decode", "filter", "encode",
+                                                         "send", "network", "viewer", "total"};
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << std::fixed << std::setprecision(1);
+        for (int hop = 0; hop < LATENCY_HOPS; hop++) {
+            if (count_[hop] > 0) {
+                out << names[hop] << " " << sum_us_[hop] / 1000.0 / count_[hop] << " ";
+            }
+        }
+        if (count_[(int)LatencyHop::Total] > 0) {
+            out << "(max " << max_total_us_ / 1000.0 << ") ";
+        }
+        out << "ms over " << count_[(int)LatencyHop::Total] << " frames";
+        out.flags(flags);
+        out.precision(precision);
+        reset();
+    }
+
+    void reset() {
+        std::fill(sum_us_, sum_us_ + LATENCY_HOPS, 0);
+        std::fill(count_, count_ + LATENCY_HOPS, 0);
+        max_total_us_ = 0;
+    }
+
+private:
+    // Hops across machines can come out negative when the clocks disagree;
+    // they are kept, so the skew shows instead of being hidden
+    void addHop(LatencyHop hop, uint64_t from_us, uint64_t to_us) {
+        if (from_us == 0 || to_us == 0) {
+            return;
+        }
+        int64_t us = (int64_t)(to_us - from_us);
+        sum_us_[(int)hop] += us;
+        count_[(int)hop]++;
+        if (hop == LatencyHop::Total) {
+            max_total_us_ = std::max(max_total_us_, us);
+        }
+    }
+
+    int64_t sum_us_[LATENCY_HOPS] = {};
+    int64_t count_[LATENCY_HOPS] = {};
+    int64_t max_total_us_ = 0;
+};
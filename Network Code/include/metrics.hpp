@@ -0,0 +1,386 @@
+// Live metrics of the relay: a latency histogram per pipeline stage and the
+// counters next to them, served as Prometheus text on a local HTTP port.
+//
+// LatencyHistogram is HDR style: values (microseconds) up to 31 are counted
+// exactly, above that each power of two is split into 16 buckets, so any
+// percentile read back is within 1/16 (6%) of the true value, from 1 us up
+// to two minutes. Recording is one relaxed atomic add (plus a compare-exchange
+// when a new maximum comes along), so any number of threads can record into
+// the same histogram without a lock. Readers take the counts as they are;
+// a scrape racing a record may be one sample off, which does not matter here.
+//
+// Scrape with e.g. curl http://127.0.0.1:<port>/metrics. Per stage it gives a
+// histogram (for histogram_quantile() over any window in Prometheus) and the
+// p50, p99 and max since start. HistogramWindow gives the same over the last
+// interval, for the servers' own stats lines.
+#pragma once
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+const int HISTOGRAM_SUB_BITS = 4;                               // 16 buckets per power of two
+const int HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+const int HISTOGRAM_MAX_EXPONENT = 26;                          // Up to 2^27 us, ~2 minutes
+const int HISTOGRAM_BUCKETS = (HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS;
+
+namespace metrics_detail {
+
+inline int bucketOf(uint64_t us) {
+    if (us < (uint64_t)HISTOGRAM_SUB_BUCKETS) {
+        return (int)us;
+    }
+    int exponent = 63 - __builtin_clzll(us);
+    int index = (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+                (int)((us >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+    return std::min(index, HISTOGRAM_BUCKETS - 1);
+}
+
+// Smallest value past the bucket
+inline uint64_t bucketEnd(int index) {
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t)index + 1;
+    }
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t start = (uint64_t)(HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift;
+    return start + ((uint64_t)1 << shift);
+}
+
+// The value below which a fraction q of the counted samples fall, as the top
+// of its bucket (never above max)
+inline uint64_t percentile(const uint64_t* counts, uint64_t total, double q, uint64_t max) {
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t)(q * total + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return std::min(bucketEnd(i) - 1, max);
+        }
+    }
+    return max;
+}
+
+} // namespace metrics_detail
+
+class LatencyHistogram {
+public:
+    void record(uint64_t us) {
+        counts_[metrics_detail::bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+        sum_us_.fetch_add(us, std::memory_order_relaxed);
+        uint64_t max = max_us_.load(std::memory_order_relaxed);
+        while (us > max && !max_us_.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Copy the counts out; returns how many there are
+    uint64_t counts(uint64_t* out) const {
+        uint64_t total = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            out[i] = counts_[i].load(std::memory_order_relaxed);
+            total += out[i];
+        }
+        return total;
+    }
+
+    uint64_t sum() const { return sum_us_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_us_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> counts_[HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint64_t> sum_us_{0};
+    std::atomic<uint64_t> max_us_{0};
+};
+
+// Times a stage into a histogram from construction to stop() or scope exit
+class StageTimer {
+public:
+    explicit StageTimer(LatencyHistogram& histogram)
+        : histogram_(&histogram), start_(std::chrono::steady_clock::now()) {}
+    ~StageTimer() { stop(); }
+
+    void stop() {
+        if (histogram_) {
+            histogram_->record(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start_).count());
+            histogram_ = nullptr;
+        }
+    }
+
+private:
+    LatencyHistogram* histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// A stage over one interval
+struct WindowSummary {
+    uint64_t count;
+    uint64_t p50_us;
+    uint64_t p99_us;
+    uint64_t max_us;    // Top of the highest bucket hit, within 6%
+};
+
+// What a histogram recorded since the last take(), for one reader
+class HistogramWindow {
+public:
+    HistogramWindow() : last_(HISTOGRAM_BUCKETS, 0), now_(HISTOGRAM_BUCKETS, 0) {}
+
+    WindowSummary take(const LatencyHistogram& histogram) {
+        histogram.counts(now_.data());
+        uint64_t total = 0;
+        int highest = -1;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            uint64_t count = now_[i] - last_[i];
+            last_[i] = now_[i];
+            now_[i] = count;
+            total += count;
+            highest = count > 0 ? i : highest;
+        }
+        WindowSummary summary = WindowSummary();
+        summary.count = total;
+        if (highest >= 0) {
+            summary.max_us = metrics_detail::bucketEnd(highest) - 1;
+            summary.p50_us = metrics_detail::percentile(now_.data(), total, 0.5, summary.max_us);
+            summary.p99_us = metrics_detail::percentile(now_.data(), total, 0.99, summary.max_us);
+        }
+        return summary;
+    }
+
+private:
+    std::vector<uint64_t> last_;
+    std::vector<uint64_t> now_;
+};
+
+// What the endpoint shows. Everything is registered before the server
+// starts and must outlive it.
+class MetricsRegistry {
+public:
+    // Metric names start with prefix, e.g. "relay"
+    explicit MetricsRegistry(const std::string& prefix) : prefix_(prefix) {}
+
+    // A counter that only goes up; labels as in Prometheus (level="nlm"), or
+    // empty. Counters sharing a name share their help text.
+    void addCounter(const char* name, const char* help, const std::atomic<unsigned long long>* value,
+                    const char* labels = "") {
+        counters_.push_back({name, help, labels, value});
+    }
+
+    // A pipeline stage, reported under <prefix>_stage_seconds{stage="..."}
+    void addStage(const char* stage, const LatencyHistogram* histogram) {
+        stages_.push_back({stage, histogram});
+    }
+
+    void render(std::string& out) const {
+        char line[256];
+        out.clear();
+
+        const char* previous = nullptr;
+        for (const Counter& counter : counters_) {
+            if (!previous || strcmp(previous, counter.name) != 0) {
+                snprintf(line, sizeof(line), "# HELP %s_%s_total %s\n# TYPE %s_%s_total counter\n", prefix_.c_str(),
+                         counter.name, counter.help, prefix_.c_str(), counter.name);
+                out += line;
+                previous = counter.name;
+            }
+            snprintf(line, sizeof(line), "%s_%s_total%s%s%s %llu\n", prefix_.c_str(), counter.name,
+                     *counter.labels ? "{" : "", counter.labels, *counter.labels ? "}" : "", counter.value->load());
+            out += line;
+        }
+        if (stages_.empty()) {
+            return;
+        }
+
+        // Buckets at powers of two from 16 us to ~8 s; they line up with the
+        // histogram's own
+        std::vector<uint64_t> counts(HISTOGRAM_BUCKETS);
+        std::string summaries[3];
+        const char* summary_names[3] = {"p50", "p99", "max"};
+        snprintf(line, sizeof(line), "# HELP %s_stage_seconds Time per frame in each stage\n"
+                 "# TYPE %s_stage_seconds histogram\n", prefix_.c_str(), prefix_.c_str());
+        out += line;
+        for (const Stage& stage : stages_) {
+            uint64_t total = stage.histogram->counts(counts.data());
+            uint64_t max = stage.histogram->max();
+            int bucket = 0;
+            uint64_t below = 0;
+            for (uint64_t bound = 16; bound <= (1 << 23); bound *= 2) {
+                while (bucket < HISTOGRAM_BUCKETS && metrics_detail::bucketEnd(bucket) <= bound) {
+                    below += counts[bucket++];
+                }
+                snprintf(line, sizeof(line), "%s_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                         prefix_.c_str(), stage.name, bound / 1e6, (unsigned long long)below);
+                out += line;
+            }
+            snprintf(line, sizeof(line), "%s_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+                     "%s_stage_seconds_sum{stage=\"%s\"} %g\n%s_stage_seconds_count{stage=\"%s\"} %llu\n",
+                     prefix_.c_str(), stage.name, (unsigned long long)total, prefix_.c_str(), stage.name,
+                     stage.histogram->sum() / 1e6, prefix_.c_str(), stage.name, (unsigned long long)total);
+            out += line;
+
+            uint64_t values[3] = {metrics_detail::percentile(counts.data(), total, 0.5, max),
+                                  metrics_detail::percentile(counts.data(), total, 0.99, max), max};
+            for (int i = 0; i < 3; i++) {
+                snprintf(line, sizeof(line), "%s_stage_%s_seconds{stage=\"%s\"} %g\n", prefix_.c_str(),
+                         summary_names[i], stage.name, values[i] / 1e6);
+                summaries[i] += line;
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            snprintf(line, sizeof(line), "# HELP %s_stage_%s_seconds %s per stage since start\n"
+                     "# TYPE %s_stage_%s_seconds gauge\n", prefix_.c_str(), summary_names[i], summary_names[i],
+                     prefix_.c_str(), summary_names[i]);
+            out += line;
+            out += summaries[i];
+        }
+    }
+
+private:
+    struct Counter {
+        const char* name;
+        const char* help;
+        const char* labels;
+        const std::atomic<unsigned long long>* value;
+    };
+    struct Stage {
+        const char* name;
+        const LatencyHistogram* histogram;
+    };
+
+    std::string prefix_;
+    std::vector<Counter> counters_;
+    std::vector<Stage> stages_;
+};
+
+// Serves the registry on GET /metrics from a thread of its own. One request
+// per connection; a scrape takes well under a millisecond, so there is no
+// need for more. Plain POSIX calls only, the Local relay runs on macOS.
+class MetricsServer {
+public:
+    MetricsServer(const MetricsRegistry& registry, const char* address, int port) : registry_(registry) {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) {
+            perror("metrics socket creation failed");
+            return;
+        }
+        closeOnExec(listen_fd_);
+        int reuse = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        inet_pton(AF_INET, address, &addr.sin_addr);
+        if (bind(listen_fd_, (const struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 8) < 0) {
+            perror("metrics bind failed");
+            close(listen_fd_);
+            listen_fd_ = -1;
+            return;
+        }
+        std::cout << "Server: Metrics on http://" << address << ":" << port << "/metrics" << std::endl;
+        thread_ = std::thread(&MetricsServer::serve, this);
+    }
+
+    ~MetricsServer() {
+        stopping_ = true;
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        if (listen_fd_ >= 0) {
+            close(listen_fd_);
+        }
+    }
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+private:
+    static constexpr int POLL_MS = 200;             // How soon the thread notices it should stop
+    static constexpr int REQUEST_TIMEOUT_MS = 1000; // A client that sends nothing is dropped
+
+    static void closeOnExec(int fd) {
+        fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+    }
+
+    void serve() {
+        std::string body;
+        std::string response;
+        while (!stopping_) {
+            struct pollfd pfd = {listen_fd_, POLLIN, 0};
+            if (poll(&pfd, 1, POLL_MS) <= 0) {
+                continue;
+            }
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) {
+                continue;
+            }
+            closeOnExec(fd);
+#ifdef SO_NOSIGPIPE
+            // No MSG_NOSIGNAL on macOS; a scraper hanging up must not kill the relay
+            int no_sigpipe = 1;
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+#endif
+
+            // The request line is all we look at
+            char request[1024];
+            size_t length = 0;
+            while (length < sizeof(request) - 1 && !memmem(request, length, "\r\n\r\n", 4)) {
+                struct pollfd cfd = {fd, POLLIN, 0};
+                if (poll(&cfd, 1, REQUEST_TIMEOUT_MS) <= 0) {
+                    break;
+                }
+                ssize_t n = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+                if (n <= 0) {
+                    break;
+                }
+                length += n;
+            }
+            request[length] = '\0';
+
+            if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+                registry_.render(body);
+                response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n"
+                           "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+            } else {
+                response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            }
+            size_t sent = 0;
+            while (sent < response.size()) {
+                ssize_t n = send(fd, response.data() + sent, response.size() - sent, SEND_FLAGS);
+                if (n <= 0) {
+                    break;
+                }
+                sent += n;
+            }
+            close(fd);
+        }
+    }
+
+#ifdef MSG_NOSIGNAL
+    static constexpr int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+    static constexpr int SEND_FLAGS = 0; // SO_NOSIGPIPE is set instead
+#endif
+
+    const MetricsRegistry& registry_;
+    int listen_fd_ = -1;
+    std::atomic<bool> stopping_{false};
+    std::thread thread_;
+};
@@ -0,0 +1,176 @@
+// Incremental Annex-B splitter: turns a stream of camera datagrams into
+// complete H.264 NAL units without rescanning or shifting the buffer.
+//
+// Incoming bytes are appended to a large pooled block. Every NAL unit is
+// handed out as a refcounted slice of that block (packet->buf references the
+// block), so the decoder gets it without another copy. When a block is full
+// the unfinished tail moves to a fresh block from the pool; the old block
+// goes back to the pool once the decoder has released every slice of it.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+}
+
+class NalSplitter {
+public:
+    explicit NalSplitter(size_t block_size = 1024 * 1024)
+        : block_size_(block_size),
+          pool_(av_buffer_pool_init(block_size + AV_INPUT_BUFFER_PADDING_SIZE, nullptr)) {}
+
+    ~NalSplitter() {
+        av_buffer_unref(&block_);
+        av_buffer_pool_uninit(&pool_);
+    }
+
+    NalSplitter(const NalSplitter&) = delete;
+    NalSplitter& operator=(const NalSplitter&) = delete;
+
+    // Add received bytes. Returns false if the pending NAL unit outgrew a
+    // whole block and had to be discarded to make room.
+    bool append(const uint8_t* data, size_t size) {
+        bool kept_everything = true;
+
+        if (!block_ || end_ + size > block_size_) {
+            // Carry over only what is still needed: the pending NAL unit, or
+            // the last few bytes in case a start code straddles the boundary
+            size_t keep_from = nal_start_ != NONE ? nal_start_ : (end_ > 3 ? end_ - 3 : 0);
+            if (end_ - keep_from + size > block_size_) {
+                // Same policy as the old 1 MB buffer trim: give up on the
+                // oversized unit and resynchronise on the next start code
+                keep_from = end_;
+                nal_start_ = NONE;
+                scan_pos_ = 0;
+                kept_everything = false;
+                if (size > block_size_) {
+                    data += size - block_size_;
+                    size = block_size_;
+                }
+            }
+            if (!rollOver(keep_from)) {
+                return false;
+            }
+        }
+
+        memcpy(block_->data + end_, data, size);
+        end_ += size;
+        return kept_everything;
+    }
+
+    // Fill packet with the next complete NAL unit (start code included).
+    // Returns false until the start code of the following unit has arrived.
+    bool next(AVPacket* packet) {
+        if (!block_) {
+            return false;
+        }
+
+        if (nal_start_ == NONE) {
+            nal_start_ = findStartCode(scan_pos_, 0);
+            if (nal_start_ == NONE) {
+                // Anything but the last two bytes can be skipped next time
+                scan_pos_ = end_ > 2 ? end_ - 2 : 0;
+                return false;
+            }
+            scan_pos_ = nal_start_ + 3;
+        }
+
+        size_t next_start = findStartCode(scan_pos_, nal_start_ + 3);
+        if (next_start == NONE) {
+            scan_pos_ = end_ > 2 ? std::max(end_ - 2, nal_start_ + 3) : nal_start_ + 3;
+            return false;
+        }
+
+        packet->buf = av_buffer_ref(block_);
+        if (!packet->buf) {
+            return false;
+        }
+        packet->data = block_->data + nal_start_;
+        packet->size = (int)(next_start - nal_start_);
+
+        nal_start_ = next_start;
+        scan_pos_ = next_start + 3;
+        return true;
+    }
+
+    // Bytes received but not yet handed out as NAL units
+    size_t buffered() const {
+        if (!block_) {
+            return 0;
+        }
+        return end_ - (nal_start_ != NONE ? nal_start_ : scan_pos_);
+    }
+
+    // Forget everything buffered and resynchronise on the next start code
+    void reset() {
+        av_buffer_unref(&block_);
+        end_ = 0;
+        nal_start_ = NONE;
+        scan_pos_ = 0;
+    }
+
+private:
+    static constexpr size_t NONE = (size_t)-1;
+
+    // Offset of the first start code (00 00 01 or 00 00 00 01) whose 01 byte
+    // is at or after from + 2. A four byte code is only recognised if its
+    // leading zero is at or after floor. memchr does the heavy lifting, as
+    // the 01 byte is rare in compressed data.
+    size_t findStartCode(size_t from, size_t floor) const {
+        const uint8_t* data = block_->data;
+        size_t pos = from + 2;
+        while (pos < end_) {
+            const uint8_t* one = (const uint8_t*)memchr(data + pos, 1, end_ - pos);
+            if (!one) {
+                return NONE;
+            }
+            size_t p = one - data;
+            if (p >= from + 2 && data[p - 1] == 0 && data[p - 2] == 0) {
+                if (p >= floor + 3 && data[p - 3] == 0) {
+                    return p - 3;
+                }
+                return p - 2;
+            }
+            pos = p + 1;
+        }
+        return NONE;
+    }
+
+    // Move [keep_from, end_) into a fresh block from the pool
+    bool rollOver(size_t keep_from) {
+        AVBufferRef* fresh = av_buffer_pool_get(pool_);
+        if (!fresh) {
+            return false;
+        }
+
+        size_t kept = end_ - keep_from;
+        if (block_ && kept > 0) {
+            memcpy(fresh->data, block_->data + keep_from, kept);
+        }
+        // The decoder may read a little past the last unit
+        memset(fresh->data + block_size_, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+        av_buffer_unref(&block_);
+        block_ = fresh;
+
+        end_ = kept;
+        if (nal_start_ != NONE) {
+            nal_start_ -= keep_from;
+        }
+        scan_pos_ = scan_pos_ > keep_from ? scan_pos_ - keep_from : 0;
+        return true;
+    }
+
+    size_t block_size_;
+    AVBufferPool* pool_;
+    AVBufferRef* block_ = nullptr;
+
+    size_t end_ = 0;           // Bytes written to the current block
+    size_t nal_start_ = NONE;  // Start code of the unit being collected
+    size_t scan_pos_ = 0;      // Where the next start code search resumes
+};
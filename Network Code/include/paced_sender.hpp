@@ -0,0 +1,216 @@
+// Paced UDP sender: batches datagrams with sendmmsg (or one UDP_SEGMENT
+// send per run of equal sized datagrams when GSO is available) and spaces
+// them out with a token bucket instead of sleeping between chunks.
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 // From linux/udp.h, missing from older libc headers
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+class PacedSender {
+public:
+    static constexpr size_t MAX_BATCH = 64;        // Datagrams per sendmmsg call
+    static constexpr size_t MAX_GSO_SEGMENTS = 64; // Kernel limit on segments per send
+    static constexpr size_t MAX_GSO_BYTES = 65000; // Must fit in one UDP datagram before segmentation
+
+    // rate_bits_per_second is the long term sending rate; burst_bytes is how
+    // much may leave back to back before pacing kicks in
+    PacedSender(int sock, int64_t rate_bits_per_second, size_t burst_bytes)
+        : sock_(sock), last_refill_(std::chrono::steady_clock::now()) {
+        setRate(rate_bits_per_second, burst_bytes);
+        tokens_ = (double)burst_bytes_;
+    }
+
+    void setRate(int64_t rate_bits_per_second, size_t burst_bytes) {
+        rate_bytes_per_second_ = std::max<double>(rate_bits_per_second / 8.0, 1.0);
+        burst_bytes_ = std::max<size_t>(burst_bytes, 1500);
+        tokens_ = std::min(tokens_, (double)burst_bytes_);
+    }
+
+    // Send one UDP_SEGMENT message per run of equal sized datagrams that lie
+    // back to back in memory. Falls back to sendmmsg if the kernel or NIC
+    // refuses it.
+    void enableGso(bool enable) { gso_ = enable; }
+    bool gsoEnabled() const { return gso_; }
+
+    // Send datagrams in order to dest, blocking only as long as pacing requires.
+    // Returns the number of datagrams handed to the kernel.
+    size_t send(const struct sockaddr* dest, socklen_t dest_len, const struct iovec* datagrams, size_t count) {
+        size_t sent = 0;
+        while (sent < count) {
+            refill();
+            size_t first_len = datagrams[sent].iov_len;
+            if (tokens_ < (double)std::min(first_len, burst_bytes_)) {
+                waitForTokens(std::min(first_len, burst_bytes_));
+                continue;
+            }
+
+            int result = -1;
+            size_t bytes = 0;
+            size_t run = gso_ ? gsoRun(datagrams + sent, count - sent) : 1;
+            if (run > 1) {
+                result = sendGso(dest, dest_len, datagrams + sent, run, bytes);
+                if (result < 0 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+                    // Not supported on this path, stay with sendmmsg from now on
+                    gso_ = false;
+                    continue;
+                }
+            } else {
+                result = sendBatch(dest, dest_len, datagrams + sent, count - sent, bytes);
+            }
+
+            if (result < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == EINTR) {
+                    // Socket buffer full, give the NIC a moment to drain it
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                    continue;
+                }
+                perror("sendmmsg failed");
+                send_errors_++;
+                sent++; // Skip the datagram rather than retrying it forever
+                continue;
+            }
+
+            tokens_ -= (double)bytes;
+            bytes_sent_ += bytes;
+            sent += result;
+        }
+        datagrams_sent_ += sent;
+        return sent;
+    }
+
+    unsigned long long bytesSent() const { return bytes_sent_; }
+    unsigned long long datagramsSent() const { return datagrams_sent_; }
+    unsigned long long sendErrors() const { return send_errors_; }
+
+private:
+    void refill() {
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - last_refill_).count();
+        last_refill_ = now;
+        tokens_ = std::min((double)burst_bytes_, tokens_ + elapsed * rate_bytes_per_second_);
+    }
+
+    void waitForTokens(size_t bytes) {
+        double missing = (double)bytes - tokens_;
+        if (missing > 0) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(missing / rate_bytes_per_second_));
+        }
+    }
+
+    // Bytes the bucket currently allows, but always at least one datagram
+    size_t allowance(size_t first_len) const {
+        return std::max(first_len, (size_t)std::max(tokens_, 0.0));
+    }
+
+    // Length of the run of datagrams starting at the first one that can go
+    // out as a single GSO send: equal sizes (the last may be shorter),
+    // contiguous in memory and within the token allowance
+    size_t gsoRun(const struct iovec* datagrams, size_t count) const {
+        size_t segment = datagrams[0].iov_len;
+        size_t limit = std::min(allowance(segment), MAX_GSO_BYTES);
+        size_t bytes = segment;
+        size_t run = 1;
+        while (run < count && run < MAX_GSO_SEGMENTS) {
+            const struct iovec& next = datagrams[run];
+            const uint8_t* expected = (const uint8_t*)datagrams[run - 1].iov_base + datagrams[run - 1].iov_len;
+            if (next.iov_base != expected || next.iov_len > segment || bytes + next.iov_len > limit) {
+                break;
+            }
+            bytes += next.iov_len;
+            run++;
+            if (next.iov_len < segment) {
+                break; // A short segment can only be the last one
+            }
+        }
+        return run;
+    }
+
+    int sendGso(const struct sockaddr* dest, socklen_t dest_len, const struct iovec* datagrams, size_t run, size_t& bytes) {
+        struct iovec payload;
+        payload.iov_base = datagrams[0].iov_base;
+        payload.iov_len = 0;
+        for (size_t i = 0; i < run; i++) {
+            payload.iov_len += datagrams[i].iov_len;
+        }
+
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        memset(control, 0, sizeof(control));
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = (void*)dest;
+        msg.msg_namelen = dest_len;
+        msg.msg_iov = &payload;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segment = (uint16_t)datagrams[0].iov_len;
+        memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+
+        if (sendmsg(sock_, &msg, 0) < 0) {
+            return -1;
+        }
+        bytes = payload.iov_len;
+        return (int)run;
+    }
+
+    int sendBatch(const struct sockaddr* dest, socklen_t dest_len, const struct iovec* datagrams, size_t count, size_t& bytes) {
+        size_t limit = allowance(datagrams[0].iov_len);
+        size_t batch = 0;
+        size_t batch_bytes = 0;
+        while (batch < count && batch < MAX_BATCH && batch_bytes + datagrams[batch].iov_len <= limit) {
+            memset(&messages_[batch], 0, sizeof(messages_[batch]));
+            messages_[batch].msg_hdr.msg_name = (void*)dest;
+            messages_[batch].msg_hdr.msg_namelen = dest_len;
+            messages_[batch].msg_hdr.msg_iov = (struct iovec*)&datagrams[batch];
+            messages_[batch].msg_hdr.msg_iovlen = 1;
+            batch_bytes += datagrams[batch].iov_len;
+            batch++;
+        }
+
+        int result = sendmmsg(sock_, messages_, batch, 0);
+        if (result < 0) {
+            return -1;
+        }
+        bytes = 0;
+        for (int i = 0; i < result; i++) {
+            bytes += datagrams[i].iov_len;
+        }
+        return result;
+    }
+
+    int sock_;
+    bool gso_ = false;
+
+    double rate_bytes_per_second_ = 0;
+    size_t burst_bytes_ = 0;
+    double tokens_ = 0;
+    std::chrono::steady_clock::time_point last_refill_;
+
+    struct mmsghdr messages_[MAX_BATCH];
+
+    unsigned long long bytes_sent_ = 0;
+    unsigned long long datagrams_sent_ = 0;
+    unsigned long long send_errors_ = 0;
+};
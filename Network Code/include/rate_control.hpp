@@ -0,0 +1,147 @@
+// Adaptive bitrate. Clients measure how the stream arrives (ReceiverStats)
+// and send it back once a second as a CONTROL_REPORT; the server turns each
+// viewer's reports into a sending rate (RateController) and the encoder
+// follows the slowest viewer of its stream.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "stream_protocol.hpp"
+
+// Client side: what goes into the next receiver report
+class ReceiverStats {
+public:
+    // A frame came out of the reassembler
+    void onFrame(const ReassembledFrame& frame) {
+        // Interarrival jitter: how much the spacing of arrivals differs from
+        // the spacing of sends, smoothed as in RFC 3550. Clock offsets cancel.
+        if (has_previous_) {
+            int64_t difference = (int64_t)(frame.first_arrival_us - previous_arrival_us_) -
+                                 (int64_t)(frame.send_time_us - previous_send_us_);
+            int64_t deviation = difference < 0 ? -difference : difference;
+            jitter_us_ += (deviation - jitter_us_) / 16.0;
+        }
+        has_previous_ = true;
+        previous_arrival_us_ = frame.first_arrival_us;
+        previous_send_us_ = frame.send_time_us;
+
+        spread_us_ += frame.complete_us - frame.first_arrival_us;
+        frames_++;
+    }
+
+    // The decoder took decode_us for a frame
+    void onDecode(uint64_t decode_us) {
+        decode_us_ += decode_us;
+        decoded_++;
+    }
+
+    // Build a report for everything since the last one; returns its size
+    size_t writeReport(uint8_t* out, const FrameReassembler& reassembler, int camera = 0) {
+        ReceiverReport report;
+        report.datagrams_received = (uint32_t)reassembler.datagramsReceived();
+        report.jitter_us = (uint32_t)jitter_us_;
+        report.spread_us = frames_ > 0 ? (uint32_t)(spread_us_ / frames_) : 0;
+        report.decode_us = decoded_ > 0 ? (uint32_t)(decode_us_ / decoded_) : 0;
+        last_ = report;
+        spread_us_ = 0;
+        frames_ = 0;
+        decode_us_ = 0;
+        decoded_ = 0;
+        return ::writeReport(out, report, camera);
+    }
+
+    // The report most recently written, for logging
+    const ReceiverReport& last() const { return last_; }
+
+private:
+    bool has_previous_ = false;
+    uint64_t previous_arrival_us_ = 0;
+    uint64_t previous_send_us_ = 0;
+    double jitter_us_ = 0;
+    uint64_t spread_us_ = 0;
+    uint64_t frames_ = 0;
+    uint64_t decode_us_ = 0;
+    uint64_t decoded_ = 0;
+    ReceiverReport last_ = {0, 0, 0, 0};
+};
+
+// Server side: sending rate for one viewer, AIMD on its reports in the
+// spirit of GCC's loss based controller. Loss above HIGH_LOSS cuts the rate
+// in proportion to the loss, loss below LOW_LOSS lets it grow by a fixed step
+// per report, and in between it holds. Queues building up show before loss
+// does: jitter that rises past jitter_limit_us, or frames taking longer than
+// spread_limit_us to arrive, back off as well.
+class RateController {
+public:
+    static constexpr double LOW_LOSS = 0.02;
+    static constexpr double HIGH_LOSS = 0.10;
+    static constexpr double DELAY_BACKOFF = 0.85;
+
+    RateController(int64_t min_bps, int64_t max_bps, int64_t step_bps, uint32_t jitter_limit_us,
+                   uint32_t spread_limit_us)
+        : min_bps_(min_bps), max_bps_(max_bps), step_bps_(step_bps), jitter_limit_us_(jitter_limit_us),
+          spread_limit_us_(spread_limit_us), rate_bps_(max_bps) {}
+
+    // Start over for a new viewer
+    void reset() {
+        rate_bps_ = max_bps_;
+        have_baseline_ = false;
+        loss_ = 0;
+    }
+
+    // A report arrived; datagrams_sent is how many were sent to the viewer so
+    // far (wrapping like the report's count). The first report after a reset
+    // only sets the baseline. Returns whether the rate changed.
+    bool onReport(const ReceiverReport& report, uint32_t datagrams_sent) {
+        last_ = report;
+        if (!have_baseline_) {
+            have_baseline_ = true;
+            last_sent_ = datagrams_sent;
+            last_received_ = report.datagrams_received;
+            last_jitter_us_ = report.jitter_us;
+            return false;
+        }
+
+        uint32_t sent = datagrams_sent - last_sent_;
+        uint32_t received = report.datagrams_received - last_received_;
+        bool jitter_rising = report.jitter_us > jitter_limit_us_ && report.jitter_us > last_jitter_us_;
+        last_sent_ = datagrams_sent;
+        last_received_ = report.datagrams_received;
+        last_jitter_us_ = report.jitter_us;
+        if (sent == 0) {
+            return false; // Nothing to judge by
+        }
+        loss_ = received < sent ? (double)(sent - received) / sent : 0.0;
+
+        int64_t previous = rate_bps_;
+        if (loss_ > HIGH_LOSS) {
+            rate_bps_ = (int64_t)(rate_bps_ * (1.0 - 0.5 * loss_));
+        } else if (jitter_rising || report.spread_us > spread_limit_us_) {
+            rate_bps_ = (int64_t)(rate_bps_ * DELAY_BACKOFF);
+        } else if (loss_ < LOW_LOSS) {
+            rate_bps_ += step_bps_;
+        }
+        rate_bps_ = std::min(std::max(rate_bps_, min_bps_), max_bps_);
+        return rate_bps_ != previous;
+    }
+
+    int64_t rate() const { return rate_bps_; }
+    double loss() const { return loss_; }                     // Loss fraction over the last report interval
+    const ReceiverReport& lastReport() const { return last_; }
+
+private:
+    int64_t min_bps_;
+    int64_t max_bps_;
+    int64_t step_bps_;
+    uint32_t jitter_limit_us_;
+    uint32_t spread_limit_us_;
+    int64_t rate_bps_;
+    bool have_baseline_ = false;
+    uint32_t last_sent_ = 0;
+    uint32_t last_received_ = 0;
+    uint32_t last_jitter_us_ = 0;
+    double loss_ = 0;
+    ReceiverReport last_ = {0, 0, 0, 0};
+};
@@ -0,0 +1,301 @@
+// Small epoll reactor shared by the servers and clients. One wait covers every
+// socket and sleeps until one of them has data or the timeout runs out; the
+// caller then drains each ready socket in recvmmsg batches (DatagramBatch)
+// instead of taking one datagram per wakeup. Sockets are level triggered, so
+// whatever a drain leaves behind wakes the next wait straight away.
+//
+// epoll, recvmmsg and SO_TIMESTAMPNS are Linux only. Elsewhere (the Local
+// relay runs on macOS for VideoToolbox) the same classes fall back to poll(),
+// a recvmsg loop and SO_TIMESTAMP.
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#include <sys/time.h>
+#endif
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#ifdef __linux__
+class Reactor {
+public:
+    static constexpr int MAX_EVENTS = 16;
+
+    Reactor() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {
+        if (epoll_fd_ < 0) {
+            perror("epoll_create1 failed");
+        }
+    }
+
+    ~Reactor() {
+        if (epoll_fd_ >= 0) {
+            close(epoll_fd_);
+        }
+    }
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    // Watch fd for incoming data
+    bool add(int fd) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("epoll_ctl failed");
+            return false;
+        }
+        return true;
+    }
+
+    // Sleep until a watched socket is readable or timeout_ms has passed (-1
+    // waits forever). Returns how many are ready, 0 on timeout or signal, -1
+    // on error.
+    int wait(int timeout_ms) {
+        ready_count_ = 0;
+        int count = epoll_wait(epoll_fd_, events_, MAX_EVENTS, timeout_ms);
+        if (count < 0) {
+            if (errno == EINTR) {
+                return 0;
+            }
+            perror("epoll_wait failed");
+            return -1;
+        }
+        ready_count_ = count;
+        return count;
+    }
+
+    // Whether fd was found readable by the last wait()
+    bool ready(int fd) const {
+        for (int i = 0; i < ready_count_; i++) {
+            if (events_[i].data.fd == fd) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    int epoll_fd_;
+    struct epoll_event events_[MAX_EVENTS];
+    int ready_count_ = 0;
+};
+#else
+// The same on poll(); the relays watch two or three sockets, so scanning
+// them all on every wait costs nothing
+class Reactor {
+public:
+    Reactor() {}
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    // Watch fd for incoming data
+    bool add(int fd) {
+        struct pollfd entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.fd = fd;
+        entry.events = POLLIN;
+        fds_.push_back(entry);
+        return true;
+    }
+
+    // Sleep until a watched socket is readable or timeout_ms has passed (-1
+    // waits forever). Returns how many are ready, 0 on timeout or signal, -1
+    // on error.
+    int wait(int timeout_ms) {
+        for (struct pollfd& entry : fds_) {
+            entry.revents = 0;
+        }
+        int count = poll(fds_.data(), fds_.size(), timeout_ms);
+        if (count < 0) {
+            if (errno == EINTR) {
+                return 0;
+            }
+            perror("poll failed");
+            return -1;
+        }
+        return count;
+    }
+
+    // Whether fd was found readable by the last wait()
+    bool ready(int fd) const {
+        for (const struct pollfd& entry : fds_) {
+            if (entry.fd == fd) {
+                return (entry.revents & (POLLIN | POLLERR | POLLHUP)) != 0;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::vector<struct pollfd> fds_;
+};
+#endif
+
+// One recvmmsg call's worth of datagrams (a recvmsg loop without recvmmsg). Each entry receives into a buffer
+// chosen by the caller (a queue slot, so nothing is copied afterwards) or,
+// if none is given, into a slab the batch owns. On sockets set up with
+// enableTimestamps() every datagram also carries the time the kernel took it
+// off the wire, which leaves the time spent waiting for us out of latency
+// figures.
+class DatagramBatch {
+public:
+    static constexpr size_t MAX_BATCH = 64;
+
+    // Have the kernel stamp every datagram received on fd (SO_TIMESTAMPNS,
+    // SO_TIMESTAMP where there is no nanosecond variant)
+    static bool enableTimestamps(int fd) {
+        int enable = 1;
+#ifdef __linux__
+        if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0) {
+            perror("setsockopt(SO_TIMESTAMPNS) failed");
+            return false;
+        }
+#else
+        if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &enable, sizeof(enable)) < 0) {
+            perror("setsockopt(SO_TIMESTAMP) failed");
+            return false;
+        }
+#endif
+        return true;
+    }
+
+    // count entries; buffer_size is the size of the batch's own buffers
+    DatagramBatch(size_t count, size_t buffer_size)
+        : count_(count < MAX_BATCH ? count : MAX_BATCH), buffer_size_(buffer_size),
+          storage_(count_ * buffer_size) {
+        for (size_t i = 0; i < count_; i++) {
+            set(i, nullptr, 0);
+        }
+    }
+
+    DatagramBatch(const DatagramBatch&) = delete;
+    DatagramBatch& operator=(const DatagramBatch&) = delete;
+
+    // Receive entry i into buffer, or into the batch's own buffer if nullptr
+    void set(size_t i, void* buffer, size_t capacity) {
+        if (!buffer) {
+            buffer = storage_.data() + i * buffer_size_;
+            capacity = buffer_size_;
+        }
+        iovecs_[i].iov_base = buffer;
+        iovecs_[i].iov_len = capacity;
+    }
+
+    // Take whatever is waiting on fd, up to the batch size, without blocking.
+    // Returns the number of datagrams, 0 if none were waiting, -1 on error.
+    int receive(int fd) {
+        for (size_t i = 0; i < count_; i++) {
+            memset(&messages_[i], 0, sizeof(messages_[i]));
+            messages_[i].msg_hdr.msg_name = &sources_[i];
+            messages_[i].msg_hdr.msg_namelen = sizeof(sources_[i]);
+            messages_[i].msg_hdr.msg_iov = &iovecs_[i];
+            messages_[i].msg_hdr.msg_iovlen = 1;
+            messages_[i].msg_hdr.msg_control = control_[i];
+            messages_[i].msg_hdr.msg_controllen = sizeof(control_[i]);
+        }
+
+#ifdef __linux__
+        int received = recvmmsg(fd, messages_, count_, MSG_DONTWAIT, nullptr);
+#else
+        int received = receiveEach(fd);
+#endif
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return 0;
+            }
+            perror("Receiving datagrams failed");
+            return -1;
+        }
+
+        // Kernel timestamps are wall clock; move them onto the steady clock
+        // the rest of the pipeline measures with
+        uint64_t steady_now = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        uint64_t wall_now = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        for (int i = 0; i < received; i++) {
+            arrivals_[i] = steady_now;
+            for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&messages_[i].msg_hdr); cmsg;
+                 cmsg = CMSG_NXTHDR(&messages_[i].msg_hdr, cmsg)) {
+                uint64_t wall = 0;
+#ifdef __linux__
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                    struct timespec stamp;
+                    memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+                    wall = (uint64_t)stamp.tv_sec * 1000000 + stamp.tv_nsec / 1000;
+                }
+#else
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+                    struct timeval stamp;
+                    memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+                    wall = (uint64_t)stamp.tv_sec * 1000000 + stamp.tv_usec;
+                }
+#endif
+                if (wall != 0) {
+                    // The wall clock may have stepped since; never go past now
+                    uint64_t age = wall < wall_now ? wall_now - wall : 0;
+                    arrivals_[i] = steady_now - std::min(age, steady_now);
+                }
+            }
+        }
+        return received;
+    }
+
+    size_t count() const { return count_; }
+    uint8_t* data(size_t i) const { return (uint8_t*)iovecs_[i].iov_base; }
+    size_t size(size_t i) const { return messages_[i].msg_len; }
+    const struct sockaddr_in& source(size_t i) const { return sources_[i]; }
+    socklen_t sourceLength(size_t i) const { return messages_[i].msg_hdr.msg_namelen; }
+
+    // When entry i arrived, on the steady clock (the time of the receive
+    // call if the socket has no timestamps)
+    uint64_t arrivalMicros(size_t i) const { return arrivals_[i]; }
+
+private:
+#ifndef __linux__
+    // What recvmmsg fills in per datagram
+    struct mmsghdr {
+        struct msghdr msg_hdr;
+        unsigned int msg_len;
+    };
+
+    // One recvmsg call per datagram until the socket runs dry. Errors are
+    // only reported if nothing was received.
+    int receiveEach(int fd) {
+        size_t received = 0;
+        while (received < count_) {
+            ssize_t n = recvmsg(fd, &messages_[received].msg_hdr, MSG_DONTWAIT);
+            if (n < 0) {
+                return received > 0 ? (int)received : -1;
+            }
+            messages_[received].msg_len = (unsigned int)n;
+            received++;
+        }
+        return (int)received;
+    }
+#endif
+
+    size_t count_;
+    size_t buffer_size_;
+    std::vector<uint8_t> storage_;
+    struct mmsghdr messages_[MAX_BATCH];
+    struct iovec iovecs_[MAX_BATCH];
+    struct sockaddr_in sources_[MAX_BATCH];
+    alignas(struct cmsghdr) char control_[MAX_BATCH][CMSG_SPACE(sizeof(struct timespec))]; // Fits a timeval too
+    uint64_t arrivals_[MAX_BATCH];
+};
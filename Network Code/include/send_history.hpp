@@ -0,0 +1,152 @@
+// Bounded history of the frames most recently packetized. It is the ring the
+// viewers are served from, each at its own pace, and the place the fragments
+// a viewer reports missing (CONTROL_NACK) are sent again from, without
+// touching the encoder. Entries keep their buffers between frames, so once
+// warmed up storing a frame does not allocate.
+//
+// Viewers get a frame at different times (each at its own pace), so the
+// retransmit deadline runs from when the frame went out to the viewer that
+// asks, not from when it was stored.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <sys/uio.h>
+
+#include "stream_protocol.hpp"
+
+class SendHistory {
+public:
+    explicit SendHistory(size_t frames = 32, size_t viewers = 1) : entries_(frames), viewers_(viewers) {}
+
+    // Remember the datagrams of a frame; they must lie back to back in memory,
+    // as FramePacketizer lays them out
+    void store(uint32_t frame_id, const std::vector<struct iovec>& datagrams) {
+        if (datagrams.empty()) {
+            return;
+        }
+        Entry& entry = entries_[frame_id % entries_.size()];
+        entry.valid = false;
+
+        const uint8_t* base = (const uint8_t*)datagrams.front().iov_base;
+        const struct iovec& last = datagrams.back();
+        size_t total = (const uint8_t*)last.iov_base + last.iov_len - base;
+        entry.buffer.assign(base, base + total);
+
+        // Index the data fragments; parity is never retransmitted
+        FragmentHeader header;
+        entry.fragments.clear();
+        entry.datagrams.clear();
+        for (const struct iovec& datagram : datagrams) {
+            const uint8_t* bytes = (const uint8_t*)datagram.iov_base;
+            entry.datagrams.push_back({(size_t)(bytes - base), datagram.iov_len});
+            if (!readFragmentHeader(bytes, datagram.iov_len, header) || (header.flags & FLAG_PARITY)) {
+                continue;
+            }
+            if (entry.fragments.size() < header.fragment_count) {
+                entry.fragments.resize(header.fragment_count, {0, 0});
+            }
+            entry.fragments[header.fragment_index] = {(size_t)(bytes - base), datagram.iov_len};
+        }
+
+        entry.frame_id = frame_id;
+        entry.sent_us.assign(viewers_, 0);
+        entry.valid = true;
+    }
+
+    // The frame finished going out to viewer (a slot below the viewer count)
+    void markSent(uint32_t frame_id, size_t viewer, uint64_t now_us) {
+        Entry& entry = entries_[frame_id % entries_.size()];
+        if (entry.valid && entry.frame_id == frame_id && viewer < entry.sent_us.size()) {
+            entry.sent_us[viewer] = now_us;
+        }
+    }
+
+    // Append every datagram of a frame, parity included, to out. Returns how
+    // many were added, 0 if the frame already left the history. The iovecs
+    // stay valid until the next store().
+    size_t frame(uint32_t frame_id, std::vector<struct iovec>& out) {
+        Entry& entry = entries_[frame_id % entries_.size()];
+        if (!entry.valid || entry.frame_id != frame_id) {
+            return 0;
+        }
+        for (const Fragment& datagram : entry.datagrams) {
+            out.push_back({entry.buffer.data() + datagram.offset, datagram.size});
+        }
+        return entry.datagrams.size();
+    }
+
+    size_t capacity() const { return entries_.size(); }
+
+    // Append the datagrams viewer asked for with one NACK entry to out.
+    // Frames that left the history or went out to the viewer more than
+    // deadline_us ago are skipped: the client has given up on them by then.
+    // So are frames the viewer has not been sent yet, they are on their way.
+    // Returns how many were added. The iovecs point into the history and stay
+    // valid until the next store().
+    size_t lookup(const NackEntry& nack, size_t viewer, uint64_t now_us, uint64_t deadline_us,
+                  std::vector<struct iovec>& out) {
+        Entry& entry = entries_[nack.frame_id % entries_.size()];
+        if (!entry.valid || entry.frame_id != nack.frame_id || viewer >= entry.sent_us.size()) {
+            expired_++;
+            return 0;
+        }
+        uint64_t sent_us = entry.sent_us[viewer];
+        if (sent_us == 0) {
+            return 0;
+        }
+        if (now_us - sent_us > deadline_us) {
+            expired_++;
+            return 0;
+        }
+
+        size_t added = 0;
+        if (nack.first == NACK_WHOLE_FRAME) {
+            for (size_t i = 0; i < entry.fragments.size(); i++) {
+                added += append(entry, i, out);
+            }
+        } else {
+            added += append(entry, nack.first, out);
+            for (int bit = 0; bit < 16; bit++) {
+                if (nack.mask & (1 << bit)) {
+                    added += append(entry, nack.first + 1 + bit, out);
+                }
+            }
+        }
+        retransmitted_ += added;
+        return added;
+    }
+
+    unsigned long long retransmitted() const { return retransmitted_; }
+    unsigned long long expired() const { return expired_; } // NACKs that came too late
+
+private:
+    struct Fragment {
+        size_t offset;
+        size_t size; // 0 if the fragment was never sent
+    };
+
+    struct Entry {
+        bool valid = false;
+        uint32_t frame_id = 0;
+        std::vector<uint64_t> sent_us;   // Per viewer, 0 until the frame went out to it
+        std::vector<uint8_t> buffer;
+        std::vector<Fragment> fragments; // Data fragments by index
+        std::vector<Fragment> datagrams; // Everything, in sending order
+    };
+
+    static size_t append(Entry& entry, size_t index, std::vector<struct iovec>& out) {
+        if (index >= entry.fragments.size() || entry.fragments[index].size == 0) {
+            return 0;
+        }
+        out.push_back({entry.buffer.data() + entry.fragments[index].offset, entry.fragments[index].size});
+        return 1;
+    }
+
+    std::vector<Entry> entries_;
+    size_t viewers_;
+    unsigned long long retransmitted_ = 0;
+    unsigned long long expired_ = 0;
+};
@@ -0,0 +1,150 @@
+// Bounded lock-free single-producer/single-consumer queue used to connect
+// the pipeline stages of the relay server (one thread on each side).
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// What a stage does when the queue to the next stage is full
+enum class DropPolicy {
+    Block,      // Wait until the consumer has made room (lossless hand-off)
+    DropNewest  // Give the item back to the producer, who discards it
+};
+
+template <typename T>
+class SpscQueue {
+public:
+    // One slot is kept empty to tell "full" apart from "empty"
+    explicit SpscQueue(size_t capacity) : slots_(capacity + 1) {}
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer side: slot to fill in place, or nullptr if the queue is full.
+    // The slot becomes visible to the consumer only after endPush(). A batch
+    // fills several at once: offset n is the slot after the first n, and
+    // endPush(count) publishes the first count of them.
+    T* beginPush(size_t offset = 0) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        size_t used = tail >= head ? tail - head : tail + slots_.size() - head;
+        if (used + offset + 1 >= slots_.size()) {
+            return nullptr;
+        }
+        size_t index = tail + offset;
+        return &slots_[index >= slots_.size() ? index - slots_.size() : index];
+    }
+
+    void endPush(size_t count = 1) {
+        size_t tail = tail_.load(std::memory_order_relaxed) + count;
+        tail_.store(tail >= slots_.size() ? tail - slots_.size() : tail, std::memory_order_release);
+    }
+
+    bool tryPush(T&& item) {
+        T* slot = beginPush();
+        if (!slot) {
+            return false;
+        }
+        *slot = std::move(item);
+        endPush();
+        return true;
+    }
+
+    // Consumer side: oldest filled slot, or nullptr if the queue is empty.
+    // The slot is handed back to the producer only after pop().
+    T* front() {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &slots_[head];
+    }
+
+    void pop() {
+        size_t head = head_.load(std::memory_order_relaxed);
+        head_.store(next(head), std::memory_order_release);
+    }
+
+    bool tryPop(T& out) {
+        T* slot = front();
+        if (!slot) {
+            return false;
+        }
+        out = std::move(*slot);
+        pop();
+        return true;
+    }
+
+    size_t size() const {
+        size_t head = head_.load(std::memory_order_acquire);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        return tail >= head ? tail - head : tail + slots_.size() - head;
+    }
+
+    size_t capacity() const { return slots_.size() - 1; }
+
+private:
+    size_t next(size_t index) const { return index + 1 == slots_.size() ? 0 : index + 1; }
+
+    std::vector<T> slots_;
+    // Producer and consumer indices live on separate cache lines
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+
+// Spin briefly, then yield, then sleep, so idle stages do not burn a core
+class Backoff {
+public:
+    void wait() {
+        if (spins_ < 64) {
+            spins_++;
+        } else if (spins_ < 128) {
+            spins_++;
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+    void reset() { spins_ = 0; }
+
+private:
+    int spins_ = 0;
+};
+
+// Push according to the stage's drop policy. Returns false if the item was
+// not queued (queue full under DropNewest, or shutdown while blocked); the
+// item is left untouched so the caller can release it.
+template <typename T>
+bool pushWithPolicy(SpscQueue<T>& queue, T& item, DropPolicy policy, const std::atomic<bool>& running) {
+    Backoff backoff;
+    while (true) {
+        T* slot = queue.beginPush();
+        if (slot) {
+            *slot = std::move(item);
+            queue.endPush();
+            return true;
+        }
+        if (policy == DropPolicy::DropNewest || !running.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        backoff.wait();
+    }
+}
+
+// Wait for an item. Returns false only on shutdown.
+template <typename T>
+bool popBlocking(SpscQueue<T>& queue, T& out, const std::atomic<bool>& running) {
+    Backoff backoff;
+    while (!queue.tryPop(out)) {
+        if (!running.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        backoff.wait();
+    }
+    return true;
+}
@@ -0,0 +1,898 @@
+// Relay -> client video transport. Every datagram carries a small header
+// describing where its payload belongs, so the client can reassemble frames
+// from fragments that arrive out of order and notice losses straight away.
+//
+// Datagram layout (all fields big endian):
+//   0  uint8   version         PROTOCOL_VERSION
+//   1  uint8   flags           FLAG_*
+//   2  uint16  fragment_index  0 .. fragment_count - 1 (parity: 0 .. parity fragments - 1)
+//   4  uint16  fragment_count  data fragments in this frame
+//   6  uint8   fec_group       data fragments per FEC group (k), 0 without FEC
+//   7  uint8   fec_parity      parity fragments per FEC group (m)
+//   8  uint32  frame_id        increments by one per encoded frame
+//  12  uint32  frame_size      bytes in the whole encoded frame
+//  16  uint32  fragment_offset where the payload goes in the frame (parity: XOR of the covered offsets)
+//  20  uint64  send_time_us    sender wall clock when the frame was sent
+//  28  uint16  payload_size    payload bytes (parity: XOR of the covered sizes)
+//  30  uint16  reserved
+//  32  payload
+//
+// Forward error correction: data fragments are split into groups of k, and
+// parity fragment j of a group is the XOR of fragments j, j + m, j + 2m, ...
+// of that group (zero padded to the longest). Each parity fragment repairs one
+// loss among the fragments it covers, so interleaving them this way recovers
+// any burst of up to m consecutive losses within a group. A group's parity
+// fragments are sent right after its data.
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <sys/uio.h>
+
+const uint8_t PROTOCOL_VERSION = 2;
+const size_t FRAGMENT_HEADER_SIZE = 32;
+const size_t MAX_DATAGRAM_SIZE = 1400; // Stays below a typical MTU
+const size_t MAX_FRAGMENT_PAYLOAD = MAX_DATAGRAM_SIZE - FRAGMENT_HEADER_SIZE;
+
+const size_t MAX_FRAME_SIZE = 1024 * 1024;   // Largest encoded frame the client accepts
+const size_t MAX_FRAGMENTS = 2048;           // Fragments per frame, bounds the reassembly bitmaps
+const size_t MAX_PARITY_FRAGMENTS = 512;     // Parity fragments per frame
+
+const uint8_t FLAG_KEYFRAME = 0x01;  // Frame is an IDR picture
+const uint8_t FLAG_NAL_START = 0x02; // Payload starts with a NAL unit start code
+const uint8_t FLAG_NAL_END = 0x04;   // Payload ends at the end of a NAL unit
+const uint8_t FLAG_PARITY = 0x08;    // FEC parity instead of frame data
+
+struct FragmentHeader {
+    uint8_t version;
+    uint8_t flags;
+    uint16_t fragment_index;
+    uint16_t fragment_count;
+    uint8_t fec_group;
+    uint8_t fec_parity;
+    uint32_t frame_id;
+    uint32_t frame_size;
+    uint32_t fragment_offset;
+    uint64_t send_time_us;
+    uint16_t payload_size;
+};
+
+// FEC settings for one frame
+struct FecParams {
+    uint8_t group_size = 0; // Data fragments per group (k), 0 disables FEC
+    uint8_t parity = 0;     // Parity fragments per group (m), at most group_size
+};
+
+// Microseconds on the wall clock, comparable between hosts synced with NTP
+inline uint64_t wallClockMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Microseconds on a monotonic clock, for local timeouts
+inline uint64_t steadyMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void putBigEndian(uint8_t* out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+inline uint64_t getBigEndian(const uint8_t* in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+inline void writeFragmentHeader(uint8_t* out, const FragmentHeader& header) {
+    out[0] = header.version;
+    out[1] = header.flags;
+    putBigEndian(out + 2, header.fragment_index, 2);
+    putBigEndian(out + 4, header.fragment_count, 2);
+    out[6] = header.fec_group;
+    out[7] = header.fec_parity;
+    putBigEndian(out + 8, header.frame_id, 4);
+    putBigEndian(out + 12, header.frame_size, 4);
+    putBigEndian(out + 16, header.fragment_offset, 4);
+    putBigEndian(out + 20, header.send_time_us, 8);
+    putBigEndian(out + 28, header.payload_size, 2);
+    putBigEndian(out + 30, 0, 2);
+}
+
+// Parses and sanity checks a header. The payload is the rest of the datagram.
+inline bool readFragmentHeader(const uint8_t* in, size_t size, FragmentHeader& header) {
+    if (size < FRAGMENT_HEADER_SIZE || size > MAX_DATAGRAM_SIZE || in[0] != PROTOCOL_VERSION) {
+        return false;
+    }
+    header.version = in[0];
+    header.flags = in[1];
+    header.fragment_index = getBigEndian(in + 2, 2);
+    header.fragment_count = getBigEndian(in + 4, 2);
+    header.fec_group = in[6];
+    header.fec_parity = in[7];
+    header.frame_id = getBigEndian(in + 8, 4);
+    header.frame_size = getBigEndian(in + 12, 4);
+    header.fragment_offset = getBigEndian(in + 16, 4);
+    header.send_time_us = getBigEndian(in + 20, 8);
+    header.payload_size = getBigEndian(in + 28, 2);
+
+    if (header.fragment_count == 0 || header.fragment_count > MAX_FRAGMENTS ||
+        header.frame_size > MAX_FRAME_SIZE || header.fec_parity > header.fec_group) {
+        return false;
+    }
+
+    size_t payload = size - FRAGMENT_HEADER_SIZE;
+    if (header.flags & FLAG_PARITY) {
+        return header.fec_parity > 0 && header.fragment_index < MAX_PARITY_FRAGMENTS;
+    }
+    return header.fragment_index < header.fragment_count && header.payload_size == payload &&
+           header.fragment_offset + payload <= header.frame_size;
+}
+
+// Client -> server control messages, sent to the server's registration port.
+// They start with CONTROL_MAGIC, which no registration text does.
+//   0  uint8   CONTROL_MAGIC
+//   1  uint8   type            CONTROL_*
+//   2  uint8   camera          stream the client watches, as in its registration
+//   3  body
+//
+// A server that has forgotten the client (restart, timeout) takes it back on
+// any control message, so each one says which camera to go back to.
+//
+// CONTROL_NACK body: up to MAX_NACK_ENTRIES entries of
+//   uint32  frame_id
+//   uint16  first           missing fragment index, NACK_WHOLE_FRAME if nothing of the frame arrived
+//   uint16  mask            bit b set: fragment first + 1 + b is missing too
+//
+// CONTROL_PLI (picture loss) has no body: the client cannot decode until the
+// next keyframe and asks for one now.
+//
+// CONTROL_HEARTBEAT has no body: the client is still watching. Any control
+// message counts, so a client only needs it when it has nothing else to say.
+//
+// CONTROL_REPORT (receiver report) body:
+//   uint32  datagrams_received  valid datagrams so far, duplicates included (wraps)
+//   uint32  jitter_us           interarrival jitter of frames (RFC 3550 style)
+//   uint32  spread_us           average time from first to last fragment of a frame
+//   uint32  decode_us           average time the decoder took per frame
+// The averages cover the frames since the previous report. The client does
+// not know what was sent, so the server works the loss fraction out itself
+// from datagrams_received and what it sent the client in between.
+const uint8_t CONTROL_MAGIC = 0xFB;
+const uint8_t CONTROL_NACK = 1;
+const uint8_t CONTROL_PLI = 2;
+const uint8_t CONTROL_HEARTBEAT = 3;
+const uint8_t CONTROL_REPORT = 4;
+const size_t CONTROL_HEADER_SIZE = 3;
+const size_t REPORT_SIZE = CONTROL_HEADER_SIZE + 16;
+const uint16_t NACK_WHOLE_FRAME = 0xFFFF;
+const size_t NACK_ENTRY_SIZE = 8;
+const size_t MAX_NACK_ENTRIES = 128;
+const size_t MAX_NACK_SIZE = CONTROL_HEADER_SIZE + MAX_NACK_ENTRIES * NACK_ENTRY_SIZE;
+
+struct ReceiverReport {
+    uint32_t datagrams_received;
+    uint32_t jitter_us;
+    uint32_t spread_us;
+    uint32_t decode_us;
+};
+
+struct NackEntry {
+    uint32_t frame_id;
+    uint16_t first;
+    uint16_t mask;
+};
+
+inline bool isControlMessage(const uint8_t* data, size_t size) {
+    return size >= CONTROL_HEADER_SIZE && data[0] == CONTROL_MAGIC;
+}
+
+// Camera named by a control message
+inline int readControlCamera(const uint8_t* data) {
+    return data[2];
+}
+
+inline void writeControlHeader(uint8_t* out, uint8_t type, int camera) {
+    out[0] = CONTROL_MAGIC;
+    out[1] = type;
+    out[2] = (uint8_t)camera;
+}
+
+// Serialize a NACK, returns its size in bytes
+inline size_t writeNack(uint8_t* out, const NackEntry* entries, size_t count, int camera = 0) {
+    count = std::min(count, MAX_NACK_ENTRIES);
+    writeControlHeader(out, CONTROL_NACK, camera);
+    uint8_t* entry = out + CONTROL_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++, entry += NACK_ENTRY_SIZE) {
+        putBigEndian(entry, entries[i].frame_id, 4);
+        putBigEndian(entry + 4, entries[i].first, 2);
+        putBigEndian(entry + 6, entries[i].mask, 2);
+    }
+    return CONTROL_HEADER_SIZE + count * NACK_ENTRY_SIZE;
+}
+
+// Serialize a picture loss indication, returns its size in bytes
+inline size_t writePictureLoss(uint8_t* out, int camera = 0) {
+    writeControlHeader(out, CONTROL_PLI, camera);
+    return CONTROL_HEADER_SIZE;
+}
+
+// Serialize a heartbeat, returns its size in bytes
+inline size_t writeHeartbeat(uint8_t* out, int camera = 0) {
+    writeControlHeader(out, CONTROL_HEARTBEAT, camera);
+    return CONTROL_HEADER_SIZE;
+}
+
+// Serialize a receiver report, returns its size in bytes
+inline size_t writeReport(uint8_t* out, const ReceiverReport& report, int camera = 0) {
+    writeControlHeader(out, CONTROL_REPORT, camera);
+    uint8_t* body = out + CONTROL_HEADER_SIZE;
+    putBigEndian(body, report.datagrams_received, 4);
+    putBigEndian(body + 4, report.jitter_us, 4);
+    putBigEndian(body + 8, report.spread_us, 4);
+    putBigEndian(body + 12, report.decode_us, 4);
+    return REPORT_SIZE;
+}
+
+// Parse a receiver report, false if it is not one
+inline bool readReport(const uint8_t* data, size_t size, ReceiverReport& report) {
+    if (!isControlMessage(data, size) || data[1] != CONTROL_REPORT || size < REPORT_SIZE) {
+        return false;
+    }
+    const uint8_t* body = data + CONTROL_HEADER_SIZE;
+    report.datagrams_received = getBigEndian(body, 4);
+    report.jitter_us = getBigEndian(body + 4, 4);
+    report.spread_us = getBigEndian(body + 8, 4);
+    report.decode_us = getBigEndian(body + 12, 4);
+    return true;
+}
+
+// Parse a NACK, returns the number of entries (0 if it is not a NACK)
+inline size_t readNack(const uint8_t* data, size_t size, NackEntry* entries, size_t capacity) {
+    if (!isControlMessage(data, size) || data[1] != CONTROL_NACK) {
+        return 0;
+    }
+    size_t count = std::min((size - CONTROL_HEADER_SIZE) / NACK_ENTRY_SIZE, capacity);
+    const uint8_t* entry = data + CONTROL_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++, entry += NACK_ENTRY_SIZE) {
+        entries[i].frame_id = getBigEndian(entry, 4);
+        entries[i].first = getBigEndian(entry + 4, 2);
+        entries[i].mask = getBigEndian(entry + 6, 2);
+    }
+    return count;
+}
+
+// Server side: splits encoded frames into datagrams, plus FEC parity if asked.
+//
+// Fragments follow NAL unit boundaries where possible: small units share a
+// fragment, and a unit that does not fit in the space left starts a new
+// one. A lost datagram then takes out as few slices as possible. All
+// datagrams are laid out back to back in one buffer, so runs of full-size
+// fragments can be handed to the kernel as a single GSO send.
+class FramePacketizer {
+public:
+    // Returns the datagrams for one frame, valid until the next call. Empty if
+    // the frame is too large for the client to reassemble.
+    const std::vector<struct iovec>& packetize(const uint8_t* data, size_t size, uint32_t frame_id,
+                                               bool keyframe, uint64_t send_time_us,
+                                               FecParams fec = FecParams()) {
+        datagrams_.clear();
+        fragments_.clear();
+        if (size == 0 || size > MAX_FRAME_SIZE) {
+            return datagrams_;
+        }
+
+        planFragments(data, size);
+        size_t count = fragments_.size();
+        if (count > MAX_FRAGMENTS) {
+            fragments_.clear();
+            return datagrams_;
+        }
+
+        // Without FEC the whole frame is treated as one group with no parity
+        fec.parity = std::min(fec.parity, fec.group_size);
+        if (fec.parity == 0 || (count + fec.group_size - 1) / fec.group_size * fec.parity > MAX_PARITY_FRAGMENTS) {
+            fec = FecParams();
+        }
+        size_t group_size = fec.group_size > 0 ? fec.group_size : count;
+
+        size_t total = count * FRAGMENT_HEADER_SIZE + size;
+        for (size_t group = 0; fec.parity > 0 && group * group_size < count; group++) {
+            for (size_t j = 0; j < fec.parity; j++) {
+                size_t longest = parityPayloadSize(group, j, group_size, fec.parity);
+                total += longest > 0 ? FRAGMENT_HEADER_SIZE + longest : 0;
+            }
+        }
+        buffer_.resize(total);
+        uint8_t* out = buffer_.data();
+
+        FragmentHeader header;
+        header.version = PROTOCOL_VERSION;
+        header.fragment_count = count;
+        header.fec_group = fec.group_size;
+        header.fec_parity = fec.parity;
+        header.frame_id = frame_id;
+        header.frame_size = size;
+        header.send_time_us = send_time_us;
+
+        for (size_t i = 0; i < count; i++) {
+            const Fragment& fragment = fragments_[i];
+            header.fragment_index = i;
+            header.fragment_offset = fragment.offset;
+            header.payload_size = fragment.size;
+            header.flags = (keyframe ? FLAG_KEYFRAME : 0) |
+                           (fragment.nal_start ? FLAG_NAL_START : 0) |
+                           (fragment.nal_end ? FLAG_NAL_END : 0);
+
+            writeFragmentHeader(out, header);
+            memcpy(out + FRAGMENT_HEADER_SIZE, data + fragment.offset, fragment.size);
+
+            size_t datagram_size = FRAGMENT_HEADER_SIZE + fragment.size;
+            datagrams_.push_back({out, datagram_size});
+            out += datagram_size;
+
+            // A group's parity follows its last data fragment
+            if (fec.parity > 0 && ((i + 1) % group_size == 0 || i + 1 == count)) {
+                size_t group = i / group_size;
+                for (size_t j = 0; j < fec.parity; j++) {
+                    out = writeParity(out, data, header, group, j, group_size, fec.parity, keyframe);
+                }
+            }
+        }
+        return datagrams_;
+    }
+
+private:
+    struct Fragment {
+        size_t offset;
+        size_t size;
+        bool nal_start;
+        bool nal_end;
+    };
+
+    // Longest data fragment covered by parity j of a group, 0 if it covers none
+    size_t parityPayloadSize(size_t group, size_t j, size_t group_size, size_t parity) const {
+        size_t end = std::min((group + 1) * group_size, fragments_.size());
+        size_t longest = 0;
+        for (size_t i = group * group_size + j; i < end; i += parity) {
+            longest = std::max(longest, fragments_[i].size);
+        }
+        return longest;
+    }
+
+    uint8_t* writeParity(uint8_t* out, const uint8_t* data, FragmentHeader header, size_t group, size_t j,
+                         size_t group_size, size_t parity, bool keyframe) {
+        size_t longest = parityPayloadSize(group, j, group_size, parity);
+        if (longest == 0) {
+            return out;
+        }
+
+        uint8_t* payload = out + FRAGMENT_HEADER_SIZE;
+        memset(payload, 0, longest);
+        header.fragment_offset = 0;
+        header.payload_size = 0;
+        size_t end = std::min((group + 1) * group_size, fragments_.size());
+        for (size_t i = group * group_size + j; i < end; i += parity) {
+            const Fragment& fragment = fragments_[i];
+            header.fragment_offset ^= fragment.offset;
+            header.payload_size ^= fragment.size;
+            const uint8_t* source = data + fragment.offset;
+            for (size_t b = 0; b < fragment.size; b++) {
+                payload[b] ^= source[b];
+            }
+        }
+        header.fragment_index = group * parity + j;
+        header.flags = FLAG_PARITY | (keyframe ? FLAG_KEYFRAME : 0);
+        writeFragmentHeader(out, header);
+
+        size_t datagram_size = FRAGMENT_HEADER_SIZE + longest;
+        datagrams_.push_back({out, datagram_size});
+        return out + datagram_size;
+    }
+
+    // Offset of the next start code at or after pos, or size
+    static size_t nextStartCode(const uint8_t* data, size_t size, size_t pos) {
+        while (pos + 3 <= size) {
+            const uint8_t* one = (const uint8_t*)memchr(data + pos + 2, 1, size - pos - 2);
+            if (!one) {
+                break;
+            }
+            size_t p = one - data;
+            if (data[p - 1] == 0 && data[p - 2] == 0) {
+                return (p >= pos + 3 && data[p - 3] == 0) ? p - 3 : p - 2;
+            }
+            pos = p - 1;
+        }
+        return size;
+    }
+
+    void planFragments(const uint8_t* data, size_t size) {
+        // Collect NAL unit boundaries; anything before the first start code
+        // is treated as part of the first unit
+        nal_ends_.clear();
+        size_t pos = nextStartCode(data, size, 0);
+        while (pos < size) {
+            size_t next = nextStartCode(data, size, pos + 3);
+            nal_ends_.push_back(next);
+            pos = next;
+        }
+        if (nal_ends_.empty() || nal_ends_.back() != size) {
+            nal_ends_.push_back(size);
+        }
+
+        Fragment current = {0, 0, true, false};
+        size_t unit_start = 0;
+        for (size_t unit_end : nal_ends_) {
+            size_t unit_size = unit_end - unit_start;
+
+            // A unit that does not fit in what is left of the current fragment
+            // starts a new one, unless it would not fit in any fragment anyway
+            if (current.size > 0 && current.size + unit_size > MAX_FRAGMENT_PAYLOAD) {
+                current.nal_end = true;
+                fragments_.push_back(current);
+                current = {unit_start, 0, true, false};
+            }
+
+            size_t remaining = unit_size;
+            while (current.size + remaining > MAX_FRAGMENT_PAYLOAD) {
+                size_t take = MAX_FRAGMENT_PAYLOAD - current.size;
+                current.size += take;
+                remaining -= take;
+                current.nal_end = false;
+                fragments_.push_back(current);
+                current = {current.offset + current.size, 0, false, false};
+            }
+            current.size += remaining;
+            unit_start = unit_end;
+        }
+        current.nal_end = true;
+        fragments_.push_back(current);
+    }
+
+    std::vector<size_t> nal_ends_;
+    std::vector<Fragment> fragments_;
+    std::vector<uint8_t> buffer_;
+    std::vector<struct iovec> datagrams_;
+};
+
+// A complete frame handed out by FrameReassembler
+struct ReassembledFrame {
+    const uint8_t* data;
+    size_t size;
+    uint32_t frame_id;
+    bool keyframe;
+    bool recovered;            // At least one fragment was rebuilt from parity
+    uint64_t send_time_us;     // Sender wall clock
+    uint64_t first_arrival_us; // Local steady clock, first fragment
+    uint64_t complete_us;      // Local steady clock, last fragment
+};
+
+// Client side: rebuilds frames from fragments in a fixed set of slots.
+//
+// All memory is allocated up front. Fragments are copied straight to their
+// offset in the frame's slot and tracked in a bitmap, so order does not
+// matter and duplicates are ignored. Parity fragments are kept next to the
+// frame, and a missing fragment is rebuilt as soon as its parity and all
+// the other fragments it covers are in. Frames are handed out strictly in
+// frame_id order; as soon as a newer frame is complete, an older incomplete
+// one is declared lost (after max_wait_us, 0 by default).
+//
+// With NACKs enabled, collectNacks() lists what is still missing: gaps in a
+// frame once a newer frame has started to arrive, or below the highest
+// fragment seen so far, asked for again every interval until the frame is
+// complete or given up.
+class FrameReassembler {
+public:
+    static const size_t SLOTS = 8; // Frames that can be in flight at once
+    // A frame id this far from the expected one means the sender started
+    // over (e.g. a relay restart) rather than reordering or loss
+    static const int32_t RESYNC_DISTANCE = 4 * SLOTS;
+
+    enum Result {
+        Accepted,   // Fragment stored
+        Duplicate,  // Fragment already seen
+        Stale,      // Fragment of a frame that was already delivered or given up
+        Invalid     // Not a valid datagram of this protocol
+    };
+
+    explicit FrameReassembler(uint64_t max_wait_us = 0) : max_wait_us_(max_wait_us) {
+        for (Slot& slot : slots_) {
+            // Zeroed padding after the largest frame, as the decoder may read past the end
+            slot.data.assign(MAX_FRAME_SIZE + 64, 0);
+            slot.parity.assign(MAX_PARITY_FRAGMENTS * MAX_FRAGMENT_PAYLOAD, 0);
+        }
+    }
+
+    // Ask for retransmissions every interval_us, 0 turns NACKs off
+    void setNackInterval(uint64_t interval_us) { nack_interval_us_ = interval_us; }
+
+    // Store one received datagram
+    Result push(const uint8_t* datagram, size_t size, uint64_t now_us) {
+        FragmentHeader header;
+        if (!readFragmentHeader(datagram, size, header)) {
+            invalid_++;
+            return Invalid;
+        }
+
+        if (!started_) {
+            started_ = true;
+            next_frame_id_ = header.frame_id;
+            newest_seen_id_ = header.frame_id;
+        }
+
+        int32_t ahead = (int32_t)(header.frame_id - next_frame_id_);
+        if (ahead <= -RESYNC_DISTANCE || ahead >= RESYNC_DISTANCE) {
+            resync(header.frame_id);
+            ahead = 0;
+        }
+        if (ahead < 0) {
+            stale_++;
+            return Stale;
+        }
+        // No slot left for this frame: give up on the oldest ones. Only the
+        // first SLOTS of them can hold anything, the rest are skipped.
+        if (ahead >= (int32_t)SLOTS) {
+            uint32_t skip = ahead - SLOTS + 1;
+            for (uint32_t i = 0; i < skip && i < SLOTS; i++) {
+                abandonNext();
+            }
+            if (skip > SLOTS) {
+                frames_lost_ += skip - SLOTS;
+                next_frame_id_ += skip - SLOTS;
+            }
+        }
+        if ((int32_t)(header.frame_id - newest_seen_id_) > 0) {
+            newest_seen_id_ = header.frame_id;
+        }
+
+        Slot& slot = slots_[header.frame_id % SLOTS];
+        if (!slot.active || slot.frame_id != header.frame_id) {
+            slot.active = true;
+            slot.frame_id = header.frame_id;
+            slot.frame_size = header.frame_size;
+            slot.fragment_count = header.fragment_count;
+            slot.fec_group = header.fec_group;
+            slot.fec_parity = header.fec_parity;
+            slot.received = 0;
+            slot.recovered = false;
+            slot.keyframe = (header.flags & FLAG_KEYFRAME) != 0;
+            slot.send_time_us = header.send_time_us;
+            slot.first_arrival_us = now_us;
+            slot.complete_us = 0;
+            slot.known_sent = 0;
+            slot.last_nack_us = 0;
+            memset(slot.bitmap, 0, sizeof(slot.bitmap));
+            memset(slot.parity_bitmap, 0, sizeof(slot.parity_bitmap));
+        } else if (slot.fragment_count != header.fragment_count || slot.frame_size != header.frame_size ||
+                   slot.fec_group != header.fec_group || slot.fec_parity != header.fec_parity) {
+            invalid_++;
+            return Invalid;
+        }
+
+        const uint8_t* payload = datagram + FRAGMENT_HEADER_SIZE;
+        size_t payload_size = size - FRAGMENT_HEADER_SIZE;
+        size_t index = header.fragment_index;
+
+        if (header.flags & FLAG_PARITY) {
+            if (hasBit(slot.parity_bitmap, index)) {
+                duplicates_++;
+                return Duplicate;
+            }
+            setBit(slot.parity_bitmap, index);
+            memcpy(slot.parity.data() + index * MAX_FRAGMENT_PAYLOAD, payload, payload_size);
+            slot.parity_offsets[index] = header.fragment_offset;
+            slot.parity_sizes[index] = header.payload_size;
+            slot.parity_lengths[index] = payload_size;
+            parity_received_++;
+
+            // Parity follows its group, so the whole group has been sent
+            size_t group_end = (index / slot.fec_parity + 1) * slot.fec_group;
+            slot.known_sent = std::max<size_t>(slot.known_sent, std::min<size_t>(group_end, slot.fragment_count));
+
+            tryRecover(slot, index / slot.fec_parity, index % slot.fec_parity, now_us);
+            return Accepted;
+        }
+
+        if (hasBit(slot.bitmap, index)) {
+            duplicates_++;
+            return Duplicate;
+        }
+        memcpy(slot.data.data() + header.fragment_offset, payload, payload_size);
+        storeFragment(slot, index, header.fragment_offset, payload_size, now_us);
+        fragments_received_++;
+        slot.known_sent = std::max<size_t>(slot.known_sent, index + 1);
+
+        if (slot.fec_parity > 0) {
+            tryRecover(slot, index / slot.fec_group, (index % slot.fec_group) % slot.fec_parity, now_us);
+        }
+        return Accepted;
+    }
+
+    // Next frame in order, if it is complete. The data stays valid until the
+    // next call to push().
+    bool nextFrame(ReassembledFrame& frame, uint64_t now_us) {
+        while (started_) {
+            Slot& slot = slots_[next_frame_id_ % SLOTS];
+            bool present = slot.active && slot.frame_id == next_frame_id_;
+
+            if (present && slot.received == slot.fragment_count) {
+                frame.data = slot.data.data();
+                frame.size = slot.frame_size;
+                frame.frame_id = slot.frame_id;
+                frame.keyframe = slot.keyframe;
+                frame.recovered = slot.recovered;
+                frame.send_time_us = slot.send_time_us;
+                frame.first_arrival_us = slot.first_arrival_us;
+                frame.complete_us = slot.complete_us;
+
+                // The data stays in the slot until a later frame claims it
+                slot.active = false;
+                next_frame_id_++;
+                frames_completed_++;
+                if (slot.recovered) {
+                    frames_recovered_++;
+                }
+                return true;
+            }
+
+            // Waiting only makes sense while nothing newer is ready
+            if (!newest_complete_set_ || (int32_t)(newest_complete_id_ - next_frame_id_) <= 0) {
+                return false;
+            }
+            uint64_t since = present ? slot.first_arrival_us : newest_complete_us_;
+            if (now_us - since < max_wait_us_) {
+                return false;
+            }
+            abandonNext();
+        }
+        return false;
+    }
+
+    // Build a NACK for everything that is missing and due to be asked for
+    // (again), for the given camera. Writes at most MAX_NACK_SIZE bytes to
+    // message and returns the size, 0 if there is nothing to ask for.
+    size_t collectNacks(uint64_t now_us, uint8_t* message, int camera = 0) {
+        if (!started_ || nack_interval_us_ == 0) {
+            return 0;
+        }
+
+        NackEntry entries[MAX_NACK_ENTRIES];
+        size_t count = 0;
+        for (uint32_t id = next_frame_id_; (int32_t)(id - newest_seen_id_) <= 0 && count < MAX_NACK_ENTRIES; id++) {
+            Slot& slot = slots_[id % SLOTS];
+            bool present = slot.active && slot.frame_id == id;
+            bool newer_started = (int32_t)(newest_seen_id_ - id) > 0;
+
+            if (!present) {
+                // Not a single fragment arrived, ask for all of it
+                if (unseen_id_[id % SLOTS] != id) {
+                    unseen_id_[id % SLOTS] = id;
+                    unseen_nack_us_[id % SLOTS] = 0;
+                }
+                uint64_t& last = unseen_nack_us_[id % SLOTS];
+                if (last == 0 || now_us - last >= nack_interval_us_) {
+                    entries[count++] = {id, NACK_WHOLE_FRAME, 0};
+                    last = now_us;
+                }
+                continue;
+            }
+
+            if (slot.received == slot.fragment_count ||
+                (slot.last_nack_us != 0 && now_us - slot.last_nack_us < nack_interval_us_)) {
+                continue;
+            }
+
+            // In the newest frame only gaps below what has arrived are known to be lost
+            size_t limit = newer_started ? slot.fragment_count : slot.known_sent;
+            bool asked = false;
+            for (size_t i = 0; i < limit && count < MAX_NACK_ENTRIES; i++) {
+                if (hasBit(slot.bitmap, i)) {
+                    continue;
+                }
+                NackEntry* last = count > 0 ? &entries[count - 1] : nullptr;
+                if (asked && last->frame_id == id && i - last->first <= 16) {
+                    last->mask |= 1 << (i - last->first - 1);
+                } else {
+                    entries[count++] = {id, (uint16_t)i, 0};
+                }
+                asked = true;
+            }
+            if (asked) {
+                slot.last_nack_us = now_us;
+            }
+        }
+
+        if (count == 0) {
+            return 0;
+        }
+        nacks_sent_++;
+        return writeNack(message, entries, count, camera);
+    }
+
+    // Fragments still missing from the oldest frame being collected
+    size_t missingFragments() const {
+        if (!started_) {
+            return 0;
+        }
+        const Slot& slot = slots_[next_frame_id_ % SLOTS];
+        if (!slot.active || slot.frame_id != next_frame_id_) {
+            return 0;
+        }
+        return slot.fragment_count - slot.received;
+    }
+
+    unsigned long long framesCompleted() const { return frames_completed_; }
+    unsigned long long framesRecovered() const { return frames_recovered_; } // Completed thanks to FEC
+    unsigned long long framesLost() const { return frames_lost_; }           // Given up on, even with FEC
+    unsigned long long fragmentsReceived() const { return fragments_received_; }
+    // Every valid datagram that arrived, wanted or not: what the sender's
+    // count is compared with to tell how many were lost on the way
+    unsigned long long datagramsReceived() const { return fragments_received_ + parity_received_ + duplicates_ + stale_; }
+    unsigned long long fragmentsRecovered() const { return fragments_recovered_; }
+    unsigned long long parityReceived() const { return parity_received_; }
+    unsigned long long nacksSent() const { return nacks_sent_; }
+    unsigned long long duplicates() const { return duplicates_; }
+    unsigned long long staleFragments() const { return stale_; }
+    unsigned long long invalidDatagrams() const { return invalid_; }
+    // Times the sender's frame ids jumped and collection started over. The
+    // decoder needs a keyframe after each.
+    unsigned long long resyncs() const { return resyncs_; }
+
+private:
+    struct Slot {
+        bool active = false;
+        uint32_t frame_id = 0;
+        uint32_t frame_size = 0;
+        uint16_t fragment_count = 0;
+        uint16_t received = 0;
+        uint8_t fec_group = 0;
+        uint8_t fec_parity = 0;
+        bool recovered = false;
+        bool keyframe = false;
+        uint64_t send_time_us = 0;
+        uint64_t first_arrival_us = 0;
+        uint64_t complete_us = 0;
+        uint16_t known_sent = 0;    // Leading data fragments the sender has certainly sent
+        uint64_t last_nack_us = 0;  // 0 if never asked for
+        uint64_t bitmap[MAX_FRAGMENTS / 64];
+        uint32_t offsets[MAX_FRAGMENTS];
+        uint16_t sizes[MAX_FRAGMENTS];
+        std::vector<uint8_t> data;
+
+        uint64_t parity_bitmap[MAX_PARITY_FRAGMENTS / 64];
+        uint32_t parity_offsets[MAX_PARITY_FRAGMENTS]; // XOR of the covered offsets
+        uint16_t parity_sizes[MAX_PARITY_FRAGMENTS];   // XOR of the covered sizes
+        uint16_t parity_lengths[MAX_PARITY_FRAGMENTS]; // Bytes of parity payload
+        std::vector<uint8_t> parity;                   // MAX_FRAGMENT_PAYLOAD per parity fragment
+    };
+
+    static bool hasBit(const uint64_t* bitmap, size_t index) {
+        return (bitmap[index / 64] >> (index % 64)) & 1;
+    }
+
+    static void setBit(uint64_t* bitmap, size_t index) {
+        bitmap[index / 64] |= 1ULL << (index % 64);
+    }
+
+    void storeFragment(Slot& slot, size_t index, uint32_t offset, size_t size, uint64_t now_us) {
+        setBit(slot.bitmap, index);
+        slot.offsets[index] = offset;
+        slot.sizes[index] = size;
+        slot.received++;
+        if (slot.received == slot.fragment_count) {
+            slot.complete_us = now_us;
+            if (!newest_complete_set_ || (int32_t)(slot.frame_id - newest_complete_id_) > 0) {
+                newest_complete_set_ = true;
+                newest_complete_id_ = slot.frame_id;
+                newest_complete_us_ = now_us;
+            }
+        }
+    }
+
+    // Rebuild the fragment covered by parity j of a group if it is the only
+    // one of its stripe still missing
+    void tryRecover(Slot& slot, size_t group, size_t j, uint64_t now_us) {
+        size_t parity_index = group * slot.fec_parity + j;
+        if (parity_index >= MAX_PARITY_FRAGMENTS || !hasBit(slot.parity_bitmap, parity_index)) {
+            return;
+        }
+
+        size_t first = group * slot.fec_group + j;
+        size_t end = std::min(first - j + slot.fec_group, (size_t)slot.fragment_count);
+        size_t missing = MAX_FRAGMENTS;
+        uint32_t offset = slot.parity_offsets[parity_index];
+        size_t size = slot.parity_sizes[parity_index];
+        for (size_t i = first; i < end; i += slot.fec_parity) {
+            if (!hasBit(slot.bitmap, i)) {
+                if (missing != MAX_FRAGMENTS) {
+                    return; // More than one loss, this parity cannot help (yet)
+                }
+                missing = i;
+            } else {
+                offset ^= slot.offsets[i];
+                size ^= slot.sizes[i];
+            }
+        }
+        if (missing == MAX_FRAGMENTS || size > slot.parity_lengths[parity_index] ||
+            offset + size > slot.frame_size) {
+            return;
+        }
+
+        uint8_t* out = slot.data.data() + offset;
+        memcpy(out, slot.parity.data() + parity_index * MAX_FRAGMENT_PAYLOAD, size);
+        for (size_t i = first; i < end; i += slot.fec_parity) {
+            if (i == missing) {
+                continue;
+            }
+            const uint8_t* other = slot.data.data() + slot.offsets[i];
+            size_t overlap = std::min<size_t>(size, slot.sizes[i]);
+            for (size_t b = 0; b < overlap; b++) {
+                out[b] ^= other[b];
+            }
+        }
+
+        slot.recovered = true;
+        fragments_recovered_++;
+        storeFragment(slot, missing, offset, size, now_us);
+    }
+
+    // Give up on the frame that is next in line
+    void abandonNext() {
+        Slot& slot = slots_[next_frame_id_ % SLOTS];
+        if (slot.active && slot.frame_id == next_frame_id_) {
+            slot.active = false;
+        }
+        frames_lost_++;
+        next_frame_id_++;
+    }
+
+    // Drop everything in flight and continue from frame_id
+    void resync(uint32_t frame_id) {
+        for (Slot& slot : slots_) {
+            slot.active = false;
+        }
+        memset(unseen_nack_us_, 0, sizeof(unseen_nack_us_));
+        newest_complete_set_ = false;
+        next_frame_id_ = frame_id;
+        newest_seen_id_ = frame_id;
+        resyncs_++;
+    }
+
+    Slot slots_[SLOTS];
+    uint64_t max_wait_us_;
+    uint64_t nack_interval_us_ = 0;
+
+    bool started_ = false;
+    uint32_t next_frame_id_ = 0;
+    uint32_t newest_seen_id_ = 0;
+
+    // NACK bookkeeping for frames of which nothing has arrived
+    uint32_t unseen_id_[SLOTS] = {};
+    uint64_t unseen_nack_us_[SLOTS] = {};
+
+    bool newest_complete_set_ = false;
+    uint32_t newest_complete_id_ = 0;
+    uint64_t newest_complete_us_ = 0;
+
+    unsigned long long frames_completed_ = 0;
+    unsigned long long frames_recovered_ = 0;
+    unsigned long long frames_lost_ = 0;
+    unsigned long long fragments_received_ = 0;
+    unsigned long long fragments_recovered_ = 0;
+    unsigned long long parity_received_ = 0;
+    unsigned long long nacks_sent_ = 0;
+    unsigned long long duplicates_ = 0;
+    unsigned long long stale_ = 0;
+    unsigned long long invalid_ = 0;
+    unsigned long long resyncs_ = 0;
+};
@@ -0,0 +1,75 @@
+import os
+import subprocess
+import tempfile
+import cv2
+import numpy as np
+from add_noise import noisy
+from ssim_gpu import gpu_ssim
+
+# Built from "Other Tests/Enhancment test/Fast bilateral"
+TOOL = "../Fast bilateral/build/bin/fast_bilateral"
+
+def run_filter(noisy_path, output_path, diameter, sigma_colour, sigma_space, engine):
+    # The tool prints its average time per image in microseconds
+    output = subprocess.check_output([TOOL, noisy_path, output_path, str(diameter), str(sigma_colour), str(sigma_space), engine])
+    return float(output.decode().strip()), cv2.imread(output_path)
+
+def process_images(img_path, noise_strength, diameter, sigma_colour, sigma_space, work_dir):
+    lst = os.listdir(img_path)
+    image_count = sum(1 for name in lst if ".png" in name)  # Count valid images
+
+    # Per engine (OpenCV, fast): SSIM, PSNR, time in us; then the fast result scored against OpenCV's
+    score_array = np.zeros(8)
+    processed_images = 0
+    for image in lst:
+        if ".png" not in image:
+            continue
+        print(f"images processed: {processed_images} of {image_count}, current image: {image}", end="\r")
+
+        original_image = cv2.imread(f"{img_path}/{image}")
+        noisy_image, _ = noisy(original_image, noise_strength)
+        noisy_path = os.path.join(work_dir, "noisy.png")
+        cv2.imwrite(noisy_path, noisy_image)
+
+        opencv_time, opencv_image = run_filter(noisy_path, os.path.join(work_dir, "opencv.png"), diameter, sigma_colour, sigma_space, "opencv")
+        fast_time, fast_image = run_filter(noisy_path, os.path.join(work_dir, "fast.png"), diameter, sigma_colour, sigma_space, "fast")
+
+        score_array[0] += gpu_ssim(original_image, opencv_image)
+        score_array[1] += cv2.PSNR(original_image, opencv_image)
+        score_array[2] += opencv_time
+        score_array[3] += gpu_ssim(original_image, fast_image)
+        score_array[4] += cv2.PSNR(original_image, fast_image)
+        score_array[5] += fast_time
+        score_array[6] += gpu_ssim(opencv_image, fast_image)
+        score_array[7] += cv2.PSNR(opencv_image, fast_image)
+
+        processed_images += 1
+
+    return score_array / processed_images
+
+def main():
+    img_path = "tests/img"
+    noise_strength_list = [5, 10, 15, 20]
+    # The server's luma filter: diameter 8, sigma space 2, sigma colour as the controller picks it
+    diameter = 8
+    sigma_colour_list = [10, 20, 30, 40]
+    sigma_space = 2
+
+    with tempfile.TemporaryDirectory() as work_dir:
+        for noise_strength in noise_strength_list:
+            score_array = np.zeros((len(sigma_colour_list), 9))
+            for i, sigma_colour in enumerate(sigma_colour_list):
+                score_array[i, 0] = sigma_colour
+                score_array[i, 1:] = process_images(img_path, noise_strength, diameter, sigma_colour, sigma_space, work_dir)
+
+                print(f"noise {noise_strength}, sigma colour {sigma_colour}: "
+                      f"OpenCV SSIM {score_array[i, 1]:.4f} PSNR {score_array[i, 2]:.2f} in {score_array[i, 3]:.0f}us, "
+                      f"fast SSIM {score_array[i, 4]:.4f} PSNR {score_array[i, 5]:.2f} in {score_array[i, 6]:.0f}us "
+                      f"({score_array[i, 3] / score_array[i, 6]:.1f}x), "
+                      f"fast vs OpenCV SSIM {score_array[i, 7]:.4f} PSNR {score_array[i, 8]:.2f}")
+
+            #save the results
+            with open(f"fast_bilateral_avg_score_{noise_strength}.npy", "wb") as f:
+                np.save(f, score_array)
+
+main()
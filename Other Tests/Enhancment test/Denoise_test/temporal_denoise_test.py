@@ -0,0 +1,95 @@
+import os
+import subprocess
+import tempfile
+import cv2
+import numpy as np
+from add_noise import noisy
+from ssim_gpu import gpu_ssim
+
+# Built from "Other Tests/Enhancment test/Temporal denoise"
+TOOL = "../Temporal denoise/build/bin/temporal_denoise"
+
+FRAMES = 10         # Frames per sequence, each with noise of its own
+MOVING_FRAMES = 3   # Moving sequences: the picture pans this many frames at the end...
+PAN_PIXELS = 4      # ...by this many pixels per frame
+
+def run_filter(frame_paths, output_path, strength, motion_low, motion_high):
+    # The tool prints its average time per frame in microseconds
+    output = subprocess.check_output([TOOL, output_path, str(strength), str(motion_low), str(motion_high)] + frame_paths)
+    return float(output.decode().strip()), cv2.imread(output_path)
+
+def make_sequence(original_image, noise_strength, moving, work_dir):
+    # Frames of a still (or, at the end, panning) camera; returns their paths,
+    # the clean last frame, the noisy last frame and the noise sigma
+    frame_paths = []
+    for i in range(FRAMES):
+        shift = (i - (FRAMES - MOVING_FRAMES) + 1) * PAN_PIXELS if moving and i >= FRAMES - MOVING_FRAMES else 0
+        clean_image = np.roll(original_image, shift, axis=1)
+        noisy_image, sigma = noisy(clean_image, noise_strength)
+        frame_path = os.path.join(work_dir, f"frame_{i}.png")
+        cv2.imwrite(frame_path, noisy_image)
+        frame_paths.append(frame_path)
+    return frame_paths, clean_image, noisy_image, sigma
+
+def process_images(img_path, noise_strength, strength, moving, work_dir):
+    lst = os.listdir(img_path)
+    image_count = sum(1 for name in lst if ".png" in name)  # Count valid images
+
+    # SSIM and PSNR of the last frame: noisy, bilateral alone, temporal (and its time in us), temporal then bilateral
+    score_array = np.zeros(9)
+    processed_images = 0
+    for image in lst:
+        if ".png" not in image:
+            continue
+        print(f"images processed: {processed_images} of {image_count}, current image: {image}", end="\r")
+
+        original_image = cv2.imread(f"{img_path}/{image}")
+        frame_paths, clean_image, noisy_image, sigma = make_sequence(original_image, noise_strength, moving, work_dir)
+
+        # The servers' motion limits: 1.5 and 3 sigma, at least 3 and 6 grey levels
+        temporal_time, temporal_image = run_filter(frame_paths, os.path.join(work_dir, "temporal.png"), strength,
+                                                   max(1.5 * sigma, 3), max(3 * sigma, 6))
+        # The servers' luma bilateral filter, with sigma colour for the noise left
+        bilateral_image = cv2.bilateralFilter(noisy_image, 8, 3 * sigma, 2)
+        both_image = cv2.bilateralFilter(temporal_image, 8, 1.5 * sigma, 2)
+
+        score_array[0] += gpu_ssim(clean_image, noisy_image)
+        score_array[1] += cv2.PSNR(clean_image, noisy_image)
+        score_array[2] += gpu_ssim(clean_image, bilateral_image)
+        score_array[3] += cv2.PSNR(clean_image, bilateral_image)
+        score_array[4] += gpu_ssim(clean_image, temporal_image)
+        score_array[5] += cv2.PSNR(clean_image, temporal_image)
+        score_array[6] += temporal_time
+        score_array[7] += gpu_ssim(clean_image, both_image)
+        score_array[8] += cv2.PSNR(clean_image, both_image)
+
+        processed_images += 1
+
+    return score_array / processed_images
+
+def main():
+    img_path = "tests/img"
+    noise_strength_list = [25, 100, 225, 400]   # Variance, as add_noise takes it
+    strength_list = [0.125, 0.25, 0.5]          # Weight of a new frame where nothing moves
+
+    with tempfile.TemporaryDirectory() as work_dir:
+        for noise_strength in noise_strength_list:
+            score_array = np.zeros((2, len(strength_list), 11))
+            for moving in [False, True]:
+                for i, strength in enumerate(strength_list):
+                    scores = score_array[int(moving), i]
+                    scores[0] = moving
+                    scores[1] = strength
+                    scores[2:] = process_images(img_path, noise_strength, strength, moving, work_dir)
+
+                    print(f"noise {noise_strength}, {'moving' if moving else 'still'}, strength {strength}: "
+                          f"noisy SSIM {scores[2]:.4f} PSNR {scores[3]:.2f}, "
+                          f"bilateral SSIM {scores[4]:.4f} PSNR {scores[5]:.2f}, "
+                          f"temporal SSIM {scores[6]:.4f} PSNR {scores[7]:.2f} in {scores[8]:.0f}us, "
+                          f"temporal + bilateral SSIM {scores[9]:.4f} PSNR {scores[10]:.2f}")
+
+            #save the results
+            with open(f"temporal_denoise_avg_score_{noise_strength}.npy", "wb") as f:
+                np.save(f, score_array)
+
+main()
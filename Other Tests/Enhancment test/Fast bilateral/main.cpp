@@ -0,0 +1,73 @@
+// Runs the separable bilateral filter (fast_bilateral.hpp) or OpenCV's on one
+// image and prints the average time per image in microseconds. Both filter
+// each channel as a plane of its own, the way the servers filter YUV planes,
+// so the outputs can be scored against each other by
+// Denoise_test/fast_bilateral_test.py.
+//
+//   fast_bilateral <input> <output> <diameter> <sigma colour> <sigma space> <fast|opencv>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include "fast_bilateral.hpp"
+
+using namespace std;
+using namespace cv;
+using namespace std::chrono;
+
+const int ITERATIONS = 20; // Timed runs, after one to warm up
+
+void filterPlanes(const vector<Mat>& src, vector<Mat>& dst, const BilateralParams& params, bool fast,
+                  FastBilateral& bilateral) {
+    for (size_t i = 0; i < src.size(); i++) {
+        if (fast) {
+            dst[i].create(src[i].size(), CV_8UC1);
+            bilateral.filter(params, src[i].data, src[i].step, dst[i].data, dst[i].step, src[i].cols, src[i].rows);
+        } else {
+            bilateralFilter(src[i], dst[i], params.diameter, params.sigma_color, params.sigma_space);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 7) {
+        cerr << "Usage: " << argv[0] << " <input> <output> <diameter> <sigma colour> <sigma space> <fast|opencv>"
+             << endl;
+        return 1;
+    }
+
+    Mat image = imread(argv[1], IMREAD_UNCHANGED);
+    if (image.empty() || image.depth() != CV_8U) {
+        cerr << "Could not read an 8-bit image from " << argv[1] << endl;
+        return 1;
+    }
+    BilateralParams params = {atoi(argv[3]), atof(argv[4]), atof(argv[5])};
+    bool fast = string(argv[6]) == "fast";
+
+    vector<Mat> planes, filtered;
+    split(image, planes);
+    filtered.resize(planes.size());
+    FastBilateral bilateral;
+
+    filterPlanes(planes, filtered, params, fast, bilateral);
+    auto start = high_resolution_clock::now();
+    for (int i = 0; i < ITERATIONS; i++) {
+        filterPlanes(planes, filtered, params, fast, bilateral);
+    }
+    auto stop = high_resolution_clock::now();
+    cout << duration_cast<microseconds>(stop - start).count() / ITERATIONS << endl;
+
+    Mat result;
+    merge(filtered, result);
+    if (!imwrite(argv[2], result)) {
+        cerr << "Could not write " << argv[2] << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+// Runs the temporal denoiser (temporal_denoiser.hpp) over a sequence of
+// images, in order, and writes the result for the last one. Each channel is
+// averaged as a plane of its own, the way the servers average YUV planes.
+// Prints the average time per frame in microseconds; used by
+// Denoise_test/temporal_denoise_test.py.
+//
+//   temporal_denoise <output> <strength> <motion low> <motion high> <frame> [<frame> ...]
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgcodecs.hpp"
+
+#include "temporal_denoiser.hpp"
+
+using namespace std;
+using namespace cv;
+using namespace std::chrono;
+
+int main(int argc, char** argv) {
+    if (argc < 6) {
+        cerr << "Usage: " << argv[0] << " <output> <strength> <motion low> <motion high> <frame> [<frame> ...]"
+             << endl;
+        return 1;
+    }
+    TemporalParams params = {atof(argv[2]), atof(argv[3]), atof(argv[4])};
+
+    vector<TemporalDenoiser> denoisers;
+    vector<Mat> planes;
+    long long total_us = 0;
+    int frames = 0;
+    for (int arg = 5; arg < argc; arg++) {
+        Mat image = imread(argv[arg], IMREAD_UNCHANGED);
+        if (image.empty() || image.depth() != CV_8U) {
+            cerr << "Could not read an 8-bit image from " << argv[arg] << endl;
+            return 1;
+        }
+        split(image, planes);
+        denoisers.resize(planes.size());
+
+        // Reading and splitting is not part of the time
+        auto start = high_resolution_clock::now();
+        for (size_t i = 0; i < planes.size(); i++) {
+            denoisers[i].filter(params, planes[i].data, planes[i].step, planes[i].data, planes[i].step,
+                                planes[i].cols, planes[i].rows);
+        }
+        total_us += duration_cast<microseconds>(high_resolution_clock::now() - start).count();
+        frames++;
+    }
+    cout << total_us / frames << endl;
+
+    Mat result;
+    merge(planes, result);
+    if (!imwrite(argv[1], result)) {
+        cerr << "Could not write " << argv[1] << endl;
+        return 1;
+    }
+    return 0;
+}
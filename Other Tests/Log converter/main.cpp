@@ -0,0 +1,42 @@
+// Turns a binary log (async_log.hpp, LogFormat::Binary) into the text layout
+// the logs have always had, for the spreadsheets in Test Data.
+//
+//   log_converter <binary log> [<text log>]
+//
+// Without a text log the lines go to standard output.
+#include <cstdio>
+#include <iostream>
+
+#include "async_log.hpp"
+
+using namespace std;
+
+int main(int argc, char** argv) {
+    if (argc != 2 && argc != 3) {
+        cerr << "Usage: " << argv[0] << " <binary log> [<text log>]" << endl;
+        return 1;
+    }
+
+    FILE* binary = fopen(argv[1], "rb");
+    if (!binary) {
+        cerr << "Could not open " << argv[1] << endl;
+        return 1;
+    }
+    FILE* text = argc == 3 ? fopen(argv[2], "w") : stdout;
+    if (!text) {
+        cerr << "Could not create " << argv[2] << endl;
+        fclose(binary);
+        return 1;
+    }
+
+    bool converted = convertLog(binary, text);
+    fclose(binary);
+    if (text != stdout) {
+        fclose(text);
+    }
+    if (!converted) {
+        cerr << argv[1] << " is not a binary log" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+import json
+import sys
+
+# Compares two denoise_bench JSON files case by case:
+#   python3 compare.py old.json new.json [threshold]
+# A case counts as a regression when its mean or p99 grew by more than the
+# threshold (default 0.10, 10%); the exit code is 1 if any did.
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    return data["context"], {bench["name"]: bench for bench in data["benchmarks"]}
+
+def change(old, new):
+    return (new - old) / old if old > 0 else 0.0
+
+def main():
+    if len(sys.argv) < 3:
+        print("usage: compare.py old.json new.json [threshold]")
+        sys.exit(2)
+    threshold = float(sys.argv[3]) if len(sys.argv) > 3 else 0.10
+
+    old_context, old = load(sys.argv[1])
+    new_context, new = load(sys.argv[2])
+    for key in ["host_name", "simd", "opencv_version", "compiler", "build_type"]:
+        if old_context.get(key) != new_context.get(key):
+            print(f"note: {key} differs: {old_context.get(key)} -> {new_context.get(key)}")
+
+    regressions = 0
+    for name, bench in new.items():
+        if name not in old:
+            continue
+        mean = change(old[name]["mean_us"], bench["mean_us"])
+        p99 = change(old[name]["p99_us"], bench["p99_us"])
+        flag = ""
+        if mean > threshold or p99 > threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        print(f"{name}: mean {old[name]['mean_us']:.0f} -> {bench['mean_us']:.0f} us ({mean:+.1%}), "
+              f"p99 {old[name]['p99_us']:.0f} -> {bench['p99_us']:.0f} us ({p99:+.1%}){flag}")
+
+    missing = [name for name in old if name not in new]
+    if missing:
+        print(f"{len(missing)} cases of the old run are missing from the new one")
+    print(f"{regressions} regressions over {threshold:.0%}")
+    sys.exit(1 if regressions else 0)
+
+main()
@@ -1,111 +1,414 @@
+// Micro-benchmarks of the denoise and noise estimation kernels, over every
+// parameter set the camera stage and the servers use (and the ones tried
+// before them), at several resolutions and thread counts. Each call is timed
+// on its own; mean, p50, p99 and max go to the console and, as JSON, to a file
+// that compare.py diffs against an earlier run, so a build that got slower
+// shows up.
+//
+//   ./bin/denoise_bench [--image=image.jpg] [--out=bench.json] [--filter=bilateral] [--min-time=0.5]
+//
+// --filter keeps the cases whose name contains the text, e.g. "nlm" or
+// "1920x1080". Filters that can run in bands go through the same TilePool
+// the servers use (tile_scheduler.hpp), one worker per thread; one thread
+// calls the kernel directly.
 #include <iostream>
 #include "opencv2/imgproc.hpp"
 #include "opencv2/imgcodecs.hpp"
-#include "opencv2/highgui.hpp"
 #include <opencv2/photo.hpp>
 #include <chrono>
 
+#include <unistd.h>
 #include <cmath>
-#include <iostream>
-#include <string>
-#include <filesystem>
-#include <sys/stat.h>
+#include <ctime>
 #include <fstream>
+#include <memory>
 #include <sstream>
+#include <string>
 #include <vector>
 #include <algorithm>
 
+#include "fast_bilateral.hpp"
+#include "noise_estimator.hpp"
+#include "noise_tracker.hpp"
+#include "temporal_denoiser.hpp"
+#include "tile_scheduler.hpp"
+
 using namespace std;
 using namespace cv;
 using namespace std::chrono;
 
-Mat src; Mat dst;
+struct Resolution {
+    int width;
+    int height;
+};
+const Resolution RESOLUTIONS[] = {{640, 480}, {1280, 720}, {1920, 1080}};
+const int THREAD_COUNTS[] = {1, 2, 4};      // Counts above the machine's cores are skipped
+const size_t TILE_BYTES = 64 * 1024;        // Band size, as the servers and the camera stage use
+
+const double NOISE_SIGMA = 8.0;             // Gaussian noise added to the test image, in grey levels
+const uint64_t RNG_SEED = 0x5eed;           // Same noise in every run
+
+// Calls per case: a few untimed ones first, then at least MIN_CALLS and
+// --min-time seconds, at most MAX_CALLS
+const int WARMUP_CALLS = 3;
+const int MIN_CALLS = 10;
+const int MAX_CALLS = 20000;
+const double DEFAULT_MIN_SECONDS = 0.5;
+
+// Bilateral grid: covers the luma (8, 10, 2) and chroma (4, 10, 1) settings
+// of the servers and camera stage and the 6/10/2 and 8/20/2 tried before
+const int BILATERAL_DIAMETERS[] = {4, 6, 8};
+const double BILATERAL_SIGMA_COLORS[] = {10, 20};
+const double BILATERAL_SIGMA_SPACES[] = {1, 2};
+
+const int MEDIAN_SIZES[] = {3, 5};
+
+struct GaussianSet {
+    int ksize;
+    double sigma;
+};
+// 3 and 7 as tried before, 5 as the denoise controller runs it on luma
+const GaussianSet GAUSSIAN_SETS[] = {{3, 0.5}, {5, 1.0}, {7, 0.7}};
+
+struct NlmSet {
+    float h;
+    int template_size;
+    int search_size;
+};
+// 3/7 as tried before, 3/11 and 5/15 as the denoise controller runs it on
+// chroma and luma
+const NlmSet NLM_SETS[] = {{2, 3, 7}, {5, 3, 7}, {3, 3, 11}, {3, 5, 15}};
+
+// The servers' noise sampling and temporal filter, with the motion limits
+// for the noise added here (1.5 and 3 sigma)
+const NoiseSampling NOISE_SAMPLING = {64, 4, 2, 0.3, 0.1};
+const TemporalParams TEMPORAL_PARAMS = {0.25, 1.5 * NOISE_SIGMA, 3.0 * NOISE_SIGMA};
+
+// The Laplacian estimator over a whole plane, every row_step-th row
+class NoiseEstimateKernel : public TileKernel {
+public:
+    explicit NoiseEstimateKernel(int row_step) : row_step_(row_step) {}
+    int halo() const override { return 1; }
+    void apply(const Mat& src, Mat&, int) override {
+        sigma_ = estimateNoise(src.data, src.cols, src.rows, src.step, row_step_);
+    }
+    double sigma() const { return sigma_; }
+
+private:
+    int row_step_;
+    double sigma_ = 0.0;
+};
+
+// The tracker as the decode threads feed it, sampled frames and skipped
+// ones, so the mean is its cost per frame
+class NoiseTrackerKernel : public TileKernel {
+public:
+    explicit NoiseTrackerKernel(const NoiseSampling& sampling) : tracker_(sampling) {}
+    int halo() const override { return 0; }
+    void apply(const Mat& src, Mat&, int) override { tracker_.update(src.data, src.cols, src.rows, src.step); }
+
+private:
+    NoiseTracker tracker_;
+};
+
+// The temporal filter keeps a running average of the whole plane, so it
+// does not run in bands. It sees the same frame every call; the SIMD paths
+// take as long whatever the picture.
+class TemporalKernel : public TileKernel {
+public:
+    explicit TemporalKernel(const TemporalParams& params) : params_(params) {}
+    int halo() const override { return 0; }
+    void apply(const Mat& src, Mat& dst, int) override {
+        dst.create(src.size(), src.type());
+        temporal_.filter(params_, src.data, src.step, dst.data, dst.step, src.cols, src.rows);
+    }
+
+private:
+    TemporalParams params_;
+    TemporalDenoiser temporal_;
+};
+
+struct BenchCase {
+    string filter;      // e.g. "bilateral_fast"
+    string params;      // e.g. "d=8 sc=10 ss=2"
+    int channels;       // 1: a Y plane (grey), 3: BGR
+    bool bands;         // Can run in bands on a TilePool
+    unique_ptr<TileKernel> kernel;
+};
+
+struct BenchResult {
+    string name;
+    const BenchCase* bench;
+    Resolution resolution;
+    int threads;
+    int calls;
+    double mean_us;
+    double p50_us;
+    double p99_us;
+    double max_us;
+};
+
+void addCase(vector<BenchCase>& cases, const string& filter, const string& params, int channels, bool bands,
+             TileKernel* kernel) {
+    BenchCase bench;
+    bench.filter = filter;
+    bench.params = params;
+    bench.channels = channels;
+    bench.bands = bands;
+    bench.kernel.reset(kernel);
+    cases.push_back(std::move(bench));
+}
+
+vector<BenchCase> makeCases() {
+    vector<BenchCase> cases;
+    ostringstream params;
+
+    for (int diameter : BILATERAL_DIAMETERS) {
+        for (double sigma_color : BILATERAL_SIGMA_COLORS) {
+            for (double sigma_space : BILATERAL_SIGMA_SPACES) {
+                BilateralParams bilateral = {diameter, sigma_color, sigma_space};
+                params.str("");
+                params << "d=" << diameter << " sc=" << sigma_color << " ss=" << sigma_space;
+                addCase(cases, "bilateral_fast", params.str(), 1, true, new BilateralKernel(bilateral, true));
+                addCase(cases, "bilateral_cv", params.str(), 1, true, new BilateralKernel(bilateral, false));
+                addCase(cases, "bilateral_cv", params.str(), 3, true, new BilateralKernel(bilateral, false));
+            }
+        }
+    }
 
-double estimateNoise(const cv::Mat& image) {
-    // Laplacian kernel
-    cv::Mat kernel = (cv::Mat_<float>(3, 3) << 
-        1, -2, 1,
-        -2, 4, -2,
-        1, -2, 1
-    );
+    for (int ksize : MEDIAN_SIZES) {
+        params.str("");
+        params << "k=" << ksize;
+        addCase(cases, "median", params.str(), 1, true, new MedianKernel(ksize));
+        addCase(cases, "median", params.str(), 3, true, new MedianKernel(ksize));
+    }
 
-    // Convolution result matrix
-    cv::Mat convResult;
-    cv::filter2D(image, convResult, CV_32F, kernel);
+    for (const GaussianSet& set : GAUSSIAN_SETS) {
+        params.str("");
+        params << "k=" << set.ksize << " sigma=" << set.sigma;
+        addCase(cases, "gaussian", params.str(), 1, true, new GaussianKernel(set.ksize, set.sigma));
+        addCase(cases, "gaussian", params.str(), 3, true, new GaussianKernel(set.ksize, set.sigma));
+    }
 
-    // Calculate absolute values and sum
-    cv::Mat absConvResult;
-    cv::convertScaleAbs(convResult, absConvResult);
+    for (const NlmSet& set : NLM_SETS) {
+        params.str("");
+        params << "h=" << set.h << " t=" << set.template_size << " s=" << set.search_size;
+        addCase(cases, "nlm", params.str(), 1, true, new NlmKernel(set.h, set.template_size, set.search_size));
+        addCase(cases, "nlm", params.str(), 3, true, new NlmKernel(set.h, set.template_size, set.search_size));
+    }
 
-    // Calculate sigma 
-    double sigma = cv::sum(absConvResult)[0];
-    int width = image.cols, height = image.rows;
-    
-    // Normalize with mathematical adjustment similar to Python version
-    sigma = sigma * std::sqrt(0.5 * M_PI) / (6.0 * (width - 2) * (height - 2));
+    addCase(cases, "noise_estimate", "rows=1", 1, false, new NoiseEstimateKernel(1));
+    addCase(cases, "noise_estimate", "rows=4", 1, false, new NoiseEstimateKernel(4));
+    params.str("");
+    params << "tile=" << NOISE_SAMPLING.tile_size << " step=" << NOISE_SAMPLING.tile_step
+           << " frames=" << NOISE_SAMPLING.frame_step;
+    addCase(cases, "noise_tracker", params.str(), 1, false, new NoiseTrackerKernel(NOISE_SAMPLING));
+    params.str("");
+    params << "strength=" << TEMPORAL_PARAMS.strength;
+    addCase(cases, "temporal", params.str(), 1, false, new TemporalKernel(TEMPORAL_PARAMS));
 
-    return sigma;
+    return cases;
 }
 
-int main() {
-    string imagePath = "/home/comtek450/P4/tests/time_test/image.jpg";
-    //src = imread(imagePath, IMREAD_GRAYSCALE);
+// One call of the kernel, in bands on the pool if there is one
+void runOnce(TileKernel& kernel, TilePool* pool, const Mat& src, Mat& dst) {
+    if (pool) {
+        pool->run(kernel, src, dst);
+    } else {
+        kernel.prepare(1);
+        kernel.apply(src, dst, 0);
+    }
+}
 
-    src = imread(imagePath);
-    int iterations = 20000;
-    cout << "medianBlur(src, dst, 3); @" << iterations << endl;
-    for (int x = 0; x < 5; x++) {
-        auto start = high_resolution_clock::now();
-        
-        for (int i =0; i<iterations; i++) {
-            //GaussianBlur( src, dst, Size( 7, 7 ), 0.7, 0.7 );
-            //GaussianBlur( src, dst, Size( 3, 3 ), 0.5, 0.5 );
+// Value below which a share of the sorted timings lie (nearest rank)
+double percentile(const vector<double>& sorted, double share) {
+    size_t rank = (size_t)ceil(share * sorted.size());
+    return sorted[min(max(rank, (size_t)1), sorted.size()) - 1];
+}
 
-            medianBlur(src, dst, 3);
-            //medianBlur(src, dst, 1);
+void timeCase(BenchCase& bench, TilePool* pool, const Mat& src, double min_seconds, BenchResult& result) {
+    Mat dst;
+    for (int i = 0; i < WARMUP_CALLS; i++) {
+        runOnce(*bench.kernel, pool, src, dst);
+    }
 
-            //fastNlMeansDenoisingColored(src, dst, 2, 3, 3, 7);
-            //fastNlMeansDenoisingColored(src, dst, 5, 7, 3, 7);
+    vector<double> timings;
+    timings.reserve(MIN_CALLS);
+    auto started = steady_clock::now();
+    double total_us = 0.0;
+    while ((int)timings.size() < MAX_CALLS &&
+           ((int)timings.size() < MIN_CALLS || total_us < min_seconds * 1e6)) {
+        auto call_start = steady_clock::now();
+        runOnce(*bench.kernel, pool, src, dst);
+        auto call_stop = steady_clock::now();
+        timings.push_back(duration<double, micro>(call_stop - call_start).count());
+        total_us = duration<double, micro>(call_stop - started).count();
+    }
 
-            //bilateralFilter(src, dst, 6, 10, 2);
-            //bilateralFilter(src, dst, 8, 20, 2);
+    double sum = 0.0;
+    for (double t : timings) {
+        sum += t;
+    }
+    sort(timings.begin(), timings.end());
+    result.calls = (int)timings.size();
+    result.mean_us = sum / timings.size();
+    result.p50_us = percentile(timings, 0.50);
+    result.p99_us = percentile(timings, 0.99);
+    result.max_us = timings.back();
+}
 
-            //double noise = estimateNoise(src);
+string jsonEscape(const string& text) {
+    string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
         }
-        
-        auto stop = high_resolution_clock::now();
-        auto duration = duration_cast<microseconds>(stop - start);
-
-        // Calculate average time
-        int64_t avg_time = duration.count() / iterations;
-
-        // Collect all timings for percentile analysis
-        std::vector<int64_t> timings;
-        timings.reserve(iterations);
-
-        for (int i = 0; i < iterations; i++) {
-            auto iter_start = high_resolution_clock::now();
-            
-            medianBlur(src, dst, 3);
-            
-            auto iter_stop = high_resolution_clock::now();
-            auto iter_duration = duration_cast<microseconds>(iter_stop - iter_start);
-            timings.push_back(iter_duration.count());
+        out += c;
+    }
+    return out;
+}
+
+// Which SIMD path the project's kernels take on this machine
+const char* simdPath() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("avx2") ? "avx2" : "scalar";
+#elif defined(__ARM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+bool writeJson(const string& path, const vector<BenchResult>& results) {
+    ofstream out(path);
+    if (!out) {
+        return false;
+    }
+
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    char date[32];
+    time_t now = time(nullptr);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+#ifdef NDEBUG
+    const char* build_type = "release";
+#else
+    const char* build_type = "debug";
+#endif
+
+    out << "{\n  \"context\": {\n"
+        << "    \"date\": \"" << date << "\",\n"
+        << "    \"host_name\": \"" << jsonEscape(host) << "\",\n"
+        << "    \"num_cpus\": " << thread::hardware_concurrency() << ",\n"
+        << "    \"simd\": \"" << simdPath() << "\",\n"
+        << "    \"opencv_version\": \"" << CV_VERSION << "\",\n"
+        << "    \"compiler\": \"" << jsonEscape(__VERSION__) << "\",\n"
+        << "    \"build_type\": \"" << build_type << "\"\n"
+        << "  },\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        out << (i ? "," : "") << "\n    {"
+            << "\"name\": \"" << jsonEscape(r.name) << "\", "
+            << "\"filter\": \"" << r.bench->filter << "\", "
+            << "\"params\": \"" << r.bench->params << "\", "
+            << "\"width\": " << r.resolution.width << ", "
+            << "\"height\": " << r.resolution.height << ", "
+            << "\"channels\": " << r.bench->channels << ", "
+            << "\"threads\": " << r.threads << ", "
+            << "\"iterations\": " << r.calls << ", "
+            << "\"mean_us\": " << r.mean_us << ", "
+            << "\"p50_us\": " << r.p50_us << ", "
+            << "\"p99_us\": " << r.p99_us << ", "
+            << "\"max_us\": " << r.max_us << "}";
+    }
+    out << "\n  ]\n}\n";
+    return (bool)out;
+}
+
+int main(int argc, char** argv) {
+    string image_path = "image.jpg";
+    string out_path = "bench.json";
+    string name_filter;
+    double min_seconds = DEFAULT_MIN_SECONDS;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.rfind("--image=", 0) == 0) {
+            image_path = arg.substr(8);
+        } else if (arg.rfind("--out=", 0) == 0) {
+            out_path = arg.substr(6);
+        } else if (arg.rfind("--filter=", 0) == 0) {
+            name_filter = arg.substr(9);
+        } else if (arg.rfind("--min-time=", 0) == 0) {
+            min_seconds = atof(arg.substr(11).c_str());
+        } else {
+            cerr << "Usage: " << argv[0] << " [--image=path] [--out=path] [--filter=text] [--min-time=seconds]"
+                 << endl;
+            return 1;
+        }
+    }
+
+    Mat image = imread(image_path);
+    if (image.empty()) {
+        cerr << "Could not read " << image_path << endl;
+        return 1;
+    }
+
+    // The pools do the threading, as in the servers
+    setNumThreads(1);
+
+    int cores = max(1, (int)thread::hardware_concurrency());
+    vector<int> thread_counts;
+    vector<unique_ptr<TilePool>> pools;
+    for (int threads : THREAD_COUNTS) {
+        if (threads <= cores) {
+            thread_counts.push_back(threads);
+            pools.emplace_back(threads > 1 ? new TilePool(coreRange(0, threads), TILE_BYTES) : nullptr);
         }
+    }
+
+    vector<BenchCase> cases = makeCases();
+    vector<BenchResult> results;
+    for (const Resolution& resolution : RESOLUTIONS) {
+        // The test image at this size with the same noise every run, in BGR
+        // and as a Y plane
+        Mat bgr, noise, noisy, grey;
+        resize(image, bgr, Size(resolution.width, resolution.height), 0, 0, INTER_AREA);
+        theRNG().state = RNG_SEED;
+        noise.create(bgr.size(), CV_16SC3);
+        randn(noise, Scalar::all(0), Scalar::all(NOISE_SIGMA));
+        add(bgr, noise, noisy, noArray(), CV_8UC3);
+        cvtColor(noisy, grey, COLOR_BGR2GRAY);
 
-        auto slowest_time = *std::max_element(timings.begin(), timings.end());
+        for (BenchCase& bench : cases) {
+            for (size_t t = 0; t < thread_counts.size(); t++) {
+                if (!bench.bands && thread_counts[t] > 1) {
+                    continue;
+                }
+                ostringstream name;
+                name << bench.filter << "/" << bench.params << "/" << resolution.width << "x" << resolution.height
+                     << "x" << bench.channels << "/threads:" << thread_counts[t];
+                if (!name_filter.empty() && name.str().find(name_filter) == string::npos) {
+                    continue;
+                }
 
-        //sort the timing vector to be able to find 99 percentile
-        std::sort(timings.begin(), timings.end());
+                BenchResult result;
+                result.name = name.str();
+                result.bench = &bench;
+                result.resolution = resolution;
+                result.threads = thread_counts[t];
+                timeCase(bench, pools[t].get(), bench.channels == 3 ? noisy : grey, min_seconds, result);
+                results.push_back(result);
 
-        // Calculate the 99th percentile, as iterations * 0.99 is the index of the 99th percentile
-        int64_t p99_time = timings[static_cast<size_t>(iterations * 0.99)];
-        
-        // Print the results
-        cout << "AVG Time: " << avg_time << " microseconds" << endl;
-        cout << "MAX Time: " << slowest_time << " microseconds percent slower: " << ((slowest_time - avg_time) / (double)avg_time) * 100 << endl;
-        cout << "P99 Time: " << p99_time << " microseconds percent slower: " << ((p99_time - avg_time) / (double)avg_time) * 100  << "\n" << endl;
+                cout << result.name << ": mean " << (int64_t)result.mean_us << " us, p99 " << (int64_t)result.p99_us
+                     << " us, max " << (int64_t)result.max_us << " us (" << result.calls << " calls)" << endl;
+            }
         }
-    
+    }
+
+    if (!writeJson(out_path, results)) {
+        cerr << "Could not write " << out_path << endl;
+        return 1;
+    }
+    cout << results.size() << " benchmarks written to " << out_path << endl;
     return 0;
-}
\ No newline at end of file
+}
@@ -1,3 +1,5 @@
+#include <memory>
+
 #include <libcamera/stream.h>
 
 #include "core/rpicam_app.hpp"
@@ -8,6 +10,11 @@
 #include "opencv2/imgproc.hpp"
 #include "opencv2/photo.hpp"
 
+#include "fast_bilateral.hpp"
+#include "noise_tracker.hpp"
+#include "temporal_denoiser.hpp"
+#include "tile_scheduler.hpp"
+
 using namespace cv;
 
 using Stream = libcamera::Stream;
@@ -30,6 +37,22 @@ private:
 	float diameter_ = 9;	// Diameter of each pixel neighborhood that is used during filtering. If it is non-positive, it is computed from sigmaSpace.
 	int sigmaColor_ = 50;	// Filter sigma in the color space. A larger value of the parameter means that farther colors within the pixel neighborhood (see sigmaSpace) will be mixed together, resulting in larger areas of semi-equal color.
 	int sigmaSpace_ = 50;   // Filter sigma in the coordinate space. A larger value of the parameter means that farther pixels will influence each other as long as their colors are close enough (see sigmaColor ). When d>0, it specifies the neighborhood size regardless of sigmaSpace. Otherwise, d is proportional to sigmaSpace.
+	bool bilateral_enabled_ = true;	// Off leaves only the temporal filter
+	bool fast_ = true;	// Separable bilateral filter (fast_bilateral.hpp) instead of OpenCV's, about 3x faster at the same SSIM
+	FastBilateral bilateral_;
+	NoiseSampling sampling_ = { 64, 4, 2, 0.3, 0.1 };	// Which tiles and frames the noise is measured on, see noise_tracker.hpp
+	std::unique_ptr<NoiseTracker> noise_;	// Smoothed noise of the stream, created in Configure()
+	bool temporal_ = true;	// Average each pixel over time where the picture holds still (temporal_denoiser.hpp)
+	bool temporal_chroma_ = true;	// Average U and V as well as Y
+	TemporalParams temporal_params_ = { 0.25, 1.5, 3.0 };	// Weight of a new frame, and motion limits in sigma
+	double temporal_min_motion_ = 3.0;	// Grey levels; the motion limits do not go below this
+	TemporalDenoiser temporal_[3];	// Y, U, V
+	int threads_ = 0;	// Filter in bands over this many threads pinned to cores first_core_ on (0: on the calling thread)
+	int first_core_ = 1;	// Core 0 is left to libcamera and the encoder
+	size_t tile_bytes_ = 64 * 1024;	// Input a band aims at, halo included
+	std::unique_ptr<TilePool> tiles_;
+	std::unique_ptr<BilateralKernel> kernel_;
+	unsigned int frames_ = 0;
 };
 
 #define NAME "fast_cv_denoise"
@@ -44,6 +67,22 @@ void FastCVDenoise::Read(boost::property_tree::ptree const &params)
 	diameter_ = params.get<float>("diameter", 9);
 	sigmaColor_ = params.get<int>("sigmaColor", 50);
 	sigmaSpace_ = params.get<int>("search_window_size", 50);
+	bilateral_enabled_ = params.get<bool>("bilateral", true);
+	fast_ = params.get<bool>("fast", true);
+	threads_ = params.get<int>("threads", 0);
+	first_core_ = params.get<int>("first_core", 1);
+	tile_bytes_ = params.get<size_t>("tile_bytes", 64 * 1024);
+	sampling_.tile_size = params.get<int>("noise_tile_size", 64);
+	sampling_.tile_step = params.get<int>("noise_tile_step", 4);
+	sampling_.frame_step = params.get<int>("noise_frame_step", 2);
+	sampling_.keep_fraction = params.get<double>("noise_keep_fraction", 0.3);
+	sampling_.smoothing = params.get<double>("noise_smoothing", 0.1);
+	temporal_ = params.get<bool>("temporal", true);
+	temporal_chroma_ = params.get<bool>("temporal_chroma", true);
+	temporal_params_.strength = params.get<double>("temporal_strength", 0.25);
+	temporal_params_.motion_low = params.get<double>("temporal_motion_low", 1.5);
+	temporal_params_.motion_high = params.get<double>("temporal_motion_high", 3.0);
+	temporal_min_motion_ = params.get<double>("temporal_min_motion", 3.0);
 }
 
 void FastCVDenoise::Configure()
@@ -51,6 +90,15 @@ void FastCVDenoise::Configure()
 	stream_ = app_->GetMainStream();
 	if (!stream_ || stream_->configuration().pixelFormat != libcamera::formats::YUV420)
 		throw std::runtime_error("FastCVDenoise: only YUV420 format supported");
+	noise_.reset(new NoiseTracker(sampling_));
+	for (TemporalDenoiser &temporal : temporal_)
+		temporal.reset();
+	if (threads_ > 0)
+	{
+		tiles_.reset(new TilePool(coreRange(first_core_, threads_), tile_bytes_));
+		kernel_.reset(new BilateralKernel({ (int)diameter_, (double)sigmaColor_, (double)sigmaSpace_ }, fast_));
+		setNumThreads(1); // The bands are the parallelism
+	}
 }
 
 bool FastCVDenoise::Process(CompletedRequestPtr &completed_request)
@@ -64,35 +112,50 @@ bool FastCVDenoise::Process(CompletedRequestPtr &completed_request)
 	Mat src = Mat(info.height, info.width, CV_8UC1, ptr, info.stride);
 	Mat dst;
 
-	// Laplacian kernel
-	cv::Mat kernel = (cv::Mat_<float>(3, 3) << 
-        1, -2, 1,
-        -2, 4, -2,
-        1, -2, 1
-    );
-
-	// The source is already grayscale (Y channel from YUV420)
-	cv::Mat greyMat = src.clone();
-
-	// Convolution result matrix
-	cv::Mat convResult;
-    cv::filter2D(greyMat, convResult, CV_32F, kernel);
-
-	// Calculate absolute values and sum
-    cv::Mat absConvResult;
-    cv::convertScaleAbs(convResult, absConvResult);
-
-    // Calculate sigma 
-    double sigma = cv::sum(absConvResult)[0];
-    int width = greyMat.cols, height = greyMat.rows;
-    
-    // Normalize with mathematical adjustment similar to Python version
-    sigma = sigma * std::sqrt(0.5 * M_PI) / (6.0 * (width - 2) * (height - 2));
-	
-	std::cout << "Sigma: " << sigma << std::endl;
+	// The source is already grayscale (Y channel from YUV420), so the noise
+	// is sampled straight from the camera buffer
+	if (noise_->update(ptr, info.width, info.height, info.stride))
+		std::cout << "Sigma: " << noise_->sigma() << std::endl;
+
+	// Average over time first, in place; the motion limits follow the noise
+	if (temporal_)
+	{
+		TemporalParams params = temporal_params_;
+		params.motion_low = std::max(temporal_params_.motion_low * noise_->sigma(), temporal_min_motion_);
+		params.motion_high = std::max(temporal_params_.motion_high * noise_->sigma(), 2 * temporal_min_motion_);
+		temporal_[0].filter(params, ptr, info.stride, ptr, info.stride, info.width, info.height);
+		if (temporal_chroma_)
+		{
+			// U then V follow Y, at half the size and half the stride
+			unsigned int chroma_width = (info.width + 1) / 2, chroma_height = (info.height + 1) / 2;
+			uint8_t *u = ptr + info.stride * info.height;
+			uint8_t *v = u + (info.stride / 2) * chroma_height;
+			temporal_[1].filter(params, u, info.stride / 2, u, info.stride / 2, chroma_width, chroma_height);
+			temporal_[2].filter(params, v, info.stride / 2, v, info.stride / 2, chroma_width, chroma_height);
+		}
+	}
 
 	// Apply the bilateral filter
-	bilateralFilter(src, dst, diameter_, sigmaColor_, sigmaSpace_);
+	if (!bilateral_enabled_)
+		return false;
+	if (tiles_)
+	{
+		tiles_->run(*kernel_, src, dst);
+		if (++frames_ % 100 == 0)
+		{
+			TileStats stats = tiles_->takeStats();
+			std::cout << "Tiles: " << stats.tiles / stats.jobs << " per frame, " << stats.total_us / stats.tiles
+					  << " us average, " << stats.max_us << " us slowest, " << stats.stolen << " stolen" << std::endl;
+		}
+	}
+	else if (fast_)
+	{
+		dst.create(info.height, info.width, CV_8UC1);
+		bilateral_.filter({ (int)diameter_, (double)sigmaColor_, (double)sigmaSpace_ }, ptr, info.stride, dst.data,
+						  dst.step, info.width, info.height);
+	}
+	else
+		bilateralFilter(src, dst, diameter_, sigmaColor_, sigmaSpace_);
 
 	// Copy the filtered image back to the original buffer
 	memcpy(ptr, dst.data, dst.total() * dst.elemSize());
@@ -9,11 +9,12 @@
 
 #include <ctime>
 #include <sstream>
-#include <fstream>
 #include <chrono>
 #include <iomanip>
 #include <cmath>  // For std::sqrt
 
+#include "async_log.hpp"
+
 using namespace cv;
 using Stream = libcamera::Stream;
 
@@ -115,14 +116,10 @@ bool FastCVDenoise::Process(CompletedRequestPtr &completed_request) {
     
     // === Stage 7: Log the Frame Data into the File ===
     //int label = frame_counter++;
-    std::ofstream pi_log("/home/comtek450/latencytest/pi_timestamp_log.txt", std::ios::app);
-    if (pi_log.is_open()) {
-        // Log format: label time_string ts_ms sigma_before sigma_after
-        pi_log << sigma_before << " " << sigma_after << "\n";
-        pi_log.close();
-    } else {
-        std::cerr << "Unable to open pi_timestamp_log.txt for writing.\n";
-    }
+    // Log format: sigma_before sigma_after. Queued here, written by the log thread
+    static const int log_file = AsyncLog::get().open(
+        "/home/comtek450/latencytest/pi_timestamp_log.txt", "ff", LogFormat::Text);
+    AsyncLog::get().write(log_file, sigma_before, sigma_after);
 
     // === Stage 8: Copy the Processed Frame Back to the Buffer ===
     memcpy(ptr, dst.data, dst.total() * dst.elemSize());
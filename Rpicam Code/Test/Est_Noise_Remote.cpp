@@ -9,11 +9,12 @@
 
 #include <ctime>
 #include <sstream>
-#include <fstream>
 #include <chrono>
 #include <iomanip>
 #include <cmath>  // For std::sqrt
 
+#include "async_log.hpp"
+
 using namespace cv;
 using Stream = libcamera::Stream;
 
@@ -81,17 +82,10 @@ bool FastCVDenoise::Process(CompletedRequestPtr &completed_request)
 
     // === Stage 3: Log Noise Estimation ===
 
-    std::ofstream pi_log("/home/comtek450/latencytest/pi_noise_log.txt", std::ios::app);
-    if (pi_log.is_open())
-    {
-        // Log format: label time_string ts_ms
-        pi_log << sigma_now << "\n";
-        pi_log.close();
-    }
-    else
-    {
-        std::cerr << "Unable to open pi_timestamp_log.txt for writing.\n";
-    }
+    // Log format: sigma. Queued here, written by the log thread
+    static const int log_file = AsyncLog::get().open(
+        "/home/comtek450/latencytest/pi_noise_log.txt", "f", LogFormat::Text);
+    AsyncLog::get().write(log_file, sigma_now);
     return false;  // Continue processing indefinitely.
 }
 
@@ -9,11 +9,13 @@
 
 #include <ctime>
 #include <sstream>
-#include <fstream>
 #include <chrono>
 #include <iomanip>
 #include <cmath>  // For std::sqrt
 
+#include "async_log.hpp"
+#include "frame_timing.hpp"
+
 using namespace cv;
 using Stream = libcamera::Stream;
 
@@ -95,29 +97,17 @@ bool FastCVDenoise::Process(CompletedRequestPtr &completed_request)
 
     int label = frame_counter++;
 
-    auto now = std::chrono::system_clock::now();
-    uint64_t ts_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-                         now.time_since_epoch()).count();
-    std::time_t time_tt = std::chrono::system_clock::to_time_t(now);
-    std::tm *tm_ptr = std::localtime(&time_tt);
-    char time_str[50];
-    std::strftime(time_str, sizeof(time_str), "%H:%M:%S", tm_ptr);
-
-    std::ofstream pi_log("/home/comtek450/latencytest/pi_timestamp_log.txt", std::ios::app);
-    if (pi_log.is_open())
-    {
-        // Log format: label time_string ts_ms
-        pi_log << label << " " << ts_ms << "\n";
-        pi_log.close();
-    }
-    else
-    {
-        std::cerr << "Unable to open pi_timestamp_log.txt for writing.\n";
-    }
-    std::stringstream overlay_text;
-    overlay_text << "Frame " << label << " " << time_str << " " << ts_ms;
-    putText(src, overlay_text.str(), Point(10, src.rows - 10),
-            FONT_HERSHEY_SIMPLEX, 0.8, Scalar(255), 2);
+    uint64_t capture_us = wallClockMicros();
+    uint64_t ts_ms = capture_us / 1000;
+
+    // Log format: label ts_ms. Queued here, written by the log thread
+    static const int log_file = AsyncLog::get().open(
+        "/home/comtek450/latencytest/pi_timestamp_log.txt", "ii", LogFormat::Text);
+    AsyncLog::get().write(log_file, label, ts_ms);
+
+    // The capture time goes into the picture (frame_timing.hpp), for the
+    // relay and the client to read back
+    stampCaptureTime(src.data, src.step, src.cols, src.rows, capture_us);
     
     /*
     // === Stage 6: Noise Estimation AFTER Filtering (no overlay) ===